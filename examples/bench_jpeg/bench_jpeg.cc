@@ -0,0 +1,180 @@
+//
+// Benchmark of baseline JPEG decoding.
+//
+// Reports the decoding time of the JPEG backend selected at compile
+// time(stb_image or libjpeg-turbo) at full, 1/2, 1/4 and 1/8 resolution.
+//
+// Usage: bench_jpeg [input.dng] [iterations]
+//
+// Without an input file, a synthetic RGB image(4032x3024) is encoded with
+// stb_image_write and decoded by the backend. With an input file, the largest
+// JPEG stream listed by `GetPreviewJPEGs` is decoded.
+//
+#define TINY_DNG_LOADER_IMPLEMENTATION
+#define STB_IMAGE_IMPLEMENTATION
+#include "tiny_dng_loader.h"
+
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "examples/common/stb_image_write.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+struct Timing {
+  double best_ms{0.0};
+  double avg_ms{0.0};
+};
+
+template <typename Func>
+static bool Measure(int iterations, Func func, Timing* timing) {
+  double total = 0.0;
+  double best = 0.0;
+  for (int i = 0; i < iterations; i++) {
+    auto start_t = std::chrono::steady_clock::now();
+    if (!func()) {
+      return false;
+    }
+    auto end_t = std::chrono::steady_clock::now();
+    double ms =
+        std::chrono::duration<double, std::milli>(end_t - start_t).count();
+    total += ms;
+    if ((i == 0) || (ms < best)) {
+      best = ms;
+    }
+  }
+  timing->best_ms = best;
+  timing->avg_ms = total / double(iterations);
+  return true;
+}
+
+static void AppendToVector(void* context, void* data, int size) {
+  std::vector<unsigned char>* buf =
+      reinterpret_cast<std::vector<unsigned char>*>(context);
+  const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+  buf->insert(buf->end(), p, p + size);
+}
+
+static int Bench(const unsigned char* jpeg, size_t jpeg_len, int iterations) {
+  const int scales[] = {1, 2, 4, 8};
+  double src_mpix = 0.0;  // MPix/s is reported in source pixels.
+  for (size_t s = 0; s < sizeof(scales) / sizeof(scales[0]); s++) {
+    std::vector<unsigned char> image;
+    int width = 0, height = 0, components = 0;
+    Timing timing;
+    bool ok = Measure(iterations, [&]() -> bool {
+      std::string err;
+      if (!tinydng::DecodeJPEG(jpeg, jpeg_len, scales[s], &image, &width,
+                               &height, &components, &err)) {
+        std::cerr << err;
+        return false;
+      }
+      return true;
+    }, &timing);
+
+    if (!ok) {
+      return EXIT_FAILURE;
+    }
+
+    if (scales[s] == 1) {
+      src_mpix = double(width) * double(height) / 1.0e6;
+    }
+    std::printf("%-14s 1/%d %5dx%-5d x%d  best %8.2f ms (%7.1f MPix/s)  avg %8.2f ms\n",
+                TINY_DNG_LOADER_JPEG_BACKEND_NAME, scales[s], width, height,
+                components, timing.best_ms, src_mpix / (timing.best_ms / 1000.0),
+                timing.avg_ms);
+  }
+
+  return EXIT_SUCCESS;
+}
+
+static int BenchSynthetic(int iterations) {
+  const int width = 4032;
+  const int height = 3024;
+
+  // Smooth gradient + noise, so that the entropy is similar to photos.
+  std::vector<unsigned char> rgb(size_t(width) * size_t(height) * 3);
+  unsigned int seed = 1;
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      for (int c = 0; c < 3; c++) {
+        seed = seed * 1103515245u + 12345u;
+        const double fx = double(x) / double(width);
+        const double fy = double(y) / double(height);
+        const double v = 128.0 + 100.0 * std::sin(8.0 * fx + 5.0 * fy + c) +
+                         double((seed >> 16) & 0xf);
+        rgb[(size_t(y) * size_t(width) + size_t(x)) * 3 + size_t(c)] =
+            static_cast<unsigned char>((std::min)(255.0, (std::max)(0.0, v)));
+      }
+    }
+  }
+
+  std::vector<unsigned char> jpeg;
+  if (!stbi_write_jpg_to_func(AppendToVector, &jpeg, width, height, 3,
+                              rgb.data(), /* quality */ 90)) {
+    std::cerr << "Failed to encode synthetic JPEG.\n";
+    return EXIT_FAILURE;
+  }
+
+  std::printf("synthetic %dx%d RGB, JPEG %.2f MB\n", width, height,
+              double(jpeg.size()) / (1024.0 * 1024.0));
+
+  return Bench(jpeg.data(), jpeg.size(), iterations);
+}
+
+static int BenchFile(const char* filename, int iterations) {
+  std::ifstream ifs(filename, std::ifstream::binary);
+  if (!ifs) {
+    std::cerr << "Failed to open file : " << filename << "\n";
+    return EXIT_FAILURE;
+  }
+  std::vector<char> data((std::istreambuf_iterator<char>(ifs)),
+                         std::istreambuf_iterator<char>());
+
+  std::vector<tinydng::PreviewJPEG> previews;
+  std::string warn, err;
+  if (!tinydng::GetPreviewJPEGs(data.data(), (unsigned int)(data.size()),
+                                &previews, &warn, &err)) {
+    std::cerr << err;
+    return EXIT_FAILURE;
+  }
+
+  if (previews.empty()) {
+    std::cerr << "No JPEG stream in " << filename << "\n";
+    return EXIT_FAILURE;
+  }
+
+  size_t largest = 0;
+  for (size_t i = 1; i < previews.size(); i++) {
+    if (size_t(previews[i].width) * size_t(previews[i].height) >
+        size_t(previews[largest].width) * size_t(previews[largest].height)) {
+      largest = i;
+    }
+  }
+
+  const tinydng::PreviewJPEG& preview = previews[largest];
+  std::printf("IFD %d %dx%d, JPEG %.2f MB\n", preview.image_index,
+              preview.width, preview.height,
+              double(preview.length) / (1024.0 * 1024.0));
+
+  return Bench(reinterpret_cast<const unsigned char*>(data.data()) +
+                   preview.offset,
+               preview.length, iterations);
+}
+
+int main(int argc, char** argv) {
+  int iterations = 5;
+  if (argc > 2) {
+    iterations = (std::max)(1, std::atoi(argv[2]));
+  }
+
+  if (argc > 1) {
+    return BenchFile(argv[1], iterations);
+  }
+
+  return BenchSynthetic(iterations);
+}
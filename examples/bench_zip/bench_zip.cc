@@ -0,0 +1,193 @@
+//
+// Benchmark of ZIP(Deflate) decoding.
+//
+// Reports the throughput(MB/s of decoded bytes) of the deflate backend selected
+// at compile time(miniz, zlib, zlib-ng or libdeflate).
+//
+// Usage: bench_zip [input.dng] [iterations]
+//
+// Without an input file, synthetic 16bit tiles(256x256, horizontal
+// differencing predictor applied) are compressed with miniz and inflated by
+// the backend. With an input file, the whole DNG is decoded with
+// `LoadDNGFromMemory` and ZIP compressed images are counted.
+//
+#define TINY_DNG_LOADER_IMPLEMENTATION
+#define STB_IMAGE_IMPLEMENTATION
+#define TINY_DNG_LOADER_ENABLE_ZIP
+#include "tiny_dng_loader.h"
+
+// miniz is always used to create synthetic tiles.
+#define MINIZ_NO_ZLIB_COMPATIBLE_NAMES
+#include "miniz.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+struct Timing {
+  double best_ms{0.0};
+  double avg_ms{0.0};
+};
+
+template <typename Func>
+static bool Measure(int iterations, Func func, Timing* timing) {
+  double total = 0.0;
+  double best = 0.0;
+  for (int i = 0; i < iterations; i++) {
+    auto start_t = std::chrono::steady_clock::now();
+    if (!func()) {
+      return false;
+    }
+    auto end_t = std::chrono::steady_clock::now();
+    double ms =
+        std::chrono::duration<double, std::milli>(end_t - start_t).count();
+    total += ms;
+    if ((i == 0) || (ms < best)) {
+      best = ms;
+    }
+  }
+  timing->best_ms = best;
+  timing->avg_ms = total / double(iterations);
+  return true;
+}
+
+static void Report(const char* name, size_t bytes, const Timing& timing) {
+  const double mb = double(bytes) / (1024.0 * 1024.0);
+  std::printf("%-12s %-10s %8.1f MB  best %8.2f ms (%8.1f MB/s)  avg %8.2f ms (%8.1f MB/s)\n",
+              TINY_DNG_LOADER_ZIP_BACKEND_NAME, name, mb, timing.best_ms,
+              mb / (timing.best_ms / 1000.0), timing.avg_ms,
+              mb / (timing.avg_ms / 1000.0));
+}
+
+static int BenchSynthetic(int iterations) {
+  const size_t width = 4096;
+  const size_t height = 3072;
+  const size_t tile_size = 256;
+  const size_t tile_bytes = tile_size * tile_size * sizeof(uint16_t);
+
+  // Smooth gradient + noise, horizontal differenced as TIFF predictor 2.
+  std::vector<std::vector<unsigned char> > tiles;
+  size_t compressed_bytes = 0;
+  unsigned int seed = 1;
+  for (size_t ty = 0; ty < height; ty += tile_size) {
+    for (size_t tx = 0; tx < width; tx += tile_size) {
+      std::vector<uint16_t> tile(tile_size * tile_size);
+      for (size_t y = 0; y < tile_size; y++) {
+        uint16_t prev = 0;
+        for (size_t x = 0; x < tile_size; x++) {
+          seed = seed * 1103515245u + 12345u;
+          const double fx = double(tx + x) / double(width);
+          const double fy = double(ty + y) / double(height);
+          const double v = 8192.0 + 6000.0 * std::sin(6.0 * fx + 3.0 * fy) +
+                           double((seed >> 16) & 0x3f);
+          const uint16_t value = static_cast<uint16_t>(v);
+          tile[y * tile_size + x] = static_cast<uint16_t>(value - prev);
+          prev = value;
+        }
+      }
+
+      mz_ulong compressed_size = mz_compressBound(mz_ulong(tile_bytes));
+      std::vector<unsigned char> compressed(compressed_size);
+      if (MZ_OK != mz_compress2(compressed.data(), &compressed_size,
+                                reinterpret_cast<const unsigned char*>(tile.data()),
+                                mz_ulong(tile_bytes), 6)) {
+        std::cerr << "Failed to compress synthetic tile.\n";
+        return EXIT_FAILURE;
+      }
+      compressed.resize(compressed_size);
+      compressed_bytes += compressed_size;
+      tiles.push_back(compressed);
+    }
+  }
+
+  std::printf("synthetic %zux%zu 16bit, %zu tiles, compression ratio %.2f\n",
+              width, height, tiles.size(),
+              double(tiles.size() * tile_bytes) / double(compressed_bytes));
+
+  std::vector<unsigned char> dst(tile_bytes);
+  tinydng::ZIPDecoder decoder;
+  Timing timing;
+  bool ok = Measure(iterations, [&]() -> bool {
+    for (size_t i = 0; i < tiles.size(); i++) {
+      unsigned long uncompressed_size = static_cast<unsigned long>(tile_bytes);
+      std::string err;
+      if (!tinydng::DecompressZIP(dst.data(), &uncompressed_size,
+                                  tiles[i].data(),
+                                  static_cast<unsigned long>(tiles[i].size()),
+                                  &err, &decoder)) {
+        std::cerr << err;
+        return false;
+      }
+    }
+    return true;
+  }, &timing);
+
+  if (!ok) {
+    return EXIT_FAILURE;
+  }
+
+  Report("inflate", tiles.size() * tile_bytes, timing);
+
+  return EXIT_SUCCESS;
+}
+
+static int BenchFile(const char* filename, int iterations) {
+  std::ifstream ifs(filename, std::ifstream::binary);
+  if (!ifs) {
+    std::cerr << "Failed to open file : " << filename << "\n";
+    return EXIT_FAILURE;
+  }
+  std::vector<char> data((std::istreambuf_iterator<char>(ifs)),
+                         std::istreambuf_iterator<char>());
+
+  size_t decoded_bytes = 0;
+  Timing timing;
+  bool ok = Measure(iterations, [&]() -> bool {
+    std::string warn, err;
+    std::vector<tinydng::FieldInfo> custom_fields;
+    std::vector<tinydng::DNGImage> images;
+    if (!tinydng::LoadDNGFromMemory(data.data(), (unsigned int)(data.size()),
+                                    custom_fields, &images, &warn, &err)) {
+      std::cerr << err;
+      return false;
+    }
+
+    decoded_bytes = 0;
+    for (size_t i = 0; i < images.size(); i++) {
+      if (images[i].compression == tinydng::COMPRESSION_ZIP) {
+        decoded_bytes += images[i].data.size();
+      }
+    }
+    return true;
+  }, &timing);
+
+  if (!ok) {
+    return EXIT_FAILURE;
+  }
+
+  if (decoded_bytes == 0) {
+    std::cerr << "No ZIP compressed image in " << filename << "\n";
+    return EXIT_FAILURE;
+  }
+
+  Report("load", decoded_bytes, timing);
+
+  return EXIT_SUCCESS;
+}
+
+int main(int argc, char** argv) {
+  int iterations = 5;
+  if (argc > 2) {
+    iterations = (std::max)(1, std::atoi(argv[2]));
+  }
+
+  if (argc > 1) {
+    return BenchFile(argv[1], iterations);
+  }
+
+  return BenchSynthetic(iterations);
+}
@@ -343,135 +343,6 @@ void MatrixMult(double dst[3][3], const double a[3][3], const double b[3][3]) {
   }
 }
 
-//
-// Decode 12bit integer image into floating point HDR image
-//
-void decode12_hdr(std::vector<float>& image, unsigned char* data, int width,
-                  int height, bool do_swap) {
-  int offsets[2][2] = {{0, 1}, {1, 2}};
-
-  int bit_shifts[2] = {4, 0};
-
-  image.resize(width * height);
-
-#pragma omp parallel for schedule(dynamic, 1)
-  for (int y = 0; y < height; y++) {
-    for (int x = 0; x < width; x++) {
-      unsigned char buf[3];
-
-      // Calculate load addres for 12bit pixel(three 8 bit pixels)
-      int n = int(y * width + x);
-
-      // 24 = 12bit * 2 pixel, 8bit * 3 pixel
-      int n2 = n % 2;           // used for offset & bitshifts
-      int addr3 = (n / 2) * 3;  // 8bit pixel pos
-      int odd = (addr3 % 2);
-
-      int bit_shift;
-      bit_shift = bit_shifts[n2];
-
-      int offset[2];
-      offset[0] = offsets[n2][0];
-      offset[1] = offsets[n2][1];
-
-      if (do_swap) {
-        // load with short byte swap
-        if (odd) {
-          buf[0] = data[addr3 - 1];
-          buf[1] = data[addr3 + 2];
-          buf[2] = data[addr3 + 1];
-        } else {
-          buf[0] = data[addr3 + 1];
-          buf[1] = data[addr3 + 0];
-          buf[2] = data[addr3 + 3];
-        }
-      } else {
-        buf[0] = data[addr3 + 0];
-        buf[1] = data[addr3 + 1];
-        buf[2] = data[addr3 + 2];
-      }
-      unsigned int b0 = (unsigned int)buf[offset[0]] & 0xff;
-      unsigned int b1 = (unsigned int)buf[offset[1]] & 0xff;
-
-      unsigned int val = (b0 << 8) | b1;
-      val = 0xfff & (val >> bit_shift);
-
-      image[y * width + x] = (float)val;
-    }
-  }
-}
-
-//
-// Decode 14bit integer image into floating point HDR image
-//
-void decode14_hdr(std::vector<float>& image, unsigned char* data, int width,
-                  int height, bool do_swap) {
-  int offsets[4][3] = {{0, 0, 1}, {1, 2, 3}, {3, 4, 5}, {5, 5, 6}};
-
-  int bit_shifts[4] = {2, 4, 6, 0};
-
-  image.resize(width * height);
-
-#ifdef _OPENMP
-#pragma omp parallel for schedule(dynamic, 1)
-#endif
-  for (int y = 0; y < height; y++) {
-    for (int x = 0; x < width; x++) {
-      unsigned char buf[7];
-
-      // Calculate load addres for 14bit pixel(three 8 bit pixels)
-      int n = int(y * width + x);
-
-      // 56 = 14bit * 4 pixel, 8bit * 7 pixel
-      int n4 = n % 4;           // used for offset & bitshifts
-      int addr7 = (n / 4) * 7;  // 8bit pixel pos
-      int odd = (addr7 % 2);
-
-      int offset[3];
-      offset[0] = offsets[n4][0];
-      offset[1] = offsets[n4][1];
-      offset[2] = offsets[n4][2];
-
-      int bit_shift;
-      bit_shift = bit_shifts[n4];
-
-      if (do_swap) {
-        // load with short byte swap
-        if (odd) {
-          buf[0] = data[addr7 - 1];
-          buf[1] = data[addr7 + 2];
-          buf[2] = data[addr7 + 1];
-          buf[3] = data[addr7 + 4];
-          buf[4] = data[addr7 + 3];
-          buf[5] = data[addr7 + 6];
-          buf[6] = data[addr7 + 5];
-        } else {
-          buf[0] = data[addr7 + 1];
-          buf[1] = data[addr7 + 0];
-          buf[2] = data[addr7 + 3];
-          buf[3] = data[addr7 + 2];
-          buf[4] = data[addr7 + 5];
-          buf[5] = data[addr7 + 4];
-          buf[6] = data[addr7 + 7];
-        }
-      } else {
-        memcpy(buf, &data[addr7], 7);
-      }
-      unsigned int b0 = (unsigned int)buf[offset[0]] & 0xff;
-      unsigned int b1 = (unsigned int)buf[offset[1]] & 0xff;
-      unsigned int b2 = (unsigned int)buf[offset[2]] & 0xff;
-
-      // unsigned int val = (b0 << 16) | (b1 << 8) | b2;
-      // unsigned int val = (b2 << 16) | (b0 << 8) | b0;
-      unsigned int val = (b0 << 16) | (b1 << 8) | b2;
-      // unsigned int val = b2;
-      val = 0x3fff & (val >> bit_shift);
-
-      image[y * width + x] = (float)val;
-    }
-  }
-}
-
 //
 // Decode 16bit integer image into floating point HDR image
 //
@@ -930,13 +801,8 @@ double color_correction(std::vector<float>& out, const std::vector<float>& in,
 void DecodeToHDR(RAWImage* raw, bool swap_endian) {
   raw->hdr_image.resize(raw->width * raw->height * raw->components);
 
-  if (raw->bits == 12) {
-    decode12_hdr(raw->hdr_image, raw->image.data.data(), raw->width * raw->components,
-                 raw->height, swap_endian);
-  } else if (raw->bits == 14) {
-    decode14_hdr(raw->hdr_image, raw->image.data.data(), raw->width * raw->components,
-                 raw->height, swap_endian);
-  } else if (raw->bits == 16) {
+  // 10, 12 and 14 bit pixels are unpacked to 16 bit by the loader.
+  if (raw->bits == 16) {
     decode16_hdr(raw->hdr_image, raw->image.data.data(), raw->width * raw->components,
                  raw->height, swap_endian);
   } else {
@@ -1335,8 +1201,11 @@ int main(int argc, char** argv) {
     std::vector<tinydng::DNGImage> images;
     std::vector<tinydng::FieldInfo> custom_fields;
 
+    tinydng::LoadOption option;
+    option.unpack_to_uint16 = true;
+
     bool ret = tinydng::LoadDNG(input_filename.c_str(), custom_fields, &images,
-                                &warn, &err);
+                                &warn, &err, option);
 
     if (!warn.empty()) {
       std::cout << "WARN: " << warn << std::endl;
@@ -0,0 +1,1505 @@
+// Reference checks of the image processing functions and decoders of
+// tiny_dng_loader. Images are synthesized, so no input file is needed.
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#define TINY_DNG_LOADER_IMPLEMENTATION
+#define STB_IMAGE_IMPLEMENTATION
+#define TINY_DNG_NO_EXCEPTION
+#include "tiny_dng_loader.h"
+
+static int g_failures = 0;
+
+#define CHECK(cond)                                                     \
+  do {                                                                  \
+    if (!(cond)) {                                                      \
+      std::cout << __FILE__ << ":" << __LINE__ << ": CHECK(" #cond      \
+                << ") failed" << std::endl;                             \
+      g_failures++;                                                     \
+    }                                                                   \
+  } while (0)
+
+#define CHECK_NEAR(a, b, tol)                                           \
+  do {                                                                  \
+    const double va_ = double(a);                                       \
+    const double vb_ = double(b);                                       \
+    if (!(std::fabs(va_ - vb_) <= double(tol))) {                       \
+      std::cout << __FILE__ << ":" << __LINE__ << ": " #a " = " << va_  \
+                << ", " #b " = " << vb_ << " (tolerance " << (tol)      \
+                << ")" << std::endl;                                    \
+      g_failures++;                                                     \
+    }                                                                   \
+  } while (0)
+
+#define CHECK_OK(call)                                                  \
+  do {                                                                  \
+    err.clear();                                                        \
+    if (!(call)) {                                                      \
+      std::cout << __FILE__ << ":" << __LINE__ << ": " #call " failed: "\
+                << err << std::endl;                                    \
+      g_failures++;                                                     \
+      return;                                                           \
+    }                                                                   \
+  } while (0)
+
+// 2x2 Bayer patterns(color of top-left, top-right, bottom-left,
+// bottom-right).
+static const int kRGGB[4] = {0, 1, 1, 2};
+static const int kGBRG[4] = {1, 2, 0, 1};
+
+// 6x6 X-Trans pattern.
+static const int kXTrans[36] = {1, 1, 0, 1, 1, 2, 1, 1, 2, 1, 1, 0,
+                                2, 0, 1, 0, 2, 1, 1, 1, 2, 1, 1, 0,
+                                1, 1, 0, 1, 1, 2, 0, 2, 1, 2, 0, 1};
+
+// CFA image of 32bit float samples(white = 1.0) with a `rows` x `cols`
+// pattern. Sample values are left zero.
+static tinydng::DNGImage MakeCFAImage(int width, int height, int rows,
+                                      int cols, const int* pattern) {
+  tinydng::DNGImage image = tinydng::DNGImage();
+  image.width = width;
+  image.height = height;
+  image.samples_per_pixel = 1;
+  image.bits_per_sample = 32;
+  image.bits_per_sample_original = 32;
+  image.sample_format = tinydng::SAMPLEFORMAT_IEEEFP;
+  image.cfa_layout = 1;
+  image.cfa_plane_color[0] = 0;
+  image.cfa_plane_color[1] = 1;
+  image.cfa_plane_color[2] = 2;
+  image.cfa_plane_color[3] = 0;
+  image.cfa_repeat_dim[0] = rows;
+  image.cfa_repeat_dim[1] = cols;
+  image.cfa_repeat_pattern.assign(pattern, pattern + rows * cols);
+  for (int y = 0; y < 2; y++) {
+    for (int x = 0; x < 2; x++) {
+      image.cfa_pattern[y][x] = pattern[(y % rows) * cols + (x % cols)];
+    }
+  }
+  image.cfa_pattern_dim = short(rows);
+  image.has_active_area = false;
+  for (int s = 0; s < 4; s++) {
+    image.black_level[s] = 0;
+    image.white_level[s] = 1;
+  }
+  image.has_analog_balance = false;
+  image.has_as_shot_neutral = false;
+  image.calibration_illuminant1 = tinydng::LIGHTSOURCE_UNKNOWN;
+  image.calibration_illuminant2 = tinydng::LIGHTSOURCE_UNKNOWN;
+  image.data.resize(size_t(width) * size_t(height) * sizeof(float));
+  return image;
+}
+
+static int CFAColor(const tinydng::DNGImage& image, int x, int y) {
+  return image.cfa_repeat_pattern[size_t(
+      (y % image.cfa_repeat_dim[0]) * image.cfa_repeat_dim[1] +
+      (x % image.cfa_repeat_dim[1]))];
+}
+
+static float* FloatData(tinydng::DNGImage* image) {
+  return reinterpret_cast<float*>(image->data.data());
+}
+
+// Make `image` 16bit unsigned integer with samples from `f(x, y, color)`.
+// The CFA pattern is relative to the ActiveArea.
+template <typename F>
+static void FillCFAU16(tinydng::DNGImage* image, F f) {
+  image->bits_per_sample = 16;
+  image->bits_per_sample_original = 16;
+  image->sample_format = tinydng::SAMPLEFORMAT_UINT;
+  image->data.resize(size_t(image->width) * size_t(image->height) * 2);
+  unsigned short* p = reinterpret_cast<unsigned short*>(image->data.data());
+  const int rows = image->cfa_repeat_dim[0];
+  const int cols = image->cfa_repeat_dim[1];
+  const int top = image->has_active_area ? image->active_area[0] : 0;
+  const int left = image->has_active_area ? image->active_area[1] : 0;
+  for (int y = 0; y < image->height; y++) {
+    for (int x = 0; x < image->width; x++) {
+      const int c = CFAColor(*image, ((x - left) % cols + cols) % cols,
+                             ((y - top) % rows + rows) % rows);
+      p[y * image->width + x] = static_cast<unsigned short>(f(x, y, c));
+    }
+  }
+}
+
+// Sample (`x`, `y`) of the CFA image is `f(x, y, color)`.
+template <typename F>
+static void FillCFA(tinydng::DNGImage* image, F f) {
+  float* p = FloatData(image);
+  for (int y = 0; y < image->height; y++) {
+    for (int x = 0; x < image->width; x++) {
+      p[y * image->width + x] = float(f(x, y, CFAColor(*image, x, y)));
+    }
+  }
+}
+
+// Dual illuminant(A and D65) camera profile with AsShotNeutral.
+static void SetColorProfile(tinydng::DNGImage* image) {
+  static const double cm1[3][3] = {
+      {0.8, -0.2, -0.1}, {-0.4, 1.2, 0.2}, {-0.05, 0.15, 0.6}};
+  static const double cm2[3][3] = {
+      {0.7, -0.15, -0.05}, {-0.45, 1.25, 0.2}, {-0.1, 0.2, 0.55}};
+  for (int i = 0; i < 3; i++) {
+    for (int j = 0; j < 3; j++) {
+      image->color_matrix1[i][j] = cm1[i][j];
+      image->color_matrix2[i][j] = cm2[i][j];
+      image->camera_calibration1[i][j] = (i == j) ? 1.0 : 0.0;
+      image->camera_calibration2[i][j] = (i == j) ? 1.0 : 0.0;
+    }
+  }
+  image->has_color_matrix1 = true;
+  image->has_color_matrix2 = true;
+  image->has_forward_matrix1 = false;
+  image->has_forward_matrix2 = false;
+  image->calibration_illuminant1 = tinydng::LIGHTSOURCE_STANDARD_LIGHT_A;
+  image->calibration_illuminant2 = tinydng::LIGHTSOURCE_D65;
+  image->has_analog_balance = false;
+  image->has_as_shot_neutral = true;
+  image->as_shot_neutral[0] = 0.5;
+  image->as_shot_neutral[1] = 1.0;
+  image->as_shot_neutral[2] = 0.7;
+}
+
+// ---------------------------------------------------------------------------
+// Opcodes
+
+// Gain map over the ActiveArea, gains 1.0 ~ 1.3.
+static tinydng::GainMap MakeGainMap() {
+  tinydng::GainMap map;
+  map.idx = 2;
+  map.top = 0;
+  map.left = 0;
+  map.bottom = 100000;
+  map.right = 100000;
+  map.plane = 0;
+  map.planes = 1;
+  map.row_pitch = 1;
+  map.col_pitch = 1;
+  map.map_points_v = 5;
+  map.map_points_h = 7;
+  map.map_spacing_v = 0.25;
+  map.map_spacing_h = 1.0 / 6.0;
+  map.map_origin_v = 0.0;
+  map.map_origin_h = 0.0;
+  map.map_planes = 1;
+  for (int i = 0; i < 35; i++) {
+    map.pixels.push_back(1.0f + 0.02f * float(i % 7) + 0.03f * float(i / 7));
+  }
+  return map;
+}
+
+// Stage 2 gain maps of integer data scale the value above the black level of
+// each sample: BlackLevel of the BlackLevelRepeatDim position plus
+// BlackLevelDeltaH/V.
+static void TestGainMapBlackLevel() {
+  std::string err;
+  const int width = 40;
+  const int height = 30;
+  tinydng::DNGImage image = MakeCFAImage(width, height, 2, 2, kRGGB);
+  FillCFAU16(&image, [](int x, int y, int) {
+    return 1000 + ((x * 131 + y * 71) % 3000);
+  });
+  image.has_active_area = true;
+  image.active_area[0] = 2;  // top
+  image.active_area[1] = 4;  // left
+  image.active_area[2] = height;
+  image.active_area[3] = width;
+  const int aw = width - 4;
+  const int ah = height - 2;
+  image.white_level[0] = 65535;
+  image.black_level[0] = 100;
+  image.black_level_repeat_dim[0] = 2;
+  image.black_level_repeat_dim[1] = 2;
+  image.black_level_repeat = {100.0f, 300.0f, 500.0f, 700.0f};
+  for (int x = 0; x < aw; x++) {
+    image.black_level_delta_h.push_back(float(x % 4) * 10.0f);
+  }
+  for (int y = 0; y < ah; y++) {
+    image.black_level_delta_v.push_back(float(y % 3) * 20.0f);
+  }
+
+  // Constant gain 1.5.
+  tinydng::GainMap map = MakeGainMap();
+  std::fill(map.pixels.begin(), map.pixels.end(), 1.5f);
+  const std::vector<tinydng::GainMap> maps(1, map);
+  tinydng::Opcode op;
+  op.id = tinydng::OPCODE_LIST_GAIN_MAP;
+  op.list_idx = 2;
+  op.gainmap_index = 0;
+  const std::vector<tinydng::Opcode> opcodes(1, op);
+
+  for (int api = 0; api < 2; api++) {
+    tinydng::DNGImage dst = image;
+    if (api == 0) {
+      CHECK_OK(tinydng::ApplyGainMaps(maps, &dst, &err));
+    } else {
+      std::string warn;
+      CHECK_OK(tinydng::ApplyOpcodeList(opcodes, maps, &dst, &warn, &err));
+    }
+    const unsigned short* in =
+        reinterpret_cast<const unsigned short*>(image.data.data());
+    const unsigned short* out =
+        reinterpret_cast<const unsigned short*>(dst.data.data());
+    double max_diff = 0.0;
+    for (int y = 0; y < ah; y++) {
+      for (int x = 0; x < aw; x++) {
+        const size_t i = size_t((y + 2) * width + (x + 4));
+        const double black =
+            image.black_level_repeat[size_t((y % 2) * 2 + (x % 2))] +
+            image.black_level_delta_h[size_t(x)] +
+            image.black_level_delta_v[size_t(y)];
+        const double ref = black + (in[i] - black) * 1.5;
+        max_diff = (std::max)(max_diff, std::fabs(out[i] - ref));
+      }
+    }
+    CHECK(max_diff <= 0.5 + 1e-3);
+    // Outside of the ActiveArea is not modified.
+    CHECK(in[0] == out[0]);
+  }
+}
+
+// Bad pixels of a flat CFA image are repaired from good pixels of the same
+// color, for the 2x2 Bayer phase of the opcode and for X-Trans.
+static void TestFixBadPixels() {
+  std::string err;
+  const double flat[3] = {1000.0, 2000.0, 3000.0};
+  for (int p = 0; p < 2; p++) {
+    tinydng::DNGImage image = (p == 0) ? MakeCFAImage(40, 30, 2, 2, kGBRG)
+                                       : MakeCFAImage(40, 30, 6, 6, kXTrans);
+    image.has_active_area = true;
+    image.active_area[0] = 1;  // top
+    image.active_area[1] = 3;  // left
+    image.active_area[2] = 30;
+    image.active_area[3] = 40;
+    FillCFAU16(&image, [&](int, int, int c) { return flat[c]; });
+    tinydng::DNGImage bad = image;
+    unsigned short* data = reinterpret_cast<unsigned short*>(bad.data.data());
+
+    tinydng::Opcode op;
+    op.id = tinydng::OPCODE_LIST_FIX_BAD_PIXELS_LIST;
+    op.list_idx = 2;
+    op.bayer_phase = 2;  // GBRG
+    for (int i = 0; i < 40; i++) {
+      const unsigned int row = (unsigned int)((i * 7) % 29);
+      const unsigned int col = (unsigned int)((i * 13) % 37);
+      op.bad_points.push_back(row);
+      op.bad_points.push_back(col);
+      data[(row + 1) * 40 + (col + 3)] = 65535;
+    }
+    std::vector<tinydng::Opcode> opcodes(1, op);
+    std::string warn;
+    CHECK_OK(tinydng::ApplyOpcodeList(opcodes, std::vector<tinydng::GainMap>(),
+                                      &bad, &warn, &err));
+    CHECK(bad.data == image.data);
+  }
+}
+
+static tinydng::Opcode MakeOpcode(unsigned int id, unsigned int list_idx) {
+  tinydng::Opcode op;
+  op.id = id;
+  op.list_idx = list_idx;
+  op.bottom = 100000;
+  op.right = 100000;
+  op.planes = 1;
+  return op;
+}
+
+// Pointwise opcodes are fused into one pass. The result must match each
+// opcode applied by itself, and the DNG definition of each opcode.
+static void TestPointwiseOpcodes() {
+  std::string err;
+  const int width = 40;
+  const int height = 30;
+  tinydng::DNGImage image = MakeCFAImage(width, height, 2, 2, kRGGB);
+  image.has_active_area = true;
+  image.active_area[0] = 2;  // top
+  image.active_area[1] = 4;  // left
+  image.active_area[2] = height;
+  image.active_area[3] = width;
+  const int aw = width - 4;
+  const int ah = height - 2;
+  FillCFAU16(&image, [](int x, int y, int) {
+    return 1000 + ((x * 97 + y * 53) % 4000);
+  });
+
+  std::vector<tinydng::Opcode> opcodes;
+  tinydng::Opcode op = MakeOpcode(tinydng::OPCODE_LIST_MAP_TABLE, 2);
+  for (int v = 0; v < 8192; v++) {
+    op.table.push_back(static_cast<unsigned short>(v * 3 / 4 + 100));
+  }
+  opcodes.push_back(op);
+
+  op = MakeOpcode(tinydng::OPCODE_LIST_DELTA_PER_ROW, 2);
+  op.top = 1;
+  op.row_pitch = 2;
+  for (int y = 1; y < ah; y += 2) {
+    op.values.push_back(float(y * 3));
+  }
+  opcodes.push_back(op);
+
+  op = MakeOpcode(tinydng::OPCODE_LIST_SCALE_PER_COLUMN, 2);
+  op.left = 3;
+  op.right = 30;
+  for (int x = 3; x < 30; x++) {
+    op.values.push_back(1.0f + 0.01f * float(x % 5));
+  }
+  opcodes.push_back(op);
+
+  op = MakeOpcode(tinydng::OPCODE_LIST_MAP_POLYNOMIAL, 2);
+  op.coefficients.push_back(0.01);
+  op.coefficients.push_back(0.9);
+  op.coefficients.push_back(0.05);
+  opcodes.push_back(op);
+
+  op = MakeOpcode(tinydng::OPCODE_LIST_DELTA_PER_COLUMN, 2);
+  op.col_pitch = 3;
+  for (int x = 0; x < aw; x += 3) {
+    op.values.push_back(float(x % 7) - 3.0f);
+  }
+  opcodes.push_back(op);
+
+  op = MakeOpcode(tinydng::OPCODE_LIST_SCALE_PER_ROW, 2);
+  op.bottom = 20;
+  for (int y = 0; y < 20; y++) {
+    op.values.push_back(0.9f + 0.01f * float(y % 4));
+  }
+  opcodes.push_back(op);
+
+  const std::vector<tinydng::GainMap> no_maps;
+  std::string warn;
+  tinydng::DNGImage fused = image;
+  CHECK_OK(tinydng::ApplyOpcodeList(opcodes, no_maps, &fused, &warn, &err));
+  tinydng::DNGImage single = image;
+  for (size_t i = 0; i < opcodes.size(); i++) {
+    CHECK_OK(tinydng::ApplyOpcodeList(
+        std::vector<tinydng::Opcode>(1, opcodes[i]), no_maps, &single, &warn,
+        &err));
+  }
+
+  const unsigned short* in =
+      reinterpret_cast<const unsigned short*>(image.data.data());
+  const unsigned short* out_fused =
+      reinterpret_cast<const unsigned short*>(fused.data.data());
+  const unsigned short* out_single =
+      reinterpret_cast<const unsigned short*>(single.data.data());
+  double max_diff_single = 0.0;
+  double max_diff_ref = 0.0;
+  for (int y = 0; y < ah; y++) {
+    for (int x = 0; x < aw; x++) {
+      const size_t i = size_t((y + 2) * width + (x + 4));
+      double v = double(opcodes[0].table[in[i]]);
+      if ((y % 2) == 1) {
+        v += opcodes[1].values[size_t(y / 2)];
+      }
+      if ((x >= 3) && (x < 30)) {
+        v *= double(opcodes[2].values[size_t(x - 3)]);
+      }
+      const double n = v / 65535.0;
+      v = (0.01 + 0.9 * n + 0.05 * n * n) * 65535.0;
+      if ((x % 3) == 0) {
+        v += opcodes[4].values[size_t(x / 3)];
+      }
+      if (y < 20) {
+        v *= double(opcodes[5].values[size_t(y)]);
+      }
+      max_diff_ref = (std::max)(max_diff_ref, std::fabs(out_fused[i] - v));
+      max_diff_single = (std::max)(
+          max_diff_single, std::fabs(double(out_fused[i]) - out_single[i]));
+    }
+  }
+  // Integer opcodes round at each step when applied one by one.
+  CHECK(max_diff_single <= 2.0);
+  CHECK(max_diff_ref <= 2.0);
+  CHECK(in[0] == out_fused[0]);
+}
+
+// RGB image of 32bit float samples with `f(x, y, plane)`.
+template <typename F>
+static tinydng::DNGImage MakeRGBImage(int width, int height, F f) {
+  tinydng::DNGImage image = tinydng::DNGImage();
+  image.width = width;
+  image.height = height;
+  image.samples_per_pixel = 3;
+  image.bits_per_sample = 32;
+  image.bits_per_sample_original = 32;
+  image.sample_format = tinydng::SAMPLEFORMAT_IEEEFP;
+  image.has_active_area = false;
+  for (int s = 0; s < 4; s++) {
+    image.black_level[s] = 0;
+    image.white_level[s] = 1;
+  }
+  image.data.resize(size_t(width) * size_t(height) * 3 * sizeof(float));
+  float* p = FloatData(&image);
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      for (int c = 0; c < 3; c++) {
+        p[(y * width + x) * 3 + c] = float(f(x, y, c));
+      }
+    }
+  }
+  return image;
+}
+
+// WarpRectilinear with kr0 = 1 is the identity. Otherwise a linear ramp is
+// resampled exactly at the source position of the DNG definition, for both
+// filters, away from the border.
+static void TestWarpRectilinear() {
+  std::string err;
+  const int width = 48;
+  const int height = 36;
+  const double ramp[3][3] = {
+      {0.1, 0.01, 0.005}, {0.2, -0.004, 0.012}, {0.7, 0.002, -0.008}};
+  const tinydng::DNGImage image =
+      MakeRGBImage(width, height, [&](int x, int y, int c) {
+        return ramp[c][0] + ramp[c][1] * x + ramp[c][2] * y;
+      });
+  const double k[6] = {0.9, 0.05, 0.0, 0.0, 0.001, -0.002};
+
+  for (int filter = 0; filter < 2; filter++) {
+    tinydng::OpcodeOption option;
+    option.warp_filter = (filter == 0) ? tinydng::WARP_FILTER_BILINEAR
+                                       : tinydng::WARP_FILTER_BICUBIC;
+    tinydng::Opcode op = MakeOpcode(tinydng::OPCODE_LIST_WARP_RECTILINEAR, 3);
+    op.planes = 3;
+    op.center_x = 0.4;
+    op.center_y = 0.6;
+    for (int c = 0; c < 3; c++) {
+      op.coefficients.push_back(1.0);
+      for (int i = 1; i < 6; i++) {
+        op.coefficients.push_back(0.0);
+      }
+    }
+    std::string warn;
+    tinydng::DNGImage identity = image;
+    CHECK_OK(tinydng::ApplyOpcodeList(std::vector<tinydng::Opcode>(1, op),
+                                      std::vector<tinydng::GainMap>(),
+                                      &identity, &warn, &err, option));
+    double max_diff = 0.0;
+    for (size_t i = 0; i < size_t(width * height * 3); i++) {
+      max_diff = (std::max)(max_diff,
+                            std::fabs(double(FloatData(&identity)[i]) -
+                                      reinterpret_cast<const float*>(
+                                          image.data.data())[i]));
+    }
+    CHECK(max_diff <= 1e-5);
+
+    for (int c = 0; c < 3; c++) {
+      for (int i = 0; i < 6; i++) {
+        op.coefficients[size_t(c * 6 + i)] = k[i];
+      }
+    }
+    tinydng::DNGImage warped = image;
+    CHECK_OK(tinydng::ApplyOpcodeList(std::vector<tinydng::Opcode>(1, op),
+                                      std::vector<tinydng::GainMap>(),
+                                      &warped, &warn, &err, option));
+    const double cx = op.center_x * width;
+    const double cy = op.center_y * height;
+    const double mx = (std::max)(cx, width - cx);
+    const double my = (std::max)(cy, height - cy);
+    const double max_dist = std::sqrt(mx * mx + my * my);
+    max_diff = 0.0;
+    int num_checked = 0;
+    for (int y = 0; y < height; y++) {
+      for (int x = 0; x < width; x++) {
+        const double dx = (x + 0.5 - cx) / max_dist;
+        const double dy = (y + 0.5 - cy) / max_dist;
+        const double r2 = dx * dx + dy * dy;
+        const double f = k[0] + r2 * (k[1] + r2 * (k[2] + r2 * k[3]));
+        const double sx =
+            cx + (dx * f + k[4] * 2.0 * dx * dy + k[5] * (r2 + 2.0 * dx * dx)) *
+                     max_dist - 0.5;
+        const double sy =
+            cy + (dy * f + k[5] * 2.0 * dx * dy + k[4] * (r2 + 2.0 * dy * dy)) *
+                     max_dist - 0.5;
+        if ((sx < 2.0) || (sy < 2.0) || (sx > width - 3.0) ||
+            (sy > height - 3.0)) {
+          continue;
+        }
+        num_checked++;
+        for (int c = 0; c < 3; c++) {
+          const double ref = ramp[c][0] + ramp[c][1] * sx + ramp[c][2] * sy;
+          max_diff = (std::max)(
+              max_diff, std::fabs(FloatData(&warped)[(y * width + x) * 3 + c] -
+                                  ref));
+        }
+      }
+    }
+    CHECK(num_checked > width * height / 2);
+    CHECK(max_diff <= 1e-4);
+  }
+}
+
+// FixVignetteRadial with zero coefficients is the identity, and otherwise
+// scales by 1 + k0 r^2 + k1 r^4 + ...(r = 1 at the farthest corner). Fused
+// with an adjacent GainMap, the result matches the two opcodes applied one
+// by one.
+static void TestFixVignetteRadial() {
+  std::string err;
+  const int width = 48;
+  const int height = 36;
+  const tinydng::DNGImage image =
+      MakeRGBImage(width, height, [](int x, int y, int c) {
+        return 0.2 + 0.01 * ((x * 7 + y * 3 + c * 5) % 50);
+      });
+  const double k[5] = {0.3, 0.1, -0.05, 0.02, 0.01};
+  const std::vector<tinydng::GainMap> no_maps;
+  std::string warn;
+
+  tinydng::Opcode op = MakeOpcode(tinydng::OPCODE_LIST_FIX_VIGNETTE_RADIAL, 3);
+  op.center_x = 0.4;
+  op.center_y = 0.6;
+  op.coefficients.assign(5, 0.0);
+  tinydng::DNGImage identity = image;
+  CHECK_OK(tinydng::ApplyOpcodeList(std::vector<tinydng::Opcode>(1, op),
+                                    no_maps, &identity, &warn, &err));
+  CHECK(identity.data == image.data);
+
+  op.coefficients.assign(k, k + 5);
+  tinydng::DNGImage vignette = image;
+  CHECK_OK(tinydng::ApplyOpcodeList(std::vector<tinydng::Opcode>(1, op),
+                                    no_maps, &vignette, &warn, &err));
+  const double cx = op.center_x * width;
+  const double cy = op.center_y * height;
+  const double mx = (std::max)(cx, width - cx);
+  const double my = (std::max)(cy, height - cy);
+  double max_diff = 0.0;
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      const double dx = x + 0.5 - cx;
+      const double dy = y + 0.5 - cy;
+      const double r2 = (dx * dx + dy * dy) / (mx * mx + my * my);
+      const double gain =
+          1.0 +
+          r2 * (k[0] + r2 * (k[1] + r2 * (k[2] + r2 * (k[3] + r2 * k[4]))));
+      for (int c = 0; c < 3; c++) {
+        const size_t i = size_t((y * width + x) * 3 + c);
+        const double ref =
+            reinterpret_cast<const float*>(image.data.data())[i] * gain;
+        max_diff =
+            (std::max)(max_diff, std::fabs(FloatData(&vignette)[i] - ref));
+      }
+    }
+  }
+  CHECK(max_diff <= 1e-5);
+
+  tinydng::GainMap map = MakeGainMap();
+  map.idx = 3;
+  map.planes = 3;
+  const std::vector<tinydng::GainMap> maps(1, map);
+  tinydng::Opcode gain_op = MakeOpcode(tinydng::OPCODE_LIST_GAIN_MAP, 3);
+  gain_op.gainmap_index = 0;
+  std::vector<tinydng::Opcode> opcodes;
+  opcodes.push_back(gain_op);
+  opcodes.push_back(op);
+  tinydng::DNGImage fused = image;
+  CHECK_OK(tinydng::ApplyOpcodeList(opcodes, maps, &fused, &warn, &err));
+  tinydng::DNGImage single = image;
+  for (size_t i = 0; i < opcodes.size(); i++) {
+    CHECK_OK(tinydng::ApplyOpcodeList(
+        std::vector<tinydng::Opcode>(1, opcodes[i]), maps, &single, &warn,
+        &err));
+  }
+  max_diff = 0.0;
+  for (size_t i = 0; i < size_t(width * height * 3); i++) {
+    max_diff = (std::max)(
+        max_diff,
+        std::fabs(double(FloatData(&fused)[i]) - FloatData(&single)[i]));
+  }
+  CHECK(max_diff <= 1e-5);
+  CHECK(fused.data != vignette.data);
+}
+
+// ---------------------------------------------------------------------------
+// Demosaic
+
+// A flat color is reproduced everywhere, and a gray ramp is reproduced
+// away from the(mirrored) border.
+static void TestDemosaicFlatAndRamp() {
+  std::string err;
+  const tinydng::DemosaicMethod methods[3] = {tinydng::DEMOSAIC_BILINEAR,
+                                              tinydng::DEMOSAIC_MALVAR,
+                                              tinydng::DEMOSAIC_AHD};
+  const int* patterns[2] = {kRGGB, kGBRG};
+  const float flat[3] = {0.25f, 0.5f, 0.125f};
+  for (int p = 0; p < 2; p++) {
+    for (int m = 0; m < 3; m++) {
+      tinydng::DemosaicOption option;
+      option.method = methods[m];
+      option.white = 1.0f;
+
+      tinydng::DNGImage image = MakeCFAImage(67, 45, 2, 2, patterns[p]);
+      FillCFA(&image, [&](int, int, int c) { return flat[c]; });
+      std::vector<float> rgb;
+      int w = 0, h = 0;
+      CHECK_OK(tinydng::Demosaic(image, &rgb, &w, &h, &err, option));
+      CHECK((w == 67) && (h == 45));
+      double max_diff = 0.0;
+      for (size_t i = 0; i < rgb.size(); i++) {
+        max_diff =
+            (std::max)(max_diff, std::fabs(double(rgb[i] - flat[i % 3])));
+      }
+      CHECK_NEAR(max_diff, 0.0, 1e-5);
+
+      FillCFA(&image,
+              [](int x, int y, int) { return 0.1 + 0.004 * x + 0.003 * y; });
+      CHECK_OK(tinydng::Demosaic(image, &rgb, &w, &h, &err, option));
+      max_diff = 0.0;
+      for (int y = 4; y < h - 4; y++) {
+        for (int x = 4; x < w - 4; x++) {
+          const double v = 0.1 + 0.004 * x + 0.003 * y;
+          for (int c = 0; c < 3; c++) {
+            const float d = rgb[size_t(y * w + x) * 3 + size_t(c)];
+            max_diff = (std::max)(max_diff, std::fabs(double(d) - v));
+          }
+        }
+      }
+      CHECK_NEAR(max_diff, 0.0, 1e-5);
+    }
+  }
+}
+
+// Patterns other than 2x2 Bayer reproduce a flat color, and a gray ramp away
+// from the border.
+static void TestDemosaicNonBayer() {
+  std::string err;
+  // 4x2 pattern where every 2x2 block has all colors.
+  const int k4x2[8] = {2, 1, 1, 2, 0, 2, 0, 1};
+  const float flat[3] = {0.25f, 0.5f, 0.125f};
+  for (int p = 0; p < 2; p++) {
+    tinydng::DNGImage image = (p == 0) ? MakeCFAImage(61, 47, 6, 6, kXTrans)
+                                       : MakeCFAImage(61, 47, 4, 2, k4x2);
+    FillCFA(&image, [&](int, int, int c) { return flat[c]; });
+    std::vector<float> rgb;
+    int w = 0, h = 0;
+    CHECK_OK(tinydng::Demosaic(image, &rgb, &w, &h, &err));
+    CHECK((w == 61) && (h == 47));
+    double max_diff = 0.0;
+    for (size_t i = 0; i < rgb.size(); i++) {
+      max_diff =
+          (std::max)(max_diff, std::fabs(double(rgb[i] - flat[i % 3])));
+    }
+    CHECK_NEAR(max_diff, 0.0, 1e-5);
+
+    FillCFA(&image,
+            [](int x, int y, int) { return 0.1 + 0.004 * x + 0.003 * y; });
+    CHECK_OK(tinydng::Demosaic(image, &rgb, &w, &h, &err));
+    max_diff = 0.0;
+    for (int y = 8; y < h - 8; y++) {
+      for (int x = 8; x < w - 8; x++) {
+        const double v = 0.1 + 0.004 * x + 0.003 * y;
+        for (int c = 0; c < 3; c++) {
+          const float d = rgb[size_t(y * w + x) * 3 + size_t(c)];
+          max_diff = (std::max)(max_diff, std::fabs(double(d) - v));
+        }
+      }
+    }
+    // Greens of the 4x2 pattern are not symmetric around every pixel, so a
+    // ramp is only reproduced to a fraction of the step between pixels.
+    CHECK_NEAR(max_diff, 0.0, (p == 0) ? 1e-5 : 2e-3);
+  }
+}
+
+// ---------------------------------------------------------------------------
+// NormalizeImage
+
+// Per-position black levels(BlackLevelRepeatDim), BlackLevelDeltaH/V, the
+// ActiveArea and the white balance against the formula of the DNG spec.
+static void TestNormalizeImage() {
+  std::string err;
+  const int width = 38;
+  const int height = 26;
+  tinydng::DNGImage image = MakeCFAImage(width, height, 2, 2, kRGGB);
+  FillCFAU16(&image, [](int x, int y, int c) {
+    return 600 + ((x * 131 + y * 71 + c * 17) % 3000);
+  });
+  image.has_active_area = true;
+  image.active_area[0] = 2;  // top
+  image.active_area[1] = 4;  // left
+  image.active_area[2] = height - 2;
+  image.active_area[3] = width - 2;
+  const int aw = width - 6;
+  const int ah = height - 4;
+  image.white_level[0] = 4000;
+  image.black_level_repeat_dim[0] = 2;
+  image.black_level_repeat_dim[1] = 2;
+  image.black_level_repeat = {500.0f, 510.0f, 520.5f, 530.0f};
+  for (int x = 0; x < aw; x++) {
+    image.black_level_delta_h.push_back(float(x % 5));
+  }
+  for (int y = 0; y < ah; y++) {
+    image.black_level_delta_v.push_back(0.5f * float(y % 3));
+  }
+  image.has_as_shot_neutral = true;
+  image.as_shot_neutral[0] = 0.5;
+  image.as_shot_neutral[1] = 1.0;
+  image.as_shot_neutral[2] = 0.8;
+
+  tinydng::NormalizeOption option;
+  option.clamp = false;
+  std::vector<float> out;
+  int w = 0, h = 0;
+  CHECK_OK(tinydng::NormalizeImage(image, &out, &w, &h, &err, option));
+  CHECK((w == aw) && (h == ah));
+
+  const unsigned short* raw =
+      reinterpret_cast<const unsigned short*>(image.data.data());
+  double max_diff = 0.0;
+  for (int y = 0; y < ah; y++) {
+    for (int x = 0; x < aw; x++) {
+      // The CFA pattern and the black level pattern are relative to the
+      // ActiveArea.
+      const int c = CFAColor(image, x, y);
+      const double repeat =
+          image.black_level_repeat[size_t((y % 2) * 2 + (x % 2))];
+      const double black = repeat + image.black_level_delta_h[size_t(x)] +
+                           image.black_level_delta_v[size_t(y)];
+      const double v = raw[(y + 2) * width + (x + 4)];
+      const double ref =
+          (v - black) / (4000.0 - repeat) / image.as_shot_neutral[c];
+      max_diff = (std::max)(max_diff,
+                            std::fabs(double(out[size_t(y * aw + x)]) - ref));
+    }
+  }
+  CHECK_NEAR(max_diff, 0.0, 1e-5);
+
+  // uint16 output is clamped to [0, 65535].
+  std::vector<unsigned short> out16;
+  CHECK_OK(tinydng::NormalizeImage(image, &out16, &w, &h, &err));
+  for (size_t i = 0; i < out16.size(); i++) {
+    const double ref = (std::min)((std::max)(double(out[i]), 0.0), 1.0);
+    max_diff = (std::max)(max_diff, std::fabs(out16[i] / 65535.0 - ref));
+  }
+  CHECK_NEAR(max_diff, 0.0, 1e-4);
+}
+
+// ---------------------------------------------------------------------------
+// Color
+
+// The camera neutral maps to the white of each output color space, with
+// ColorMatrix and with ForwardMatrix, and cached transforms are the same.
+static void TestColorNeutralToWhite() {
+  std::string err;
+  tinydng::DNGImage image = MakeCFAImage(4, 4, 2, 2, kRGGB);
+  SetColorProfile(&image);
+  const tinydng::ColorSpace spaces[3] = {tinydng::COLOR_SPACE_SRGB,
+                                         tinydng::COLOR_SPACE_ADOBE_RGB,
+                                         tinydng::COLOR_SPACE_PROPHOTO_RGB};
+  for (int f = 0; f < 2; f++) {
+    if (f == 1) {
+      // ForwardMatrix maps the white balanced camera white to D50.
+      static const double fm[3][3] = {{0.6, 0.25, 0.1142},
+                                      {0.25, 0.7, 0.05},
+                                      {0.02, 0.1, 0.7049}};
+      for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+          image.forward_matrix1[i][j] = fm[i][j];
+          image.forward_matrix2[i][j] = fm[i][j];
+        }
+      }
+      image.has_forward_matrix1 = true;
+      image.has_forward_matrix2 = true;
+    }
+    for (int s = 0; s < 3; s++) {
+      for (int wb = 0; wb < 2; wb++) {
+        tinydng::ColorOption option;
+        option.color_space = spaces[s];
+        option.white_balanced_input = (wb == 0);
+        option.clamp = false;
+        tinydng::ColorTransform transform;
+        CHECK_OK(tinydng::ComputeColorTransform(image, nullptr, &transform,
+                                                &err, option));
+        // White balanced white is (1, 1, 1). Camera native white is the
+        // neutral.
+        float rgb[3] = {1.0f, 1.0f, 1.0f};
+        if (wb == 1) {
+          for (int c = 0; c < 3; c++) {
+            rgb[c] = float(image.as_shot_neutral[c]);
+          }
+        }
+        CHECK_OK(tinydng::ApplyColorTransform(transform, rgb, 1, rgb, &err));
+        for (int c = 0; c < 3; c++) {
+          CHECK_NEAR(rgb[c], 1.0, 1e-4);
+        }
+      }
+    }
+  }
+
+  // A mid gray is encoded with the sRGB transfer curve.
+  tinydng::ColorTransform transform;
+  CHECK_OK(tinydng::ComputeColorTransform(image, nullptr, &transform, &err));
+  float gray[3] = {0.18f, 0.18f, 0.18f};
+  CHECK_OK(tinydng::ApplyColorTransform(transform, gray, 1, gray, &err));
+  const double srgb = 1.055 * std::pow(0.18, 1.0 / 2.4) - 0.055;
+  for (int c = 0; c < 3; c++) {
+    CHECK_NEAR(gray[c], srgb, 1e-4);
+  }
+
+  // The cache returns the transform computed for the same neutral.
+  tinydng::ColorTransformCache cache;
+  const double neutral[3] = {0.6, 1.0, 0.5};
+  tinydng::ColorTransform a, b;
+  CHECK_OK(tinydng::ComputeColorTransform(image, neutral, &a, &err,
+                                          tinydng::ColorOption(), &cache));
+  CHECK_OK(tinydng::ComputeColorTransform(image, neutral, &b, &err,
+                                          tinydng::ColorOption(), &cache));
+  CHECK(cache.transforms.size() == 1);
+  for (int i = 0; i < 3; i++) {
+    for (int j = 0; j < 3; j++) {
+      CHECK(a.matrix[i][j] == b.matrix[i][j]);
+    }
+  }
+}
+
+// ---------------------------------------------------------------------------
+// Tone curve
+
+// The baked curve goes through the control points, is monotonic for
+// monotonic points and an identity for (0, 0), (1, 1).
+static void TestToneCurve() {
+  std::string err;
+  std::vector<float> points = {0.0f, 0.0f, 0.25f, 0.35f, 0.5f,
+                               0.62f, 0.75f, 0.84f, 1.0f, 1.0f};
+  tinydng::ToneCurve curve;
+  CHECK_OK(tinydng::BuildToneCurve(points, &curve, &err));
+  CHECK(curve.lut.size() == 4097);
+
+  std::vector<float> in;
+  for (size_t i = 0; i < points.size(); i += 2) {
+    in.push_back(points[i]);
+  }
+  in.push_back(-0.5f);  // clamped to 0
+  in.push_back(2.0f);   // clamped to 1
+  std::vector<float> out(in.size());
+  CHECK_OK(tinydng::ApplyToneCurve(curve, in.data(), in.size(), out.data(),
+                                   &err));
+  for (size_t i = 0; i + 2 < in.size(); i++) {
+    CHECK_NEAR(out[i], points[2 * i + 1], 1e-4);
+  }
+  CHECK_NEAR(out[in.size() - 2], 0.0, 1e-6);
+  CHECK_NEAR(out[in.size() - 1], 1.0, 1e-6);
+
+  const size_t n = 1001;
+  in.resize(n);
+  out.resize(n);
+  for (size_t i = 0; i < n; i++) {
+    in[i] = float(i) / float(n - 1);
+  }
+  CHECK_OK(tinydng::ApplyToneCurve(curve, in.data(), n, out.data(), &err));
+  for (size_t i = 1; i < n; i++) {
+    CHECK(out[i] >= out[i - 1]);
+  }
+
+  const std::vector<float> identity = {0.0f, 0.0f, 1.0f, 1.0f};
+  CHECK_OK(tinydng::BuildToneCurve(identity, &curve, &err));
+  CHECK_OK(tinydng::ApplyToneCurve(curve, in.data(), n, out.data(), &err));
+  for (size_t i = 0; i < n; i++) {
+    CHECK_NEAR(out[i], in[i], 1e-5);
+  }
+}
+
+// ---------------------------------------------------------------------------
+// Develop
+
+// 16bit raw image with black/white levels, an ActiveArea, a camera profile
+// and a ProfileToneCurve.
+static tinydng::DNGImage MakeRawImage(int width, int height, int rows,
+                                      int cols, const int* pattern) {
+  tinydng::DNGImage image = MakeCFAImage(width, height, rows, cols, pattern);
+  FillCFAU16(&image, [](int x, int y, int c) {
+    return 600.0 + 9000.0 * (0.5 + 0.5 * std::sin(x * 0.05 + c) *
+                                       std::cos(y * 0.03)) +
+           double((x * 37 + y * 91) % 400);
+  });
+  image.has_active_area = true;
+  image.active_area[0] = 2;  // top
+  image.active_area[1] = 4;  // left
+  image.active_area[2] = height - 2;
+  image.active_area[3] = width - 2;
+  image.black_level_repeat_dim[0] = 2;
+  image.black_level_repeat_dim[1] = 2;
+  image.black_level_repeat = {500.0f, 510.0f, 520.0f, 530.0f};
+  image.black_level[0] = 500;
+  image.white_level[0] = 12000;
+  SetColorProfile(&image);
+  for (int i = 0; i <= 8; i++) {
+    const double x = i / 8.0;
+    image.profile_tone_curve.push_back(float(x));
+    image.profile_tone_curve.push_back(float(std::pow(x, 0.8)));
+  }
+  return image;
+}
+
+// `DevelopImage` done with the public functions of each stage, in linear
+// float RGB before the color transform.
+static bool DevelopByStages(const tinydng::DNGImage& image,
+                            tinydng::DemosaicMethod method,
+                            std::vector<float>* rgb, int* width, int* height,
+                            std::string* err) {
+  tinydng::DNGImage raw = image;
+  if (!image.linearization_table.empty()) {
+    unsigned short* p = reinterpret_cast<unsigned short*>(raw.data.data());
+    const size_t last = image.linearization_table.size() - 1;
+    for (size_t i = 0; i < raw.data.size() / 2; i++) {
+      p[i] = image.linearization_table[(std::min)(size_t(p[i]), last)];
+    }
+  }
+
+  // Black/white level only. Gain maps apply before the white balance.
+  std::vector<float> values;
+  int w = 0, h = 0;
+  tinydng::NormalizeOption normalize_option;
+  normalize_option.white_balance = false;
+  normalize_option.clamp = false;
+  if (!tinydng::NormalizeImage(raw, &values, &w, &h, err, normalize_option)) {
+    return false;
+  }
+  tinydng::DNGImage cfa = MakeCFAImage(
+      w, h, image.cfa_repeat_dim[0], image.cfa_repeat_dim[1],
+      image.cfa_repeat_pattern.data());
+  memcpy(cfa.data.data(), values.data(), values.size() * sizeof(float));
+  if (!image.opcodelist2_gainmap.empty() &&
+      !tinydng::ApplyGainMaps(image.opcodelist2_gainmap, &cfa, err)) {
+    return false;
+  }
+
+  float* p = FloatData(&cfa);
+  for (int y = 0; y < h; y++) {
+    for (int x = 0; x < w; x++) {
+      const double wb = 1.0 / image.as_shot_neutral[CFAColor(cfa, x, y)];
+      const double v = p[y * w + x] * wb;
+      p[y * w + x] = float((std::min)((std::max)(v, 0.0), 1.0));
+    }
+  }
+
+  tinydng::DemosaicOption demosaic_option;
+  demosaic_option.method = method;
+  demosaic_option.white = 1.0f;
+  return tinydng::Demosaic(cfa, rgb, width, height, err, demosaic_option);
+}
+
+// The fused tile pipeline matches the chain of `NormalizeImage`,
+// `ApplyGainMaps`, `Demosaic` and `ApplyColorTransform`.
+static void TestDevelopImageMatchesStages() {
+  std::string err;
+  for (int p = 0; p < 2; p++) {
+    for (int config = 0; config < 2; config++) {
+      tinydng::DNGImage image = (p == 0)
+                                    ? MakeRawImage(203, 77, 2, 2, kGBRG)
+                                    : MakeRawImage(203, 77, 6, 6, kXTrans);
+      if (config == 1) {
+        for (int i = 0; i < 20000; i++) {
+          image.linearization_table.push_back(static_cast<unsigned short>(
+              (std::min)(65535.0, i * 1.1 + 0.00002 * i * double(i))));
+        }
+        image.opcodelist2_gainmap.push_back(MakeGainMap());
+      }
+      for (int m = 0; m < 2; m++) {
+        const tinydng::DemosaicMethod method =
+            (m == 0) ? tinydng::DEMOSAIC_BILINEAR : tinydng::DEMOSAIC_MALVAR;
+        tinydng::DevelopOption option;
+        option.demosaic_method = method;
+        std::vector<unsigned char> out8;
+        std::vector<unsigned short> out16;
+        int w = 0, h = 0;
+        CHECK_OK(tinydng::DevelopImage(image, &out8, &w, &h, &err, option));
+        CHECK_OK(tinydng::DevelopImage(image, &out16, &w, &h, &err, option));
+
+        std::vector<float> rgb;
+        int rw = 0, rh = 0;
+        CHECK_OK(DevelopByStages(image, method, &rgb, &rw, &rh, &err));
+        CHECK((w == rw) && (h == rh));
+        tinydng::ColorOption color_option;
+        color_option.apply_tone_curve = true;
+        tinydng::ColorTransform transform;
+        CHECK_OK(tinydng::ComputeColorTransform(image, nullptr, &transform,
+                                                &err, color_option));
+        CHECK_OK(tinydng::ApplyColorTransform(transform, rgb.data(),
+                                              size_t(rw) * size_t(rh),
+                                              rgb.data(), &err));
+        CHECK(out8.size() == rgb.size());
+        CHECK(out16.size() == rgb.size());
+        int max_diff8 = 0;
+        int max_diff16 = 0;
+        for (size_t i = 0; i < rgb.size(); i++) {
+          max_diff8 = (std::max)(
+              max_diff8, std::abs(int(out8[i]) - int(rgb[i] * 255.0f + 0.5f)));
+          max_diff16 = (std::max)(
+              max_diff16,
+              std::abs(int(out16[i]) - int(rgb[i] * 65535.0f + 0.5f)));
+        }
+        // The transfer curve is looked up from a table.
+        CHECK(max_diff8 <= 1);
+        CHECK(max_diff16 <= 48);
+      }
+    }
+  }
+}
+
+// ---------------------------------------------------------------------------
+// Preview
+
+// Smallest block size from `scale` where every block has all colors.
+static int PreviewBlockSize(const tinydng::DNGImage& image, int scale) {
+  const int rows = image.cfa_repeat_dim[0];
+  const int cols = image.cfa_repeat_dim[1];
+  for (int n = scale;; n++) {
+    bool all = true;
+    for (int by = 0; by < rows; by++) {
+      for (int bx = 0; bx < cols; bx++) {
+        bool seen[3] = {false, false, false};
+        for (int y = by * n; y < (by + 1) * n; y++) {
+          for (int x = bx * n; x < (bx + 1) * n; x++) {
+            seen[CFAColor(image, x, y)] = true;
+          }
+        }
+        all = all && seen[0] && seen[1] && seen[2];
+      }
+    }
+    if (all) {
+      return n;
+    }
+  }
+}
+
+// Each preview pixel is the per-color block average of the normalized image
+// through the color transform. The 4x2 pattern at scale 3 has blocks of
+// every CFA phase.
+static void TestDevelopPreview() {
+  std::string err;
+  const int k4x2[8] = {2, 1, 1, 2, 0, 2, 0, 1};
+  for (int p = 0; p < 3; p++) {
+    for (int scale = 2; scale <= 4; scale++) {
+      tinydng::DNGImage image =
+          (p == 0) ? MakeRawImage(203, 77, 2, 2, kRGGB)
+                   : ((p == 1) ? MakeRawImage(203, 77, 6, 6, kXTrans)
+                               : MakeRawImage(203, 77, 4, 2, k4x2));
+      tinydng::PreviewOption option;
+      option.scale = scale;
+      std::vector<unsigned char> preview;
+      int w = 0, h = 0;
+      CHECK_OK(tinydng::DevelopPreview(image, &preview, &w, &h, &err, option));
+
+      const int n = PreviewBlockSize(image, scale);
+      std::vector<float> values;
+      int nw = 0, nh = 0;
+      CHECK_OK(tinydng::NormalizeImage(image, &values, &nw, &nh, &err));
+      CHECK((w == nw / n) && (h == nh / n));
+      if ((w != nw / n) || (h != nh / n)) {
+        continue;
+      }
+      std::vector<float> rgb(size_t(w) * size_t(h) * 3);
+      for (int oy = 0; oy < h; oy++) {
+        for (int ox = 0; ox < w; ox++) {
+          double sum[3] = {0.0, 0.0, 0.0};
+          double count[3] = {0.0, 0.0, 0.0};
+          for (int y = oy * n; y < (oy + 1) * n; y++) {
+            for (int x = ox * n; x < (ox + 1) * n; x++) {
+              const int c = CFAColor(image, x, y);
+              sum[c] += double(values[size_t(y * nw + x)]);
+              count[c] += 1.0;
+            }
+          }
+          for (int c = 0; c < 3; c++) {
+            rgb[size_t(oy * w + ox) * 3 + size_t(c)] = float(sum[c] / count[c]);
+          }
+        }
+      }
+      tinydng::ColorTransform transform;
+      CHECK_OK(tinydng::ComputeColorTransform(image, nullptr, &transform,
+                                              &err));
+      CHECK_OK(tinydng::ApplyColorTransform(
+          transform, rgb.data(), size_t(w) * size_t(h), rgb.data(), &err));
+      int max_diff = 0;
+      for (size_t i = 0; i < rgb.size(); i++) {
+        max_diff = (std::max)(
+            max_diff, std::abs(int(preview[i]) - int(rgb[i] * 255.0f + 0.5f)));
+      }
+      CHECK(max_diff <= 1);
+    }
+  }
+}
+
+// A flat color develops to one color, and the preview at any scale is the
+// same color as the downsampled developed image.
+static void TestDevelopPreviewFlat() {
+  std::string err;
+  const int k4x2[8] = {2, 1, 1, 2, 0, 2, 0, 1};
+  const int* patterns[3] = {kRGGB, kXTrans, k4x2};
+  const int dims[3][2] = {{2, 2}, {6, 6}, {4, 2}};
+  const double flat[3] = {2000.0, 5000.0, 3500.0};
+  for (int p = 0; p < 3; p++) {
+    tinydng::DNGImage image =
+        MakeRawImage(96, 60, dims[p][0], dims[p][1], patterns[p]);
+    FillCFAU16(&image, [&](int, int, int c) { return flat[c]; });
+    image.black_level_repeat = {500.0f, 500.0f, 500.0f, 500.0f};
+
+    std::vector<unsigned char> developed;
+    int dw = 0, dh = 0;
+    CHECK_OK(tinydng::DevelopImage(image, &developed, &dw, &dh, &err));
+    int max_diff = 0;
+    for (size_t i = 3; i < developed.size(); i++) {
+      max_diff = (std::max)(
+          max_diff, std::abs(int(developed[i]) - int(developed[i % 3])));
+    }
+    CHECK(max_diff <= 1);
+
+    for (int scale = 1; scale <= 4; scale++) {
+      tinydng::PreviewOption option;
+      option.scale = scale;
+      option.apply_tone_curve = true;
+      std::vector<unsigned char> preview;
+      int w = 0, h = 0;
+      CHECK_OK(tinydng::DevelopPreview(image, &preview, &w, &h, &err, option));
+      const int n = PreviewBlockSize(image, scale);
+      CHECK((w == dw / n) && (h == dh / n));
+      max_diff = 0;
+      for (size_t i = 0; i < preview.size(); i++) {
+        max_diff = (std::max)(
+            max_diff, std::abs(int(preview[i]) - int(developed[i % 3])));
+      }
+      CHECK(max_diff <= 1);
+    }
+  }
+}
+
+// ---------------------------------------------------------------------------
+// Tiled LZW
+
+// Sample layout of a synthesized tiled image.
+struct TiledFormat {
+  int spp;
+  int bps;
+  int sample_format;
+  int predictor;
+};
+
+// Store the lower `n` bytes of `v` at `p` in the byte order of the file.
+static void StoreValue(unsigned char* p, uint64_t v, size_t n,
+                       bool big_endian) {
+  for (size_t i = 0; i < n; i++) {
+    p[big_endian ? (n - 1 - i) : i] = static_cast<unsigned char>(v >> (8 * i));
+  }
+}
+
+// TIFF LZW encoder. Codes are packed MSB first and the code width grows one
+// code early, as libtiff does. `src` must not fill the 4096 entries
+// dictionary.
+static std::vector<unsigned char> EncodeLZW(
+    const std::vector<unsigned char>& src) {
+  std::vector<unsigned char> out;
+  uint64_t acc = 0;
+  int acc_bits = 0;
+  int width = 9;
+  auto put = [&](int code) {
+    acc = (acc << width) | uint64_t(code);
+    acc_bits += width;
+    while (acc_bits >= 8) {
+      out.push_back(static_cast<unsigned char>(acc >> (acc_bits - 8)));
+      acc_bits -= 8;
+    }
+    acc &= (uint64_t(1) << acc_bits) - 1;
+  };
+
+  std::map<std::pair<int, int>, int> dict;
+  int next_code = 258;
+  auto grow = [&]() {
+    next_code++;
+    if (next_code > (1 << width) - 1) {
+      width++;
+    }
+  };
+
+  put(256);  // ClearCode
+  int w = -1;
+  for (size_t i = 0; i < src.size(); i++) {
+    const int c = src[i];
+    if (w < 0) {
+      w = c;
+      continue;
+    }
+    std::map<std::pair<int, int>, int>::const_iterator it =
+        dict.find(std::make_pair(w, c));
+    if (it != dict.end()) {
+      w = it->second;
+      continue;
+    }
+    put(w);
+    dict[std::make_pair(w, c)] = next_code;
+    grow();
+    w = c;
+  }
+  if (w >= 0) {
+    put(w);
+    grow();
+  }
+  put(257);  // EndOfInformation
+  if (acc_bits > 0) {
+    out.push_back(static_cast<unsigned char>(acc << (8 - acc_bits)));
+  }
+  return out;
+}
+
+// Sample `c` of pixel (`x`, `y`). Bits of a float for IEEEFP.
+static uint64_t TiledSample(const TiledFormat& format, int x, int y, int c) {
+  if (format.sample_format == tinydng::SAMPLEFORMAT_IEEEFP) {
+    const float f = 0.01f * float(x) + 0.5f * float(y) + float(c) - 3.0f;
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    return bits;
+  }
+  const uint64_t v = uint64_t(x * 37 + y * 101 + c * 1009 + 12345);
+  const uint64_t mask = (format.bps == 64) ? ~uint64_t(0)
+                                           : ((uint64_t(1) << format.bps) - 1);
+  return (format.bps == 32) ? ((v * 65537) & mask) : (v & mask);
+}
+
+// Uncompressed data of tile (`tx`, `ty`) with the predictor of `format`
+// applied, in the byte order of the file.
+static std::vector<unsigned char> MakeTileData(const TiledFormat& format,
+                                               bool big_endian, int tile_size,
+                                               int tx, int ty) {
+  const size_t spp = size_t(format.spp);
+  const size_t elem_bytes = size_t(format.bps) / 8;
+  const size_t num_samples = size_t(tile_size) * spp;
+  const size_t row_bytes = num_samples * elem_bytes;
+  const uint64_t mask = (format.bps == 64) ? ~uint64_t(0)
+                                           : ((uint64_t(1) << format.bps) - 1);
+
+  std::vector<unsigned char> data(row_bytes * size_t(tile_size));
+  std::vector<uint64_t> row(num_samples);
+  for (int y = 0; y < tile_size; y++) {
+    for (size_t i = 0; i < num_samples; i++) {
+      row[i] = TiledSample(format, tx * tile_size + int(i / spp),
+                           ty * tile_size + y, int(i % spp));
+    }
+    unsigned char* p = data.data() + size_t(y) * row_bytes;
+    if (format.predictor == 3) {
+      // Byte planes(most significant byte first), then byte differences.
+      for (size_t i = 0; i < num_samples; i++) {
+        for (size_t b = 0; b < elem_bytes; b++) {
+          p[b * num_samples + i] = static_cast<unsigned char>(
+              row[i] >> (8 * (elem_bytes - 1 - b)));
+        }
+      }
+      for (size_t i = row_bytes - 1; i >= spp; i--) {
+        p[i] = static_cast<unsigned char>(p[i] - p[i - spp]);
+      }
+      continue;
+    }
+    if (format.predictor == 2) {
+      for (size_t i = num_samples - 1; i >= spp; i--) {
+        row[i] = (row[i] - row[i - spp]) & mask;
+      }
+    }
+    for (size_t i = 0; i < num_samples; i++) {
+      StoreValue(p + i * elem_bytes, row[i], elem_bytes, big_endian);
+    }
+  }
+  return data;
+}
+
+// TIFF file of `width` x `height` pixels with `tiles`(compressed data of
+// each `tile_size` x `tile_size` tile).
+static std::vector<unsigned char> MakeTiledTIFF(
+    const TiledFormat& format, bool big_endian, int width, int height,
+    int tile_size, int compression,
+    const std::vector<std::vector<unsigned char> >& tiles) {
+  std::vector<unsigned char> file(8);
+  file[0] = file[1] = big_endian ? 'M' : 'I';
+  StoreValue(&file[2], 42, 2, big_endian);
+
+  std::vector<uint32_t> offsets;
+  std::vector<uint32_t> byte_counts;
+  for (size_t i = 0; i < tiles.size(); i++) {
+    offsets.push_back(uint32_t(file.size()));
+    byte_counts.push_back(uint32_t(tiles[i].size()));
+    file.insert(file.end(), tiles[i].begin(), tiles[i].end());
+  }
+  if (file.size() % 2) {
+    file.push_back(0);
+  }
+
+  struct Entry {
+    uint16_t tag;
+    uint16_t type;  // 3: SHORT, 4: LONG
+    std::vector<uint32_t> values;
+  };
+  const std::vector<uint32_t> spp_values(size_t(format.spp), 0);
+  std::vector<uint32_t> bps = spp_values;
+  std::vector<uint32_t> sample_format = spp_values;
+  for (size_t i = 0; i < spp_values.size(); i++) {
+    bps[i] = uint32_t(format.bps);
+    sample_format[i] = uint32_t(format.sample_format);
+  }
+  const Entry entries[] = {
+      {256, 4, std::vector<uint32_t>(1, uint32_t(width))},
+      {257, 4, std::vector<uint32_t>(1, uint32_t(height))},
+      {258, 3, bps},
+      {259, 3, std::vector<uint32_t>(1, uint32_t(compression))},
+      {262, 3, std::vector<uint32_t>(1, (format.spp == 3) ? 2u : 1u)},
+      {277, 3, std::vector<uint32_t>(1, uint32_t(format.spp))},
+      {284, 3, std::vector<uint32_t>(1, 1u)},
+      {317, 3, std::vector<uint32_t>(1, uint32_t(format.predictor))},
+      {322, 4, std::vector<uint32_t>(1, uint32_t(tile_size))},
+      {323, 4, std::vector<uint32_t>(1, uint32_t(tile_size))},
+      {324, 4, offsets},
+      {325, 4, byte_counts},
+      {339, 3, sample_format},
+  };
+  const size_t num_entries = sizeof(entries) / sizeof(entries[0]);
+
+  const size_t ifd_offset = file.size();
+  StoreValue(&file[4], ifd_offset, 4, big_endian);
+  file.resize(ifd_offset + 2 + 12 * num_entries + 4, 0);
+  StoreValue(&file[ifd_offset], num_entries, 2, big_endian);
+  for (size_t i = 0; i < num_entries; i++) {
+    const Entry& e = entries[i];
+    const size_t elem_bytes = (e.type == 3) ? 2 : 4;
+    std::vector<unsigned char> values(
+        (std::max)(size_t(4), e.values.size() * elem_bytes), 0);
+    for (size_t k = 0; k < e.values.size(); k++) {
+      StoreValue(&values[k * elem_bytes], e.values[k], elem_bytes, big_endian);
+    }
+    unsigned char* p = &file[ifd_offset + 2 + 12 * i];
+    StoreValue(p, e.tag, 2, big_endian);
+    StoreValue(p + 2, e.type, 2, big_endian);
+    StoreValue(p + 4, e.values.size(), 4, big_endian);
+    if (values.size() <= 4) {
+      memcpy(p + 8, values.data(), 4);
+    } else {
+      StoreValue(p + 8, file.size(), 4, big_endian);
+      file.insert(file.end(), values.begin(), values.end());
+    }
+  }
+  return file;
+}
+
+// Tiled LZW images of each predictor in both byte orders. Tiles in the right
+// and bottom edge exceed the image extent.
+static void TestTiledLZW() {
+  const TiledFormat formats[] = {
+      {1, 8, tinydng::SAMPLEFORMAT_UINT, 2},
+      {1, 16, tinydng::SAMPLEFORMAT_UINT, 1},
+      {1, 16, tinydng::SAMPLEFORMAT_UINT, 2},
+      {3, 16, tinydng::SAMPLEFORMAT_UINT, 1},
+      {3, 16, tinydng::SAMPLEFORMAT_UINT, 2},
+      {1, 32, tinydng::SAMPLEFORMAT_UINT, 2},
+      {1, 32, tinydng::SAMPLEFORMAT_IEEEFP, 1},
+      {1, 32, tinydng::SAMPLEFORMAT_IEEEFP, 3},
+      {3, 32, tinydng::SAMPLEFORMAT_IEEEFP, 3},
+  };
+  const int width = 40;
+  const int height = 36;
+  const int tile_size = 16;
+  const int tiles_across = (width + tile_size - 1) / tile_size;
+  const int tiles_down = (height + tile_size - 1) / tile_size;
+
+  for (int e = 0; e < 2; e++) {
+    const bool big_endian = (e == 1);
+    for (size_t f = 0; f < sizeof(formats) / sizeof(formats[0]); f++) {
+      const TiledFormat& format = formats[f];
+      std::vector<std::vector<unsigned char> > tiles;
+      for (int ty = 0; ty < tiles_down; ty++) {
+        for (int tx = 0; tx < tiles_across; tx++) {
+          tiles.push_back(EncodeLZW(
+              MakeTileData(format, big_endian, tile_size, tx, ty)));
+        }
+      }
+      const std::vector<unsigned char> file =
+          MakeTiledTIFF(format, big_endian, width, height, tile_size,
+                        tinydng::COMPRESSION_LZW, tiles);
+
+      std::string warn, err;
+      std::vector<tinydng::FieldInfo> custom_fields;
+      std::vector<tinydng::DNGImage> images;
+      const bool loaded = tinydng::LoadDNGFromMemory(
+          reinterpret_cast<const char*>(file.data()),
+          static_cast<unsigned int>(file.size()), custom_fields, &images,
+          &warn, &err);
+      CHECK(loaded && (images.size() == 1));
+      if (!loaded || images.empty()) {
+        std::cout << (big_endian ? "MM" : "II") << " spp " << format.spp
+                  << " bps " << format.bps << " predictor "
+                  << format.predictor << ": " << err << std::endl;
+        continue;
+      }
+
+      const size_t elem_bytes = size_t(format.bps) / 8;
+      std::vector<unsigned char> expected(size_t(width) * size_t(height) *
+                                          size_t(format.spp) * elem_bytes);
+      for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+          for (int c = 0; c < format.spp; c++) {
+            const size_t i = (size_t(y) * size_t(width) + size_t(x)) *
+                                 size_t(format.spp) +
+                             size_t(c);
+            const uint64_t v = TiledSample(format, x, y, c);
+            if (elem_bytes == 1) {
+              expected[i] = static_cast<unsigned char>(v);
+            } else if (elem_bytes == 2) {
+              const uint16_t u = static_cast<uint16_t>(v);
+              memcpy(&expected[i * 2], &u, 2);
+            } else {
+              const uint32_t u = static_cast<uint32_t>(v);
+              memcpy(&expected[i * 4], &u, 4);
+            }
+          }
+        }
+      }
+      CHECK(images[0].data == expected);
+    }
+  }
+
+  // A tile decoding to fewer bytes than the tile size fails the load instead
+  // of leaving stale pixels.
+  const TiledFormat format = {1, 16, tinydng::SAMPLEFORMAT_UINT, 2};
+  std::vector<std::vector<unsigned char> > tiles;
+  for (int ty = 0; ty < tiles_down; ty++) {
+    for (int tx = 0; tx < tiles_across; tx++) {
+      tiles.push_back(
+          EncodeLZW(MakeTileData(format, false, tile_size, tx, ty)));
+    }
+  }
+  tiles[4].resize(tiles[4].size() / 3);
+  const std::vector<unsigned char> file = MakeTiledTIFF(
+      format, false, width, height, tile_size, tinydng::COMPRESSION_LZW, tiles);
+  std::string warn, err;
+  std::vector<tinydng::FieldInfo> custom_fields;
+  std::vector<tinydng::DNGImage> images;
+  CHECK(!tinydng::LoadDNGFromMemory(reinterpret_cast<const char*>(file.data()),
+                                    static_cast<unsigned int>(file.size()),
+                                    custom_fields, &images, &warn, &err));
+}
+
+int main(int argc, char** argv) {
+  (void)argc;
+  (void)argv;
+
+  TestGainMapBlackLevel();
+  TestFixBadPixels();
+  TestPointwiseOpcodes();
+  TestWarpRectilinear();
+  TestFixVignetteRadial();
+  TestDemosaicFlatAndRamp();
+  TestDemosaicNonBayer();
+  TestNormalizeImage();
+  TestColorNeutralToWhite();
+  TestToneCurve();
+  TestDevelopImageMatchesStages();
+  TestDevelopPreview();
+  TestDevelopPreviewFlat();
+  TestTiledLZW();
+
+  if (g_failures) {
+    std::cout << g_failures << " check(s) failed." << std::endl;
+    return EXIT_FAILURE;
+  }
+  std::cout << "All checks passed." << std::endl;
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,546 @@
+// Round trip checks of tiny_dng_writer: images written in little and big
+// endian are loaded back with tiny_dng_loader.
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#define TINY_DNG_LOADER_IMPLEMENTATION
+#define STB_IMAGE_IMPLEMENTATION
+#define TINY_DNG_NO_EXCEPTION
+#define TINY_DNG_LOADER_ENABLE_ZIP
+#include "tiny_dng_loader.h"
+
+#define TINY_DNG_WRITER_IMPLEMENTATION
+#define TINY_DNG_WRITER_ENABLE_ZIP
+#include "tiny_dng_writer.h"
+
+// To create baseline JPEG data.
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "examples/common/stb_image_write.h"
+
+static int g_failures = 0;
+
+#define CHECK(cond)                                                     \
+  do {                                                                  \
+    if (!(cond)) {                                                      \
+      std::cout << __FILE__ << ":" << __LINE__ << ": CHECK(" #cond      \
+                << ") failed" << std::endl;                             \
+      g_failures++;                                                     \
+    }                                                                   \
+  } while (0)
+
+static const char* kFilename = "test_writer_output.dng";
+
+// Sample layout of an image to write.
+struct Format {
+  unsigned short spp;
+  unsigned short bps;
+  unsigned short sample_format;
+  unsigned short compression;
+  unsigned short predictor;
+};
+
+// Image data of `format` in native byte order. Values vary per sample so
+// that swapped bytes or planes are detected.
+static std::vector<unsigned char> MakeSamples(const Format& format,
+                                              unsigned int width,
+                                              unsigned int height) {
+  const size_t n = size_t(width) * height * format.spp;
+  std::vector<unsigned char> data(n * format.bps / 8);
+  for (size_t i = 0; i < n; i++) {
+    const unsigned int v = (unsigned int)((i * 2654435761u) >> 7);
+    if (format.sample_format == tinydngwriter::SAMPLEFORMAT_IEEEFP) {
+      const float f = float(v % 100000) / 1000.0f - 20.0f;
+      memcpy(&data[i * 4], &f, 4);
+    } else if (format.bps == 16) {
+      const unsigned short s = static_cast<unsigned short>(v);
+      memcpy(&data[i * 2], &s, 2);
+    } else {
+      data[i] = static_cast<unsigned char>(v);
+    }
+  }
+  return data;
+}
+
+// Write an image of `format` with a few tags whose values fit in the IFD
+// entry itself, then load it back and compare.
+static void TestRoundTrip(bool big_endian, const Format& format) {
+  const unsigned int width = 70;
+  const unsigned int height = 45;
+  const std::vector<unsigned char> samples =
+      MakeSamples(format, width, height);
+
+  tinydngwriter::DNGImage image;
+  image.SetBigEndian(big_endian);
+  image.SetSubfileType(false, false, false);
+  image.SetImageWidth(width);
+  image.SetImageLength(height);
+  image.SetSamplesPerPixel(format.spp);
+  std::vector<unsigned short> bps(format.spp, format.bps);
+  image.SetBitsPerSample(format.spp, bps.data());
+  std::vector<unsigned short> sample_format(format.spp, format.sample_format);
+  image.SetSampleFormat(format.spp, sample_format.data());
+  image.SetPlanarConfig(tinydngwriter::PLANARCONFIG_CONTIG);
+  image.SetCompression(format.compression);
+  image.SetPhotometric(format.spp == 1 ? tinydngwriter::PHOTOMETRIC_CFA
+                                       : tinydngwriter::PHOTOMETRIC_LINEARRAW);
+  image.SetCFARepeatPatternDim(2, 2);
+  const unsigned char cfa[4] = {0, 1, 1, 2};
+  image.SetCFAPattern(4, cfa);
+  image.SetBlackLevelRepeatDim(2, 1);
+  std::vector<unsigned short> black(2 * format.spp);
+  for (size_t i = 0; i < black.size(); i++) {
+    black[i] = static_cast<unsigned short>(10 + i);
+  }
+  image.SetBlackLevel(static_cast<unsigned int>(black.size()), black.data());
+  const unsigned int active_area[4] = {1, 2, height, width};
+  image.SetActiveArea(active_area);
+  image.SetCalibrationIlluminant1(tinydng::LIGHTSOURCE_D65);
+
+  bool ret;
+  if (format.compression == tinydngwriter::COMPRESSION_ZIP) {
+    ret = image.SetImageDataZIP(samples.data(), width, height, 32, 16,
+                                format.predictor);
+  } else {
+    image.SetRowsPerStrip(height);
+    ret = image.SetImageData(samples.data(), samples.size());
+  }
+  if (!ret) {
+    std::cout << "Failed to set image data: " << image.Error() << std::endl;
+    g_failures++;
+    return;
+  }
+
+  tinydngwriter::DNGWriter writer(big_endian);
+  writer.AddImage(&image);
+  std::string err;
+  if (!writer.WriteToFile(kFilename, &err)) {
+    std::cout << "Failed to write DNG: " << err << std::endl;
+    g_failures++;
+    return;
+  }
+
+  std::string warn;
+  std::vector<tinydng::FieldInfo> custom_fields;
+  std::vector<tinydng::DNGImage> images;
+  const bool loaded =
+      tinydng::LoadDNG(kFilename, custom_fields, &images, &warn, &err);
+  std::remove(kFilename);
+  if (!loaded || (images.size() != 1)) {
+    std::cout << "Failed to load DNG: " << err << std::endl;
+    g_failures++;
+    return;
+  }
+
+  const tinydng::DNGImage& loaded_image = images[0];
+  CHECK(loaded_image.width == int(width));
+  CHECK(loaded_image.height == int(height));
+  CHECK(loaded_image.samples_per_pixel == format.spp);
+  CHECK(loaded_image.bits_per_sample == format.bps);
+  CHECK(loaded_image.sample_format == format.sample_format);
+  CHECK(loaded_image.compression == format.compression);
+  CHECK(loaded_image.cfa_repeat_dim[0] == 2);
+  CHECK(loaded_image.cfa_repeat_dim[1] == 2);
+  CHECK(loaded_image.black_level_repeat_dim[0] == 2);
+  CHECK(loaded_image.black_level_repeat_dim[1] == 1);
+  CHECK(loaded_image.black_level_repeat.size() == black.size());
+  for (size_t i = 0; i < loaded_image.black_level_repeat.size(); i++) {
+    CHECK(loaded_image.black_level_repeat[i] == float(black[i]));
+  }
+  CHECK(loaded_image.has_active_area);
+  CHECK(loaded_image.active_area[0] == 1);
+  CHECK(loaded_image.active_area[1] == 2);
+  CHECK(loaded_image.active_area[2] == int(height));
+  CHECK(loaded_image.active_area[3] == int(width));
+  CHECK(loaded_image.calibration_illuminant1 == tinydng::LIGHTSOURCE_D65);
+  CHECK(loaded_image.data == samples);
+  if (g_failures > 0) {
+    std::cout << (big_endian ? "big" : "little") << " endian, spp "
+              << format.spp << ", bps " << format.bps << ", compression "
+              << format.compression << ", predictor " << format.predictor
+              << std::endl;
+  }
+}
+
+// An invalid BlackLevelRepeatDim(over 16) or a BlackLevel count that does
+// not match it does not fail the load. The first value per sample is used.
+static void TestInvalidBlackLevel() {
+  const unsigned short dims[2][2] = {{17, 1}, {2, 2}};
+  for (int i = 0; i < 2; i++) {
+    const unsigned int width = 16;
+    const unsigned int height = 8;
+    std::vector<unsigned short> samples(width * height, 1000);
+
+    tinydngwriter::DNGImage image;
+    image.SetBigEndian(false);
+    image.SetSubfileType(false, false, false);
+    image.SetImageWidth(width);
+    image.SetImageLength(height);
+    image.SetRowsPerStrip(height);
+    image.SetSamplesPerPixel(1);
+    const unsigned short bps = 16;
+    image.SetBitsPerSample(1, &bps);
+    image.SetPlanarConfig(tinydngwriter::PLANARCONFIG_CONTIG);
+    image.SetCompression(tinydngwriter::COMPRESSION_NONE);
+    image.SetPhotometric(tinydngwriter::PHOTOMETRIC_LINEARRAW);
+    image.SetBlackLevelRepeatDim(dims[i][0], dims[i][1]);
+    // 17 values: too many for 2x2.
+    std::vector<unsigned short> black(17);
+    for (size_t k = 0; k < black.size(); k++) {
+      black[k] = static_cast<unsigned short>(100 + k);
+    }
+    image.SetBlackLevel(static_cast<unsigned int>(black.size()), black.data());
+    image.SetImageData(reinterpret_cast<const unsigned char*>(samples.data()),
+                       samples.size() * sizeof(unsigned short));
+
+    tinydngwriter::DNGWriter writer(false);
+    writer.AddImage(&image);
+    std::string err;
+    if (!writer.WriteToFile(kFilename, &err)) {
+      std::cout << "Failed to write DNG: " << err << std::endl;
+      g_failures++;
+      return;
+    }
+
+    std::string warn;
+    std::vector<tinydng::FieldInfo> custom_fields;
+    std::vector<tinydng::DNGImage> images;
+    const bool loaded =
+        tinydng::LoadDNG(kFilename, custom_fields, &images, &warn, &err);
+    std::remove(kFilename);
+    CHECK(loaded && (images.size() == 1));
+    if (!loaded || images.empty()) {
+      std::cout << err << std::endl;
+      continue;
+    }
+    CHECK(!warn.empty());
+    CHECK(images[0].black_level[0] == 100);
+    CHECK(images[0].black_level_repeat.empty());
+    CHECK(images[0].black_level_repeat_dim[0] *
+              images[0].black_level_repeat_dim[1] ==
+          ((i == 0) ? 1 : 4));
+  }
+}
+
+// Rows of bit-packed samples start at a byte boundary. 5 x 12 bits leaves
+// 4 bits of padding at the end of each row.
+static void TestPaddedRows() {
+  const unsigned int width = 5;
+  const unsigned int height = 3;
+  const unsigned int bits = 12;
+  const size_t row_bytes = (width * bits + 7) / 8;
+
+  std::vector<unsigned short> values(width * height);
+  std::vector<unsigned char> packed(row_bytes * height, 0);
+  for (unsigned int y = 0; y < height; y++) {
+    for (unsigned int x = 0; x < width; x++) {
+      const unsigned short v =
+          static_cast<unsigned short>((y * width + x) * 251 + 7) & 0xfff;
+      values[y * width + x] = v;
+      // MSB first.
+      for (unsigned int b = 0; b < bits; b++) {
+        if ((v >> (bits - 1 - b)) & 1) {
+          const size_t bit = x * bits + b;
+          packed[y * row_bytes + bit / 8] |=
+              static_cast<unsigned char>(0x80 >> (bit % 8));
+        }
+      }
+    }
+  }
+
+  tinydngwriter::DNGImage image;
+  image.SetBigEndian(false);
+  image.SetSubfileType(false, false, false);
+  image.SetImageWidth(width);
+  image.SetImageLength(height);
+  image.SetRowsPerStrip(height);
+  image.SetSamplesPerPixel(1);
+  const unsigned short bps = bits;
+  image.SetBitsPerSample(1, &bps);
+  image.SetPlanarConfig(tinydngwriter::PLANARCONFIG_CONTIG);
+  image.SetCompression(tinydngwriter::COMPRESSION_NONE);
+  image.SetPhotometric(tinydngwriter::PHOTOMETRIC_LINEARRAW);
+  image.SetImageData(packed.data(), packed.size());
+
+  tinydngwriter::DNGWriter writer(false);
+  writer.AddImage(&image);
+  std::string err;
+  if (!writer.WriteToFile(kFilename, &err)) {
+    std::cout << "Failed to write DNG: " << err << std::endl;
+    g_failures++;
+    return;
+  }
+
+  tinydng::LoadOption option;
+  option.unpack_to_uint16 = true;
+  std::string warn;
+  std::vector<tinydng::FieldInfo> custom_fields;
+  std::vector<tinydng::DNGImage> images;
+  const bool loaded = tinydng::LoadDNG(kFilename, custom_fields, &images,
+                                       &warn, &err, option);
+  std::remove(kFilename);
+  CHECK(loaded && (images.size() == 1));
+  if (!loaded || images.empty()) {
+    std::cout << err << std::endl;
+    return;
+  }
+  CHECK(images[0].bits_per_sample == 16);
+  CHECK(images[0].data.size() == values.size() * sizeof(unsigned short));
+  if (images[0].data.size() != values.size() * sizeof(unsigned short)) {
+    return;
+  }
+  std::vector<unsigned short> unpacked(values.size());
+  memcpy(unpacked.data(), images[0].data.data(), images[0].data.size());
+  CHECK(unpacked == values);
+
+  // Unpadded input is rejected when it is too short for the padded rows.
+  CHECK(!tinydng::UnpackBitsRowsToU16(packed.data(), packed.size() - 1, width,
+                                      height, int(bits), false,
+                                      unpacked.data(), &err));
+}
+
+static unsigned int ReadU32LE(const unsigned char* p) {
+  return unsigned(p[0]) | (unsigned(p[1]) << 8) | (unsigned(p[2]) << 16) |
+         (unsigned(p[3]) << 24);
+}
+
+static void WriteU32LE(unsigned char* p, unsigned int v) {
+  for (int i = 0; i < 4; i++) {
+    p[i] = static_cast<unsigned char>(v >> (8 * i));
+  }
+}
+
+// Replace the data of tile `k` in the first IFD of little endian `file` with
+// `data`, appended to the end of the file.
+static bool ReplaceTile(std::vector<unsigned char>* file, size_t k,
+                        const std::vector<unsigned char>& data) {
+  const size_t ifd = ReadU32LE(&(*file)[4]);
+  const size_t num_entries =
+      size_t((*file)[ifd]) | (size_t((*file)[ifd + 1]) << 8);
+  size_t offsets = 0;
+  size_t byte_counts = 0;
+  for (size_t i = 0; i < num_entries; i++) {
+    const unsigned char* e = &(*file)[ifd + 2 + 12 * i];
+    const unsigned int tag = unsigned(e[0]) | (unsigned(e[1]) << 8);
+    if (tag == 324) {  // TileOffsets
+      offsets = ReadU32LE(e + 8);
+    } else if (tag == 325) {  // TileByteCounts
+      byte_counts = ReadU32LE(e + 8);
+    }
+  }
+  if ((offsets == 0) || (byte_counts == 0)) {
+    return false;
+  }
+  WriteU32LE(&(*file)[offsets + 4 * k],
+             static_cast<unsigned int>(file->size()));
+  WriteU32LE(&(*file)[byte_counts + 4 * k],
+             static_cast<unsigned int>(data.size()));
+  file->insert(file->end(), data.begin(), data.end());
+  return true;
+}
+
+// A tile inflating to fewer bytes than its size fails the load instead of
+// leaving stale pixels. Tiles narrower than the image are inflated to a
+// reused buffer, and tiles spanning the whole width are inflated in place.
+static void TestShortZIPTile() {
+  const unsigned int tile_widths[2] = {32, 64};
+  for (int i = 0; i < 2; i++) {
+    const unsigned int width = 64;
+    const unsigned int height = 48;
+    const unsigned int tile_width = tile_widths[i];
+    const unsigned int tile_length = 16;
+    const Format format = {1, 16, tinydngwriter::SAMPLEFORMAT_UINT,
+                           tinydngwriter::COMPRESSION_ZIP,
+                           tinydngwriter::PREDICTOR_HORIZONTAL};
+    const std::vector<unsigned char> samples =
+        MakeSamples(format, width, height);
+
+    tinydngwriter::DNGImage image;
+    image.SetBigEndian(false);
+    image.SetSubfileType(false, false, false);
+    image.SetImageWidth(width);
+    image.SetImageLength(height);
+    image.SetSamplesPerPixel(1);
+    image.SetBitsPerSample(1, &format.bps);
+    image.SetPlanarConfig(tinydngwriter::PLANARCONFIG_CONTIG);
+    image.SetCompression(format.compression);
+    image.SetPhotometric(tinydngwriter::PHOTOMETRIC_LINEARRAW);
+    if (!image.SetImageDataZIP(samples.data(), width, height, tile_width,
+                               tile_length, format.predictor)) {
+      std::cout << "Failed to set image data: " << image.Error() << std::endl;
+      g_failures++;
+      return;
+    }
+
+    tinydngwriter::DNGWriter writer(false);
+    writer.AddImage(&image);
+    std::string err;
+    if (!writer.WriteToFile(kFilename, &err)) {
+      std::cout << "Failed to write DNG: " << err << std::endl;
+      g_failures++;
+      return;
+    }
+    std::vector<unsigned char> file;
+    FILE* fp = fopen(kFilename, "rb");
+    if (fp) {
+      unsigned char buf[4096];
+      size_t n;
+      while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        file.insert(file.end(), buf, buf + n);
+      }
+      fclose(fp);
+    }
+    std::remove(kFilename);
+
+    std::string warn;
+    std::vector<tinydng::FieldInfo> custom_fields;
+    std::vector<tinydng::DNGImage> images;
+    CHECK(tinydng::LoadDNGFromMemory(
+        reinterpret_cast<const char*>(file.data()),
+        static_cast<unsigned int>(file.size()), custom_fields, &images, &warn,
+        &err));
+
+    // Valid zlib stream of 1000 bytes, shorter than a tile.
+    const size_t tile = 1;
+    std::vector<unsigned char> short_data(1000, 7);
+    mz_ulong compressed_size = mz_compressBound(mz_ulong(short_data.size()));
+    std::vector<unsigned char> compressed(
+        static_cast<size_t>(compressed_size));
+    CHECK(mz_compress(compressed.data(), &compressed_size, short_data.data(),
+                      mz_ulong(short_data.size())) == MZ_OK);
+    compressed.resize(size_t(compressed_size));
+    CHECK(ReplaceTile(&file, tile, compressed));
+
+    images.clear();
+    CHECK(!tinydng::LoadDNGFromMemory(
+        reinterpret_cast<const char*>(file.data()),
+        static_cast<unsigned int>(file.size()), custom_fields, &images, &warn,
+        &err));
+  }
+}
+
+static void AppendBytes(void* context, void* data, int size) {
+  std::vector<unsigned char>* out =
+      static_cast<std::vector<unsigned char>*>(context);
+  const unsigned char* p = static_cast<const unsigned char*>(data);
+  out->insert(out->end(), p, p + size);
+}
+
+// `preview_jpeg_scale_denom` scales an 8bit NEW_JPEG image only when it is a
+// reduced resolution image(NewSubFileType = 1) and `decode_preview_jpeg` is
+// set.
+static void TestPreviewJPEGScale() {
+  const int width = 64;
+  const int height = 48;
+  std::vector<unsigned char> rgb(size_t(width * height * 3));
+  for (size_t i = 0; i < rgb.size(); i++) {
+    rgb[i] = static_cast<unsigned char>(i % 251);
+  }
+  std::vector<unsigned char> jpeg;
+  if (!stbi_write_jpg_to_func(AppendBytes, &jpeg, width, height, 3,
+                              rgb.data(), 90)) {
+    std::cout << "Failed to encode JPEG." << std::endl;
+    g_failures++;
+    return;
+  }
+
+  // IFD 0: preview, IFD 1: full resolution JPEG.
+  tinydngwriter::DNGImage images[2];
+  for (int i = 0; i < 2; i++) {
+    tinydngwriter::DNGImage& image = images[i];
+    image.SetBigEndian(false);
+    image.SetSubfileType(i == 0, false, false);
+    image.SetImageWidth(width);
+    image.SetImageLength(height);
+    image.SetRowsPerStrip(height);
+    image.SetSamplesPerPixel(3);
+    const unsigned short bps[3] = {8, 8, 8};
+    image.SetBitsPerSample(3, bps);
+    image.SetPlanarConfig(tinydngwriter::PLANARCONFIG_CONTIG);
+    image.SetCompression(7);  // NEW_JPEG
+    image.SetPhotometric(6);  // YCbCr
+    image.SetImageData(jpeg.data(), jpeg.size());
+  }
+
+  tinydngwriter::DNGWriter writer(false);
+  writer.AddImage(&images[0]);
+  writer.AddImage(&images[1]);
+  std::string err;
+  if (!writer.WriteToFile(kFilename, &err)) {
+    std::cout << "Failed to write DNG: " << err << std::endl;
+    g_failures++;
+    return;
+  }
+
+  for (int decode_preview = 0; decode_preview < 2; decode_preview++) {
+    tinydng::LoadOption option;
+    option.decode_preview_jpeg = (decode_preview == 1);
+    option.preview_jpeg_scale_denom = 2;
+    std::string warn;
+    std::vector<tinydng::FieldInfo> custom_fields;
+    std::vector<tinydng::DNGImage> loaded;
+    CHECK(tinydng::LoadDNG(kFilename, custom_fields, &loaded, &warn, &err,
+                           option));
+    CHECK(loaded.size() == 2);
+    if (loaded.size() != 2) {
+      std::cout << err << std::endl;
+      break;
+    }
+    CHECK(loaded[0].new_subfile_type == 1);
+    CHECK(loaded[1].new_subfile_type == 0);
+    const int scale = (decode_preview == 1) ? 2 : 1;
+    CHECK(loaded[0].width == width / scale);
+    CHECK(loaded[0].height == height / scale);
+    CHECK(loaded[0].data.size() == rgb.size() / size_t(scale * scale));
+    CHECK(loaded[1].width == width);
+    CHECK(loaded[1].height == height);
+    CHECK(loaded[1].data.size() == rgb.size());
+  }
+  std::remove(kFilename);
+}
+
+int main() {
+  const Format formats[] = {
+      {1, 16, tinydngwriter::SAMPLEFORMAT_UINT,
+       tinydngwriter::COMPRESSION_NONE, tinydngwriter::PREDICTOR_NONE},
+      {3, 16, tinydngwriter::SAMPLEFORMAT_UINT,
+       tinydngwriter::COMPRESSION_NONE, tinydngwriter::PREDICTOR_NONE},
+      {1, 16, tinydngwriter::SAMPLEFORMAT_UINT,
+       tinydngwriter::COMPRESSION_ZIP, tinydngwriter::PREDICTOR_NONE},
+      {1, 16, tinydngwriter::SAMPLEFORMAT_UINT,
+       tinydngwriter::COMPRESSION_ZIP, tinydngwriter::PREDICTOR_HORIZONTAL},
+      {3, 16, tinydngwriter::SAMPLEFORMAT_UINT,
+       tinydngwriter::COMPRESSION_ZIP, tinydngwriter::PREDICTOR_HORIZONTAL},
+      {3, 8, tinydngwriter::SAMPLEFORMAT_UINT,
+       tinydngwriter::COMPRESSION_ZIP, tinydngwriter::PREDICTOR_HORIZONTAL},
+      {1, 32, tinydngwriter::SAMPLEFORMAT_IEEEFP,
+       tinydngwriter::COMPRESSION_ZIP, tinydngwriter::PREDICTOR_FLOATINGPOINT},
+      {3, 32, tinydngwriter::SAMPLEFORMAT_IEEEFP,
+       tinydngwriter::COMPRESSION_ZIP, tinydngwriter::PREDICTOR_FLOATINGPOINT},
+  };
+
+  for (int e = 0; e < 2; e++) {
+    for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+      const int failures = g_failures;
+      g_failures = 0;
+      TestRoundTrip(e == 1, formats[i]);
+      g_failures += failures;
+    }
+  }
+
+  TestInvalidBlackLevel();
+  TestPaddedRows();
+  TestShortZIPTile();
+  TestPreviewJPEGScale();
+
+  if (g_failures > 0) {
+    std::cout << g_failures << " check(s) failed." << std::endl;
+    return EXIT_FAILURE;
+  }
+  std::cout << "All checks passed." << std::endl;
+  return EXIT_SUCCESS;
+}
@@ -111,6 +111,23 @@ typedef enum {
   SAMPLEFORMAT_COMPLEXIEEEFP = 6
 } SampleFormat;
 
+// Opcode IDs of OpcodeList1, OpcodeList2 and OpcodeList3.
+typedef enum {
+  OPCODE_LIST_WARP_RECTILINEAR = 1,
+  OPCODE_LIST_WARP_FISHEYE = 2,
+  OPCODE_LIST_FIX_VIGNETTE_RADIAL = 3,
+  OPCODE_LIST_FIX_BAD_PIXELS_CONSTANT = 4,
+  OPCODE_LIST_FIX_BAD_PIXELS_LIST = 5,
+  OPCODE_LIST_TRIM_BOUNDS = 6,
+  OPCODE_LIST_MAP_TABLE = 7,
+  OPCODE_LIST_MAP_POLYNOMIAL = 8,
+  OPCODE_LIST_GAIN_MAP = 9,
+  OPCODE_LIST_DELTA_PER_ROW = 10,
+  OPCODE_LIST_DELTA_PER_COLUMN = 11,
+  OPCODE_LIST_SCALE_PER_ROW = 12,
+  OPCODE_LIST_SCALE_PER_COLUMN = 13
+} OpCodeListValue;
+
 struct FieldInfo {
   int tag;
   short read_count;
@@ -158,11 +175,70 @@ struct GainMap {
   }
 };
 
+///
+/// Opcode in OpcodeList1, OpcodeList2 or OpcodeList3.
+/// Parameters of WarpRectilinear, WarpFisheye, FixVignetteRadial,
+/// FixBadPixelsConstant/List, MapTable, MapPolynomial, GainMap,
+/// DeltaPerRow/Column and ScalePerRow/Column are parsed. Other opcodes keep
+/// their raw parameters in `data`.
+///
+struct Opcode {
+  unsigned int id{0};  // OpCodeListValue
+  unsigned int dng_version{0};
+  unsigned int flags{0};     // bit 0: optional, bit 1: can be skipped for preview
+  unsigned int list_idx{0};  // 1, 2 or 3: OpCodeListN
+
+  // Area and plane(s) to process.
+  unsigned int top{0}, left{0}, bottom{0}, right{0};
+  unsigned int plane{0}, planes{0};
+  unsigned int row_pitch{1}, col_pitch{1};
+
+  std::vector<unsigned short> table;  // MapTable
+  // MapPolynomial: degree + 1 items.
+  // WarpRectilinear: kr0, kr1, kr2, kr3, kt0, kt1 for each plane.
+  // WarpFisheye: kr0, kr1, kr2, kr3 for each plane.
+  // FixVignetteRadial: k0, k1, k2, k3, k4.
+  std::vector<double> coefficients;
+  std::vector<float> values;  // Deltas(DeltaPer*) or scales(ScalePer*)
+  int gainmap_index{-1};      // GainMap: index in `DNGImage::opcodelistN_gainmap`
+
+  // FixBadPixelsConstant/List
+  unsigned int constant{0};     // Pixels with this value are bad(Constant)
+  unsigned int bayer_phase{0};  // 0: red, 1: green(red row), 2: green(blue row), 3: blue at top-left
+  std::vector<unsigned int> bad_points;  // row, col pairs(List)
+  std::vector<unsigned int> bad_rects;   // top, left, bottom, right(List)
+
+  // WarpRectilinear/Fisheye, FixVignetteRadial: optical center relative to
+  // the image(0.0 ~ 1.0).
+  double center_x{0.5};
+  double center_y{0.5};
+
+  std::vector<unsigned char> data;  // Raw(big endian) parameters of other opcodes
+};
+
 struct DNGImage {
   int black_level[4];  // for each spp(up to 4)
   int white_level[4];  // for each spp(up to 4)
+
+  // BlackLevelRepeatDim(rows, cols) and the whole BlackLevel(rows * cols *
+  // samples_per_pixel values in row-major order, relative to the ActiveArea).
+  // `black_level` has the first samples_per_pixel values.
+  // An invalid BlackLevelRepeatDim(over 16) is ignored and BlackLevel whose
+  // count does not match it is kept only in `black_level`, with a warning.
+  int black_level_repeat_dim[2]{1, 1};
+  std::vector<float> black_level_repeat;
+  std::vector<float> black_level_delta_h;  // per column of the ActiveArea
+  std::vector<float> black_level_delta_v;  // per row of the ActiveArea
+
+  // LinearizationTable: stored integer value to linear value, applied before
+  // the black level. Empty = none.
+  std::vector<unsigned short> linearization_table;
   int version{0};         // DNG version
 
+  // NewSubFileType. bit 0: reduced resolution(preview or thumbnail),
+  // bit 2: transparency mask, bit 16: depth map, etc.
+  unsigned int new_subfile_type{0};
+
   int samples_per_pixel{0};
   int rows_per_strip{0};
 
@@ -171,10 +247,16 @@ struct DNGImage {
 
   char cfa_plane_color[4];  // 0:red, 1:green, 2:blue, 3:cyan, 4:magenta,
                             // 5:yellow, 6:white
-  int cfa_pattern[2][2];    // @fixme { Support non 2x2 CFA pattern. }
-  short cfa_pattern_dim;
+  int cfa_pattern[2][2];    // Top-left 2x2 of `cfa_repeat_pattern`
+  short cfa_pattern_dim;    // Rows of CFARepeatPatternDim
   short _pad_cfa_patern_dim;
   int cfa_layout;
+
+  // CFARepeatPatternDim(rows, cols) and the whole CFAPattern(rows * cols
+  // indices to `cfa_plane_color` in row-major order. e.g. 6x6 for X-Trans).
+  // `cfa_repeat_pattern` is empty when the image has no CFAPattern.
+  int cfa_repeat_dim[2]{2, 2};
+  std::vector<int> cfa_repeat_pattern;
   int active_area[4];  // top, left, bottom, right
   bool has_active_area;
   unsigned char pad_has_active_area[3];
@@ -204,6 +286,13 @@ struct DNGImage {
   double camera_calibration1[3][3];
   double camera_calibration2[3][3];
 
+  // True when ColorMatrix1/2, ForwardMatrix1/2 exist(CameraCalibration
+  // defaults to identity).
+  bool has_color_matrix1{false};
+  bool has_color_matrix2{false};
+  bool has_forward_matrix1{false};
+  bool has_forward_matrix2{false};
+
   LightSource calibration_illuminant1;
   LightSource calibration_illuminant2;
 
@@ -226,6 +315,10 @@ struct DNGImage {
   std::vector<unsigned int> strip_byte_counts;
   std::vector<unsigned int> strip_offsets;
 
+  // For an image with multiple tiles(row-major order).
+  std::vector<unsigned int> tile_byte_counts;
+  std::vector<unsigned int> tile_offsets;
+
   // Color profile
   std::string profile_name; // UTF-8 string
   // An array of flattened the pair of input/output value.
@@ -249,9 +342,19 @@ struct DNGImage {
   std::vector<GainMap> opcodelist2_gainmap;
   std::vector<GainMap> opcodelist3_gainmap;
 
+  // All opcodes of OpcodeListN in the order of execution.
+  std::vector<Opcode> opcodelist1;
+  std::vector<Opcode> opcodelist2;
+  std::vector<Opcode> opcodelist3;
+
   std::vector<unsigned char>
       data;  // Decoded pixel data(len = spp * width * height * bps / 8)
 
+  // Uncompressed pixel data in the input memory(LoadOption::uncompressed_view).
+  // `data` is empty when the view is set.
+  const unsigned char* data_view{nullptr};
+  size_t data_view_size{0};
+
   std::array<int32_t, 2> shutter_speed{0,0}; // numerator, denominator
   std::array<int32_t, 2> aperture_value{0,0}; // numerator, denominator
 
@@ -259,6 +362,49 @@ struct DNGImage {
   std::vector<FieldData> custom_fields;
 };
 
+typedef enum {
+  WARP_FILTER_BILINEAR = 0,
+  WARP_FILTER_BICUBIC = 1  // Catmull-Rom
+} WarpFilter;
+
+///
+/// Options for `ApplyOpcodeList`.
+///
+struct OpcodeOption {
+  // Resampling filter of WarpRectilinear and WarpFisheye.
+  WarpFilter warp_filter{WARP_FILTER_BICUBIC};
+};
+
+///
+/// Options for `LoadDNG` and `LoadDNGFromMemory`.
+///
+struct LoadOption {
+  // Unpack bit-packed samples(e.g. 10, 12 or 14 bits. Anything below 16 bits
+  // except 8 bits) of uncompressed, LZW or ZIP image into native endian
+  // uint16. `bits_per_sample` becomes 16 and `bits_per_sample_original` keeps
+  // the bit depth in the file. Sample values are not scaled.
+  bool unpack_to_uint16{false};
+
+  // Do not copy uncompressed pixel data. `DNGImage::data_view` points to the
+  // input memory instead of filling `DNGImage::data`, when the data is stored
+  // in contiguous strips and does not need byte swapping. The input memory must
+  // be kept alive while the view is used. `LoadDNGFromMemory` only(`LoadDNG`
+  // frees the file content before returning).
+  bool uncompressed_view{false};
+
+  // Decode baseline JPEG stored in OLD_JPEG IFD(e.g. preview image of CR2) into
+  // `DNGImage::data`(8bit, 1 or 3 channels). When false, only the width and
+  // height are read from the JPEG header and `data` is left empty.
+  bool decode_preview_jpeg{false};
+
+  // Decode 8bit JPEG preview(OLD_JPEG and NEW_JPEG) at 1/N resolution.
+  // 1, 2, 4 or 8. DCT domain scaling is used with libjpeg-turbo backend
+  // (TINY_DNG_LOADER_USE_LIBJPEG_TURBO), box filtering after decoding otherwise.
+  // NEW_JPEG images are scaled only when `decode_preview_jpeg` is true and
+  // NewSubFileType is a reduced resolution image.
+  int preview_jpeg_scale_denom{1};
+};
+
 ///
 /// Loads DNG image and store it to `images`
 ///
@@ -271,13 +417,14 @@ struct DNGImage {
 /// @param[out] images Loaded DNG images.
 /// @param[out] warn Warning message.
 /// @param[out] err Error message.
+/// @param[in] option Load option.
 ///
 /// @return true upon success.
 /// @return false upon failure and store error message into `err`.
 ///
 bool LoadDNG(const char* filename, std::vector<FieldInfo>& custom_fields,
              std::vector<DNGImage>* images, std::string* warn,
-             std::string* err);
+             std::string* err, const LoadOption& option = LoadOption());
 
 ///
 /// Check if a file is DNG(TIFF) or not.
@@ -292,13 +439,404 @@ bool IsDNG(const char* filename, std::string* msg);
 bool LoadDNGFromMemory(const char* mem, unsigned int size,
                        std::vector<FieldInfo>& custom_fields,
                        std::vector<DNGImage>* images, std::string* warn,
-                       std::string* err);
+                       std::string* err,
+                       const LoadOption& option = LoadOption());
 
 ///
 /// A variant of `IsDNG` which checks if a data is DNG image.
 ///
 bool IsDNGFromMemory(const char* mem, unsigned int size, std::string* msg);
 
+///
+/// Baseline JPEG stream embedded in DNG/TIFF(e.g. preview or thumbnail image).
+///
+struct PreviewJPEG {
+  size_t offset{0};  // Byte offset of the JPEG stream(SOI marker) in the input.
+  size_t length{0};  // Byte length of the JPEG stream.
+
+  int image_index{-1};  // Index of the IFD(same order as `images` of `LoadDNG`)
+  int compression{0};   // COMPRESSION_OLD_JPEG, COMPRESSION_NEW_JPEG, etc.
+  int width{0};         // from JPEG header
+  int height{0};        // from JPEG header
+  int components{0};    // 1 or 3
+};
+
+///
+/// Lists baseline JPEG streams(preview, thumbnail or lossy image) in DNG data
+/// without decoding them. Only TIFF IFDs and JPEG headers are parsed.
+/// `offset` and `length` point into `mem`, so the JPEG stream can be served
+/// as-is(e.g. with a single range read of the file).
+/// Lossless JPEG(RAW data) and JPEG split into multiple strips or tiles are
+/// not listed.
+///
+/// @return true upon success(`previews` may be empty).
+/// @return false upon failure and store error message into `err`.
+///
+bool GetPreviewJPEGs(const char* mem, unsigned int size,
+                     std::vector<PreviewJPEG>* previews, std::string* warn,
+                     std::string* err);
+
+///
+/// Decode baseline JPEG stream(e.g. `PreviewJPEG` range of the input) into
+/// 8bit, 1 or 3 channels image with the backend selected at compile
+/// time(stb_image or libjpeg-turbo. See TINY_DNG_LOADER_JPEG_BACKEND_NAME).
+///
+/// @param[in] scale_denom Decode at 1/N resolution(1, 2, 4 or 8). The image
+/// size becomes ceil(width / N) x ceil(height / N).
+///
+bool DecodeJPEG(const unsigned char* src, size_t src_len, int scale_denom,
+                std::vector<unsigned char>* dst, int* width, int* height,
+                int* components, std::string* err);
+
+///
+/// Unpack `num_samples` bit-packed samples in `src` into uint16 `dst`.
+/// Samples are packed without padding(e.g. 4 samples in 7 bytes for 14 bits).
+/// Use `UnpackBitsRowsToU16` for image rows padded to a byte boundary.
+///
+/// @param[in] bits_per_sample 1 ~ 16. SIMD path is used for 2, 4, 6, 10, 12 and
+/// 14 bits.
+/// @param[in] lsb_first false: Samples are packed from the most significant
+/// bit of each byte(big endian. TIFF/DNG). true: Samples are packed from the
+/// least significant bit(little endian).
+///
+/// @return false when `src_len` is too short for `num_samples` samples.
+///
+bool UnpackBitsToU16(const unsigned char* src, size_t src_len,
+                     size_t num_samples, int bits_per_sample, bool lsb_first,
+                     unsigned short* dst, std::string* err);
+
+///
+/// Unpack `rows` rows of `row_samples` bit-packed samples in `src` into uint16
+/// `dst`. As in TIFF/DNG, each row starts at a byte boundary, so the row
+/// stride of `src` is (row_samples * bits_per_sample + 7) / 8 bytes. Same as
+/// `UnpackBitsToU16` when rows have no padding bits.
+///
+/// @return false when `src_len` is too short for `rows` rows.
+///
+bool UnpackBitsRowsToU16(const unsigned char* src, size_t src_len,
+                         size_t row_samples, size_t rows, int bits_per_sample,
+                         bool lsb_first, unsigned short* dst,
+                         std::string* err);
+
+///
+/// Apply GainMap opcodes(e.g. `DNGImage::opcodelist2_gainmap`) to
+/// `image->data` in place. Area(top/left/bottom/right), plane(s) and
+/// row/column pitch of each map are honored, and the gain is bilinearly
+/// interpolated from the map points as done in DNG SDK.
+///
+/// Supported data: 8bit or 16bit unsigned integer, 32bit float.
+/// Coordinates of OpcodeList2 and OpcodeList3 maps are relative to the
+/// ActiveArea. For integer data of OpcodeList2 maps, the gain is applied to
+/// the value above the black level(`black + (value - black) * gain`), which is
+/// equivalent to applying it to linearized value. The black level of each
+/// sample is the same as `NormalizeImage`(BlackLevelRepeatDim pattern and
+/// BlackLevelDeltaH/V). Results are clamped to the range of the sample type.
+///
+/// When `image->data_view` is set, the data is copied to `image->data` first.
+/// Rows are processed in parallel when TINY_DNG_LOADER_USE_THREAD is defined.
+///
+bool ApplyGainMaps(const std::vector<GainMap>& gainmaps, DNGImage* image,
+                   std::string* err);
+
+///
+/// Apply an OpcodeList(e.g. `DNGImage::opcodelist2`) to `image->data` in
+/// place. `gainmaps` is the GainMap list of the same OpcodeList(e.g.
+/// `DNGImage::opcodelist2_gainmap`).
+///
+/// Supported opcodes: WarpRectilinear, WarpFisheye, FixVignetteRadial,
+/// FixBadPixelsConstant, FixBadPixelsList, MapTable, MapPolynomial, GainMap,
+/// DeltaPerRow, DeltaPerColumn, ScalePerRow and ScalePerColumn. Consecutive opcodes other
+/// than Warp* and FixBadPixels* are fused: each row goes through them in order
+/// while it is in cache, so the image is read and written once. Unsupported
+/// opcodes are skipped with a message in `warn` when they are flagged
+/// optional, otherwise an error is returned.
+///
+/// Bad pixels are replaced with the average of the nearest good pixels of the
+/// same CFA color(BayerPhase of the opcode for 2x2 patterns,
+/// `cfa_repeat_pattern` for others such as X-Trans), and the cost is proportional to the number of bad pixels
+/// (FixBadPixelsConstant also scans the image to find them).
+///
+/// Warp* resample the image with `option.warp_filter` in tiles. Source
+/// coordinates outside of the image are clamped to the edge.
+///
+/// Supported data: 16bit unsigned integer and 32bit float. For integer data,
+/// MapPolynomial is evaluated on values normalized to [0, 1], deltas are in
+/// sample units, and results are clamped to [0, 65535]. Float data is not
+/// clamped. GainMap follows `ApplyGainMaps`.
+///
+/// FixVignetteRadial gains are looked up from a table over r^2 and applied
+/// like GainMap. Gains of adjacent GainMap and FixVignetteRadial opcodes are
+/// multiplied and applied to each sample once.
+///
+/// When `image->data_view` is set, the data is copied to `image->data` first.
+/// Rows are processed in parallel when TINY_DNG_LOADER_USE_THREAD is defined.
+///
+bool ApplyOpcodeList(const std::vector<Opcode>& opcodes,
+                     const std::vector<GainMap>& gainmaps, DNGImage* image,
+                     std::string* warn, std::string* err,
+                     const OpcodeOption& option = OpcodeOption());
+
+typedef enum {
+  DEMOSAIC_BILINEAR = 0,
+  DEMOSAIC_MALVAR = 1,  // Malvar-He-Cutler(gradient-corrected bilinear)
+  DEMOSAIC_AHD = 2      // Adaptive Homogeneity-Directed
+} DemosaicMethod;
+
+///
+/// Options for `Demosaic`.
+///
+struct DemosaicOption {
+  DemosaicMethod method{DEMOSAIC_MALVAR};
+
+  // Sample value of the white(used by AHD to measure the color difference in
+  // CIELab). 0 = `white_level[0]` for integer data, 1.0 for float data.
+  float white{0.0f};
+};
+
+///
+/// Demosaic the CFA image of `image`(samples_per_pixel = 1) into
+/// interleaved RGB `rgb`(`*width` x `*height` x 3 floats). The ActiveArea is
+/// processed when `image.has_active_area` is true, and the CFA pattern
+/// (`cfa_repeat_pattern` and `cfa_plane_color`) is relative to its top-left.
+///
+/// `option.method` applies to 2x2 Bayer patterns. Other patterns up to 8x8
+/// (e.g. 6x6 X-Trans) interpolate green from the nearest green samples, then
+/// red and blue from the color difference to green.
+///
+/// Supported data: 8bit or 16bit unsigned integer, 32bit float(use
+/// `LoadOption::unpack_to_uint16` for bit-packed data). Sample values are
+/// interpolated as they are, so apply black level and white balance first for
+/// the best quality. Bilinear and Malvar-He-Cutler are SSE2/NEON accelerated.
+/// Malvar-He-Cutler and AHD results are not clamped.
+///
+/// The image is processed in tiles with a mirrored border(halo), in parallel
+/// when TINY_DNG_LOADER_USE_THREAD is defined.
+///
+bool Demosaic(const DNGImage& image, std::vector<float>* rgb, int* width,
+              int* height, std::string* err,
+              const DemosaicOption& option = DemosaicOption());
+
+///
+/// Options for `NormalizeImage`.
+///
+struct NormalizeOption {
+  // Multiply white balance from `as_shot_neutral`(1 / neutral, scaled so that
+  // the smallest multiplier is 1) to CFA images and images with 3 samples per
+  // pixel.
+  bool white_balance{true};
+
+  // Clamp float output to [0, 1]. uint16 output is always clamped.
+  bool clamp{true};
+};
+
+///
+/// Subtract the black level, normalize by the white level and apply white
+/// balance in one pass. `out` has the ActiveArea of `image`(`*width` x
+/// `*height` x `samples_per_pixel`), where white is 1.0 for float output and
+/// 65535 for uint16 output.
+///
+/// The black level is `black_level_repeat`(per BlackLevelRepeatDim position
+/// and sample) + `black_level_delta_h` + `black_level_delta_v`, or
+/// `black_level` when `black_level_repeat` is empty. The white level is
+/// `white_level` per sample(1.0 for float data without WhiteLevel). Supported
+/// data: 8bit or 16bit unsigned integer, 32bit float. SSE2/NEON accelerated
+/// and multithreaded when TINY_DNG_LOADER_USE_THREAD is defined.
+///
+bool NormalizeImage(const DNGImage& image, std::vector<float>* out,
+                    int* width, int* height, std::string* err,
+                    const NormalizeOption& option = NormalizeOption());
+bool NormalizeImage(const DNGImage& image, std::vector<unsigned short>* out,
+                    int* width, int* height, std::string* err,
+                    const NormalizeOption& option = NormalizeOption());
+
+///
+/// Tone curve baked into a lookup table over [0, 1].
+///
+struct ToneCurve {
+  // 4097 samples, linearly interpolated. Empty = identity.
+  std::vector<float> lut;
+};
+
+///
+/// Bake a tone curve of flattened (input, output) pairs(same layout as
+/// `DNGImage::profile_tone_curve`) into `curve`. The points are interpolated
+/// with the cubic spline of the DNG SDK.
+///
+bool BuildToneCurve(const std::vector<float>& points, ToneCurve* curve,
+                    std::string* err);
+
+///
+/// Apply `curve` to each of `num_values` values of `in` into `out`(may be
+/// `in`). Input is clamped to [0, 1]. SSE2/NEON accelerated and
+/// multithreaded when TINY_DNG_LOADER_USE_THREAD is defined.
+///
+bool ApplyToneCurve(const ToneCurve& curve, const float* in,
+                    size_t num_values, float* out, std::string* err);
+
+///
+/// Output color space of `ColorTransform`.
+///
+enum ColorSpace {
+  COLOR_SPACE_SRGB = 0,          // sRGB(D65), sRGB transfer curve
+  COLOR_SPACE_ADOBE_RGB = 1,     // Adobe RGB(1998)(D65), gamma 563/256
+  COLOR_SPACE_PROPHOTO_RGB = 2,  // ProPhoto RGB(D50), gamma 1.8
+  COLOR_SPACE_XYZ_D50 = 3        // CIE XYZ(D50, DNG PCS), linear
+};
+
+///
+/// Options for `ComputeColorTransform`.
+///
+struct ColorOption {
+  ColorSpace color_space{COLOR_SPACE_SRGB};
+
+  // Input camera RGB is white balanced with `as_shot_neutral` by
+  // `NormalizeImage`. Set false for camera native RGB.
+  bool white_balanced_input{true};
+
+  // Encode the transfer curve of `color_space`. false = linear output.
+  bool encode_gamma{true};
+
+  // Clamp the output to [0, 1].
+  bool clamp{true};
+
+  // Apply `profile_tone_curve` of the image(if exists) to each linear output
+  // channel before the transfer curve.
+  bool apply_tone_curve{false};
+};
+
+///
+/// Camera RGB to output RGB transform for a white point.
+///
+struct ColorTransform {
+  ColorSpace color_space{COLOR_SPACE_SRGB};
+  bool encode_gamma{true};
+  bool clamp{true};
+
+  double matrix[3][3];      // Input camera RGB to linear output RGB
+  double white_xy[2];       // Chromaticity of the white point
+  double temperature{0.0};  // Correlated color temperature of the white(K)
+  double weight1{1.0};      // Weight of the calibration illuminant 1 matrices
+
+  // Applied after clamp and before the transfer curve. Empty = none.
+  ToneCurve tone_curve;
+};
+
+///
+/// Recently computed color transforms keyed by the camera profile, white point
+/// and option. Not thread-safe.
+///
+struct ColorTransformCache {
+  size_t max_entries{16};
+
+  std::vector<std::vector<double> > keys;
+  std::vector<ColorTransform> transforms;
+  size_t next{0};  // Entry to replace when full
+};
+
+///
+/// Compute the camera to `option.color_space` transform of `image` as the DNG
+/// spec "Mapping Camera Color Space to CIE XYZ Space". `camera_neutral`(3
+/// values) is the white balance, or nullptr for `as_shot_neutral`(D65 white
+/// when the image has none).
+///
+/// The white point is found from the neutral by iterating the matrices
+/// interpolated by the inverse of its correlated color temperature between
+/// the two calibration illuminants. ForwardMatrix is used when it exists,
+/// otherwise the inverse of ColorMatrix with Bradford adaptation to D50.
+/// CameraCalibration and AnalogBalance are applied. ProfileToneCurve is baked
+/// into `transform->tone_curve` when `option.apply_tone_curve` is set. When
+/// `cache` is given, a transform computed for the same profile, neutral and
+/// option is reused.
+///
+bool ComputeColorTransform(const DNGImage& image, const double* camera_neutral,
+                           ColorTransform* transform, std::string* err,
+                           const ColorOption& option = ColorOption(),
+                           ColorTransformCache* cache = nullptr);
+
+///
+/// Apply `transform` to `num_pixels` interleaved RGB pixels of `in` into
+/// `out`(may be `in`): matrix, clamp, tone curve and transfer curve in one
+/// pass. SSE2/NEON accelerated and multithreaded when
+/// TINY_DNG_LOADER_USE_THREAD is defined.
+///
+bool ApplyColorTransform(const ColorTransform& transform, const float* in,
+                         size_t num_pixels, float* out, std::string* err);
+
+///
+/// Options for `DevelopImage`.
+///
+struct DevelopOption {
+  DemosaicMethod demosaic_method{DEMOSAIC_MALVAR};
+  ColorSpace color_space{COLOR_SPACE_SRGB};
+
+  // Camera neutral(3 values) of the white balance. nullptr =
+  // `as_shot_neutral`(D65 white when the image has none).
+  const double* camera_neutral{nullptr};
+
+  // Apply GainMap opcodes of OpcodeList2(e.g. lens shading). Do not set when
+  // OpcodeList2 is already applied to the data with `ApplyOpcodeList`.
+  bool apply_gain_maps{true};
+
+  // Apply `profile_tone_curve`(if exists).
+  bool apply_tone_curve{true};
+
+  // Encode the transfer curve of `color_space`. false = linear output.
+  bool encode_gamma{true};
+};
+
+///
+/// Develop the CFA image of `image` into interleaved RGB `rgb`(`*width` x
+/// `*height` x 3, the ActiveArea) with 8bit or 16bit samples.
+///
+/// LinearizationTable, black/white level(`NormalizeImage`), OpcodeList2
+/// GainMaps, white balance, demosaic(`Demosaic`), color matrix
+/// (`ComputeColorTransform`), tone curve and transfer curve are applied to
+/// one tile at a time. Each tile is loaded with the halo of the demosaic
+/// kernel and stays in cache through all stages, so the image data is read
+/// once and the output is written once without full-frame intermediates.
+/// Tiles are processed in parallel when TINY_DNG_LOADER_USE_THREAD is defined.
+///
+/// Values are clipped to white after the white balance. Other opcodes and
+/// OpcodeList3 are not applied. Supported data: same as `Demosaic`.
+///
+bool DevelopImage(const DNGImage& image, std::vector<unsigned char>* rgb,
+                  int* width, int* height, std::string* err,
+                  const DevelopOption& option = DevelopOption());
+bool DevelopImage(const DNGImage& image, std::vector<unsigned short>* rgb,
+                  int* width, int* height, std::string* err,
+                  const DevelopOption& option = DevelopOption());
+
+///
+/// Options for `DevelopPreview`.
+///
+struct PreviewOption {
+  // Downscale factor(2: half, 4: quarter). For CFA patterns whose blocks of
+  // this size miss a color(e.g. X-Trans at 2), the smallest larger factor
+  // that has all colors in every block is used.
+  int scale{2};
+
+  // Apply `profile_tone_curve`(if exists).
+  bool apply_tone_curve{false};
+};
+
+///
+/// Render a downscaled 8bit sRGB preview of the raw image(CFA or 3 samples
+/// per pixel) of `image` into interleaved RGB `rgb`(`*width` x `*height` x 3)
+/// e.g. for thumbnails of raw files without a usable preview JPEG.
+///
+/// Each output pixel is the average of the samples of each color in a
+/// `scale` x `scale` block of the ActiveArea after linearization, black/white
+/// level and white balance, so no demosaic is needed. The color matrix of
+/// `ComputeColorTransform`(identity without ColorMatrix1) and the sRGB
+/// transfer curve from a LUT follow. Only a few rows of floats per thread
+/// are allocated besides the output. With `LoadOption::uncompressed_view`,
+/// uncompressed samples are read directly from the file memory. Rows are
+/// processed in parallel when TINY_DNG_LOADER_USE_THREAD is defined.
+///
+bool DevelopPreview(const DNGImage& image, std::vector<unsigned char>* rgb,
+                    int* width, int* height, std::string* err,
+                    const PreviewOption& option = PreviewOption());
+
 }  // namespace tinydng
 
 #ifdef TINY_DNG_LOADER_IMPLEMENTATION
@@ -313,6 +851,7 @@ bool IsDNGFromMemory(const char* mem, unsigned int size, std::string* msg);
 
 #include <stdint.h>  // for lj92
 
+#include <algorithm>
 #include <cmath>
 #include <cstdlib>
 #include <cstring>
@@ -345,6 +884,26 @@ bool IsDNGFromMemory(const char* mem, unsigned int size, std::string* msg);
 
 #endif
 
+// SIMD kernels. Define TINY_DNG_LOADER_NO_SIMD to use scalar code only.
+#if !defined(TINY_DNG_LOADER_NO_SIMD)
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#define TINY_DNG_LOADER_SIMD_SSE2
+#include <emmintrin.h>
+#if defined(__SSSE3__) || defined(__AVX2__)
+#define TINY_DNG_LOADER_SIMD_SSSE3
+#include <tmmintrin.h>
+#endif
+#if defined(__AVX2__)
+#define TINY_DNG_LOADER_SIMD_AVX2
+#include <immintrin.h>
+#endif
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define TINY_DNG_LOADER_SIMD_NEON
+#include <arm_neon.h>
+#endif
+#endif
+
 #ifdef __clang__
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Weverything"
@@ -427,8 +986,19 @@ bool IsDNGFromMemory(const char* mem, unsigned int size, std::string* msg);
 #endif
 
 #ifdef TINY_DNG_LOADER_ENABLE_ZIP
-#ifndef TINY_DNG_LOADER_USE_SYSTEM_ZLIB
+// Deflate backend. miniz is used by default.
+#if defined(TINY_DNG_LOADER_USE_LIBDEFLATE)
+#include <libdeflate.h>
+#define TINY_DNG_LOADER_ZIP_BACKEND_NAME "libdeflate"
+#elif defined(TINY_DNG_LOADER_USE_ZLIB_NG)
+#include <zlib-ng.h>
+#define TINY_DNG_LOADER_ZIP_BACKEND_NAME "zlib-ng"
+#elif defined(TINY_DNG_LOADER_USE_SYSTEM_ZLIB)
+#include <zlib.h>
+#define TINY_DNG_LOADER_ZIP_BACKEND_NAME "zlib"
+#else
 #include "miniz.h"
+#define TINY_DNG_LOADER_ZIP_BACKEND_NAME "miniz"
 #endif
 #endif
 
@@ -440,6 +1010,16 @@ bool IsDNGFromMemory(const char* mem, unsigned int size, std::string* msg);
 #include "stb_image.h"
 #endif
 
+// Baseline JPEG backend. stb_image is used by default.
+#if defined(TINY_DNG_LOADER_USE_LIBJPEG_TURBO)
+#include <csetjmp>
+#include <cstdio>  // jpeglib.h requires FILE
+#include <jpeglib.h>
+#define TINY_DNG_LOADER_JPEG_BACKEND_NAME "libjpeg-turbo"
+#else
+#define TINY_DNG_LOADER_JPEG_BACKEND_NAME "stb_image"
+#endif
+
 #ifdef __clang__
 #pragma clang diagnostic pop
 #endif
@@ -640,10 +1220,16 @@ static int parseHuff(ljp* self) {
   u8* huffhead =
       &self->data
            [self->ix];  // xstruct.unpack('>HB16B',self.data[self.ix:self.ix+19])
-  u8* bits = &huffhead[2];
-  bits[0] = 0;  // Because table starts from 1
   int hufflen = BEH(huffhead[0]);
   if ((self->ix + hufflen) >= self->datalen) return ret;
+  if (hufflen < 19) return ret;
+  // Copy the counts so that the input data is not modified(it may be decoded
+  // as a baseline JPEG afterwards).
+  u8 bits[17];
+  bits[0] = 0;  // Because table starts from 1
+  for (int b = 1; b < 17; b++) {
+    bits[b] = huffhead[2 + b];
+  }
 #ifdef SLOW_HUFF
   u8* huffval = calloc(hufflen - 19, sizeof(u8));
   if (huffval == NULL) return LJ92_ERROR_NO_MEMORY;
@@ -1965,7 +2551,11 @@ typedef enum {
   TAG_CFA_PATTERN = 33422,
   TAG_CFA_PLANE_COLOR = 50710,
   TAG_CFA_LAYOUT = 50711,
+  TAG_LINEARIZATION_TABLE = 50712,
+  TAG_BLACK_LEVEL_REPEAT_DIM = 50713,
   TAG_BLACK_LEVEL = 50714,
+  TAG_BLACK_LEVEL_DELTA_H = 50715,
+  TAG_BLACK_LEVEL_DELTA_V = 50716,
   TAG_WHITE_LEVEL = 50717,
   TAG_COLOR_MATRIX1 = 50721,
   TAG_COLOR_MATRIX2 = 50722,
@@ -2030,22 +2620,6 @@ typedef enum {
   TAG_INVALID = 65535
 } TiffTag;
 
-typedef enum {
-  OPCODE_LIST_WARP_RECTILINEAR = 1,
-  OPCODE_LIST_WARP_FISHEYE = 2,
-  OPCODE_LIST_FIX_VIGNETTE_RADIAL = 3,
-  OPCODE_LIST_FIX_BAD_PIXELS_CONSTANT = 4,
-  OPCODE_LIST_FIX_BAD_PIXELS_LIST = 5,
-  OPCODE_LIST_TRIM_BOUNDS = 6,
-  OPCODE_LIST_MAP_TABLE = 7,
-  OPCODE_LIST_MAP_POLYNOMIAL = 8,
-  OPCODE_LIST_GAIN_MAP = 9,
-  OPCODE_LIST_DELTA_PER_ROW = 10,
-  OPCODE_LIST_DELTA_PER_COLUMN = 11,
-  OPCODE_LIST_SCALE_PER_ROW = 12,
-  OPCODE_LIST_SCALE_PER_COLUMN = 13
-} OpCodeListValue;
-
 static bool IsBigEndian();
 
 static void swap2(unsigned short* val) {
@@ -2383,11 +2957,14 @@ class StreamReader {
       return false;
     }
 
-    float value = 0.0f;
-    if (!read4(reinterpret_cast<int*>(&value))) {
+    // Read as integer and copy the bits(avoid type punning through pointers).
+    unsigned int bits = 0;
+    if (!read4(&bits)) {
       return false;
     }
 
+    float value;
+    memcpy(&value, &bits, sizeof(float));
     (*ret) = value;
 
     return true;
@@ -2398,11 +2975,13 @@ class StreamReader {
       return false;
     }
 
-    double value = 0.0;
-    if (!read8(reinterpret_cast<uint64_t*>(&value))) {
+    uint64_t bits = 0;
+    if (!read8(&bits)) {
       return false;
     }
 
+    double value;
+    memcpy(&value, &bits, sizeof(double));
     (*ret) = value;
 
     return true;
@@ -2573,7 +3152,7 @@ class StreamReader {
   //
   // @return nullptr when failed to map address.
   //
-  const uint8_t* map_abs_addr(size_t pos, const size_t length) {
+  const uint8_t* map_abs_addr(size_t pos, const size_t length) const {
     if (length == 0) {
       return NULL;
     }
@@ -2701,6 +3280,11 @@ static void InitializeDNGImage(tinydng::DNGImage* image) {
   image->camera_calibration2[2][1] = 0.0;
   image->camera_calibration2[2][2] = 1.0;
 
+  image->has_color_matrix1 = false;
+  image->has_color_matrix2 = false;
+  image->has_forward_matrix1 = false;
+  image->has_forward_matrix2 = false;
+
   image->calibration_illuminant1 = LIGHTSOURCE_UNKNOWN;
   image->calibration_illuminant2 = LIGHTSOURCE_UNKNOWN;
 
@@ -2717,6 +3301,12 @@ static void InitializeDNGImage(tinydng::DNGImage* image) {
   image->black_level[1] = 0;
   image->black_level[2] = 0;
   image->black_level[3] = 0;
+  image->black_level_repeat_dim[0] = 1;
+  image->black_level_repeat_dim[1] = 1;
+  image->black_level_repeat.clear();
+  image->black_level_delta_h.clear();
+  image->black_level_delta_v.clear();
+  image->linearization_table.clear();
 
   image->bits_per_sample = 0;
 
@@ -2732,6 +3322,9 @@ static void InitializeDNGImage(tinydng::DNGImage* image) {
   image->cfa_plane_color[3] = 0;  // optional?
 
   image->cfa_pattern_dim = 2;
+  image->cfa_repeat_dim[0] = 2;
+  image->cfa_repeat_dim[1] = 2;
+  image->cfa_repeat_pattern.clear();
 
   // The spec says default is None, thus fill with -1(=invalid).
   image->cfa_pattern[0][0] = -1;
@@ -2810,3464 +3403,10281 @@ static bool IsLosslessJPEG(const uint8_t* header_addr, int data_len, int* width,
   return (ret == LJ92_ERROR_NONE) ? true : false;
 }
 
-#ifdef TINY_DNG_LOADER_ENABLE_ZIP
+// ---------------------------------------------------------------------------
+// Undo TIFF predictor. Shared by LZW and ZIP decoders.
+//
+// Horizontal differencing is a running sum along the row with a stride of
+// `spp` samples. SIMD path computes the running sum in a 16 bytes register with
+// log2(lanes) shift-and-add steps, then adds the last pixel of the previous
+// register. It is used when the pixel(`spp` samples) size is a power of two
+// and <= 16 bytes(e.g. 1, 2 or 4 channels), otherwise the scalar loop is used.
+// ---------------------------------------------------------------------------
+
+template <typename T>
+static void AccumulateRowScalar(T* row, size_t start, size_t num_samples,
+                                size_t stride) {
+  // value may overflow(wrap over), but its expected behavior.
+  for (size_t i = (std::max)(start, stride); i < num_samples; i++) {
+    row[i] = static_cast<T>(row[i] + row[i - stride]);
+  }
+}
 
-static bool DecompressZIP(unsigned char* dst,
-                          unsigned long* uncompressed_size /* inout */,
-                          const unsigned char* src, unsigned long src_size,
-                          std::string* err) {
-  std::vector<unsigned char> tmpBuf(*uncompressed_size);
+#if defined(TINY_DNG_LOADER_SIMD_SSE2)
 
-#ifdef TINY_DNG_LOADER_USE_SYSTEM_ZLIB
-  int ret = uncompress(&tmpBuf.at(0), uncompressed_size, src, src_size);
-  if (Z_OK != ret) {
-    if (err) {
-      std::stringstream ss;
-      ss << "zlib uncompress failed. code = " << ret << "\n";
-      (*err) += ss.str();
-    }
-    return false;
-  }
-#else
-  int ret = mz_uncompress(&tmpBuf.at(0), uncompressed_size, src, src_size);
-  if (MZ_OK != ret) {
-    if (err) {
-      std::stringstream ss;
-      ss << "mz_uncompress failed. code = " << ret << "\n";
-      (*err) += ss.str();
-    }
-    return false;
-  }
-#endif
+typedef __m128i Vec128;
 
-  memcpy(dst, tmpBuf.data(), (*uncompressed_size));
+static inline Vec128 Load128(const uint8_t* p) {
+  return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+}
 
-  return true;
+static inline void Store128(uint8_t* p, Vec128 v) {
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(p), v);
 }
 
-// Assume T = uint8 or uint16
-static bool UnpredictImageU8(std::vector<uint8_t>& dst,  // inout
-                             int predictor, const size_t width,
-                             const size_t rows, const size_t spp) {
-  if (predictor == 1) {
-    // no prediction shceme
-    return true;
-  } else if (predictor == 2) {
-    // horizontal diff
-    const size_t stride = size_t(width * spp);
-    for (size_t row = 0; row < rows; row++) {
-      for (size_t c = 0; c < spp; c++) {
-        unsigned int b = dst[row * stride + c];
-        for (size_t col = 1; col < width; col++) {
-          // value may overflow(wrap over), but its expected behavior.
-          b += dst[stride * row + spp * col + c];
-          dst[stride * row + spp * col + c] =
-              static_cast<unsigned char>(b & 0xFF);
-        }
-      }
-    }
-    return true;
-  } else {
-    // TODO
-    return false;
-  }
+static inline Vec128 Zero128() { return _mm_setzero_si128(); }
+
+template <int kElemBytes>
+static inline Vec128 AddLanes(Vec128 a, Vec128 b) {
+  return (kElemBytes == 1)
+             ? _mm_add_epi8(a, b)
+             : (kElemBytes == 2) ? _mm_add_epi16(a, b)
+                                 : (kElemBytes == 4) ? _mm_add_epi32(a, b)
+                                                     : _mm_add_epi64(a, b);
 }
 
-static bool DecompressZIPedTile(const StreamReader& sr, unsigned char* dst_data,
-                                int dst_width, const DNGImage& image_info,
-                                std::string* err) {
-  unsigned int tiff_h = 0, tiff_w = 0;
-  int offset = 0;
+// Shift toward the higher lane by `kBytes`(< 16) bytes.
+template <int kBytes>
+static inline Vec128 ShiftLanes(Vec128 v) {
+  return _mm_slli_si128(v, kBytes);
+}
 
-  (void)dst_data;
-  (void)dst_width;
+// Broadcast the last `kPixelBytes` bytes to the whole register.
+template <int kPixelBytes>
+static inline Vec128 BroadcastLastPixel(Vec128 v) {
+  if (kPixelBytes == 16) {
+    return v;
+  } else if (kPixelBytes == 8) {
+    return _mm_shuffle_epi32(v, 0xEE);
+  } else if (kPixelBytes == 4) {
+    return _mm_shuffle_epi32(v, 0xFF);
+  } else if (kPixelBytes == 2) {
+    return _mm_shuffle_epi32(_mm_shufflehi_epi16(v, 0xFF), 0xFF);
+  }
+  return _mm_shuffle_epi32(_mm_shufflehi_epi16(_mm_unpackhi_epi8(v, v), 0xFF),
+                           0xFF);
+}
 
-#ifdef TINY_DNG_LOADER_PROFILING
-  auto start_t = std::chrono::system_clock::now();
-#endif
+#define TINY_DNG_LOADER_SIMD_128
 
-  TINY_DNG_DPRINTF("tile_offset = %d\n", int(image_info.tile_offset));
+#elif defined(TINY_DNG_LOADER_SIMD_NEON)
 
-  if ((image_info.tile_width > 0) && (image_info.tile_length > 0)) {
-    // Assume ZIP is stored in tiled format.
-    //TINY_DNG_ASSERT(image_info.tile_width > 0, "Invalid tile width.");
-    //TINY_DNG_ASSERT(image_info.tile_length > 0, "Invalid tile length.");
+typedef uint8x16_t Vec128;
 
-    // <-       image width(skip len)           ->
-    // +-----------------------------------------+
-    // |                                         |
-    // |              <- tile w  ->              |
-    // |              +-----------+              |
-    // |              |           | \            |
-    // |              |           | |            |
-    // |              |           | | tile h     |
-    // |              |           | |            |
-    // |              |           | /            |
-    // |              +-----------+              |
-    // |                                         |
-    // |                                         |
-    // +-----------------------------------------+
+static inline Vec128 Load128(const uint8_t* p) { return vld1q_u8(p); }
 
-    TINY_DNG_DPRINTF("tile = %d, %d\n", image_info.tile_width,
-                     image_info.tile_length);
-    TINY_DNG_DPRINTF("w, h = %d, %d\n", image_info.width, image_info.height);
+static inline void Store128(uint8_t* p, Vec128 v) { vst1q_u8(p, v); }
 
-    // Currently we only support tile data for tile.length == tiff.height.
-    // assert(image_info.tile_length == image_info.height);
+static inline Vec128 Zero128() { return vdupq_n_u8(0); }
 
-    size_t column_step = 0; // debug
-    (void)column_step;
+template <int kElemBytes>
+static inline Vec128 AddLanes(Vec128 a, Vec128 b) {
+  if (kElemBytes == 1) {
+    return vaddq_u8(a, b);
+  } else if (kElemBytes == 2) {
+    return vreinterpretq_u8_u16(
+        vaddq_u16(vreinterpretq_u16_u8(a), vreinterpretq_u16_u8(b)));
+  } else if (kElemBytes == 4) {
+    return vreinterpretq_u8_u32(
+        vaddq_u32(vreinterpretq_u32_u8(a), vreinterpretq_u32_u8(b)));
+  }
+  return vreinterpretq_u8_u64(
+      vaddq_u64(vreinterpretq_u64_u8(a), vreinterpretq_u64_u8(b)));
+}
 
-    while (tiff_h < static_cast<unsigned int>(image_info.height)) {
-      TINY_DNG_DPRINTF("sr tell = %d\n", int(sr.tell()));
-
-      if ((image_info.width <= image_info.tile_width) &&
-          (image_info.height <= image_info.tile_length)) {
-        // Only 1 tile in the image and tile size is larger than image size.
-        // Use image_info.tile_offset
-        // FIXME(syoyo): Record tag len in somewhere and lookup it to count the
-        // number of tiles in the image.
-        offset = int(image_info.tile_offset);
-      } else {
-        // Read offset to data location.
-        if (!sr.read4(&offset)) {
-          if (err) {
-            (*err) +=
-                "Failed to read offset to image data location in "
-                "DecompressZip.\n";
-          }
-          return false;
-        }
-        TINY_DNG_DPRINTF("offt = %d\n", offset);
-      }
+// Shift toward the higher lane by `kBytes`(< 16) bytes.
+template <int kBytes>
+static inline Vec128 ShiftLanes(Vec128 v) {
+  return vextq_u8(vdupq_n_u8(0), v, 16 - kBytes);
+}
 
-      size_t input_len = sr.size() - static_cast<size_t>(offset);
-      unsigned long uncompressed_size =
-          static_cast<unsigned long>(
-              image_info.samples_per_pixel * image_info.tile_width *
-              image_info.tile_length * image_info.bits_per_sample) /
-          static_cast<unsigned long>(8);
+// Broadcast the last `kPixelBytes` bytes to the whole register.
+template <int kPixelBytes>
+static inline Vec128 BroadcastLastPixel(Vec128 v) {
+  if (kPixelBytes == 16) {
+    return v;
+  } else if (kPixelBytes == 8) {
+    return vreinterpretq_u8_u64(
+        vdupq_n_u64(vgetq_lane_u64(vreinterpretq_u64_u8(v), 1)));
+  } else if (kPixelBytes == 4) {
+    return vreinterpretq_u8_u32(
+        vdupq_n_u32(vgetq_lane_u32(vreinterpretq_u32_u8(v), 3)));
+  } else if (kPixelBytes == 2) {
+    return vreinterpretq_u8_u16(
+        vdupq_n_u16(vgetq_lane_u16(vreinterpretq_u16_u8(v), 7)));
+  }
+  return vdupq_n_u8(vgetq_lane_u8(v, 15));
+}
 
-      std::vector<uint8_t> tmp_buf;
-      tmp_buf.resize(uncompressed_size);
+#define TINY_DNG_LOADER_SIMD_128
 
-      if (!DecompressZIP(tmp_buf.data(), &uncompressed_size, sr.data() + offset,
-                         static_cast<unsigned long>(input_len), err)) {
-        if (err) {
-          (*err) += "Failed to decode ZIP data.\n";
-        }
-        return false;
-      }
+#endif
 
-      if (!UnpredictImageU8(tmp_buf, image_info.predictor,
-                            size_t(image_info.tile_width),
-                            size_t(image_info.tile_length),
-                            size_t(image_info.samples_per_pixel))) {
-        if (err) {
-          (*err) += "Failed to unpredict ZIP-ed tile image.\n";
-        }
-        return false;
-      }
+#if defined(TINY_DNG_LOADER_SIMD_128)
 
-      // Copy to dest buffer.
-      // NOTE: For some DNG file, tiled image may exceed the extent of target
-      // image resolution.
-      const size_t spp = size_t(image_info.samples_per_pixel);
+// Running sum inside a register, `kStride` bytes apart.
+template <int kElemBytes, int kStride>
+static inline Vec128 PrefixSumLanes(Vec128 v) {
+  if (kStride < 16) {
+    v = AddLanes<kElemBytes>(v, ShiftLanes<(kStride < 16) ? kStride : 1>(v));
+  }
+  if (kStride * 2 < 16) {
+    v = AddLanes<kElemBytes>(
+        v, ShiftLanes<(kStride * 2 < 16) ? (kStride * 2) : 1>(v));
+  }
+  if (kStride * 4 < 16) {
+    v = AddLanes<kElemBytes>(
+        v, ShiftLanes<(kStride * 4 < 16) ? (kStride * 4) : 1>(v));
+  }
+  if (kStride * 8 < 16) {
+    v = AddLanes<kElemBytes>(
+        v, ShiftLanes<(kStride * 8 < 16) ? (kStride * 8) : 1>(v));
+  }
+  return v;
+}
 
-      for (unsigned int y = 0;
-           y < static_cast<unsigned int>(image_info.tile_length); y++) {
-        unsigned int y_offset = y + tiff_h;
-        if (y_offset >= static_cast<unsigned int>(image_info.height)) {
-          continue;
-        }
+// Returns the number of bytes processed. Remaining bytes(less than 16) must be
+// processed by the scalar loop.
+template <int kElemBytes, int kPixelBytes>
+static size_t AccumulateRowSIMD(uint8_t* row, size_t row_bytes) {
+  Vec128 carry = Zero128();
+  size_t i = 0;
+  for (; i + 16 <= row_bytes; i += 16) {
+    Vec128 v = PrefixSumLanes<kElemBytes, kPixelBytes>(Load128(row + i));
+    v = AddLanes<kElemBytes>(v, carry);
+    Store128(row + i, v);
+    carry = BroadcastLastPixel<kPixelBytes>(v);
+  }
+  return i;
+}
 
-        size_t dst_offset =
-            tiff_w + static_cast<unsigned int>(dst_width) * y_offset;
+template <int kElemBytes>
+static size_t AccumulateRowSIMD(uint8_t* row, size_t row_bytes,
+                                size_t pixel_bytes) {
+  switch (pixel_bytes) {
+    case 1:
+      return AccumulateRowSIMD<kElemBytes, 1>(row, row_bytes);
+    case 2:
+      return AccumulateRowSIMD<kElemBytes, 2>(row, row_bytes);
+    case 4:
+      return AccumulateRowSIMD<kElemBytes, 4>(row, row_bytes);
+    case 8:
+      return AccumulateRowSIMD<kElemBytes, 8>(row, row_bytes);
+    case 16:
+      return AccumulateRowSIMD<kElemBytes, 16>(row, row_bytes);
+    default:
+      return 0;
+  }
+}
 
-        size_t x_len = static_cast<size_t>(image_info.tile_width);
-        if ((tiff_w + static_cast<unsigned int>(image_info.tile_width)) >=
-            static_cast<unsigned int>(dst_width)) {
-          x_len = static_cast<size_t>(dst_width) - tiff_w;
-        }
+#endif
 
-        for (size_t x = 0; x < x_len; x++) {
-          for (size_t c = 0; c < spp; c++) {
-            dst_data[spp * (dst_offset + x) + c] =
-                tmp_buf[spp * (y * static_cast<size_t>(image_info.tile_width) +
-                               x) +
-                        c];
-          }
-        }
-      }
+// Running sum of `num_samples` samples(`elem_bytes` bytes each, native byte
+// order) with a stride of `spp` samples.
+static void AccumulateRow(uint8_t* row, size_t num_samples, size_t spp,
+                          size_t elem_bytes) {
+  size_t start = 0;
+
+#if defined(TINY_DNG_LOADER_SIMD_128)
+  const size_t pixel_bytes = spp * elem_bytes;
+  const size_t row_bytes = num_samples * elem_bytes;
+  size_t done = 0;
+  if (elem_bytes == 1) {
+    done = AccumulateRowSIMD<1>(row, row_bytes, pixel_bytes);
+  } else if (elem_bytes == 2) {
+    done = AccumulateRowSIMD<2>(row, row_bytes, pixel_bytes);
+  } else if (elem_bytes == 4) {
+    done = AccumulateRowSIMD<4>(row, row_bytes, pixel_bytes);
+  } else if (elem_bytes == 8) {
+    done = AccumulateRowSIMD<8>(row, row_bytes, pixel_bytes);
+  }
+  start = done / elem_bytes;
+#endif
 
-      tiff_w += static_cast<unsigned int>(image_info.tile_width);
-      column_step++;
-      // TINY_DNG_DPRINTF("col = %d, tiff_w = %d / %d\n", column_step, tiff_w,
-      // image_info.width);
-      if (tiff_w >= static_cast<unsigned int>(image_info.width)) {
-        // tiff_h += static_cast<unsigned int>(image_info.tile_length);
-        tiff_h += static_cast<unsigned int>(image_info.tile_length);
-        // TINY_DNG_DPRINTF("tiff_h = %d\n", tiff_h);
-        tiff_w = 0;
-        column_step = 0;
+  if (elem_bytes == 1) {
+    AccumulateRowScalar(row, start, num_samples, spp);
+  } else if (elem_bytes == 2) {
+    AccumulateRowScalar(reinterpret_cast<uint16_t*>(row), start, num_samples,
+                        spp);
+  } else if (elem_bytes == 4) {
+    AccumulateRowScalar(reinterpret_cast<uint32_t*>(row), start, num_samples,
+                        spp);
+  } else if (elem_bytes == 8) {
+    AccumulateRowScalar(reinterpret_cast<uint64_t*>(row), start, num_samples,
+                        spp);
+  }
+}
+
+// Reverse byte order of each `elem_bytes` bytes element.
+static void SwapElements(uint8_t* data, size_t num_elems, size_t elem_bytes) {
+  const size_t num_bytes = num_elems * elem_bytes;
+  size_t i = 0;
+
+  // 16 and 32 bytes blocks always contain whole 2, 4 or 8 bytes elements.
+  if ((elem_bytes == 2) || (elem_bytes == 4) || (elem_bytes == 8)) {
+#if defined(TINY_DNG_LOADER_SIMD_SSSE3)
+    const int e = int(elem_bytes);
+    // pshufb index reversing each element: (e - 1 - b % e) + (b / e) * e
+    uint8_t index[16];
+    for (int b = 0; b < 16; b++) {
+      index[b] = uint8_t((e - 1 - (b % e)) + (b / e) * e);
+    }
+    const __m128i shuffle = Load128(index);
+#if defined(TINY_DNG_LOADER_SIMD_AVX2)
+    const __m256i shuffle256 = _mm256_broadcastsi128_si256(shuffle);
+    for (; i + 32 <= num_bytes; i += 32) {
+      __m256i* p = reinterpret_cast<__m256i*>(data + i);
+      _mm256_storeu_si256(
+          p, _mm256_shuffle_epi8(_mm256_loadu_si256(p), shuffle256));
+    }
+#endif
+    for (; i + 16 <= num_bytes; i += 16) {
+      Store128(data + i, _mm_shuffle_epi8(Load128(data + i), shuffle));
+    }
+#elif defined(TINY_DNG_LOADER_SIMD_SSE2)
+    for (; i + 16 <= num_bytes; i += 16) {
+      __m128i v = Load128(data + i);
+      // Reverse 16bit words in the element, then bytes in each word.
+      if (elem_bytes == 4) {
+        v = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, 0xB1), 0xB1);
+      } else if (elem_bytes == 8) {
+        v = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, 0x1B), 0x1B);
+      }
+      v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+      Store128(data + i, v);
+    }
+#elif defined(TINY_DNG_LOADER_SIMD_NEON)
+    for (; i + 16 <= num_bytes; i += 16) {
+      const uint8x16_t v = vld1q_u8(data + i);
+      if (elem_bytes == 2) {
+        vst1q_u8(data + i, vrev16q_u8(v));
+      } else if (elem_bytes == 4) {
+        vst1q_u8(data + i, vrev32q_u8(v));
+      } else {
+        vst1q_u8(data + i, vrev64q_u8(v));
       }
     }
-  } else {
-    // Assume ZIP data is not stored in tiled format.
+#endif
+  }
 
-    TINY_DNG_DPRINTF("width = %d", int(image_info.width));
-    TINY_DNG_DPRINTF("height = %d", int(image_info.height));
+  for (; i < num_bytes; i += elem_bytes) {
+    std::reverse(data + i, data + i + elem_bytes);
+  }
+}
 
-    TINY_DNG_CHECK_AND_RETURN(image_info.offset > 0, "Invalid ZIPed data offset.", err);
-    offset = static_cast<int>(image_info.offset);
+// Interleave byte planes(most significant byte first) of FP predictor into
+// native byte order floating point values.
+// `src` contains `elem_bytes` planes of `num_samples` bytes.
+static void MergeBytePlanes(const uint8_t* src, size_t num_samples,
+                            size_t elem_bytes, uint8_t* dst) {
+  const bool big_endian = IsBigEndian();
+  size_t i = 0;
+
+#if defined(TINY_DNG_LOADER_SIMD_SSE2)
+  if (elem_bytes == 4) {
+    const uint8_t* p0 = src;
+    const uint8_t* p1 = src + num_samples;
+    const uint8_t* p2 = src + 2 * num_samples;
+    const uint8_t* p3 = src + 3 * num_samples;
+    for (; i + 16 <= num_samples; i += 16) {
+      const __m128i b0 = Load128(p0 + i);
+      const __m128i b1 = Load128(p1 + i);
+      const __m128i b2 = Load128(p2 + i);
+      const __m128i b3 = Load128(p3 + i);
+      const __m128i b32_lo = _mm_unpacklo_epi8(b3, b2);
+      const __m128i b32_hi = _mm_unpackhi_epi8(b3, b2);
+      const __m128i b10_lo = _mm_unpacklo_epi8(b1, b0);
+      const __m128i b10_hi = _mm_unpackhi_epi8(b1, b0);
+      Store128(dst + 4 * i, _mm_unpacklo_epi16(b32_lo, b10_lo));
+      Store128(dst + 4 * i + 16, _mm_unpackhi_epi16(b32_lo, b10_lo));
+      Store128(dst + 4 * i + 32, _mm_unpacklo_epi16(b32_hi, b10_hi));
+      Store128(dst + 4 * i + 48, _mm_unpackhi_epi16(b32_hi, b10_hi));
+    }
+  } else if (elem_bytes == 2) {
+    const uint8_t* p0 = src;
+    const uint8_t* p1 = src + num_samples;
+    for (; i + 16 <= num_samples; i += 16) {
+      const __m128i b0 = Load128(p0 + i);
+      const __m128i b1 = Load128(p1 + i);
+      Store128(dst + 2 * i, _mm_unpacklo_epi8(b1, b0));
+      Store128(dst + 2 * i + 16, _mm_unpackhi_epi8(b1, b0));
+    }
+  }
+#elif defined(TINY_DNG_LOADER_SIMD_NEON) && !defined(__ARM_BIG_ENDIAN)
+  if (elem_bytes == 4) {
+    for (; i + 16 <= num_samples; i += 16) {
+      uint8x16x4_t v;
+      v.val[0] = vld1q_u8(src + 3 * num_samples + i);
+      v.val[1] = vld1q_u8(src + 2 * num_samples + i);
+      v.val[2] = vld1q_u8(src + num_samples + i);
+      v.val[3] = vld1q_u8(src + i);
+      vst4q_u8(dst + 4 * i, v);
+    }
+  } else if (elem_bytes == 2) {
+    for (; i + 16 <= num_samples; i += 16) {
+      uint8x16x2_t v;
+      v.val[0] = vld1q_u8(src + num_samples + i);
+      v.val[1] = vld1q_u8(src + i);
+      vst2q_u8(dst + 2 * i, v);
+    }
+  }
+#endif
 
-    size_t input_len = sr.size() - static_cast<size_t>(offset);
-    unsigned long uncompressed_size =
-        static_cast<unsigned long>(image_info.samples_per_pixel *
-                                   image_info.width * image_info.height *
-                                   image_info.bits_per_sample) /
-        static_cast<unsigned long>(8);
+  for (; i < num_samples; i++) {
+    for (size_t b = 0; b < elem_bytes; b++) {
+      const size_t dst_b = big_endian ? b : (elem_bytes - 1 - b);
+      dst[i * elem_bytes + dst_b] = src[b * num_samples + i];
+    }
+  }
+}
 
-    std::vector<uint8_t> tmp_buf;
-    tmp_buf.resize(uncompressed_size);
+///
+/// Undo predictor for `rows` rows of `width` * `spp` samples in `data`.
+///
+/// predictor 1 : No prediction. Samples of 16, 24, 32 or 64 bits are converted
+///               to native byte order when `swap_endian` is set.
+/// predictor 2 : Horizontal differencing(8, 16, 32 or 64 bits integer).
+///               Samples are stored in the byte order of the file, thus set
+///               `swap_endian` when it differs from the host. Decoded samples
+///               are in native byte order.
+/// predictor 3 : Floating point horizontal differencing(16, 24, 32 or 64 bits).
+///               Decoded samples are in native byte order.
+///
+/// `scratch` is used as a temporary row buffer for predictor 3.
+///
+static bool UnpredictImage(uint8_t* data,  // inout
+                           const int predictor, const size_t width,
+                           const size_t rows, const size_t spp,
+                           const int bits_per_sample, const bool swap_endian,
+                           std::vector<uint8_t>* scratch, std::string* err) {
+  const size_t num_samples = width * spp;
 
-    if (!DecompressZIP(tmp_buf.data(), &uncompressed_size, sr.data() + offset,
-                       static_cast<unsigned long>(input_len), err)) {
-      if (err) {
-        (*err) += "Failed to decode non-tiled ZIP data.\n";
-      }
-      return false;
+  if (predictor == 1) {
+    // no prediction shceme
+    if (swap_endian && (bits_per_sample >= 16) &&
+        ((bits_per_sample % 8) == 0)) {
+      SwapElements(data, num_samples * rows, size_t(bits_per_sample) / 8);
+    }
+    return true;
+  } else if (predictor == 2) {
+    // horizontal diff
+    if ((bits_per_sample != 8) && (bits_per_sample != 16) &&
+        (bits_per_sample != 32) && (bits_per_sample != 64)) {
+      TINY_DNG_ERROR_AND_RETURN(
+          "Horizontal differencing predictor requires 8, 16, 32 or 64 bits "
+          "per sample, but got " << bits_per_sample,
+          err);
     }
 
-    if (!UnpredictImageU8(tmp_buf, image_info.predictor,
-                          size_t(image_info.tile_width),
-                          size_t(image_info.tile_length),
-                          size_t(image_info.samples_per_pixel))) {
-      if (err) {
-        (*err) += "Failed to unpredict ZIP-ed tile image.\n";
+    const size_t elem_bytes = size_t(bits_per_sample) / 8;
+    const size_t row_bytes = num_samples * elem_bytes;
+    for (size_t row = 0; row < rows; row++) {
+      uint8_t* p = data + row * row_bytes;
+      if (swap_endian && (elem_bytes > 1)) {
+        SwapElements(p, num_samples, elem_bytes);
       }
-      return false;
+      AccumulateRow(p, num_samples, spp, elem_bytes);
     }
-
-    memcpy(dst_data, tmp_buf.data(), tmp_buf.size());
+    return true;
+  } else if (predictor == 3) {
+    // fp horizontal diff.
+    // Each row is stored as byte planes(most significant byte first) and each
+    // byte is differenced with the byte `spp` bytes before.
+    if ((bits_per_sample != 16) && (bits_per_sample != 24) &&
+        (bits_per_sample != 32) && (bits_per_sample != 64)) {
+      TINY_DNG_ERROR_AND_RETURN(
+          "Floating point predictor requires 16, 24, 32 or 64 bits per "
+          "sample, but got " << bits_per_sample,
+          err);
+    }
+
+    const size_t elem_bytes = size_t(bits_per_sample) / 8;
+    const size_t row_bytes = num_samples * elem_bytes;
+    scratch->resize(row_bytes);
+    for (size_t row = 0; row < rows; row++) {
+      uint8_t* p = data + row * row_bytes;
+      AccumulateRow(p, row_bytes, spp, 1);
+      MergeBytePlanes(p, num_samples, elem_bytes, scratch->data());
+      memcpy(p, scratch->data(), row_bytes);
+    }
+    return true;
   }
 
-#ifdef TINY_DNG_LOADER_PROFILING
-  auto end_t = std::chrono::system_clock::now();
-  auto ms =
-      std::chrono::duration_cast<std::chrono::milliseconds>(end_t - start_t);
+  TINY_DNG_ERROR_AND_RETURN("Invalid predictor value " << predictor, err);
+}
 
-  std::cout << "DecompressZIP : " << ms.count() << " [ms]" << std::endl;
-#endif
+///
+/// Tile placement shared among tiled image decoders(LJ92, ZIP and LZW).
+/// Tiles are stored in row-major order(left to right, then top to bottom),
+/// and tiles in the right and bottom edge may exceed the image extent.
+///
+struct TileLayout {
+  size_t tile_width{0};
+  size_t tile_length{0};
+  size_t tiles_across{0};
+  size_t tiles_down{0};
+  size_t num_tiles{0};
+};
+
+static bool ComputeTileLayout(const DNGImage& image, TileLayout* layout,
+                              std::string* err) {
+  TINY_DNG_CHECK_AND_RETURN((image.tile_width > 0) && (image.tile_length > 0),
+                            "Invalid tile size.", err);
+  TINY_DNG_CHECK_AND_RETURN((image.width > 0) && (image.height > 0),
+                            "Invalid image size.", err);
+
+  layout->tile_width = size_t(image.tile_width);
+  layout->tile_length = size_t(image.tile_length);
+  layout->tiles_across =
+      (size_t(image.width) + layout->tile_width - 1) / layout->tile_width;
+  layout->tiles_down =
+      (size_t(image.height) + layout->tile_length - 1) / layout->tile_length;
+  layout->num_tiles = layout->tiles_across * layout->tiles_down;
 
   return true;
 }
-#endif
 
-// Decompress LosslesJPEG adta.
-static bool DecompressLosslessJPEG(const StreamReader& sr,
-                                   unsigned short* dst_data, int dst_width,
-                                   const DNGImage& image_info, int* ljbits_out,
-                                   std::string* err) {
-  unsigned int tiff_h = 0, tiff_w = 0;
-  int offset = 0;
+// Copy decoded tile(`tile_width` * `tile_length` pixels) to its location in
+// the destination image, clipping the part exceeding the image extent.
+static void CopyTileToImage(const uint8_t* tile, const TileLayout& layout,
+                            const size_t tile_index, const size_t pixel_bytes,
+                            const size_t dst_width, const size_t dst_height,
+                            uint8_t* dst) {
+  const size_t tx = (tile_index % layout.tiles_across) * layout.tile_width;
+  const size_t ty = (tile_index / layout.tiles_across) * layout.tile_length;
 
-#ifdef TINY_DNG_LOADER_PROFILING
-  auto start_t = std::chrono::system_clock::now();
+  if ((tx >= dst_width) || (ty >= dst_height)) {
+    return;
+  }
+
+  const size_t x_len = (std::min)(layout.tile_width, dst_width - tx);
+  const size_t y_len = (std::min)(layout.tile_length, dst_height - ty);
+
+  for (size_t y = 0; y < y_len; y++) {
+    memcpy(dst + ((ty + y) * dst_width + tx) * pixel_bytes,
+           tile + y * layout.tile_width * pixel_bytes, x_len * pixel_bytes);
+  }
+}
+
+// Returns the number of worker threads to process `num_items` items.
+// Always 1 when TINY_DNG_LOADER_USE_THREAD is not defined.
+static int GetNumWorkers(size_t num_items) {
+#if (__cplusplus > 199711L) && defined(TINY_DNG_LOADER_USE_THREAD)
+  int num_threads = (std::max)(1, int(std::thread::hardware_concurrency()));
+  if (size_t(num_threads) > num_items) {
+    num_threads = (std::max)(1, int(num_items));
+  }
+  return num_threads;
+#else
+  (void)num_items;
+  return 1;
 #endif
+}
 
-  TINY_DNG_DPRINTF("tile_width %d, tile_length %d\n", image_info.tile_width,
-                   image_info.tile_length);
+///
+/// Calls `func(item, thread_id, err)` for each item in [0, num_items).
+/// `thread_id` is in [0, num_threads) and can be used to index per-thread
+/// scratch buffers. Items are distributed to `num_threads` workers when
+/// TINY_DNG_LOADER_USE_THREAD is defined, otherwise processed in order.
+///
+/// Returns false when any call of `func` returned false.
+///
+template <typename Func>
+static bool ParallelFor(size_t num_items, int num_threads, std::string* err,
+                        Func func) {
+#if (__cplusplus > 199711L) && defined(TINY_DNG_LOADER_USE_THREAD)
+  if (num_threads > 1) {
+    std::vector<std::thread> workers;
+    std::atomic<size_t> item_count(0);
+    std::atomic<bool> failed(false);
+    std::mutex err_mtx;
+
+    for (int t = 0; t < num_threads; t++) {
+      workers.emplace_back(std::thread([&, t]() {
+        std::string local_err;
+        size_t k = 0;
+        while (!failed && ((k = item_count++) < num_items)) {
+          if (!func(k, t, &local_err)) {
+            failed = true;
+          }
+        }
 
-  if ((image_info.tile_width > 0) && (image_info.tile_length > 0)) {
-    // Assume Lossless JPEG data is stored in tiled format.
-    if (image_info.tile_width <= 0) {
-      if (err) {
-        (*err) += "Invalid tile width.\n";
-      }
-      return false;
+        if (!local_err.empty()) {
+          std::lock_guard<std::mutex> lock(err_mtx);
+          if (err) {
+            (*err) += local_err;
+          }
+        }
+      }));
     }
-    if (image_info.tile_length <= 0) {
-      if (err) {
-        (*err) += "Invalid tile length.\n";
-      }
-      return false;
+
+    for (auto& w : workers) {
+      w.join();
     }
-    //TINY_DNG_ASSERT(image_info.tile_width > 0, "Invalid tile width.");
-    //TINY_DNG_ASSERT(image_info.tile_length > 0, "Invalid tile length.");
 
-    // <-       image width(skip len)           ->
-    // +-----------------------------------------+
-    // |                                         |
-    // |              <- tile w  ->              |
-    // |              +-----------+              |
-    // |              |           | \            |
-    // |              |           | |            |
-    // |              |           | | tile h     |
-    // |              |           | |            |
-    // |              |           | /            |
-    // |              +-----------+              |
-    // |                                         |
-    // |                                         |
-    // +-----------------------------------------+
+    return !failed;
+  }
+#else
+  (void)num_threads;
+#endif
 
-    // TINY_DNG_DPRINTF("tile = %d, %d\n", image_info.tile_width,
-    // image_info.tile_length);
+  for (size_t k = 0; k < num_items; k++) {
+    if (!func(k, 0, err)) {
+      return false;
+    }
+  }
 
-    // Currently we only support tile data for tile.length == tiff.height.
-    // assert(image_info.tile_length == image_info.height);
+  return true;
+}
 
-    size_t column_step = 0; // debug
-    (void)column_step;
+// ---------------------------------------------------------------------------
+// Unpack bit-packed samples into uint16.
+//
+// For even bits per sample(<= 14), 4 samples are packed into `bps / 2`
+// bytes(a group). A group is loaded into a 64bit lane as little endian, and
+// each source bit moves to its 16bit output field by a shift which only
+// depends on the bit position in the group. Bits moving by the same amount are
+// handled with one shift-and-mask term, so a group is unpacked with a few
+// terms(e.g. 10 terms for 14 bits MSB first), and the same terms are applied
+// to 1(scalar), 2(SSE2, NEON) or 4(AVX2) groups at once.
+// Odd bits per sample are unpacked with the scalar bit reader.
+// ---------------------------------------------------------------------------
+
+struct UnpackTerms {
+  int num_terms{0};
+  int shifts[16];  // > 0: left shift, < 0: right shift
+  uint64_t masks[16];
+};
 
-    while (tiff_h < static_cast<unsigned int>(image_info.height)) {
-      // Read offset to JPEG data location.
-      if (!sr.read4(&offset)) {
-        if (err) {
-          (*err) +=
-              "Failed to read offset to JPEG data location in "
-              "DecompressLosslessJPEG.\n";
-        }
-        return false;
+static void ComputeUnpackTerms(const int bps, const bool lsb_first,
+                               UnpackTerms* terms) {
+  terms->num_terms = 0;
+  for (int p = 0; p < 4 * bps; p++) {
+    const int j = p / bps;  // sample index in the group
+    const int in_bit = lsb_first ? p : (8 * (p / 8) + 7 - (p % 8));
+    const int out_bit =
+        16 * j + (lsb_first ? (p - j * bps) : (bps - 1 - (p - j * bps)));
+    const int shift = out_bit - in_bit;
+
+    int t = 0;
+    for (; t < terms->num_terms; t++) {
+      if (terms->shifts[t] == shift) {
+        break;
       }
-      TINY_DNG_DPRINTF("tile offt = %d\n", offset);
+    }
+    if (t == terms->num_terms) {
+      terms->shifts[t] = shift;
+      terms->masks[t] = 0;
+      terms->num_terms++;
+    }
+    terms->masks[t] |= uint64_t(1) << out_bit;
+  }
+}
 
-      int lj_width = 0;
-      int lj_height = 0;
-      int lj_bits = 0;
+static inline uint64_t UnpackGroupScalar(uint64_t x, const UnpackTerms& terms) {
+  uint64_t y = 0;
+  for (int t = 0; t < terms.num_terms; t++) {
+    const int s = terms.shifts[t];
+    y |= ((s >= 0) ? (x << s) : (x >> (-s))) & terms.masks[t];
+  }
+  return y;
+}
 
-      lj92 ljp;
+// Load up to 8 bytes as little endian. Missing bytes are zero.
+static inline uint64_t LoadLE64(const uint8_t* p, size_t n) {
+  uint64_t x = 0;
+  for (size_t b = 0; b < (std::min)(n, size_t(8)); b++) {
+    x |= uint64_t(p[b]) << (8 * b);
+  }
+  return x;
+}
 
-      size_t input_len = sr.size() - static_cast<size_t>(offset);
+static void UnpackBitsScalar(const uint8_t* src, size_t num_samples,
+                             const int bps, const bool lsb_first,
+                             uint16_t* dst) {
+  const uint32_t mask = (1u << bps) - 1u;
+  uint64_t acc = 0;
+  int num_bits = 0;
+  size_t pos = 0;
+  for (size_t i = 0; i < num_samples; i++) {
+    while (num_bits < bps) {
+      if (lsb_first) {
+        acc |= uint64_t(src[pos++]) << num_bits;
+      } else {
+        acc = (acc << 8) | uint64_t(src[pos++]);
+      }
+      num_bits += 8;
+    }
+    num_bits -= bps;
+    if (lsb_first) {
+      dst[i] = static_cast<uint16_t>(acc & mask);
+      acc >>= bps;
+    } else {
+      dst[i] = static_cast<uint16_t>((acc >> num_bits) & mask);
+    }
+  }
+}
 
-      // @fixme { Parse LJPEG header first and set exact compressed LJPEG data
-      // length to `data_len` arg. }
-      int ret =
-          lj92_open(&ljp, reinterpret_cast<const uint8_t*>(sr.data() + offset),
-                    /* data_len */ static_cast<int>(input_len), &lj_width,
-                    &lj_height, &lj_bits);
-      TINY_DNG_DPRINTF("ret = %d\n", ret);
-      TINY_DNG_CHECK_AND_RETURN(ret == LJ92_ERROR_NONE, "Error opening JPEG stream.", err);
+///
+/// Unpack `num_samples` samples. `src_len` is the number of readable bytes from
+/// `src`, and may exceed the packed size of `num_samples` samples.
+///
+static void UnpackBitsRange(const uint8_t* src, size_t src_len,
+                            size_t num_samples, const int bps,
+                            const bool lsb_first, uint16_t* dst) {
+  if (((bps % 2) != 0) || (bps > 14)) {
+    UnpackBitsScalar(src, num_samples, bps, lsb_first, dst);
+    return;
+  }
+
+  UnpackTerms terms;
+  ComputeUnpackTerms(bps, lsb_first, &terms);
+
+  const size_t group_bytes = size_t(bps) / 2;
+  const size_t num_groups = num_samples / 4;
+  const bool big_endian = IsBigEndian();
+  size_t g = 0;
+
+  if (!big_endian) {
+#if defined(TINY_DNG_LOADER_SIMD_AVX2)
+    __m256i masks256[16];
+    __m128i shifts256[16];
+    for (int t = 0; t < terms.num_terms; t++) {
+      masks256[t] = _mm256_set1_epi64x(static_cast<long long>(terms.masks[t]));
+      shifts256[t] = _mm_cvtsi32_si128(std::abs(terms.shifts[t]));
+    }
+    // 4 groups. The last load reads 8 bytes from the 4th group.
+    for (; (g + 4 <= num_groups) && ((g + 3) * group_bytes + 8 <= src_len);
+         g += 4) {
+      const uint8_t* p = src + g * group_bytes;
+      const __m128i lo = _mm_unpacklo_epi64(
+          _mm_loadl_epi64(reinterpret_cast<const __m128i*>(p)),
+          _mm_loadl_epi64(reinterpret_cast<const __m128i*>(p + group_bytes)));
+      const __m128i hi = _mm_unpacklo_epi64(
+          _mm_loadl_epi64(
+              reinterpret_cast<const __m128i*>(p + 2 * group_bytes)),
+          _mm_loadl_epi64(
+              reinterpret_cast<const __m128i*>(p + 3 * group_bytes)));
+      const __m256i x =
+          _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+      __m256i y = _mm256_setzero_si256();
+      for (int t = 0; t < terms.num_terms; t++) {
+        const __m256i v = (terms.shifts[t] >= 0)
+                              ? _mm256_sll_epi64(x, shifts256[t])
+                              : _mm256_srl_epi64(x, shifts256[t]);
+        y = _mm256_or_si256(y, _mm256_and_si256(v, masks256[t]));
+      }
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + 4 * g), y);
+    }
+#endif
 
-      TINY_DNG_DPRINTF("lj %d, %d, %d\n", lj_width, lj_height, lj_bits);
-      TINY_DNG_DPRINTF("ljp x %d, y %d, c %d\n", ljp->x, ljp->y,
-      ljp->components);
-      TINY_DNG_DPRINTF("tile width = %d\n", image_info.tile_width);
-      TINY_DNG_DPRINTF("tile height = %d\n", image_info.tile_length);
-      TINY_DNG_DPRINTF("col = %d, tiff_w = %d / %d\n", int(column_step), tiff_w,
-      image_info.width);
+#if defined(TINY_DNG_LOADER_SIMD_SSE2)
+    __m128i masks[16];
+    __m128i shifts[16];
+    for (int t = 0; t < terms.num_terms; t++) {
+      masks[t] = _mm_set1_epi64x(static_cast<long long>(terms.masks[t]));
+      shifts[t] = _mm_cvtsi32_si128(std::abs(terms.shifts[t]));
+    }
+    for (; (g + 2 <= num_groups) && ((g + 1) * group_bytes + 8 <= src_len);
+         g += 2) {
+      const uint8_t* p = src + g * group_bytes;
+      const __m128i x = _mm_unpacklo_epi64(
+          _mm_loadl_epi64(reinterpret_cast<const __m128i*>(p)),
+          _mm_loadl_epi64(reinterpret_cast<const __m128i*>(p + group_bytes)));
+      __m128i y = _mm_setzero_si128();
+      for (int t = 0; t < terms.num_terms; t++) {
+        const __m128i v = (terms.shifts[t] >= 0) ? _mm_sll_epi64(x, shifts[t])
+                                                 : _mm_srl_epi64(x, shifts[t]);
+        y = _mm_or_si128(y, _mm_and_si128(v, masks[t]));
+      }
+      Store128(reinterpret_cast<uint8_t*>(dst + 4 * g), y);
+    }
+#elif defined(TINY_DNG_LOADER_SIMD_NEON) && !defined(__ARM_BIG_ENDIAN)
+    uint64x2_t masks[16];
+    int64x2_t shifts[16];
+    for (int t = 0; t < terms.num_terms; t++) {
+      masks[t] = vdupq_n_u64(terms.masks[t]);
+      shifts[t] = vdupq_n_s64(terms.shifts[t]);  // negative: right shift
+    }
+    for (; (g + 2 <= num_groups) && ((g + 1) * group_bytes + 8 <= src_len);
+         g += 2) {
+      const uint8_t* p = src + g * group_bytes;
+      const uint64x2_t x =
+          vcombine_u64(vreinterpret_u64_u8(vld1_u8(p)),
+                       vreinterpret_u64_u8(vld1_u8(p + group_bytes)));
+      uint64x2_t y = vdupq_n_u64(0);
+      for (int t = 0; t < terms.num_terms; t++) {
+        y = vorrq_u64(y, vandq_u64(vshlq_u64(x, shifts[t]), masks[t]));
+      }
+      vst1q_u16(dst + 4 * g, vreinterpretq_u16_u64(y));
+    }
+#endif
+  }
 
-      TINY_DNG_CHECK_AND_RETURN(lj_width <= image_info.tile_width, "Unexpected JPEG tile width size.", err);
-      TINY_DNG_CHECK_AND_RETURN(lj_height <= image_info.tile_length, "Unexpected JPEG tile length size.", err);
+  for (; g < num_groups; g++) {
+    const size_t offset = g * group_bytes;
+    const uint64_t y =
+        UnpackGroupScalar(LoadLE64(src + offset, src_len - offset), terms);
+    for (size_t j = 0; j < 4; j++) {
+      dst[4 * g + j] = static_cast<uint16_t>(y >> (16 * j));
+    }
+  }
 
-      //TINY_DNG_ASSERT((lj_width * lj_height) ==
-      //                    image_info.tile_width * image_info.tile_length,
-      //                "Unexpected JPEG tile size.");
+  // Remaining(< 4) samples.
+  if (num_groups * 4 < num_samples) {
+    const size_t offset = num_groups * group_bytes;
+    const uint64_t y =
+        UnpackGroupScalar(LoadLE64(src + offset, src_len - offset), terms);
+    for (size_t j = 0; j < num_samples - num_groups * 4; j++) {
+      dst[4 * num_groups + j] = static_cast<uint16_t>(y >> (16 * j));
+    }
+  }
+}
 
-      TINY_DNG_DPRINTF("lj.components %d, samples_per_pixel %d\n", ljp->components, image_info.samples_per_pixel);
-      //TINY_DNG_ASSERT(ljp->components == image_info.samples_per_pixel,
-      //                "# of color channels does not match.");
+#if defined(TINY_DNG_LOADER_USE_LIBJPEG_TURBO)
 
-      // int write_length = image_info.tile_width;
-      // int skip_length = dst_width - image_info.tile_width;
-      // TINY_DNG_DPRINTF("write_len = %d, skip_len = %d\n", write_length,
-      // skip_length);
+struct JPEGErrorManager {
+  struct jpeg_error_mgr pub;
+  jmp_buf setjmp_buffer;
+  char message[JMSG_LENGTH_MAX];
+};
 
-      // size_t dst_offset =
-      //    column_step * static_cast<size_t>(image_info.tile_width) +
-      //    static_cast<unsigned int>(dst_width) * tiff_h;
+static void JPEGErrorExit(j_common_ptr cinfo) {
+  JPEGErrorManager* mgr = reinterpret_cast<JPEGErrorManager*>(cinfo->err);
+  (*cinfo->err->format_message)(cinfo, mgr->message);
+  longjmp(mgr->setjmp_buffer, 1);
+}
 
-      // Decode into temporary buffer.
+static void JPEGOutputMessage(j_common_ptr cinfo) {
+  // Suppress warnings to stderr.
+  (void)cinfo;
+}
 
-      std::vector<uint16_t> tmpbuf;
-      tmpbuf.resize(
-          static_cast<size_t>(lj_width * lj_height * ljp->components));
+// Decode(or only read header when `dst` is NULL) with libjpeg(-turbo) API.
+// No C++ object with destructor is created in this function, since libjpeg
+// reports errors with longjmp.
+static bool DecodeJPEGTurbo(const uint8_t* src, size_t src_len,
+                            int scale_denom, std::vector<uint8_t>* dst,
+                            int* width, int* height, int* components,
+                            char* message /* JMSG_LENGTH_MAX */) {
+  struct jpeg_decompress_struct cinfo;
+  JPEGErrorManager jerr;
+
+  cinfo.err = jpeg_std_error(&jerr.pub);
+  jerr.pub.error_exit = JPEGErrorExit;
+  jerr.pub.output_message = JPEGOutputMessage;
+  jerr.message[0] = '\0';
+
+  if (setjmp(jerr.setjmp_buffer)) {
+    jpeg_destroy_decompress(&cinfo);
+    memcpy(message, jerr.message, JMSG_LENGTH_MAX);
+    return false;
+  }
 
-      // TODO: ljp->components > image_info.samples_per_pixel
-      ret = lj92_decode(ljp, tmpbuf.data(), image_info.tile_width, 0, NULL, 0);
-      // ret = lj92_decode(ljp, tmpbuf.data(), write_length, skip_length, NULL,
-      // 0);
-      TINY_DNG_CHECK_AND_RETURN(ret == LJ92_ERROR_NONE, "Error decoding JPEG stream.", err);
-      // ret = lj92_decode(ljp, dst_data + dst_offset, write_length,
-      // skip_length,
-      //                  NULL, 0);
+  jpeg_create_decompress(&cinfo);
+  jpeg_mem_src(&cinfo, const_cast<unsigned char*>(src),
+               static_cast<unsigned long>(src_len));
+  if (jpeg_read_header(&cinfo, TRUE) != JPEG_HEADER_OK) {
+    jpeg_destroy_decompress(&cinfo);
+    return false;
+  }
 
-      // Copy to dest buffer.
-      // NOTE: For some DNG file, tiled image may exceed the extent of target
-      // image resolution.
+  // Lossless JPEG(supported by libjpeg-turbo 3.x) is decoded with lj92.
+  if ((cinfo.data_precision != 8) ||
+      ((cinfo.num_components != 1) && (cinfo.num_components != 3))) {
+    jpeg_destroy_decompress(&cinfo);
+    strcpy(message, "Unsupported JPEG precision or color space.");
+    return false;
+  }
 
-#if 0  // TODO: remove
-      for (unsigned int y = 0;
-           y < static_cast<unsigned int>(image_info.tile_length); y++) {
-        unsigned int y_offset = y + tiff_h;
-        if (y_offset >= static_cast<unsigned int>(image_info.height)) {
-          continue;
-        }
+  if (!dst) {
+    (*width) = static_cast<int>(cinfo.image_width);
+    (*height) = static_cast<int>(cinfo.image_height);
+    (*components) = cinfo.num_components;
+    jpeg_destroy_decompress(&cinfo);
+    return true;
+  }
 
-        size_t dst_offset =
-            tiff_w + static_cast<unsigned int>(dst_width) * y_offset;
+  // DCT domain scaling.
+  cinfo.scale_num = 1;
+  cinfo.scale_denom = static_cast<unsigned int>(scale_denom);
+  cinfo.out_color_space = (cinfo.num_components == 1) ? JCS_GRAYSCALE : JCS_RGB;
 
-        size_t x_len = static_cast<size_t>(image_info.tile_width);
-        if ((tiff_w + static_cast<unsigned int>(image_info.tile_width)) >=
-            static_cast<unsigned int>(dst_width)) {
-          x_len = static_cast<size_t>(dst_width) - tiff_w;
-        }
-        for (size_t x = 0; x < x_len; x++) {
-          dst_data[dst_offset + x] =
-              tmpbuf[y * static_cast<size_t>(image_info.tile_width) + x];
+  jpeg_start_decompress(&cinfo);
+
+  const size_t stride =
+      size_t(cinfo.output_width) * size_t(cinfo.output_components);
+  dst->resize(stride * size_t(cinfo.output_height));
+
+  while (cinfo.output_scanline < cinfo.output_height) {
+    JSAMPROW row = dst->data() + stride * size_t(cinfo.output_scanline);
+    jpeg_read_scanlines(&cinfo, &row, 1);
+  }
+
+  (*width) = static_cast<int>(cinfo.output_width);
+  (*height) = static_cast<int>(cinfo.output_height);
+  (*components) = cinfo.output_components;
+
+  jpeg_finish_decompress(&cinfo);
+  jpeg_destroy_decompress(&cinfo);
+
+  return true;
+}
+
+#endif
+
+///
+/// Read the resolution and the number of channels from baseline JPEG header.
+/// Returns false for non baseline JPEG(e.g. lossless JPEG).
+///
+static bool GetJPEGInfo(const uint8_t* src, size_t src_len, int* width,
+                        int* height, int* components) {
+  if ((src_len == 0) ||
+      (src_len > size_t((std::numeric_limits<int>::max)()))) {
+    return false;
+  }
+#if defined(TINY_DNG_LOADER_USE_LIBJPEG_TURBO)
+  char message[JMSG_LENGTH_MAX];
+  return DecodeJPEGTurbo(src, src_len, 1, /* dst */ NULL, width, height,
+                         components, message);
+#else
+  return stbi_info_from_memory(src, static_cast<int>(src_len), width, height,
+                               components) == 1;
+#endif
+}
+
+#if !defined(TINY_DNG_LOADER_USE_LIBJPEG_TURBO)
+// Downscale by box filter. The output size is ceil(w / scale_denom), the same
+// as DCT domain scaling of libjpeg.
+static void DownscaleBox(const uint8_t* src, int width, int height,
+                         int components, int scale_denom, uint8_t* dst) {
+  const int out_w = (width + scale_denom - 1) / scale_denom;
+  const int out_h = (height + scale_denom - 1) / scale_denom;
+  for (int y = 0; y < out_h; y++) {
+    const int y0 = y * scale_denom;
+    const int y1 = (std::min)(y0 + scale_denom, height);
+    for (int x = 0; x < out_w; x++) {
+      const int x0 = x * scale_denom;
+      const int x1 = (std::min)(x0 + scale_denom, width);
+      const int n = (y1 - y0) * (x1 - x0);
+      for (int c = 0; c < components; c++) {
+        int sum = 0;
+        for (int sy = y0; sy < y1; sy++) {
+          const uint8_t* row = src + size_t(sy) * size_t(width) * size_t(components);
+          for (int sx = x0; sx < x1; sx++) {
+            sum += row[sx * components + c];
+          }
         }
+        dst[(size_t(y) * size_t(out_w) + size_t(x)) * size_t(components) +
+            size_t(c)] = static_cast<uint8_t>((sum + n / 2) / n);
       }
+    }
+  }
+}
 #endif
 
-      const size_t spp = size_t(image_info.samples_per_pixel);
+///
+/// Decode lossy JPEG(34892) image stored in tiles(or multiple strips). Each
+/// tile is an independent baseline JPEG stream, so tiles are decoded in
+/// parallel(TINY_DNG_LOADER_USE_THREAD) and written to its region of
+/// `image->data`(8bit).
+///
+static bool DecompressLossyJPEGTiles(const StreamReader& sr, DNGImage* image,
+                                     std::string* err) {
+  TINY_DNG_CHECK_AND_RETURN((image->width > 0) && (image->height > 0),
+                            "Invalid image size.", err);
 
-      // const size_t tile_size =
-      //    size_t(image_info.tile_width) * size_t(image_info.tile_length);
-      for (unsigned int y = 0;
-           y < static_cast<unsigned int>(image_info.tile_length); y++) {
-        unsigned int y_offset = y + tiff_h;
-        if (y_offset >= static_cast<unsigned int>(image_info.height)) {
-          continue;
-        }
+  TileLayout layout;
+  std::vector<unsigned int> offsets;
+  std::vector<unsigned int> byte_counts;
 
-        size_t dst_offset =
-            tiff_w + static_cast<unsigned int>(dst_width) * y_offset;
+  if ((image->tile_width > 0) && (image->tile_length > 0)) {
+    if (!ComputeTileLayout(*image, &layout, err)) {
+      return false;
+    }
+    offsets = image->tile_offsets;
+    byte_counts = image->tile_byte_counts;
+  } else {
+    // Treat each strip as a tile with the width of the image.
+    TINY_DNG_CHECK_AND_RETURN(image->rows_per_strip > 0,
+                              "Invalid RowsPerStrip.", err);
+    layout.tile_width = size_t(image->width);
+    layout.tile_length =
+        size_t((std::min)(image->rows_per_strip, image->height));
+    layout.tiles_across = 1;
+    layout.tiles_down =
+        (size_t(image->height) + layout.tile_length - 1) / layout.tile_length;
+    layout.num_tiles = layout.tiles_down;
+    offsets = image->strip_offsets;
+    byte_counts = image->strip_byte_counts;
+  }
+
+  TINY_DNG_CHECK_AND_RETURN(
+      (layout.num_tiles > 0) && (offsets.size() >= layout.num_tiles) &&
+          (byte_counts.size() >= layout.num_tiles),
+      "The number of offsets or byte counts is less than the number of "
+      "tiles(strips) in lossy JPEG image.", err);
+
+  // The number of channels is taken from the first tile.
+  int components = 0;
+  {
+    const uint8_t* src_addr = sr.map_abs_addr(offsets[0], byte_counts[0]);
+    int w = 0, h = 0;
+    TINY_DNG_CHECK_AND_RETURN(
+        src_addr && GetJPEGInfo(src_addr, byte_counts[0], &w, &h, &components),
+        "Currently We only supports Standard JPEG data for Lossy "
+        "compression(34892).", err);
+    TINY_DNG_CHECK_AND_RETURN((components == 1) || (components == 3),
+                              "Unsupported channels in JPEG data.", err);
+  }
+
+  const size_t pixel_bytes = size_t(components);
+  const uint64_t len =
+      uint64_t(image->width) * uint64_t(image->height) * pixel_bytes;
+  TINY_DNG_CHECK_AND_RETURN(len <= (kMaxImageSizeInMB * 1024ull * 1024ull),
+                            "Image data size too large.", err);
+
+  image->data.resize(size_t(len));
+
+  const int num_threads = GetNumWorkers(layout.num_tiles);
+
+  // Per-thread decode buffer.
+  std::vector<std::vector<uint8_t> > scratch(static_cast<size_t>(num_threads));
+
+  bool ret = ParallelFor(
+      layout.num_tiles, num_threads, err,
+      [&](size_t k, int thread_id, std::string* thread_err) -> bool {
+        const uint8_t* src_addr = sr.map_abs_addr(offsets[k], byte_counts[k]);
+        if (!src_addr) {
+          if (thread_err) {
+            (*thread_err) +=
+                "Cannot read lossy JPEG compressed tile(strip) from a "
+                "memory.\n";
+          }
+          return false;
+        }
 
-        size_t x_len = static_cast<size_t>(image_info.tile_width);
-        if ((tiff_w + static_cast<unsigned int>(image_info.tile_width)) >=
-            static_cast<unsigned int>(dst_width)) {
-          x_len = static_cast<size_t>(dst_width) - tiff_w;
+        std::vector<uint8_t>& buf = scratch[size_t(thread_id)];
+        int w = 0, h = 0, c = 0;
+        if (!DecodeJPEG(src_addr, byte_counts[k], /* scale_denom */ 1, &buf,
+                        &w, &h, &c, thread_err)) {
+          return false;
         }
 
-        // Decoded ljpeg data is already channel first(RGBRGBRGB...)
-        for (size_t x = 0; x < x_len; x++) {
-          for (size_t c = 0; c < spp; c++) {
-            dst_data[spp * (dst_offset + x) + c] =
-                tmpbuf[spp * (y * static_cast<size_t>(image_info.tile_width) +
-                              x) +
-                       c];
+        if (c != components) {
+          if (thread_err) {
+            (*thread_err) += "The number of channels differs among tiles.\n";
           }
+          return false;
         }
-      }
-
-      TINY_DNG_CHECK_AND_RETURN(ret == LJ92_ERROR_NONE,
-                      "Error opening JPEG stream.", err);  // @fixme: redundant?
 
-      if (ljbits_out && (lj_bits > 0)) {
-        // Assume all tiles have same lj_bits value.
-        (*ljbits_out) = lj_bits;
-      }
+        // The JPEG stream of a tile in the right or bottom edge may be
+        // clipped to the image extent.
+        const size_t tx = (k % layout.tiles_across) * layout.tile_width;
+        const size_t ty = (k / layout.tiles_across) * layout.tile_length;
+        const size_t x_len = (std::min)(
+            (std::min)(layout.tile_width, size_t(image->width) - tx), size_t(w));
+        const size_t y_len = (std::min)(
+            (std::min)(layout.tile_length, size_t(image->height) - ty),
+            size_t(h));
 
-      lj92_close(ljp);
+        for (size_t y = 0; y < y_len; y++) {
+          memcpy(image->data.data() +
+                     ((ty + y) * size_t(image->width) + tx) * pixel_bytes,
+                 buf.data() + y * size_t(w) * pixel_bytes, x_len * pixel_bytes);
+        }
 
-      tiff_w += static_cast<unsigned int>(image_info.tile_width);
-      column_step++;
-      // TINY_DNG_DPRINTF("col = %d, tiff_w = %d / %d\n", column_step, tiff_w,
-      // image_info.width);
-      if (tiff_w >= static_cast<unsigned int>(image_info.width)) {
-        // tiff_h += static_cast<unsigned int>(image_info.tile_length);
-        tiff_h += static_cast<unsigned int>(image_info.tile_length);
-        // TINY_DNG_DPRINTF("tiff_h = %d\n", tiff_h);
-        tiff_w = 0;
-        column_step = 0;
-      }
-    }
-  } else {
-    // Assume LJPEG data is not stored in tiled format.
+        return true;
+      });
 
-    // Read offset to JPEG data location.
-    // offset = static_cast<int>(Read4(fp, swap_endian));
+  if (!ret) {
+    image->data.clear();
+    return false;
+  }
 
-    if (image_info.offset <= 0) {
-      TINY_DNG_ERROR_AND_RETURN("Invalid JPEG data offset.", err);
-    }
+  image->samples_per_pixel = components;
+  image->bits_per_sample = 8;
 
-    offset = static_cast<int>(image_info.offset);
+  return true;
+}
 
-    TINY_DNG_DPRINTF("LJPEG offset %d\n", offset);
+#ifdef TINY_DNG_LOADER_ENABLE_ZIP
 
-    int lj_width = 0;
-    int lj_height = 0;
-    int lj_bits = 0;
-    lj92 ljp;
+///
+/// Deflate backend state reused by `DecompressZIP` calls of one thread.
+/// libdeflate allocates its decompressor once here instead of once per tile.
+/// Other backends keep no state.
+///
+struct ZIPDecoder {
+#if defined(TINY_DNG_LOADER_USE_LIBDEFLATE)
+  struct libdeflate_decompressor* decompressor{nullptr};
 
-    size_t input_len = sr.size() - static_cast<size_t>(offset);
+  ZIPDecoder() {}
+  ~ZIPDecoder() {
+    if (decompressor) {
+      libdeflate_free_decompressor(decompressor);
+    }
+  }
+  ZIPDecoder(const ZIPDecoder&) = delete;
+  ZIPDecoder& operator=(const ZIPDecoder&) = delete;
+#endif
+};
 
-    // @fixme { Parse LJPEG header first and set exact compressed LJPEG data
-    // length to `data_len` arg. }
-    int ret =
-        lj92_open(&ljp, reinterpret_cast<const uint8_t*>(sr.data() + offset),
-                  /* data_len */ static_cast<int>(input_len), &lj_width,
-                  &lj_height, &lj_bits);
+///
+/// Inflate zlib(Adobe Deflate) stream `src` into `dst`.
+/// Implemented with the backend selected at compile time(miniz, zlib, zlib-ng
+/// or libdeflate). See TINY_DNG_LOADER_ZIP_BACKEND_NAME.
+///
+/// @param[inout] uncompressed_size Capacity of `dst` on input. The number of
+/// bytes written to `dst` on output.
+/// @param[inout] decoder Backend state to reuse across calls of the same
+/// thread. nullptr = create and release it in this call.
+///
+static bool DecompressZIP(unsigned char* dst,
+                          unsigned long* uncompressed_size /* inout */,
+                          const unsigned char* src, unsigned long src_size,
+                          std::string* err, ZIPDecoder* decoder = nullptr) {
+  // Inflate directly into `dst`.
+#if defined(TINY_DNG_LOADER_USE_LIBDEFLATE)
+  ZIPDecoder local_decoder;
+  if (!decoder) {
+    decoder = &local_decoder;
+  }
+  if (!decoder->decompressor) {
+    decoder->decompressor = libdeflate_alloc_decompressor();
+    if (!decoder->decompressor) {
+      if (err) {
+        (*err) += "Failed to allocate libdeflate decompressor.\n";
+      }
+      return false;
+    }
+  }
 
-    // TINY_DNG_DPRINTF("ret = %d\n", ret);
-    if (ret != LJ92_ERROR_NONE) {
-      TINY_DNG_ERROR_AND_RETURN("Error opening JPEG stream.", err);
+  size_t actual_size = 0;
+  enum libdeflate_result ret = libdeflate_zlib_decompress(
+      decoder->decompressor, src, size_t(src_size), dst,
+      size_t(*uncompressed_size), &actual_size);
+  if (LIBDEFLATE_SUCCESS != ret) {
+    if (err) {
+      std::stringstream ss;
+      ss << "libdeflate_zlib_decompress failed. code = " << int(ret) << "\n";
+      (*err) += ss.str();
+    }
+    return false;
+  }
+  (*uncompressed_size) = static_cast<unsigned long>(actual_size);
+#elif defined(TINY_DNG_LOADER_USE_ZLIB_NG)
+  (void)decoder;
+  size_t actual_size = size_t(*uncompressed_size);
+  int ret = zng_uncompress(dst, &actual_size, src, size_t(src_size));
+  if (Z_OK != ret) {
+    if (err) {
+      std::stringstream ss;
+      ss << "zlib-ng uncompress failed. code = " << ret << "\n";
+      (*err) += ss.str();
+    }
+    return false;
+  }
+  (*uncompressed_size) = static_cast<unsigned long>(actual_size);
+#elif defined(TINY_DNG_LOADER_USE_SYSTEM_ZLIB)
+  (void)decoder;
+  int ret = uncompress(dst, uncompressed_size, src, src_size);
+  if (Z_OK != ret) {
+    if (err) {
+      std::stringstream ss;
+      ss << "zlib uncompress failed. code = " << ret << "\n";
+      (*err) += ss.str();
+    }
+    return false;
+  }
+#else
+  (void)decoder;
+  int ret = mz_uncompress(dst, uncompressed_size, src, src_size);
+  if (MZ_OK != ret) {
+    if (err) {
+      std::stringstream ss;
+      ss << "mz_uncompress failed. code = " << ret << "\n";
+      (*err) += ss.str();
     }
+    return false;
+  }
+#endif
 
-    // TINY_DNG_DPRINTF("lj %d, %d, %d\n", lj_width, lj_height, lj_bits);
+  return true;
+}
 
-    int write_length = image_info.width;
-    int skip_length = 0;
+///
+/// Decode ZIP(Deflate) compressed tiles or strips into `image->data`.
+///
+/// Each tile(or strip) is inflated independently with its exact compressed
+/// size(TileByteCounts/StripByteCounts), in parallel when
+/// TINY_DNG_LOADER_USE_THREAD is defined, and its rows are written to its
+/// location in the output image.
+///
+static bool DecompressZIPedTiles(const StreamReader& sr, DNGImage* image,
+                                 std::string* err) {
+#ifdef TINY_DNG_LOADER_PROFILING
+  auto start_t = std::chrono::system_clock::now();
+#endif
 
-    ret = lj92_decode(ljp, dst_data, write_length, skip_length, NULL, 0);
-    // TINY_DNG_DPRINTF("ret = %d\n", ret);
+  TINY_DNG_CHECK_AND_RETURN(image->planar_configuration == 1,
+                            "Planar ZIP image is not supported.", err);
+  TINY_DNG_CHECK_AND_RETURN((image->bits_per_sample % 8) == 0,
+                            "ZIP image must be multiple of 8 bits per sample.", err);
+  TINY_DNG_CHECK_AND_RETURN((image->width > 0) && (image->height > 0),
+                            "Invalid image size.", err);
 
-    if (ret != LJ92_ERROR_NONE) {
-      TINY_DNG_ERROR_AND_RETURN("Error decoding JPEG stream.", err);
+  TileLayout layout;
+  std::vector<unsigned int> offsets;
+  std::vector<unsigned int> byte_counts;
+
+  const bool tiled = (image->tile_width > 0) && (image->tile_length > 0);
+  if (tiled) {
+    if (!ComputeTileLayout(*image, &layout, err)) {
+      return false;
     }
+    offsets = image->tile_offsets;
+    byte_counts = image->tile_byte_counts;
+  } else {
+    // Treat each strip as a tile with the width of the image.
+    layout.tile_width = size_t(image->width);
+    layout.tile_length = size_t(image->height);
+    if ((image->rows_per_strip > 0) &&
+        (image->rows_per_strip < image->height)) {
+      layout.tile_length = size_t(image->rows_per_strip);
+    }
+    layout.tiles_across = 1;
+    layout.tiles_down =
+        (size_t(image->height) + layout.tile_length - 1) / layout.tile_length;
+    layout.num_tiles = layout.tiles_down;
+
+    if (!image->strip_offsets.empty()) {
+      offsets = image->strip_offsets;
+      byte_counts = image->strip_byte_counts;
+    } else {
+      // Single strip.
+      TINY_DNG_CHECK_AND_RETURN((image->offset > 0) && (image->offset < sr.size()),
+                                "Invalid ZIPed data offset.", err);
+      offsets.push_back(image->offset);
+      byte_counts.push_back(
+          (image->strip_byte_count > 0)
+              ? static_cast<unsigned int>(image->strip_byte_count)
+              : static_cast<unsigned int>(sr.size() - image->offset));
+    }
+  }
+
+  TINY_DNG_CHECK_AND_RETURN(
+      (offsets.size() >= layout.num_tiles) &&
+          (byte_counts.size() >= layout.num_tiles),
+      "The number of offsets or byte counts is less than the number of "
+      "tiles(strips) in ZIP image.", err);
+
+  TINY_DNG_DPRINTF("tile = %d, %d\n", int(layout.tile_width),
+                   int(layout.tile_length));
+  TINY_DNG_DPRINTF("w, h = %d, %d\n", image->width, image->height);
+
+  const size_t spp = size_t(image->samples_per_pixel);
+  const size_t pixel_bytes = spp * size_t(image->bits_per_sample) / 8;
+  const uint64_t tile_bytes =
+      uint64_t(layout.tile_width) * uint64_t(layout.tile_length) * pixel_bytes;
+  const uint64_t len =
+      uint64_t(image->width) * uint64_t(image->height) * pixel_bytes;
+
+  if ((len == 0) || (len > (kMaxImageSizeInMB * 1024ull * 1024ull)) ||
+      (tile_bytes > uint64_t((std::numeric_limits<int32_t>::max)()))) {
+    TINY_DNG_ERROR_AND_RETURN("Invalid or too large ZIP image size.", err);
+  }
+
+  image->data.resize(size_t(len));
+
+  const int num_threads = GetNumWorkers(layout.num_tiles);
+
+  const size_t row_bytes = size_t(image->width) * pixel_bytes;
+
+  // Per-thread deflate backend state, inflate buffer(for tiles not contiguous
+  // in the output image) and row buffer for the predictor.
+  std::vector<ZIPDecoder> decoders(static_cast<size_t>(num_threads));
+  std::vector<std::vector<uint8_t> > scratch(static_cast<size_t>(num_threads));
+  std::vector<std::vector<uint8_t> > row_scratch(
+      static_cast<size_t>(num_threads));
+
+  bool ret = ParallelFor(
+      layout.num_tiles, num_threads, err,
+      [&](size_t k, int thread_id, std::string* thread_err) -> bool {
+        const size_t src_offset = offsets[k];
+        const size_t src_bytesize = byte_counts[k];
+
+        const uint8_t* src_addr = sr.map_abs_addr(src_offset, src_bytesize);
+        if (!src_addr) {
+          if (thread_err) {
+            (*thread_err) +=
+                "Cannot read ZIP compressed tile(strip) from a memory.\n";
+          }
+          return false;
+        }
 
-    lj92_close(ljp);
+        // Rows exceeding the image extent(e.g. the last strip) are not
+        // unpredicted.
+        const size_t ty = (k / layout.tiles_across) * layout.tile_length;
+        const size_t rows =
+            (std::min)(layout.tile_length, size_t(image->height) - ty);
+
+        // A strip(or a tile spanning the whole image width) is contiguous in
+        // the output image, so inflate it in place. Other tiles are inflated
+        // into the per-thread buffer, which stays in cache until its rows are
+        // copied to the output image.
+        const bool contiguous = (layout.tile_width == size_t(image->width)) &&
+                                (!tiled || (rows == layout.tile_length));
+
+        uint8_t* dst = nullptr;
+        unsigned long uncompressed_size = 0;
+        if (contiguous) {
+          dst = image->data.data() + ty * row_bytes;
+          uncompressed_size = static_cast<unsigned long>(rows * row_bytes);
+        } else {
+          std::vector<uint8_t>& buf = scratch[size_t(thread_id)];
+          buf.resize(size_t(tile_bytes));
+          dst = buf.data();
+          uncompressed_size = static_cast<unsigned long>(tile_bytes);
+        }
+
+        const unsigned long expected_size = uncompressed_size;
+        if (!DecompressZIP(dst, &uncompressed_size, src_addr,
+                           static_cast<unsigned long>(src_bytesize),
+                           thread_err, &decoders[size_t(thread_id)])) {
+          if (thread_err) {
+            (*thread_err) += "Failed to decode ZIP data.\n";
+          }
+          return false;
+        }
 
-    if (ljbits_out && (lj_bits > 0)) {
-      (*ljbits_out) = lj_bits;
-    }
-  }
+        // The per-thread buffer is reused across tiles, so a short tile would
+        // keep the pixels of the previous one.
+        if (uncompressed_size != expected_size) {
+          if (thread_err) {
+            std::stringstream ss;
+            ss << "ZIP tile(strip) " << k << " inflated to "
+               << uncompressed_size << " bytes but " << expected_size
+               << " bytes required.\n";
+            (*thread_err) += ss.str();
+          }
+          return false;
+        }
+
+        if (!UnpredictImage(dst, image->predictor, layout.tile_width, rows,
+                            spp, image->bits_per_sample, sr.swap_endian(),
+                            &row_scratch[size_t(thread_id)], thread_err)) {
+          if (thread_err) {
+            (*thread_err) += "Failed to unpredict ZIP-ed tile image.\n";
+          }
+          return false;
+        }
+
+        if (!contiguous) {
+          // NOTE: For some DNG file, tiled image may exceed the extent of
+          // target image resolution.
+          CopyTileToImage(dst, layout, k, pixel_bytes, size_t(image->width),
+                          size_t(image->height), image->data.data());
+        }
+
+        return true;
+      });
 
 #ifdef TINY_DNG_LOADER_PROFILING
   auto end_t = std::chrono::system_clock::now();
   auto ms =
       std::chrono::duration_cast<std::chrono::milliseconds>(end_t - start_t);
 
-  std::cout << "DecompressLosslessJPEG : " << ms.count() << " [ms]"
-            << std::endl;
+  std::cout << "DecompressZIP : " << ms.count() << " [ms]" << std::endl;
 #endif
 
-  return true;
+  return ret;
 }
+#endif
 
-// Currently we only support parsing GainMap
-static bool ParseOpcodeList(unsigned short tag, const uint8_t *data, size_t dataSize,
-  std::vector<GainMap> *gainmaps_out)
+// Decompress LosslesJPEG adta.
+static bool DecompressLosslessJPEG(const StreamReader& sr,
+                                   unsigned short* dst_data, int dst_width,
+                                   const DNGImage& image_info, int* ljbits_out,
+                                   std::string* err) {
+  unsigned int tiff_h = 0, tiff_w = 0;
+  int offset = 0;
+
+#ifdef TINY_DNG_LOADER_PROFILING
+  auto start_t = std::chrono::system_clock::now();
+#endif
+
+  TINY_DNG_DPRINTF("tile_width %d, tile_length %d\n", image_info.tile_width,
+                   image_info.tile_length);
+
+  if ((image_info.tile_width > 0) && (image_info.tile_length > 0)) {
+    // Assume Lossless JPEG data is stored in tiled format.
+    if (image_info.tile_width <= 0) {
+      if (err) {
+        (*err) += "Invalid tile width.\n";
+      }
+      return false;
+    }
+    if (image_info.tile_length <= 0) {
+      if (err) {
+        (*err) += "Invalid tile length.\n";
+      }
+      return false;
+    }
+    //TINY_DNG_ASSERT(image_info.tile_width > 0, "Invalid tile width.");
+    //TINY_DNG_ASSERT(image_info.tile_length > 0, "Invalid tile length.");
+
+    // <-       image width(skip len)           ->
+    // +-----------------------------------------+
+    // |                                         |
+    // |              <- tile w  ->              |
+    // |              +-----------+              |
+    // |              |           | \            |
+    // |              |           | |            |
+    // |              |           | | tile h     |
+    // |              |           | |            |
+    // |              |           | /            |
+    // |              +-----------+              |
+    // |                                         |
+    // |                                         |
+    // +-----------------------------------------+
+
+    // TINY_DNG_DPRINTF("tile = %d, %d\n", image_info.tile_width,
+    // image_info.tile_length);
+
+    // Currently we only support tile data for tile.length == tiff.height.
+    // assert(image_info.tile_length == image_info.height);
+
+    size_t column_step = 0; // debug
+    (void)column_step;
+
+    std::vector<uint8_t> row_buf;
+
+    while (tiff_h < static_cast<unsigned int>(image_info.height)) {
+      // Read offset to JPEG data location.
+      if (!sr.read4(&offset)) {
+        if (err) {
+          (*err) +=
+              "Failed to read offset to JPEG data location in "
+              "DecompressLosslessJPEG.\n";
+        }
+        return false;
+      }
+      TINY_DNG_DPRINTF("tile offt = %d\n", offset);
+
+      int lj_width = 0;
+      int lj_height = 0;
+      int lj_bits = 0;
+
+      lj92 ljp;
+
+      size_t input_len = sr.size() - static_cast<size_t>(offset);
+
+      // @fixme { Parse LJPEG header first and set exact compressed LJPEG data
+      // length to `data_len` arg. }
+      int ret =
+          lj92_open(&ljp, reinterpret_cast<const uint8_t*>(sr.data() + offset),
+                    /* data_len */ static_cast<int>(input_len), &lj_width,
+                    &lj_height, &lj_bits);
+      TINY_DNG_DPRINTF("ret = %d\n", ret);
+      TINY_DNG_CHECK_AND_RETURN(ret == LJ92_ERROR_NONE, "Error opening JPEG stream.", err);
+
+      TINY_DNG_DPRINTF("lj %d, %d, %d\n", lj_width, lj_height, lj_bits);
+      TINY_DNG_DPRINTF("ljp x %d, y %d, c %d\n", ljp->x, ljp->y,
+      ljp->components);
+      TINY_DNG_DPRINTF("tile width = %d\n", image_info.tile_width);
+      TINY_DNG_DPRINTF("tile height = %d\n", image_info.tile_length);
+      TINY_DNG_DPRINTF("col = %d, tiff_w = %d / %d\n", int(column_step), tiff_w,
+      image_info.width);
+
+      TINY_DNG_CHECK_AND_RETURN(lj_width <= image_info.tile_width, "Unexpected JPEG tile width size.", err);
+      TINY_DNG_CHECK_AND_RETURN(lj_height <= image_info.tile_length, "Unexpected JPEG tile length size.", err);
+
+      //TINY_DNG_ASSERT((lj_width * lj_height) ==
+      //                    image_info.tile_width * image_info.tile_length,
+      //                "Unexpected JPEG tile size.");
+
+      TINY_DNG_DPRINTF("lj.components %d, samples_per_pixel %d\n", ljp->components, image_info.samples_per_pixel);
+      //TINY_DNG_ASSERT(ljp->components == image_info.samples_per_pixel,
+      //                "# of color channels does not match.");
+
+      // int write_length = image_info.tile_width;
+      // int skip_length = dst_width - image_info.tile_width;
+      // TINY_DNG_DPRINTF("write_len = %d, skip_len = %d\n", write_length,
+      // skip_length);
+
+      // size_t dst_offset =
+      //    column_step * static_cast<size_t>(image_info.tile_width) +
+      //    static_cast<unsigned int>(dst_width) * tiff_h;
+
+      // Decode into temporary buffer.
+
+      std::vector<uint16_t> tmpbuf;
+      tmpbuf.resize(
+          static_cast<size_t>(lj_width * lj_height * ljp->components));
+
+      // TODO: ljp->components > image_info.samples_per_pixel
+      ret = lj92_decode(ljp, tmpbuf.data(), image_info.tile_width, 0, NULL, 0);
+      // ret = lj92_decode(ljp, tmpbuf.data(), write_length, skip_length, NULL,
+      // 0);
+      TINY_DNG_CHECK_AND_RETURN(ret == LJ92_ERROR_NONE, "Error decoding JPEG stream.", err);
+      // ret = lj92_decode(ljp, dst_data + dst_offset, write_length,
+      // skip_length,
+      //                  NULL, 0);
+
+      // Copy to dest buffer.
+      // NOTE: For some DNG file, tiled image may exceed the extent of target
+      // image resolution.
+
+#if 0  // TODO: remove
+      for (unsigned int y = 0;
+           y < static_cast<unsigned int>(image_info.tile_length); y++) {
+        unsigned int y_offset = y + tiff_h;
+        if (y_offset >= static_cast<unsigned int>(image_info.height)) {
+          continue;
+        }
+
+        size_t dst_offset =
+            tiff_w + static_cast<unsigned int>(dst_width) * y_offset;
+
+        size_t x_len = static_cast<size_t>(image_info.tile_width);
+        if ((tiff_w + static_cast<unsigned int>(image_info.tile_width)) >=
+            static_cast<unsigned int>(dst_width)) {
+          x_len = static_cast<size_t>(dst_width) - tiff_w;
+        }
+        for (size_t x = 0; x < x_len; x++) {
+          dst_data[dst_offset + x] =
+              tmpbuf[y * static_cast<size_t>(image_info.tile_width) + x];
+        }
+      }
+#endif
+
+      const size_t spp = size_t(image_info.samples_per_pixel);
+
+      // const size_t tile_size =
+      //    size_t(image_info.tile_width) * size_t(image_info.tile_length);
+      for (unsigned int y = 0;
+           y < static_cast<unsigned int>(image_info.tile_length); y++) {
+        unsigned int y_offset = y + tiff_h;
+        if (y_offset >= static_cast<unsigned int>(image_info.height)) {
+          continue;
+        }
+
+        size_t dst_offset =
+            tiff_w + static_cast<unsigned int>(dst_width) * y_offset;
+
+        size_t x_len = static_cast<size_t>(image_info.tile_width);
+        if ((tiff_w + static_cast<unsigned int>(image_info.tile_width)) >=
+            static_cast<unsigned int>(dst_width)) {
+          x_len = static_cast<size_t>(dst_width) - tiff_w;
+        }
+
+        // Decoded ljpeg data is already channel first(RGBRGBRGB...)
+        for (size_t x = 0; x < x_len; x++) {
+          for (size_t c = 0; c < spp; c++) {
+            dst_data[spp * (dst_offset + x) + c] =
+                tmpbuf[spp * (y * static_cast<size_t>(image_info.tile_width) +
+                              x) +
+                       c];
+          }
+        }
+      }
+
+      TINY_DNG_CHECK_AND_RETURN(ret == LJ92_ERROR_NONE,
+                      "Error opening JPEG stream.", err);  // @fixme: redundant?
+
+      if (ljbits_out && (lj_bits > 0)) {
+        // Assume all tiles have same lj_bits value.
+        (*ljbits_out) = lj_bits;
+      }
+
+      lj92_close(ljp);
+
+      tiff_w += static_cast<unsigned int>(image_info.tile_width);
+      column_step++;
+      // TINY_DNG_DPRINTF("col = %d, tiff_w = %d / %d\n", column_step, tiff_w,
+      // image_info.width);
+      if (tiff_w >= static_cast<unsigned int>(image_info.width)) {
+        // tiff_h += static_cast<unsigned int>(image_info.tile_length);
+        tiff_h += static_cast<unsigned int>(image_info.tile_length);
+        // TINY_DNG_DPRINTF("tiff_h = %d\n", tiff_h);
+        tiff_w = 0;
+        column_step = 0;
+      }
+    }
+  } else {
+    // Assume LJPEG data is not stored in tiled format.
+
+    // Read offset to JPEG data location.
+    // offset = static_cast<int>(Read4(fp, swap_endian));
+
+    if (image_info.offset <= 0) {
+      TINY_DNG_ERROR_AND_RETURN("Invalid JPEG data offset.", err);
+    }
+
+    offset = static_cast<int>(image_info.offset);
+
+    TINY_DNG_DPRINTF("LJPEG offset %d\n", offset);
+
+    int lj_width = 0;
+    int lj_height = 0;
+    int lj_bits = 0;
+    lj92 ljp;
+
+    size_t input_len = sr.size() - static_cast<size_t>(offset);
+
+    // @fixme { Parse LJPEG header first and set exact compressed LJPEG data
+    // length to `data_len` arg. }
+    int ret =
+        lj92_open(&ljp, reinterpret_cast<const uint8_t*>(sr.data() + offset),
+                  /* data_len */ static_cast<int>(input_len), &lj_width,
+                  &lj_height, &lj_bits);
+
+    // TINY_DNG_DPRINTF("ret = %d\n", ret);
+    if (ret != LJ92_ERROR_NONE) {
+      TINY_DNG_ERROR_AND_RETURN("Error opening JPEG stream.", err);
+    }
+
+    // TINY_DNG_DPRINTF("lj %d, %d, %d\n", lj_width, lj_height, lj_bits);
+
+    int write_length = image_info.width;
+    int skip_length = 0;
+
+    ret = lj92_decode(ljp, dst_data, write_length, skip_length, NULL, 0);
+    // TINY_DNG_DPRINTF("ret = %d\n", ret);
+
+    if (ret != LJ92_ERROR_NONE) {
+      TINY_DNG_ERROR_AND_RETURN("Error decoding JPEG stream.", err);
+    }
+
+    lj92_close(ljp);
+
+    if (ljbits_out && (lj_bits > 0)) {
+      (*ljbits_out) = lj_bits;
+    }
+  }
+
+#ifdef TINY_DNG_LOADER_PROFILING
+  auto end_t = std::chrono::system_clock::now();
+  auto ms =
+      std::chrono::duration_cast<std::chrono::milliseconds>(end_t - start_t);
+
+  std::cout << "DecompressLosslessJPEG : " << ms.count() << " [ms]"
+            << std::endl;
+#endif
+
+  return true;
+}
+
+// Top, Left, Bottom, Right, Plane, Planes, RowPitch, ColPitch (LONG)
+static bool ReadOpcodeArea(const StreamReader& sr, Opcode* op) {
+  return sr.read4(&op->top) && sr.read4(&op->left) && sr.read4(&op->bottom) &&
+         sr.read4(&op->right) && sr.read4(&op->plane) &&
+         sr.read4(&op->planes) && sr.read4(&op->row_pitch) &&
+         sr.read4(&op->col_pitch);
+}
+
+// GainMap is stored in `gainmaps_out`, and all opcodes(including GainMap) are
+// stored in `opcodes_out` in the order of execution.
+static bool ParseOpcodeList(unsigned short tag, const uint8_t *data, size_t dataSize,
+  std::vector<GainMap> *gainmaps_out, std::vector<Opcode> *opcodes_out)
 {
   const size_t kMaxSize = 1024*1024*512;
 
-  // OpCode data is always store in big-endian byte order.
-  // First 32bit uint: The number of opcodes.
-  // For each opcode:
-  //   32bit uint for OpCodeID
-  //   32bit uint for DNG version
-  //   32bit uint for various flag bits.
-  //   32bit uint for the number of bytes of opcode data.
-  //
-  // Value range of processed Image data after OpCode processing(not implemented in TinyDNG)
-  //   Opcode1 : 0 to 2^32 - 1
-  //   Opcode2 : 0 to 2^16 - 1
-  //   Opcode3 : 0.0 to 1.0
+  // OpCode data is always store in big-endian byte order.
+  // First 32bit uint: The number of opcodes.
+  // For each opcode:
+  //   32bit uint for OpCodeID
+  //   32bit uint for DNG version
+  //   32bit uint for various flag bits.
+  //   32bit uint for the number of bytes of opcode data.
+  //
+  // Value range of processed Image data after OpCode processing(not implemented in TinyDNG)
+  //   Opcode1 : 0 to 2^32 - 1
+  //   Opcode2 : 0 to 2^16 - 1
+  //   Opcode3 : 0.0 to 1.0
+
+  // TODO: Clip image data range according with `tag`
+  (void)tag;
+
+  if (dataSize <= (4 * 5)) {
+    // Too small
+    return false;
+  }
+
+  bool swap_endian = !IsBigEndian();
+  StreamReader sr(data, dataSize, swap_endian);
+
+  uint32_t num_opcodes = 0;
+
+  if (!sr.read4(&num_opcodes)) {
+    return false;
+  }
+
+  const size_t kMaxNumOpcodes = 16;
+  if (num_opcodes > kMaxNumOpcodes) {
+    // too many opcodes.
+    return false;
+  }
+
+  //TINY_DNG_DPRINTF("# of opcodes = %d\n", num_opcodes);
+
+  for (size_t i = 0; i < num_opcodes; i++) {
+    uint32_t opcode_id = 0;
+    uint32_t dng_version = 0;
+    uint32_t flags = 0;
+    uint32_t num_bytes = 0;
+
+    if (!sr.read4(&opcode_id)) {
+      return false;
+    }
+    if (!sr.read4(&dng_version)) {
+      return false;
+    }
+    if (!sr.read4(&flags)) {
+      return false;
+    }
+    if (!sr.read4(&num_bytes)) {
+      return false;
+    }
+
+    TINY_DNG_DPRINTF("opcode %d, dng ver %d, flags %d, num_bytes %d\n", opcode_id, dng_version, flags, num_bytes);
+
+    if (num_bytes < 4) {
+      return false;
+    }
+
+    Opcode op;
+    op.id = opcode_id;
+    op.dng_version = dng_version;
+    op.flags = flags;
+    op.list_idx = (tag - TAG_OPCODE_LIST1) + 1;
+
+    if (opcode_id == OPCODE_LIST_GAIN_MAP) {
+      const size_t kMaxItems = 1024*1024;
+
+      uint32_t saved_loc = uint32_t(sr.tell());
+
+      // Top, Left, Bottom, Right, Plane, Planes, RowPitch, ColPitch, MapPointsV, MapPointsH (LONG)
+      // MapSpacingV, MapSpacingH, MapOriginV, MapOriginH (DOUBLE)
+      // MapPlanes (LONG)
+      // For each MapPointsV
+      //   For each MapPointsH
+      //     For each MapPlanes
+      //       MapGain (FLOAT)
+
+      uint32_t top, left, bottom, right, plane, planes, row_pitch, col_pitch, map_points_v, map_points_h;
+      double map_spacing_v, map_spacing_h, map_origin_v, map_origin_h;
+      uint32_t map_planes;
+
+      if (!sr.read4(&top)) {
+        return false;
+      }
+
+      if (!sr.read4(&left)) {
+        return false;
+      }
+
+      if (!sr.read4(&bottom)) {
+        return false;
+      }
+
+      if (!sr.read4(&right)) {
+        return false;
+      }
+
+      if (!sr.read4(&plane)) {
+        return false;
+      }
+
+      if (!sr.read4(&planes)) {
+        return false;
+      }
+
+      if (!sr.read4(&row_pitch)) {
+        return false;
+      }
+
+      if (!sr.read4(&col_pitch)) {
+        return false;
+      }
+
+      if (!sr.read4(&map_points_v)) {
+        return false;
+      }
+
+      if (!sr.read4(&map_points_h)) {
+        return false;
+      }
+
+      if (!sr.read_double(&map_spacing_v)) {
+        return false;
+      }
+
+      if (!sr.read_double(&map_spacing_h)) {
+        return false;
+      }
+
+      if (!sr.read_double(&map_origin_v)) {
+        return false;
+      }
+
+      if (!sr.read_double(&map_origin_h)) {
+        return false;
+      }
+
+      if (!sr.read4(&map_planes)) {
+        return false;
+      }
+
+      size_t num_items = map_points_v * map_points_h * map_planes;
+
+      //TINY_DNG_DPRINTF("top %d, left %d, bottom %d, right %d\n", top, left, bottom, right);
+      //TINY_DNG_DPRINTF("plane %d, planes %d\n", plane, planes);
+      //TINY_DNG_DPRINTF("row_pitch %d, col_pitch %d\n", row_pitch, col_pitch);
+      //TINY_DNG_DPRINTF("map_points_v %d, map_points_h %d\n", map_points_v, map_points_h);
+      //TINY_DNG_DPRINTF("map_spacing_v %f, map_spacing_h %f\n", map_spacing_v, map_spacing_h);
+      //TINY_DNG_DPRINTF("map_origin_v %f, map_origin_h %f\n", map_origin_v, map_origin_h);
+      //TINY_DNG_DPRINTF("map_planes %d\n", map_planes);
+      //TINY_DNG_DPRINTF("num_items %d\n", int(num_items));
+
+      // Read gain values.
+
+      if (num_items > kMaxItems) {
+        return false;
+      }
+
+      std::vector<float> gainmap_pixels(num_items);
+      for (size_t k = 0; k < num_items; k++) {
+
+        if (!sr.read_float(&gainmap_pixels[k])) {
+          return false;
+        }
+
+        //TINY_DNG_DPRINTF("values = %f\n", double(gainmap_pixels[k]));
+      }
+
+      GainMap gmap;
+      gmap.idx = (tag - TAG_OPCODE_LIST1) + 1;
+      //TINY_DNG_DPRINTF("idx = %d\n", gmap.idx);
+      gmap.top = top;
+      gmap.left = left;
+      gmap.bottom = bottom;
+      gmap.right = right;
+      gmap.plane = plane;
+      gmap.planes = planes;
+      gmap.row_pitch = row_pitch;
+      gmap.col_pitch = col_pitch;
+      gmap.map_points_v = map_points_v;
+      gmap.map_points_h = map_points_h;
+      gmap.map_origin_v = map_origin_v;
+      gmap.map_origin_h = map_origin_h;
+      gmap.map_spacing_v = map_spacing_v;
+      gmap.map_spacing_h = map_spacing_h;
+      gmap.map_planes = map_planes;
+      gmap.pixels = gainmap_pixels;
+
+      op.top = top;
+      op.left = left;
+      op.bottom = bottom;
+      op.right = right;
+      op.plane = plane;
+      op.planes = planes;
+      op.row_pitch = row_pitch;
+      op.col_pitch = col_pitch;
+      op.gainmap_index = int(gainmaps_out->size());
+
+      gainmaps_out->push_back(gmap);
+      opcodes_out->push_back(op);
+
+      // Go to next OpCode data
+      // TODO: Ensure read bytes == num_bytes
+      if (!sr.seek_set(saved_loc + num_bytes)) {
+        return false;
+      }
+
+    } else if ((opcode_id == OPCODE_LIST_MAP_TABLE) ||
+               (opcode_id == OPCODE_LIST_MAP_POLYNOMIAL) ||
+               (opcode_id == OPCODE_LIST_DELTA_PER_ROW) ||
+               (opcode_id == OPCODE_LIST_DELTA_PER_COLUMN) ||
+               (opcode_id == OPCODE_LIST_SCALE_PER_ROW) ||
+               (opcode_id == OPCODE_LIST_SCALE_PER_COLUMN)) {
+      const size_t kMaxItems = 1024*1024;
+
+      size_t saved_loc = sr.tell();
+
+      // Area(8 LONGs) followed by:
+      //   MapTable: TableSize (LONG), TableSize SHORTs
+      //   MapPolynomial: Degree (LONG, <= 8), Degree + 1 DOUBLEs
+      //   Delta/ScalePerRow/Column: Count (LONG), Count FLOATs
+      if (!ReadOpcodeArea(sr, &op)) {
+        return false;
+      }
+
+      uint32_t count = 0;
+      if (!sr.read4(&count)) {
+        return false;
+      }
+
+      if (opcode_id == OPCODE_LIST_MAP_TABLE) {
+        if ((count < 1) || (count > 65536)) {
+          return false;
+        }
+        op.table.resize(count);
+        for (size_t k = 0; k < count; k++) {
+          if (!sr.read2(&op.table[k])) {
+            return false;
+          }
+        }
+      } else if (opcode_id == OPCODE_LIST_MAP_POLYNOMIAL) {
+        if (count > 8) {
+          return false;
+        }
+        op.coefficients.resize(count + 1);
+        for (size_t k = 0; k <= count; k++) {
+          if (!sr.read_double(&op.coefficients[k])) {
+            return false;
+          }
+        }
+      } else {
+        if (count > kMaxItems) {
+          return false;
+        }
+        op.values.resize(count);
+        for (size_t k = 0; k < count; k++) {
+          if (!sr.read_float(&op.values[k])) {
+            return false;
+          }
+        }
+      }
+
+      if ((sr.tell() - saved_loc) > num_bytes) {
+        return false;
+      }
+
+      opcodes_out->push_back(op);
+
+      if (!sr.seek_set(saved_loc + num_bytes)) {
+        return false;
+      }
+
+    } else if ((opcode_id == OPCODE_LIST_WARP_RECTILINEAR) ||
+               (opcode_id == OPCODE_LIST_WARP_FISHEYE)) {
+      size_t saved_loc = sr.tell();
+
+      // N (LONG): 1 or the number of planes.
+      // For each plane:
+      //   Rectilinear: kr0, kr1, kr2, kr3, kt0, kt1 (DOUBLE)
+      //   Fisheye: kr0, kr1, kr2, kr3 (DOUBLE)
+      // cx, cy (DOUBLE)
+      uint32_t num_planes = 0;
+      if (!sr.read4(&num_planes)) {
+        return false;
+      }
+      const size_t num_coeffs =
+          (opcode_id == OPCODE_LIST_WARP_RECTILINEAR) ? 6 : 4;
+      if ((num_planes < 1) || (num_planes > 16)) {
+        return false;
+      }
+      op.coefficients.resize(num_planes * num_coeffs);
+      for (size_t k = 0; k < op.coefficients.size(); k++) {
+        if (!sr.read_double(&op.coefficients[k])) {
+          return false;
+        }
+      }
+      if (!sr.read_double(&op.center_x)) {
+        return false;
+      }
+      if (!sr.read_double(&op.center_y)) {
+        return false;
+      }
+
+      if ((sr.tell() - saved_loc) > num_bytes) {
+        return false;
+      }
+
+      opcodes_out->push_back(op);
+
+      if (!sr.seek_set(saved_loc + num_bytes)) {
+        return false;
+      }
+
+    } else if (opcode_id == OPCODE_LIST_FIX_VIGNETTE_RADIAL) {
+      size_t saved_loc = sr.tell();
+
+      // k0, k1, k2, k3, k4, cx, cy (DOUBLE)
+      op.coefficients.resize(5);
+      for (size_t k = 0; k < op.coefficients.size(); k++) {
+        if (!sr.read_double(&op.coefficients[k])) {
+          return false;
+        }
+      }
+      if (!sr.read_double(&op.center_x)) {
+        return false;
+      }
+      if (!sr.read_double(&op.center_y)) {
+        return false;
+      }
+
+      if ((sr.tell() - saved_loc) > num_bytes) {
+        return false;
+      }
+
+      opcodes_out->push_back(op);
+
+      if (!sr.seek_set(saved_loc + num_bytes)) {
+        return false;
+      }
+
+    } else if ((opcode_id == OPCODE_LIST_FIX_BAD_PIXELS_CONSTANT) ||
+               (opcode_id == OPCODE_LIST_FIX_BAD_PIXELS_LIST)) {
+      size_t saved_loc = sr.tell();
+
+      // Constant: Constant (LONG), BayerPhase (LONG)
+      // List: BayerPhase (LONG), BadPointCount (LONG), BadRectCount (LONG),
+      //   BadPointCount (row, col) LONG pairs,
+      //   BadRectCount (top, left, bottom, right) LONGs
+      if (opcode_id == OPCODE_LIST_FIX_BAD_PIXELS_CONSTANT) {
+        if (!sr.read4(&op.constant)) {
+          return false;
+        }
+        if (!sr.read4(&op.bayer_phase)) {
+          return false;
+        }
+      } else {
+        uint32_t point_count = 0, rect_count = 0;
+        if (!sr.read4(&op.bayer_phase)) {
+          return false;
+        }
+        if (!sr.read4(&point_count)) {
+          return false;
+        }
+        if (!sr.read4(&rect_count)) {
+          return false;
+        }
+
+        if ((12 + 8 * uint64_t(point_count) + 16 * uint64_t(rect_count)) >
+            num_bytes) {
+          return false;
+        }
+
+        op.bad_points.resize(2 * size_t(point_count));
+        for (size_t k = 0; k < op.bad_points.size(); k++) {
+          if (!sr.read4(&op.bad_points[k])) {
+            return false;
+          }
+        }
+        op.bad_rects.resize(4 * size_t(rect_count));
+        for (size_t k = 0; k < op.bad_rects.size(); k++) {
+          if (!sr.read4(&op.bad_rects[k])) {
+            return false;
+          }
+        }
+      }
+
+      opcodes_out->push_back(op);
+
+      if (!sr.seek_set(saved_loc + num_bytes)) {
+        return false;
+      }
+
+    } else {
+
+      if (num_bytes > kMaxSize) {
+        // Too large bytes. Guess invalid OpCode data.
+        return false;
+      }
+
+      // Unimplemented
+      op.data.resize(num_bytes);
+      size_t read_bytes = sr.read(num_bytes, num_bytes, op.data.data());
+      if (read_bytes == 0) {
+        return false;
+      }
+      op.data.resize(read_bytes);
+
+      opcodes_out->push_back(op);
+    }
+
+  }
+
+  return true;
+}
+
+// Parse custom TIFF field
+// returns -1 when error.
+// returns 0 when not found.
+// returns 1 when success.
+static int ParseCustomField(const StreamReader& sr,
+                            const std::vector<FieldInfo>& field_lists,
+                            const unsigned short tag, const unsigned short type,
+                            const unsigned int len, FieldData* data,
+                            std::string* err) {
+  bool found = false;
+
+  (void)len;
+
+  // Simple linear search.
+  // TODO(syoyo): Use binary search for faster procesing.
+  for (size_t i = 0; i < field_lists.size(); i++) {
+    if ((field_lists[i].tag > TAG_NEW_SUBFILE_TYPE) &&
+        (field_lists[i].tag == tag) && (field_lists[i].type == type)) {
+      if ((type == TYPE_BYTE) || (type == TYPE_SBYTE)) {
+        data->name = field_lists[i].name;
+        data->type = static_cast<DataType>(type);
+        unsigned char val;
+        if (!sr.read1(&val)) {
+          if (err) {
+            (*err) += "Failed tp parse custom field.\n";
+          }
+          return -1;
+        }
+
+        data->data.resize(1);
+        data->data[0] = val;
+        found = true;
+      } else if ((type == TYPE_SHORT) || (type == TYPE_SSHORT)) {
+        data->name = field_lists[i].name;
+        data->type = static_cast<DataType>(type);
+        unsigned short val;
+        if (!sr.read2(&val)) {
+          if (err) {
+            (*err) += "Failed tp parse custom field.\n";
+          }
+          return -1;
+        }
+        data->data.resize(sizeof(short));
+        memcpy(data->data.data(), &val, sizeof(short));
+        found = true;
+      } else if ((type == TYPE_LONG) || (type == TYPE_SLONG) ||
+                 (type == TYPE_FLOAT)) {
+        data->name = field_lists[i].name;
+        data->type = static_cast<DataType>(type);
+        unsigned int val;
+        if (!sr.read4(&val)) {
+          if (err) {
+            (*err) += "Failed tp parse custom field.\n";
+          }
+          return -1;
+        }
+        data->data.resize(sizeof(int));
+        memcpy(data->data.data(), &val, sizeof(int));
+        found = true;
+      } else if ((type == TYPE_RATIONAL) || (type == TYPE_SRATIONAL)) {
+        data->name = field_lists[i].name;
+        data->type = static_cast<DataType>(type);
+        unsigned int num, denom;
+
+        if (!sr.read4(&num)) {
+          if (err) {
+            (*err) += "Failed tp parse custom field.\n";
+          }
+          return -1;
+        }
+
+        if (!sr.read4(&denom)) {
+          if (err) {
+            (*err) += "Failed tp parse custom field.\n";
+          }
+          return -1;
+        }
+
+        data->data.resize(sizeof(int) * 2);
+
+        // Store rational value as is.
+        memcpy(&data->data[0], &num, 4);
+        memcpy(&data->data[4], &denom, 4);
+        found = true;
+      } else {
+        // TODO(syoyo): Support more data types.
+      }
+    }
+  }
+
+  return found ? 1 : 0;
+}
+
+// Parse TIFF IFD.
+// Returns true upon success, false if failed to parse.
+static bool ParseTIFFIFD(const StreamReader& sr,
+                         const std::vector<FieldInfo>& custom_field_lists,
+                         std::vector<tinydng::DNGImage>* images,
+                         std::string* warn, std::string* err, uint32_t call_depth = 0) {
+  if (!images) {
+    if (err) {
+      (*err) += "`images` argument is null.\n";
+    }
+    return false;
+  }
+
+  tinydng::DNGImage image;
+  InitializeDNGImage(&image);
+
+  // TINY_DNG_DPRINTF("id = %d\n", idx);
+  unsigned short num_entries = 0;
+  if (!sr.read2(&num_entries)) {
+    if (err) {
+      (*err) += "Faild to read the number of entries in TIFF IFD.\n";
+    }
+    return false;
+  }
+
+  if (num_entries == 0) {
+    if (err) {
+      (*err) += "TIFF IFD cannot have 0 entries.\n";
+    }
+    return false;
+  }
+
+  TINY_DNG_DPRINTF("----------\n");
+  TINY_DNG_DPRINTF("num entries %d\n", num_entries);
+
+  // For delayed reading of strip offsets and strip byte counts.
+  long offt_strip_offset = 0;
+  long offt_strip_byte_counts = 0;
+
+  // For delayed reading of tile offsets and tile byte counts.
+  long offt_tile_offsets = 0;
+  long offt_tile_byte_counts = 0;
+  unsigned int num_tile_offsets = 0;
+  unsigned int num_tile_byte_counts = 0;
+  unsigned short tile_offsets_type = TYPE_LONG;
+  unsigned short tile_byte_counts_type = TYPE_LONG;
+
+  while (num_entries--) {
+    unsigned short tag, type;
+    unsigned int len;
+    unsigned int saved_offt;
+    if (!GetTIFFTag(sr, &tag, &type, &len, &saved_offt)) {
+      if (err) {
+        (*err) += "Failed to read TIFF Tag.\n";
+      }
+      return false;
+    }
+
+    TINY_DNG_DPRINTF("tag %d\n", tag);
+    TINY_DNG_DPRINTF("saved_offt %d\n", saved_offt);
+    if (tag < TAG_NEW_SUBFILE_TYPE) {
+      if (err) {
+        (*err) += "Invalid tag ID.\n";
+      }
+      return false;
+    }
+
+    // TINY_DNG_DPRINTF("tag = %d\n", tag);
+
+    switch (tag) {
+      case TAG_NEW_SUBFILE_TYPE:
+        if (!sr.read_uint(type, &image.new_subfile_type)) {
+          if (err) {
+            (*err) += "Failed to read NewSubFileType Tag.\n";
+          }
+          return false;
+        }
+        break;
+
+      case 2:
+      case TAG_IMAGE_WIDTH:
+      case 61441:  // ImageWidth
+        if (!sr.read_uint(type,
+                          reinterpret_cast<unsigned int*>(&(image.width)))) {
+          if (err) {
+            (*err) += "Failed to read ImageWidth Tag.\n";
+          }
+          return false;
+        }
+        // TINY_DNG_DPRINTF("[%d] width = %d\n", idx, info.width);
+        break;
+
+      case 3:
+      case TAG_IMAGE_HEIGHT:
+      case 61442:  // ImageHeight
+        if (!sr.read_uint(type,
+                          reinterpret_cast<unsigned int*>(&(image.height)))) {
+          if (err) {
+            (*err) += "Failed to read ImageHeight Tag.\n";
+          }
+          return false;
+        }
+        // TINY_DNG_DPRINTF("height = %d\n", image.height);
+        break;
+
+      case TAG_BITS_PER_SAMPLE:
+      case 61443:  // BitsPerSample
+        // image->samples = len & 7;
+        if (!sr.read_uint(type, reinterpret_cast<unsigned int*>(
+                                    &(image.bits_per_sample_original)))) {
+          if (err) {
+            (*err) += "Failed to read BitsPerSample Tag.\n";
+          }
+          return false;
+        }
+        break;
+
+      case TAG_SAMPLES_PER_PIXEL: {
+        short spp = 0;
+        if (!sr.read2(&spp)) {
+          if (err) {
+            (*err) += "Failed to read SamplesPerPixel Tag.\n";
+          }
+          return false;
+        }
+
+        if (spp < 1) {
+          if (err) {
+            (*err) += "SamplesPerPixel must be 1 ~ 4, but got " + std::to_string(spp) + ".\n";
+          }
+          return false;
+        }
+
+        if (spp > 4) {
+          if (err) {
+            (*err) += "SamplesPerPixel must be less than or equal to 4.\n";
+          }
+          return false;
+        }
+
+        image.samples_per_pixel = static_cast<int>(spp);
+
+        // TINY_DNG_DPRINTF("spp = %d\n", image.samples_per_pixel);
+      } break;
+
+      case TAG_ROWS_PER_STRIP: {
+        // The TIFF Spec says data type may be SHORT, but assume LONG for a
+        // while.
+        if (!sr.read4(&image.rows_per_strip)) {
+          if (err) {
+            (*err) += "Failed to parse RowsPerStrip Tag.\n";
+          }
+          return false;
+        }
+        // NOTE: Compute strip_per_image in later since image.height is required
+        // to compute strips_per_image.
+      } break;
+
+      case TAG_COMPRESSION:
+        if (!sr.read_uint(
+                type, reinterpret_cast<unsigned int*>(&image.compression))) {
+          if (err) {
+            (*err) += "Failed to parse Compression Tag.\n";
+          }
+          return false;
+        }
+
+        // TINY_DNG_DPRINTF("tag-compression = %d\n", image.compression);
+        break;
+
+      case TAG_STRIP_OFFSET:
+      case TAG_JPEG_IF_OFFSET:
+        offt_strip_offset = static_cast<long>(sr.tell());
+        if (!sr.read4(&image.offset)) {
+          if (err) {
+            (*err) += "Failed to parse Compression Tag.\n";
+          }
+          return false;
+        }
+        // TINY_DNG_DPRINTF("strip_offset = %d\n", image.offset);
+        break;
+
+      case TAG_JPEG_IF_BYTE_COUNT:
+        if (!sr.read4(&image.jpeg_byte_count)) {
+          if (err) {
+            (*err) = "Failed to parse JpegIfByteCount Tag.\n";
+          }
+          return false;
+        }
+        break;
+
+      case TAG_ORIENTATION:
+        if (!sr.read2(&image.orientation)) {
+          if (err) {
+            (*err) = "Failed to parse Orientation Tag.\n";
+          }
+          return false;
+        }
+        break;
+
+      case TAG_STRIP_BYTE_COUNTS:
+        offt_strip_byte_counts = static_cast<long>(sr.tell());
+        if (!sr.read4(&image.strip_byte_count)) {
+          if (err) {
+            (*err) = "Failed to parse StripByteCount Tag.\n";
+          }
+          return false;
+        }
+        TINY_DNG_DPRINTF("strip_byte_count = %d\n", image.strip_byte_count);
+        break;
+
+      case TAG_PLANAR_CONFIGURATION:
+        if (!sr.read2(&image.planar_configuration)) {
+          if (err) {
+            (*err) = "Failed to parse PlanarConfiguration Tag.\n";
+          }
+          return false;
+        }
+        break;
+
+      case TAG_PREDICTOR:
+        if (!sr.read2(&image.predictor)) {
+          if (err) {
+            (*err) = "Failed to parse Predictor Tag.\n";
+          }
+          return false;
+        }
+
+        if ((image.predictor < 1) || (image.predictor > 3)) {
+          if (err) {
+            (*err) = "Predictor value must be 1, 2 or 3.\n";
+          }
+          return false;
+        }
+        break;
+
+      case TAG_SAMPLE_FORMAT: {
+        short format;
+        if (!sr.read2(&format)) {
+          if (err) {
+            (*err) = "Failed to parse SampleFormat.\n";
+          }
+          return false;
+        }
+
+        if ((format == SAMPLEFORMAT_INT) || (format == SAMPLEFORMAT_UINT) ||
+            (format == SAMPLEFORMAT_IEEEFP)) {
+          image.sample_format = static_cast<SampleFormat>(format);
+        }
+      } break;
+
+      case TAG_SUB_IFDS:
+
+      {
+        // TINY_DNG_DPRINTF("sub_ifds = %d\n", len);
+        for (size_t k = 0; k < len; k++) {
+          unsigned int i = static_cast<unsigned int>(sr.tell());
+          unsigned int offt;
+          if (!sr.read4(&offt)) {
+            if (err) {
+              (*err) += "Failed to parse SubIFDs Tag.\n";
+            }
+            return false;
+          }
+
+          unsigned int base = 0;  // @fixme
+          if (!sr.seek_set(offt + base)) {
+            if (err) {
+              (*err) += "Failed to seek to SubIFD Tag.\n";
+            }
+            return false;
+          }
+
+          // recursive call
+          if (call_depth > kMaxRecursiveIFDParse) {
+            if (err) {
+              (*err) += "Too many nested SUB_IFDS. Input DNG seems invalid or malcious.\n";
+            }
+            return false;
+          }
+
+          if (!ParseTIFFIFD(sr, custom_field_lists, images, warn, err, call_depth+1)) {
+            if (err) {
+              (*err) += "Failed to Parse SubIFD Tag.\n";
+            }
+            return false;
+          }
+
+          if (!sr.seek_set(i + 4)) {
+            if (err) {
+              (*err) += "Failed to rewind to SubIFD Tag position.\n";
+            }
+            return false;
+          }
+        }
+        // TINY_DNG_DPRINTF("sub_ifds DONE\n");
+      }
+
+      break;
+
+      case TAG_TILE_WIDTH:
+        if (!sr.read_uint(type,
+                          reinterpret_cast<unsigned int*>(&image.tile_width))) {
+          if (err) {
+            (*err) += "Failed to parse TileWidth Tag.\n";
+          }
+        }
+        // TINY_DNG_DPRINTF("tile_width = %d\n", image.tile_width);
+        break;
+
+      case TAG_TILE_LENGTH:
+        // TINY_DNG_DPRINTF("tile_length = %d\n", image.tile_length);
+        if (!sr.read_uint(
+                type, reinterpret_cast<unsigned int*>(&image.tile_length))) {
+          if (err) {
+            (*err) += "Failed to parse TileLength Tag.\n";
+          }
+        }
+        break;
+
+      case TAG_TILE_OFFSETS:
+        offt_tile_offsets = static_cast<long>(sr.tell());
+        num_tile_offsets = len;
+        tile_offsets_type = type;
+        if (len > 1) {
+          image.tile_offset = static_cast<unsigned int>(sr.tell());
+        } else {
+          if (!sr.read4(&image.tile_offset)) {
+            if (err) {
+              (*err) += "Failed to parse TileOffsets Tag.\n";
+            }
+          }
+        }
+        TINY_DNG_DPRINTF("tile_offt = %d\n", int(image.tile_offset));
+        break;
+
+      case TAG_TILE_BYTE_COUNTS:
+        offt_tile_byte_counts = static_cast<long>(sr.tell());
+        num_tile_byte_counts = len;
+        tile_byte_counts_type = type;
+        if (len > 1) {
+          image.tile_byte_count = static_cast<unsigned int>(sr.tell());
+        } else {
+          if (!sr.read4(&image.tile_byte_count)) {
+            if (err) {
+              (*err) += "Failed to parse TileByteCounts Tag.\n";
+            }
+          }
+        }
+        break;
+
+      case TAG_CFA_PATTERN_DIM: {
+        // rows, cols
+        short dim[2] = {2, 2};
+        if (!sr.read2(&dim[0]) || ((len > 1) && !sr.read2(&dim[1]))) {
+          if (err) {
+            (*err) = "Failed to parse CFA PatternDim Tag.\n";
+          }
+          return false;
+        }
+        if ((dim[0] < 1) || (dim[0] > 16) || (dim[1] < 1) || (dim[1] > 16)) {
+          if (err) {
+            (*err) = "Invalid CFARepeatPatternDim.\n";
+          }
+          return false;
+        }
+        image.cfa_pattern_dim = dim[0];
+        image.cfa_repeat_dim[0] = dim[0];
+        image.cfa_repeat_dim[1] = dim[1];
+      } break;
+
+      case TAG_CFA_PATTERN: {
+        unsigned char buf[256];
+        if ((len < 1) || (len > 256) ||
+            (sr.read(len, sizeof(buf), buf) != len)) {
+          if (err) {
+            (*err) = "Failed to parse CFA Pattern Tag.\n";
+          }
+          return false;
+        }
+
+        // CFARepeatPatternDim precedes CFAPattern. 2x2 is assumed for
+        // 4 items without the dimension.
+        int rows = image.cfa_repeat_dim[0];
+        int cols = image.cfa_repeat_dim[1];
+        if ((size_t(rows * cols) != len) && (len == 4)) {
+          rows = 2;
+          cols = 2;
+        }
+        if (size_t(rows * cols) != len) {
+          if (err) {
+            std::stringstream ss;
+            ss << "Length of CFA pattern(" << len
+               << ") does not match CFARepeatPatternDim(" << rows << " x "
+               << cols << ").\n";
+            (*err) = ss.str();
+          }
+          return false;
+        }
+        image.cfa_repeat_dim[0] = rows;
+        image.cfa_repeat_dim[1] = cols;
+        image.cfa_repeat_pattern.assign(buf, buf + len);
+        for (int y = 0; y < 2; y++) {
+          for (int x = 0; x < 2; x++) {
+            image.cfa_pattern[y][x] = buf[(y % rows) * cols + (x % cols)];
+          }
+        }
+      } break;
+
+      case TAG_DNG_VERSION: {
+        char data[4];
+        {
+          for (int i = 0; i < 4; i++) {
+            if (!sr.read1(&data[i])) {
+              if (err) {
+                (*err) += "Failed to parse DNGVersion Tag.\n";
+              }
+              return false;
+            }
+          }
+        }
+
+        image.version =
+            (data[3] << 24) | (data[2] << 16) | (data[1] << 8) | data[0];
+      } break;
+
+      case TAG_CFA_PLANE_COLOR: {
+        char buf[4];
+        size_t readLen = len;
+        if (readLen > 4) readLen = 4;
+
+        if (!sr.read(readLen, readLen, reinterpret_cast<unsigned char*>(buf))) {
+          if (err) {
+            (*err) += "Failed to parse CFALayout Tag.\n";
+          }
+          return false;
+        }
+
+        for (size_t i = 0; i < readLen; i++) {
+          image.cfa_plane_color[i] = buf[i];
+        }
+      } break;
+
+      case TAG_CFA_LAYOUT: {
+        if (!sr.read4(&image.cfa_layout)) {
+          if (err) {
+            (*err) += "Failed to parse CFALayout Tag.\n";
+          }
+          return false;
+        }
+      } break;
+
+      case TAG_ACTIVE_AREA: {
+
+        for (size_t c = 0; c < 4; c++) {
+          if (!sr.read_uint(type, reinterpret_cast<unsigned int*>(
+                                      &image.active_area[c]))) {
+            if (err) {
+              (*err) += "Failed to parse ActiveArea Tag.\n";
+            }
+            return false;
+          }
+        }
+
+        image.has_active_area = true;
+
+      }  break;
+
+      case TAG_PROFILE_NAME: {
+
+        size_t readLen = len;
+        if (readLen < 1) {
+          if (err) {
+            (*err) += "Null string for ProfileName Tag.\n";
+          }
+
+          return false;
+        }
+
+        const size_t kMaxNameSize = 1024 * 1024;
+
+        if (readLen > kMaxNameSize) {
+          if (err) {
+            (*err) += "The length of ProfileName string too large.\n";
+          }
+          return false;
+        }
+
+        std::vector<uint8_t> buf(readLen);  // readLen includes null char
+        if (!sr.read(readLen, readLen,
+                     reinterpret_cast<unsigned char*>(buf.data()))) {
+          if (err) {
+            (*err) += "Failed to parse ProfileName Tag.\n";
+          }
+          return false;
+        }
+
+        // TODO: Validate UTF-8 string.
+        image.profile_name = std::string(buf.begin(), buf.end());
+
+        TINY_DNG_DPRINTF("profile_name = %s\n", image.profile_name.c_str());
+
+      }  break;
+
+      case TAG_PROFILE_TONE_CURVE: {
+
+        TINY_DNG_DPRINTF("tone curve datalen = %d\n", len);
+
+        // len = samples * 2.
+        // It seems single channel tone curve only. 
+        if ((len % 2) != 0) {
+          if (err) {
+            (*err) += "Invalid data size for ProfileToneCurve Tag.\n";
+          }
+
+          return false;
+        }
+        size_t readLen = len * sizeof(float);
+
+        const size_t kMaxSamples = 1024 * 1024;
+
+        if (len > (kMaxSamples * 2)) {
+          if (err) {
+            (*err) += "The count of ProfileToneCurve too large.\n";
+          }
+          return false;
+        }
+
+        std::vector<float> buf(len);
+
+        for (size_t k = 0; k < len; k++) {
+          if (!sr.read_float(&buf[k])) {
+            if (err) {
+              (*err) += "Failed to parse ProfileToneCurve Tag.\n";
+            }
+            return false;
+          }
+        }
+
+        // TODO: Validate curve data.
+        image.profile_tone_curve = buf;
+
+        TINY_DNG_DPRINTF("profile_tone_curve.count = %d\n", int(image.profile_tone_curve.size()));
+
+      }  break;
+
+      case TAG_PROFILE_EMBED_POLICY: {
+        int policy;
+        if (!sr.read4(&policy)) {
+          if (err) {
+            (*err) += "Failed to parse ProfileEmbedPolicy Tag.\n";
+          }
+          return false;
+        }
+
+        if ((policy < 0) || (policy > 2)) {
+          if (err) {
+            (*err) += "ProfileEmbedPolicy value must be 0, 1 or 2.\n";
+          }
+          return false;
+        }
+
+        image.profile_embed_policy = policy;
+
+      } break;
+
+      case TAG_NOISE_PROFILE: {
+
+        TINY_DNG_DPRINTF("noise profile datalen = %d\n", len);
+
+        // DOUBLE * 2.
+        // or
+        // DOUBLE * 2 * colorPlanes
+
+        // It seems single channel tone curve only. 
+        if ((len % 2) != 0) {
+          if (err) {
+            (*err) += "Invalid data size for ProfileToneCurve Tag.\n";
+          }
+
+          return false;
+        }
+
+        if (len > 2) {
+          if ((image.samples_per_pixel < 1) || (image.samples_per_pixel > 4)) {
+            if (err) {
+              (*err) += "SamplesPerPixel Tag must exist before NoiseProfile Tag.\n";
+            }
+          }
+
+          if (len != (image.samples_per_pixel * 2)) {
+            if (err) {
+              (*err) += "Counts in NoisProfile must be 2 * SamplesPerPixel.\n";
+            }
+          }
+        }
+
+        const size_t kMaxSamples = 1024;
+
+        if (len > kMaxSamples) {
+          if (err) {
+            (*err) += "The count of NoiseProfile too large.\n";
+          }
+          return false;
+        }
+
+        std::vector<double> buf(len);
+
+        for (size_t k = 0; k < len; k++) {
+          if (!sr.read_double(&buf[k])) {
+            if (err) {
+              (*err) += "Failed to parse NoiseProfile Tag.\n";
+            }
+            return false;
+          }
+        }
+    
+        // TODO: Validate noise profile data.
+        image.noise_profile = buf;
+
+        TINY_DNG_DPRINTF("noise_profile.samples = %d\n", int(image.noise_profile.size()));
+
+      }  break;
+
+      case TAG_LINEARIZATION_TABLE: {
+        if ((len < 1) || (len > 65536)) {
+          if (err) {
+            (*err) += "Invalid count of LinearizationTable Tag.\n";
+          }
+          return false;
+        }
+        image.linearization_table.resize(len);
+        for (size_t s = 0; s < len; s++) {
+          unsigned int val = 0;
+          if (!sr.read_uint(type, &val) || (val > 65535)) {
+            if (err) {
+              (*err) += "Failed to parse LinearizationTable Tag.\n";
+            }
+            return false;
+          }
+          image.linearization_table[s] = static_cast<unsigned short>(val);
+        }
+      } break;
+
+      case TAG_BLACK_LEVEL_REPEAT_DIM: {
+        // rows, cols. An invalid tag is ignored(1x1) so that the image can
+        // still be loaded.
+        unsigned short dim[2] = {1, 1};
+        if ((len != 2) || !sr.read2(&dim[0]) || !sr.read2(&dim[1]) ||
+            (dim[0] < 1) || (dim[0] > 16) || (dim[1] < 1) || (dim[1] > 16)) {
+          if (warn) {
+            (*warn) += "Invalid BlackLevelRepeatDim Tag. Ignored.\n";
+          }
+          break;
+        }
+        image.black_level_repeat_dim[0] = dim[0];
+        image.black_level_repeat_dim[1] = dim[1];
+      } break;
+
+      case TAG_BLACK_LEVEL: {
+        // rows * cols * spp values of BlackLevelRepeatDim. The first spp
+        // values are also stored to `black_level`. When the count does not
+        // match BlackLevelRepeatDim, only `black_level` is read.
+        // Assume TAG_SAMPLES_PER_PIXEL and TAG_BLACK_LEVEL_REPEAT_DIM are read
+        // before(tags are sorted in the IFD).
+        // FIXME(syoyo): scan TAG_SAMPLES_PER_PIXEL in IFD table in advance.
+        if (len < 1) {
+          if (warn) {
+            (*warn) += "Invalid count of BlackLevel Tag. Ignored.\n";
+          }
+          break;
+        }
+        const size_t num_repeat =
+            size_t(image.black_level_repeat_dim[0]) *
+            size_t(image.black_level_repeat_dim[1]) *
+            size_t((std::max)(image.samples_per_pixel, 1));
+        const bool keep_repeat = (size_t(len) == num_repeat);
+        if (!keep_repeat && warn) {
+          std::stringstream ss;
+          ss << "Count of BlackLevel Tag(" << len
+             << ") does not match BlackLevelRepeatDim. Only the first "
+                "SamplesPerPixel values are used.\n";
+          (*warn) += ss.str();
+        }
+        const size_t num_values =
+            keep_repeat ? size_t(len)
+                        : (std::min)(size_t(len),
+                                     size_t((std::min)(
+                                         image.samples_per_pixel, 4)));
+        image.black_level_repeat.clear();
+        for (size_t s = 0; s < num_values; s++) {
+          double val = 0.0;
+          unsigned int ival = 0;
+          const bool ok = ((type == TYPE_RATIONAL) || (type == TYPE_SRATIONAL))
+                              ? sr.read_real(type, &val)
+                              : sr.read_uint(type, &ival);
+          if (!ok) {
+            if (err) {
+              (*err) += "Failed to parse BlackLevel Tag.\n";
+            }
+            return false;
+          }
+          if ((type != TYPE_RATIONAL) && (type != TYPE_SRATIONAL)) {
+            val = double(ival);
+          }
+          if (keep_repeat) {
+            image.black_level_repeat.push_back(float(val));
+          }
+          if (int(s) < (std::min)(image.samples_per_pixel, 4)) {
+            image.black_level[s] = int(val);
+          }
+        }
+      } break;
+
+      case TAG_BLACK_LEVEL_DELTA_H:
+      case TAG_BLACK_LEVEL_DELTA_V: {
+        std::vector<float>& delta = (tag == TAG_BLACK_LEVEL_DELTA_H)
+                                        ? image.black_level_delta_h
+                                        : image.black_level_delta_v;
+        delta.clear();
+        for (size_t s = 0; s < len; s++) {
+          double val;
+          if (!sr.read_real(type, &val)) {
+            if (err) {
+              (*err) += "Failed to parse BlackLevelDeltaH/V Tag.\n";
+            }
+            return false;
+          }
+          delta.push_back(float(val));
+        }
+      } break;
+
+      case TAG_WHITE_LEVEL: {
+        // Assume TAG_SAMPLES_PER_PIXEL is read before
+        // FIXME(syoyo): scan TAG_SAMPLES_PER_PIXEL in IFD table in advance.
+        for (int s = 0; s < image.samples_per_pixel; s++) {
+          if (!sr.read_uint(type, reinterpret_cast<unsigned int*>(
+                                      &image.white_level[s]))) {
+            if (err) {
+              (*err) += "Failed to parse WhiteLevel Tag.\n";
+            }
+            return false;
+          }
+        }
+      } break;
+
+      case TAG_ANALOG_BALANCE:
+        // Assume RGB
+        if (!sr.read_real(type, &image.analog_balance[0])) {
+          if (err) {
+            (*err) += "Failed to parse analog balance.\n";
+          }
+          return false;
+        }
+        if (!sr.read_real(type, &image.analog_balance[1])) {
+          if (err) {
+            (*err) += "Failed to parse analog balance.\n";
+          }
+          return false;
+        }
+        if (!sr.read_real(type, &image.analog_balance[2])) {
+          if (err) {
+            (*err) += "Failed to parse analog balance.\n";
+          }
+          return false;
+        }
+
+        image.has_analog_balance = true;
+        break;
+
+      case TAG_AS_SHOT_NEUTRAL:
+        // Assume RGB
+        // TINY_DNG_DPRINTF("ty = %d\n", type);
+        for (size_t c = 0; c < 3; c++) {
+          if (!sr.read_real(type, &image.as_shot_neutral[c])) {
+            if (err) {
+              (*err) += "Failed to parse AsShotNeutral Tag.\n";
+            }
+            return false;
+          }
+        }
+
+        image.has_as_shot_neutral = true;
+        break;
+
+      case TAG_CALIBRATION_ILLUMINANT1: {
+        unsigned short val;
+        if (!sr.read2(&val)) {
+          if (err) {
+            (*err) += "Failed to parse CalibrartionIlluminant1 Tag.\n";
+          }
+          return false;
+        }
+
+        image.calibration_illuminant1 = static_cast<LightSource>(val);
+      } break;
+
+      case TAG_CALIBRATION_ILLUMINANT2: {
+        unsigned short val;
+        if (!sr.read2(&val)) {
+          if (err) {
+            (*err) += "Failed to parse CalibrartionIlluminant2 Tag.\n";
+          }
+          return false;
+        }
+        image.calibration_illuminant2 = static_cast<LightSource>(val);
+      } break;
+
+      case TAG_COLOR_MATRIX1: {
+        for (int c = 0; c < 3; c++) {
+          for (int k = 0; k < 3; k++) {
+            double val;
+            if (!sr.read_real(type, &val)) {
+              if (err) {
+                (*err) += "Failed to parse ColorMatrix1 Tag.\n";
+              }
+              return false;
+            }
+
+            image.color_matrix1[c][k] = val;
+          }
+        }
+        image.has_color_matrix1 = true;
+      } break;
+
+      case TAG_COLOR_MATRIX2: {
+        for (int c = 0; c < 3; c++) {
+          for (int k = 0; k < 3; k++) {
+            double val;
+            if (!sr.read_real(type, &val)) {
+              if (err) {
+                (*err) += "Failed to parse ColorMatrix2 Tag.\n";
+              }
+              return false;
+            }
+            image.color_matrix2[c][k] = val;
+          }
+        }
+        image.has_color_matrix2 = true;
+      } break;
+
+      case TAG_FORWARD_MATRIX1: {
+        for (int c = 0; c < 3; c++) {
+          for (int k = 0; k < 3; k++) {
+            double val;
+            if (!sr.read_real(type, &val)) {
+              if (err) {
+                (*err) += "Failed to parse ForwardMatrix1 Tag.\n";
+              }
+              return false;
+            }
+            image.forward_matrix1[c][k] = val;
+          }
+        }
+        image.has_forward_matrix1 = true;
+      } break;
+
+      case TAG_FORWARD_MATRIX2: {
+        for (int c = 0; c < 3; c++) {
+          for (int k = 0; k < 3; k++) {
+            double val;
+            if (!sr.read_real(type, &val)) {
+              if (err) {
+                (*err) += "Failed to parse ForwardMatrix2 Tag.\n";
+              }
+              return false;
+            }
+            image.forward_matrix2[c][k] = val;
+          }
+        }
+        image.has_forward_matrix2 = true;
+      } break;
+
+      case TAG_CAMERA_CALIBRATION1: {
+        for (int c = 0; c < 3; c++) {
+          for (int k = 0; k < 3; k++) {
+            double val;
+            if (!sr.read_real(type, &val)) {
+              if (err) {
+                (*err) += "Failed to parse CameraCalibration1 Tag.\n";
+              }
+              return false;
+            }
+            image.camera_calibration1[c][k] = val;
+          }
+        }
+      } break;
+
+      case TAG_CAMERA_CALIBRATION2: {
+        for (int c = 0; c < 3; c++) {
+          for (int k = 0; k < 3; k++) {
+            double val;
+            if (!sr.read_real(type, &val)) {
+              if (err) {
+                (*err) += "Failed to parse CameraCalibration2 Tag.\n";
+              }
+              return false;
+            }
+            image.camera_calibration2[c][k] = val;
+          }
+        }
+      } break;
+
+      case TAG_CR2_SLICES: {
+        // Assume 3 ushorts;
+        for (size_t c = 0; c < 3; c++) {
+          if (!sr.read2(&image.cr2_slices[c])) {
+            if (err) {
+              (*err) += "Failed to parse CR2Slices Tag.\n";
+            }
+            return false;
+          }
+        }
+        // TINY_DNG_DPRINTF("cr2_slices = %d, %d, %d\n",
+        //  image.cr2_slices[0],
+        //  image.cr2_slices[1],
+        //  image.cr2_slices[2]);
+      } break;
+
+      case TAG_SEMANTIC_NAME: {
+        size_t readLen = len;
+        if (readLen < 1) {
+          if (err) {
+            (*err) += "Null string for SemanticName Tag.\n";
+          }
+
+          return false;
+        }
+
+        const size_t kMaxNameSize = 1024 * 1024;
+
+        if (readLen > kMaxNameSize) {
+          if (err) {
+            (*err) += "The length of SemanticName string too large.\n";
+          }
+          return false;
+        }
+
+        std::vector<uint8_t> buf(readLen);  // readLen includes null char
+        if (!sr.read(readLen, readLen,
+                     reinterpret_cast<unsigned char*>(buf.data()))) {
+          if (err) {
+            (*err) += "Failed to parse SemanticName Tag.\n";
+          }
+          return false;
+        }
+
+        image.semantic_name = std::string(buf.begin(), buf.end());
+
+        TINY_DNG_DPRINTF("semantic_name = %s\n", image.semantic_name.c_str());
+      } break;
+
+      case TAG_OPCODE_LIST1:
+      case TAG_OPCODE_LIST2:
+      case TAG_OPCODE_LIST3: {
+        const size_t kMaxOpcodeDataSize = 1024*1024*256;
+
+        TINY_DNG_DPRINTF("opcodelist %d\n", tag);
+        size_t readLen = len;
+        if (readLen < 1) {
+          if (err) {
+            (*err) += "Empty data for OpCodeList Tag.\n";
+          }
+
+          return false;
+        }
+
+        if (readLen > kMaxOpcodeDataSize) {
+          if (err) {
+            (*err) += "OpCodeList data too large.\n";
+          }
+
+          return false;
+        }
+        std::vector<uint8_t> buf(readLen);
+        if (!sr.read(readLen, readLen,
+                     reinterpret_cast<unsigned char*>(buf.data()))) {
+          if (err) {
+            (*err) += "Failed to read OpCodeList data.\n";
+          }
+          return false;
+        }
+
+        std::vector<GainMap> *gainmaps = NULL;
+        std::vector<Opcode> *opcodes = NULL;
+        if (tag == TAG_OPCODE_LIST1) {
+          gainmaps = &image.opcodelist1_gainmap;
+          opcodes = &image.opcodelist1;
+        } else if (tag == TAG_OPCODE_LIST2) {
+          gainmaps = &image.opcodelist2_gainmap;
+          opcodes = &image.opcodelist2;
+        } else if (tag == TAG_OPCODE_LIST3) {
+          gainmaps = &image.opcodelist3_gainmap;
+          opcodes = &image.opcodelist3;
+        }
+
+        if (!ParseOpcodeList(tag, buf.data(), buf.size(), gainmaps, opcodes)) {
+          if (err) {
+            (*err) += "Failed to parse OpCodeList Tag.\n";
+          }
+          return false;
+        }
+
+        TINY_DNG_DPRINTF("opcodelist %d, dataLen = %d\n", tag, int(readLen));
+
+      } break;
+
+      default: {
+        FieldData data;
+        int ret = ParseCustomField(sr, custom_field_lists, tag, type, len,
+                                   &data, err);
+        if (ret == -1) {
+          return false;
+        }
+
+        if (ret > 0) {
+          image.custom_fields.push_back(data);
+        }
+        // TINY_DNG_DPRINTF("unknown or unsupported tag = %d\n", tag);
+      }
+    }
+
+    sr.seek_set(saved_offt);
+  }
+
+  if (image.rows_per_strip > 0) {
+    if (image.height == -1) {
+      if (err) {
+        (*err) = "image height tag is required to compute StripsPerImage.\n";
+      }
+      return false;
+    }
+
+    // http://www.awaresystems.be/imaging/tiff/tifftags/rowsperstrip.html
+    image.strips_per_image =
+        static_cast<int>(floor(double(image.height + image.rows_per_strip - 1) /
+                               double(image.rows_per_strip)));
+    TINY_DNG_DPRINTF("rows_per_strip = %d\n", image.samples_per_pixel);
+    TINY_DNG_DPRINTF("strips_per_image = %d\n", image.strips_per_image);
+  }
+
+  // Delayed read of strip offsets and strip byte counts
+  if (image.strips_per_image > 0) {
+    image.strip_byte_counts.clear();
+    image.strip_offsets.clear();
+
+    long curr_offt = static_cast<long>(sr.tell());
+
+    if (offt_strip_byte_counts > 0) {
+      if (!sr.seek_set(uint64_t(offt_strip_byte_counts))) {
+        if (err) {
+          (*err) = "Failed to seek.\n";
+        }
+        return false;
+      }
+
+      for (int k = 0; k < image.strips_per_image; k++) {
+        unsigned int strip_byte_count;
+        if (!sr.read4(&strip_byte_count)) {
+          if (err) {
+            (*err) += "Failed to read StripByteCount value.\n";
+          }
+          return false;
+        }
+        TINY_DNG_DPRINTF("strip_byte_counts[%d] = %u\n", k, strip_byte_count);
+        image.strip_byte_counts.push_back(strip_byte_count);
+      }
+    }
+
+    if (offt_strip_offset > 0) {
+      if (!sr.seek_set(uint64_t(offt_strip_offset))) {
+        if (err) {
+          (*err) = "Failed to seek.\n";
+        }
+        return false;
+      }
+
+      for (int k = 0; k < image.strips_per_image; k++) {
+        unsigned int strip_offset;
+        if (!sr.read4(&strip_offset)) {
+          if (err) {
+            (*err) += "Failed to read StripOffset value.\n";
+          }
+          return false;
+        }
+
+        TINY_DNG_DPRINTF("strip_offset[%d] = %u\n", k, strip_offset);
+        image.strip_offsets.push_back(strip_offset);
+      }
+    }
+
+    if (!sr.seek_set(uint64_t(curr_offt))) {
+      if (err) {
+        (*err) = "Failed to seek.\n";
+      }
+      return false;
+    }
+  }
+
+  // Delayed read of tile offsets and tile byte counts
+  if ((offt_tile_offsets > 0) && (num_tile_offsets > 0)) {
+    image.tile_offsets.clear();
+    image.tile_byte_counts.clear();
+
+    // Each entry takes at least 2 bytes(SHORT).
+    if ((size_t(num_tile_offsets) * 2 > sr.size()) ||
+        (size_t(num_tile_byte_counts) * 2 > sr.size())) {
+      if (err) {
+        (*err) += "The number of TileOffsets or TileByteCounts too large.\n";
+      }
+      return false;
+    }
+
+    long curr_offt = static_cast<long>(sr.tell());
+
+    if (!sr.seek_set(uint64_t(offt_tile_offsets))) {
+      if (err) {
+        (*err) += "Failed to seek to TileOffsets.\n";
+      }
+      return false;
+    }
+
+    for (unsigned int k = 0; k < num_tile_offsets; k++) {
+      unsigned int tile_offset;
+      if (!sr.read_uint(tile_offsets_type, &tile_offset)) {
+        if (err) {
+          (*err) += "Failed to read TileOffsets value.\n";
+        }
+        return false;
+      }
+      image.tile_offsets.push_back(tile_offset);
+    }
+
+    if ((offt_tile_byte_counts > 0) && (num_tile_byte_counts > 0)) {
+      if (!sr.seek_set(uint64_t(offt_tile_byte_counts))) {
+        if (err) {
+          (*err) += "Failed to seek to TileByteCounts.\n";
+        }
+        return false;
+      }
+
+      for (unsigned int k = 0; k < num_tile_byte_counts; k++) {
+        unsigned int tile_byte_count;
+        if (!sr.read_uint(tile_byte_counts_type, &tile_byte_count)) {
+          if (err) {
+            (*err) += "Failed to read TileByteCounts value.\n";
+          }
+          return false;
+        }
+        image.tile_byte_counts.push_back(tile_byte_count);
+      }
+    }
+
+    TINY_DNG_DPRINTF("tile_offsets = %d, tile_byte_counts = %d\n",
+                     int(image.tile_offsets.size()),
+                     int(image.tile_byte_counts.size()));
+
+    if (!sr.seek_set(uint64_t(curr_offt))) {
+      if (err) {
+        (*err) = "Failed to seek.\n";
+      }
+      return false;
+    }
+  }
+  //
+
+  // Add to images.
+  if (images->size() < kMaxImages) {
+    images->push_back(image);
+  } else {
+    if (warn) {
+      (*warn) = "Too many images in one DNG file. Skipped some images\n";
+    }
+  }
+
+  // TINY_DNG_DPRINTF("DONE ---------\n");
+
+  return true;
+}
+
+static bool ParseDNGFromMemory(const StreamReader& sr,
+                               const std::vector<FieldInfo>& custom_fields,
+                               std::vector<tinydng::DNGImage>* images,
+                               std::string* warn, std::string* err) {
+  if (!images) {
+    if (err) {
+      (*err) += "Invalid `images` argument.\n";
+    }
+    return false;
+  }
+
+  unsigned int offt;
+  if (!sr.read4(&offt)) {
+    if (err) {
+      (*err) += "Failed to read offset.\n";
+    }
+    return false;
+  }
+
+  TINY_DNG_DPRINTF("First IFD offt: %d\n", offt);
+
+  size_t count = 0;
+
+  while (offt) {
+    if (!sr.seek_set(offt)) {
+      if (err) {
+        (*err) += "Failed to seek to TIFF IFD.\n";
+      }
+      return false;
+    }
+
+    // TINY_DNG_DPRINTF("Parse TIFF IFD\n");
+    if (!ParseTIFFIFD(sr, custom_fields, images, warn, err)) {
+      break;
+    }
+    // Get next IFD offset(0 = end of file).
+    if (!sr.read4(&offt)) {
+      if (err) {
+        (*err) += "Failed to read next IDF offset.\n";
+      }
+      return false;
+    }
+
+    TINY_DNG_DPRINTF("Next IFD offset = %d\n", offt);
+
+    // Avoid infinite loop
+    count++;
+    if (count > kMaxImages) {
+      if (warn) {
+        (*warn) += "Too many IFDs. IFD offset seems invalid.\n";
+      }
+      break;
+    }
+  }
+
+  return true;
+}
+
+static bool IsBigEndian() {
+  uint32_t i = 0x01020304;
+  char c[4];
+  memcpy(c, &i, 4);
+  return (c[0] == 1);
+}
+
+// C++03 and tiff lzw port of https://github.com/glampert/compression-algorithms
+// =============================================================================
+//
+// File: lzw.hpp
+// Author: Guilherme R. Lampert
+// Created on: 17/02/16
+// Brief: LZW encoder/decoder in C++11 with varying length dictionary codes.
+//
+#ifdef __clang__
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+#endif
+namespace lzw {
+
+class Dictionary {
+ public:
+  struct Entry {
+    int code;
+    int value;
+  };
+
+  // Dictionary entries 0-255 are always reserved to the byte/ASCII range.
+  int size_;
+  Entry entries_[4096];
+
+  Dictionary();
+  int findIndex(int code, int value) const;
+  bool add(int code, int value);
+  bool flush(int& codeBitsWidth);
+  void init();
+  int size() { return size_; }
+};
+
+// ========================================================
+// class Dictionary:
+// ========================================================
+
+Dictionary::Dictionary() { init(); }
+
+void Dictionary::init() {
+  // First 256 dictionary entries are reserved to the byte/ASCII
+  // range. Additional entries follow for the character sequences
+  // found in the input. Up to 4096 - 256 (MaxDictEntries - FirstCode).
+  size_ = 256;
+  for (int i = 0; i < size_; ++i) {
+    entries_[i].code = -1;
+    entries_[i].value = i;
+  }
+
+  // 256 is reserved for ClearCode, 257 is reserved for end of stream, thus
+  // FistCode starts with 258
+  size_ = 258;  // = 256 + 2
+}
 
-  // TODO: Clip image data range according with `tag`
-  (void)tag;
+int Dictionary::findIndex(const int code, const int value) const {
+  if (code == -1) {
+    return value;
+  }
 
-  if (dataSize <= (4 * 5)) {
-    // Too small
+  // Linear search for now.
+  // TODO: Worth optimizing with a proper hash-table?
+  for (int i = 0; i < size_; ++i) {
+    if (entries_[i].code == code && entries_[i].value == value) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+bool Dictionary::add(const int code, const int value) {
+  //TINY_DNG_ASSERT(code <= size_,
+  //                "`code' must be less than or equal to dictionary size.");
+  TINY_DNG_CHECK_AND_RETURN_C(code <= size_, false);
+  if (size_ == 4096) {
+    TINY_DNG_DPRINTF("Dictionary overflowed!");
     return false;
   }
 
-  bool swap_endian = !IsBigEndian();
-  StreamReader sr(data, dataSize, swap_endian);
+  TINY_DNG_DPRINTF("add[%d].code = %d\n", size_, code);
+  TINY_DNG_DPRINTF("add[%d].value = %d\n", size_, value);
+  entries_[size_].code = code;
+  entries_[size_].value = value;
+  ++size_;
+  return true;
+}
 
-  uint32_t num_opcodes = 0;
+bool Dictionary::flush(int& codeBitsWidth) {
+  if (size_ == ((1 << codeBitsWidth) - 1)) {
+    ++codeBitsWidth;
+    TINY_DNG_DPRINTF("expand: bits %d\n", codeBitsWidth);
+    if (codeBitsWidth > 12)  // MaxDictBits
+    {
+      // Clear the dictionary (except the first 256 byte entries).
+      codeBitsWidth = 9;  // StartBits
+      size_ = 256 + 2;    // 256 is reserved for ClearCode, 257 is reserved for
+                          // end of stream, thus FistCode starts with 258
+      return true;
+    }
+  }
+  return false;
+}
 
-  if (!sr.read4(&num_opcodes)) {
-    return false;
+class BitStreamReader {
+ public:
+  // No copy/assignment.
+  // BitStreamReader(const BitStreamReader &) = delete;
+  // BitStreamReader & operator = (const BitStreamReader &) = delete;
+
+  // BitStreamReader(const BitStreamWriter & bitStreamWriter);
+  BitStreamReader(const uint8_t* bitStream, size_t byteCount,
+                  size_t bitCount);
+
+  bool isEndOfStream() const;
+  bool readNextBitLE(int& bitOut);       // little endian
+  bool readNextBitBE(int& bitOut);       // big endian
+  uint64_t readBitsU64LE(int bitCount);  // little endian
+  uint64_t readBitsU64BE(int bitCount);  // big endian
+  void reset();
+
+ private:
+  const uint8_t*
+      stream;  // Pointer to the external bit stream. Not owned by the reader.
+  const size_t
+      sizeInBytes;  // Size of the stream *in bytes*. Might include padding.
+  const size_t
+      sizeInBits;      // Size of the stream *in bits*, padding *not* include.
+  size_t currBytePos;  // Current byte being read in the stream.
+  int nextBitPos;  // Bit position within the current byte to access next. 0 to
+                   // 7.
+  size_t numBitsRead;  // Total bits read from the stream so far. Never
+                       // includes byte-rounding padding.
+};
+
+// BitStreamReader::BitStreamReader(const BitStreamWriter & bitStreamWriter)
+//    : stream(bitStreamWriter.getBitStream())
+//    , sizeInBytes(bitStreamWriter.getByteCount())
+//    , sizeInBits(bitStreamWriter.getBitCount())
+//{
+//    reset();
+//}
+
+BitStreamReader::BitStreamReader(const unsigned char* bitStream,
+                                 const size_t byteCount, const size_t bitCount)
+    : stream(bitStream),
+      sizeInBytes(byteCount),
+      // Never read past the end of the stream.
+      sizeInBits((std::min)(bitCount, byteCount * 8)) {
+  reset();
+}
+
+bool BitStreamReader::readNextBitLE(int& bitOut) {
+  if (numBitsRead >= sizeInBits) {
+    return false;  // We are done.
   }
 
-  const size_t kMaxNumOpcodes = 16;
-  if (num_opcodes > kMaxNumOpcodes) {
-    // too many opcodes.
-    return false;
+  const uint32_t mask = uint32_t(1) << nextBitPos;
+  bitOut = !!(stream[currBytePos] & mask);
+  ++numBitsRead;
+
+  if (++nextBitPos == 8) {
+    nextBitPos = 0;
+    ++currBytePos;
   }
+  return true;
+}
 
-  //TINY_DNG_DPRINTF("# of opcodes = %d\n", num_opcodes);
+bool BitStreamReader::readNextBitBE(int& bitOut) {
+  if (numBitsRead >= sizeInBits) {
+    return false;  // We are done.
+  }
 
-  for (size_t i = 0; i < num_opcodes; i++) {
-    uint32_t opcode_id = 0;
-    uint32_t dng_version = 0;
-    uint32_t flags = 0;
-    uint32_t num_bytes = 0;
+  const uint32_t mask = uint32_t(1) << (7 - nextBitPos);
+  bitOut = !!(stream[currBytePos] & mask);
+  ++numBitsRead;
 
-    if (!sr.read4(&opcode_id)) {
-      return false;
-    }
-    if (!sr.read4(&dng_version)) {
-      return false;
-    }
-    if (!sr.read4(&flags)) {
-      return false;
-    }
-    if (!sr.read4(&num_bytes)) {
-      return false;
+  if (++nextBitPos == 8) {
+    nextBitPos = 0;
+    ++currBytePos;
+  }
+  return true;
+}
+
+uint64_t BitStreamReader::readBitsU64LE(const int bitCount) {
+  //TINY_DNG_ASSERT(bitCount <= 64,
+  //                "`bitCount' must be less than or equal to 64.");
+  TINY_DNG_CHECK_AND_RETURN_C(bitCount <= 64, 0);
+
+  uint64_t num = 0;
+  for (int b = 0; b < bitCount; ++b) {
+    int bit;
+    if (!readNextBitLE(bit)) {
+      TINY_DNG_DPRINTF(
+          "LE: Failed to read bits from stream! Unexpected end.\n");
+      break;
     }
 
-    TINY_DNG_DPRINTF("opcode %d, dng ver %d, flags %d, num_bytes %d\n", opcode_id, dng_version, flags, num_bytes);
+    // Based on a "Stanford bit-hack":
+    // http://graphics.stanford.edu/~seander/bithacks.html#ConditionalSetOrClearBitsWithoutBranching
+    const uint64_t mask = uint64_t(1) << b;
+    num = (num & ~mask) | (uint64_t(-bit) & mask);
+  }
 
-    if (num_bytes < 4) {
-      return false;
+  return num;
+}
+
+uint64_t BitStreamReader::readBitsU64BE(const int bitCount) {
+  //TINY_DNG_ASSERT(bitCount <= 64,
+  //                "`bitCount' must be less than or equal to 64.");
+  TINY_DNG_CHECK_AND_RETURN_C(bitCount <= 64, 0);
+
+  uint64_t num = 0;
+  for (int b = 0; b < bitCount; ++b) {
+    int bit;
+    if (!readNextBitBE(bit)) {
+      TINY_DNG_DPRINTF("BE: Failed to read bits from stream! Unexpected end.");
+      break;
     }
 
-    if (opcode_id == OPCODE_LIST_GAIN_MAP) {
-      const size_t kMaxItems = 1024*1024;
+    TINY_DNG_DPRINTF("bit[%d](count %d) = %d\n", b, bitCount, bit);
 
-      uint32_t saved_loc = uint32_t(sr.tell());
+    // Based on a "Stanford bit-hack":
+    // http://graphics.stanford.edu/~seander/bithacks.html#ConditionalSetOrClearBitsWithoutBranching
+    const uint64_t mask = uint64_t(1) << (bitCount - b - 1);
+    num = (num & ~mask) | (uint64_t(-bit) & mask);
+  }
 
-      // Top, Left, Bottom, Right, Plane, Planes, RowPitch, ColPitch, MapPointsV, MapPointsH (LONG)
-      // MapSpacingV, MapSpacingH, MapOriginV, MapOriginH (DOUBLE)
-      // MapPlanes (LONG)
-      // For each MapPointsV
-      //   For each MapPointsH
-      //     For each MapPlanes
-      //       MapGain (FLOAT)
+  TINY_DNG_DPRINTF("num = %d\n", int(num));
+  return num;
+}
 
-      uint32_t top, left, bottom, right, plane, planes, row_pitch, col_pitch, map_points_v, map_points_h;
-      double map_spacing_v, map_spacing_h, map_origin_v, map_origin_h;
-      uint32_t map_planes;
+void BitStreamReader::reset() {
+  currBytePos = 0;
+  nextBitPos = 0;
+  numBitsRead = 0;
+}
 
-      if (!sr.read4(&top)) {
-        return false;
-      }
+bool BitStreamReader::isEndOfStream() const {
+  return numBitsRead >= sizeInBits;
+}
 
-      if (!sr.read4(&left)) {
-        return false;
-      }
+// ========================================================
+// easyDecode() and helpers:
+// ========================================================
 
-      if (!sr.read4(&bottom)) {
-        return false;
-      }
+static bool outputByte(int code, unsigned char*& output,
+                       size_t outputSizeBytes, size_t& bytesDecodedSoFar) {
+  if (bytesDecodedSoFar >= outputSizeBytes) {
+    // LZW_ERROR("Decoder output buffer too small!");
+    return false;
+  }
 
-      if (!sr.read4(&right)) {
-        return false;
-      }
+  //TINY_DNG_ASSERT(code >= 0 && code < 256, "`code' must be within [0, 255].");
+  TINY_DNG_CHECK_AND_RETURN_C(code >= 0 && code < 256, false);
+  *output++ = static_cast<unsigned char>(code);
+  ++bytesDecodedSoFar;
+  return true;
+}
 
-      if (!sr.read4(&plane)) {
-        return false;
-      }
+static bool outputSequence(const Dictionary& dict, int code,
+                           unsigned char*& output, size_t outputSizeBytes,
+                           size_t& bytesDecodedSoFar, int& firstByte) {
+  const int MaxDictEntries = 4096;
+  (void)MaxDictEntries;
+
+  // A sequence is stored backwards, so we have to write
+  // it to a temp then output the buffer in reverse.
+  int i = 0;
+  unsigned char sequence[4096];
+  do {
+    //TINY_DNG_ASSERT(i < MaxDictEntries - 1 && code >= 0,
+    //                "Invalid value for `i' or `code'.");
+    TINY_DNG_CHECK_AND_RETURN_C(i < MaxDictEntries - 1 && code >= 0, false);
+    TINY_DNG_DPRINTF("i = %d, ent[%d].value = %d\n", i, code,
+                     dict.entries_[code].value);
+    sequence[i++] = static_cast<unsigned char>(dict.entries_[code].value);
+    code = dict.entries_[code].code;
+  } while (code >= 0);
 
-      if (!sr.read4(&planes)) {
-        return false;
-      }
+  firstByte = sequence[--i];
+  for (; i >= 0; --i) {
+    if (!outputByte(sequence[i], output, outputSizeBytes, bytesDecodedSoFar)) {
+      return false;
+    }
+  }
+  return true;
+}
 
-      if (!sr.read4(&row_pitch)) {
-        return false;
-      }
+// Returns the number of decoded bytes. 0 on failure.
+// TIFF LZW codes are packed MSB first regardless of the byte order of the
+// file.
+static size_t easyDecode(const unsigned char* compressed,
+                         const size_t compressedSizeBytes,
+                         const size_t compressedSizeBits,
+                         unsigned char* uncompressed,
+                         const size_t uncompressedSizeBytes) {
+  const int Nil = -1;
+  const int MaxDictBits = 12;
+  const int StartBits = 9;
 
-      if (!sr.read4(&col_pitch)) {
-        return false;
-      }
+  // TIFF specific values
+  const int ClearCode = 256;
+  const int EndOfInformation = 257;
 
-      if (!sr.read4(&map_points_v)) {
-        return false;
-      }
+  if (compressed == NULL || uncompressed == NULL) {
+    TINY_DNG_DPRINTF("lzw::easyDecode(): Null data pointer(s)!\n");
+    return 0;
+  }
 
-      if (!sr.read4(&map_points_h)) {
-        return false;
-      }
+  if (compressedSizeBytes == 0 || compressedSizeBits == 0 ||
+      uncompressedSizeBytes == 0) {
+    TINY_DNG_DPRINTF("lzw::easyDecode(): Bad in/out sizes!n");
+    return 0;
+  }
 
-      if (!sr.read_double(&map_spacing_v)) {
-        return false;
-      }
+  int code = Nil;
+  int prevCode = Nil;
+  int firstByte = 0;
+  size_t bytesDecoded = 0;
+  int codeBitsWidth = StartBits;
 
-      if (!sr.read_double(&map_spacing_h)) {
-        return false;
-      }
+  // We'll reconstruct the dictionary based on the
+  // bit stream codes. Unlike Huffman encoding, we
+  // don't store the dictionary as a prefix to the data.
+  Dictionary dictionary;
+  BitStreamReader bitStream(compressed, compressedSizeBytes,
+                            compressedSizeBits);
 
-      if (!sr.read_double(&map_origin_v)) {
-        return false;
-      }
+  // We check to avoid an overflow of the user buffer.
+  // If the buffer is smaller than the decompressed size,
+  // TINY_DNG_DPRINTF() is called. If that doesn't throw or
+  // terminate we break the loop and return the current
+  // decompression count.
+  while (!bitStream.isEndOfStream()) {
+    //TINY_DNG_ASSERT(
+    //    codeBitsWidth <= MaxDictBits,
+    //    "`codeBitsWidth must be less than or equal to `MaxDictBits'.");
+    TINY_DNG_CHECK_AND_RETURN_C(codeBitsWidth <= MaxDictBits, 0);
+    (void)MaxDictBits;
 
-      if (!sr.read_double(&map_origin_h)) {
-        return false;
-      }
+    code = static_cast<int>(bitStream.readBitsU64BE(codeBitsWidth));
 
-      if (!sr.read4(&map_planes)) {
-        return false;
-      }
+    TINY_DNG_DPRINTF("code = %d\n", code);
 
-      size_t num_items = map_points_v * map_points_h * map_planes;
+    // if (code >= dictionary.size()) {
+    //  std::cerr << "code = " << code << "dict.size = " << dictionary.size() <<
+    //  std::endl;
+    //}
 
-      //TINY_DNG_DPRINTF("top %d, left %d, bottom %d, right %d\n", top, left, bottom, right);
-      //TINY_DNG_DPRINTF("plane %d, planes %d\n", plane, planes);
-      //TINY_DNG_DPRINTF("row_pitch %d, col_pitch %d\n", row_pitch, col_pitch);
-      //TINY_DNG_DPRINTF("map_points_v %d, map_points_h %d\n", map_points_v, map_points_h);
-      //TINY_DNG_DPRINTF("map_spacing_v %f, map_spacing_h %f\n", map_spacing_v, map_spacing_h);
-      //TINY_DNG_DPRINTF("map_origin_v %f, map_origin_h %f\n", map_origin_v, map_origin_h);
-      //TINY_DNG_DPRINTF("map_planes %d\n", map_planes);
-      //TINY_DNG_DPRINTF("num_items %d\n", int(num_items));
+    // TINY_DNG_ASSERT(code <= dictionary.size(),
+    //                "`code' must be less than or equal to dictionary size.");
 
-      // Read gain values.
+    if (code == EndOfInformation) {
+      TINY_DNG_DPRINTF("EoI\n");
+      break;
+    }
 
-      if (num_items > kMaxItems) {
-        return false;
-      }
+    if (code == ClearCode) {
+      // Initialize dict.
+      dictionary.init();
+      codeBitsWidth = StartBits;
 
-      std::vector<float> gainmap_pixels(num_items);
-      for (size_t k = 0; k < num_items; k++) {
+      code = static_cast<int>(bitStream.readBitsU64BE(codeBitsWidth));
 
-        if (!sr.read_float(&gainmap_pixels[k])) {
-          return false;
-        }
+      if (code == EndOfInformation) {
+        TINY_DNG_DPRINTF("EoI\n");
+        break;
+      }
 
-        //TINY_DNG_DPRINTF("values = %f\n", double(gainmap_pixels[k]));
+      if (!outputByte(code, uncompressed, uncompressedSizeBytes,
+                      bytesDecoded)) {
+        break;
       }
 
-      GainMap gmap;
-      gmap.idx = (tag - TAG_OPCODE_LIST1) + 1;
-      //TINY_DNG_DPRINTF("idx = %d\n", gmap.idx);
-      gmap.top = top;
-      gmap.left = left;
-      gmap.bottom = bottom;
-      gmap.right = right;
-      gmap.plane = plane;
-      gmap.planes = planes;
-      gmap.row_pitch = row_pitch;
-      gmap.col_pitch = col_pitch;
-      gmap.map_points_v = map_points_v;
-      gmap.map_points_h = map_points_h;
-      gmap.map_origin_v = map_origin_v;
-      gmap.map_origin_h = map_origin_h;
-      gmap.map_spacing_v = map_spacing_v;
-      gmap.map_spacing_h = map_spacing_h;
-      gmap.map_planes = map_planes;
-      gmap.pixels = gainmap_pixels;
+      prevCode = code;
+      continue;
+    }
 
-      gainmaps_out->push_back(gmap);
+    if (prevCode == Nil) {
+      if (!outputByte(code, uncompressed, uncompressedSizeBytes,
+                      bytesDecoded)) {
+        break;
+      }
+      firstByte = code;
+      prevCode = code;
+      continue;
+    }
 
-      // Go to next OpCode data
-      // TODO: Ensure read bytes == num_bytes
-      if (!sr.seek_set(saved_loc + num_bytes)) {
-        return false;
+    if (code >= dictionary.size()) {
+      if (!outputSequence(dictionary, prevCode, uncompressed,
+                          uncompressedSizeBytes, bytesDecoded, firstByte)) {
+        break;
+      }
+      if (!outputByte(firstByte, uncompressed, uncompressedSizeBytes,
+                      bytesDecoded)) {
+        break;
       }
+    } else {
+      if (!outputSequence(dictionary, code, uncompressed, uncompressedSizeBytes,
+                          bytesDecoded, firstByte)) {
+        break;
+      }
+    }
 
+    dictionary.add(prevCode, firstByte);
+    if (dictionary.flush(codeBitsWidth)) {
+      TINY_DNG_DPRINTF("flush\n");
+      prevCode = Nil;
     } else {
+      prevCode = code;
+    }
+  }
 
-      if (num_bytes > kMaxSize) {
-        // Too large bytes. Guess invalid OpCode data.
-        return false;
-      }
+  return bytesDecoded;
+}
 
-      // Unimplemented
-      std::vector<uint8_t> op_data(num_bytes);
-      if (!sr.read(num_bytes, num_bytes, reinterpret_cast<unsigned char *>(op_data.data()))) {
-        return false;
-      }
+// =============================================================================
+#ifdef __clang__
+#pragma clang diagnostic pop
+#endif
 
-    }
+}  // namespace lzw
 
+// Decode LZW compressed tiles into `image->data`.
+// Each tile is decoded independently(in parallel when
+// TINY_DNG_LOADER_USE_THREAD is defined) and written to its location in the
+// output image.
+static bool DecompressLZWTiles(const StreamReader& sr, DNGImage* image,
+                               const bool swap_endian, std::string* err) {
+  TileLayout layout;
+  if (!ComputeTileLayout(*image, &layout, err)) {
+    return false;
   }
 
-  return true;
-}
+  TINY_DNG_CHECK_AND_RETURN(image->planar_configuration == 1,
+                            "Planar tiled LZW image is not supported.", err);
+  TINY_DNG_CHECK_AND_RETURN((image->bits_per_sample % 8) == 0,
+                            "Tiled LZW image must be multiple of 8 bits per sample.", err);
+  TINY_DNG_CHECK_AND_RETURN(
+      (image->tile_offsets.size() >= layout.num_tiles) &&
+          (image->tile_byte_counts.size() >= layout.num_tiles),
+      "The number of TileOffsets or TileByteCounts is less than the number of tiles.", err);
 
-// Parse custom TIFF field
-// returns -1 when error.
-// returns 0 when not found.
-// returns 1 when success.
-static int ParseCustomField(const StreamReader& sr,
-                            const std::vector<FieldInfo>& field_lists,
-                            const unsigned short tag, const unsigned short type,
-                            const unsigned int len, FieldData* data,
-                            std::string* err) {
-  bool found = false;
+  const size_t spp = size_t(image->samples_per_pixel);
+  const size_t pixel_bytes = spp * size_t(image->bits_per_sample) / 8;
+  const uint64_t tile_bytes =
+      uint64_t(layout.tile_width) * uint64_t(layout.tile_length) * pixel_bytes;
+  const uint64_t len =
+      uint64_t(image->width) * uint64_t(image->height) * pixel_bytes;
 
-  (void)len;
+  if ((len == 0) || (len > (kMaxImageSizeInMB * 1024ull * 1024ull)) ||
+      (tile_bytes > uint64_t((std::numeric_limits<int32_t>::max)()))) {
+    TINY_DNG_ERROR_AND_RETURN("Invalid or too large tiled LZW image size.", err);
+  }
 
-  // Simple linear search.
-  // TODO(syoyo): Use binary search for faster procesing.
-  for (size_t i = 0; i < field_lists.size(); i++) {
-    if ((field_lists[i].tag > TAG_NEW_SUBFILE_TYPE) &&
-        (field_lists[i].tag == tag) && (field_lists[i].type == type)) {
-      if ((type == TYPE_BYTE) || (type == TYPE_SBYTE)) {
-        data->name = field_lists[i].name;
-        data->type = static_cast<DataType>(type);
-        unsigned char val;
-        if (!sr.read1(&val)) {
-          if (err) {
-            (*err) += "Failed tp parse custom field.\n";
-          }
-          return -1;
-        }
+  image->data.resize(size_t(len));
 
-        data->data.resize(1);
-        data->data[0] = val;
-        found = true;
-      } else if ((type == TYPE_SHORT) || (type == TYPE_SSHORT)) {
-        data->name = field_lists[i].name;
-        data->type = static_cast<DataType>(type);
-        unsigned short val;
-        if (!sr.read2(&val)) {
-          if (err) {
-            (*err) += "Failed tp parse custom field.\n";
-          }
-          return -1;
-        }
-        data->data.resize(sizeof(short));
-        memcpy(data->data.data(), &val, sizeof(short));
-        found = true;
-      } else if ((type == TYPE_LONG) || (type == TYPE_SLONG) ||
-                 (type == TYPE_FLOAT)) {
-        data->name = field_lists[i].name;
-        data->type = static_cast<DataType>(type);
-        unsigned int val;
-        if (!sr.read4(&val)) {
-          if (err) {
-            (*err) += "Failed tp parse custom field.\n";
-          }
-          return -1;
-        }
-        data->data.resize(sizeof(int));
-        memcpy(data->data.data(), &val, sizeof(int));
-        found = true;
-      } else if ((type == TYPE_RATIONAL) || (type == TYPE_SRATIONAL)) {
-        data->name = field_lists[i].name;
-        data->type = static_cast<DataType>(type);
-        unsigned int num, denom;
+  const int num_threads = GetNumWorkers(layout.num_tiles);
 
-        if (!sr.read4(&num)) {
-          if (err) {
-            (*err) += "Failed tp parse custom field.\n";
+  // Per-thread decode buffer and row buffer for the predictor.
+  std::vector<std::vector<uint8_t> > scratch(static_cast<size_t>(num_threads));
+  std::vector<std::vector<uint8_t> > row_scratch(
+      static_cast<size_t>(num_threads));
+
+  return ParallelFor(
+      layout.num_tiles, num_threads, err,
+      [&](size_t k, int thread_id, std::string* thread_err) -> bool {
+        const size_t tile_offset = image->tile_offsets[k];
+        const size_t tile_bytesize = image->tile_byte_counts[k];
+
+        const uint8_t* src_addr = sr.map_abs_addr(tile_offset, tile_bytesize);
+        if (!src_addr) {
+          if (thread_err) {
+            (*thread_err) += "Cannot read tile_byte_counts bytes from a memory.\n";
           }
-          return -1;
+          return false;
         }
 
-        if (!sr.read4(&denom)) {
-          if (err) {
-            (*err) += "Failed tp parse custom field.\n";
+        std::vector<uint8_t>& dst = scratch[size_t(thread_id)];
+        dst.resize(size_t(tile_bytes));
+
+        const size_t decoded_bytes = lzw::easyDecode(
+            src_addr, tile_bytesize, tile_bytesize * 8, dst.data(),
+            size_t(tile_bytes));
+        // `dst` is reused across tiles, so a short tile would keep the
+        // pixels of the previous one.
+        if (decoded_bytes != size_t(tile_bytes)) {
+          if (thread_err) {
+            std::stringstream ss;
+            ss << "lzw decode failed. Tile " << k << " decoded to "
+               << decoded_bytes << " bytes but " << tile_bytes
+               << " bytes required.\n";
+            (*thread_err) += ss.str();
           }
-          return -1;
+          return false;
         }
 
-        data->data.resize(sizeof(int) * 2);
+        if (!UnpredictImage(dst.data(), image->predictor, layout.tile_width,
+                            layout.tile_length, spp, image->bits_per_sample,
+                            swap_endian, &row_scratch[size_t(thread_id)],
+                            thread_err)) {
+          return false;
+        }
 
-        // Store rational value as is.
-        memcpy(&data->data[0], &num, 4);
-        memcpy(&data->data[4], &denom, 4);
-        found = true;
-      } else {
-        // TODO(syoyo): Support more data types.
-      }
-    }
-  }
+        CopyTileToImage(dst.data(), layout, k, pixel_bytes,
+                        size_t(image->width), size_t(image->height),
+                        image->data.data());
 
-  return found ? 1 : 0;
+        return true;
+      });
 }
 
-// Parse TIFF IFD.
-// Returns true upon success, false if failed to parse.
-static bool ParseTIFFIFD(const StreamReader& sr,
-                         const std::vector<FieldInfo>& custom_field_lists,
-                         std::vector<tinydng::DNGImage>* images,
-                         std::string* warn, std::string* err, uint32_t call_depth = 0) {
+#if defined(_WIN32)
+namespace {
+
+static inline std::wstring UTF8ToWchar(const std::string& str) {
+  int wstr_size =
+      MultiByteToWideChar(CP_UTF8, 0, str.data(), int(str.size()), NULL, 0);
+  if (wstr_size < 0) {
+    // ??? wstr_size must be positive
+    return std::wstring();
+  }
+  std::wstring wstr(size_t(wstr_size), 0);
+  MultiByteToWideChar(CP_UTF8, 0, str.data(), int(str.size()), &wstr[0],
+                      int(wstr.size()));
+  return wstr;
+}
+
+}  // namespace
+#endif
+
+bool LoadDNG(const char* filename, std::vector<FieldInfo>& custom_fields,
+             std::vector<DNGImage>* images, std::string* warn,
+             std::string* err, const LoadOption& option) {
+  (void)warn;
+  std::stringstream ss;
+
   if (!images) {
     if (err) {
-      (*err) += "`images` argument is null.\n";
+      (*err) += "Invalid `images` pointer.\n";
     }
     return false;
   }
 
-  tinydng::DNGImage image;
-  InitializeDNGImage(&image);
+  FILE* fp;
+#if defined(_WIN32)
 
-  // TINY_DNG_DPRINTF("id = %d\n", idx);
-  unsigned short num_entries = 0;
-  if (!sr.read2(&num_entries)) {
+#if defined(_MSC_VER) || defined(__MINGW32__)  // MSVC, MinGW gcc or clang
+  errno_t errcode = _wfopen_s(&fp, UTF8ToWchar(filename).c_str(), L"rb");
+  if (errcode != 0) {
     if (err) {
-      (*err) += "Faild to read the number of entries in TIFF IFD.\n";
+      (*err) += "Error opening file: " + std::string(filename) + "(errno " +
+                std::to_string(errcode) + ")\n";
     }
     return false;
   }
+#else
+  // Unknown compiler
+  fp = fopen(filename, "rb");
+#endif
 
-  if (num_entries == 0) {
+#else
+  fp = fopen(filename, "rb");
+#endif
+
+  if (!fp) {
+    ss << "File not found or cannot open file " << filename << std::endl;
     if (err) {
-      (*err) += "TIFF IFD cannot have 0 entries.\n";
+      (*err) = ss.str();
     }
     return false;
   }
 
-  TINY_DNG_DPRINTF("----------\n");
-  TINY_DNG_DPRINTF("num entries %d\n", num_entries);
-
-  // For delayed reading of strip offsets and strip byte counts.
-  long offt_strip_offset = 0;
-  long offt_strip_byte_counts = 0;
-
-  while (num_entries--) {
-    unsigned short tag, type;
-    unsigned int len;
-    unsigned int saved_offt;
-    if (!GetTIFFTag(sr, &tag, &type, &len, &saved_offt)) {
-      if (err) {
-        (*err) += "Failed to read TIFF Tag.\n";
-      }
-      return false;
+  if (0 != fseek(fp, 0, SEEK_END)) {
+    if (err) {
+      (*err) = "Error seeking.\n";
     }
+    return false;
+  }
 
-    TINY_DNG_DPRINTF("tag %d\n", tag);
-    TINY_DNG_DPRINTF("saved_offt %d\n", saved_offt);
-    if (tag < TAG_NEW_SUBFILE_TYPE) {
+  size_t file_size = static_cast<size_t>(ftell(fp));
+
+  std::vector<unsigned char> whole_data;
+  {
+    whole_data.resize(file_size);
+    fseek(fp, 0, SEEK_SET);
+    size_t read_len = fread(whole_data.data(), 1, file_size, fp);
+    if (read_len != file_size) {
       if (err) {
-        (*err) += "Invalid tag ID.\n";
+        (*err) += "Unexpected file size.\n";
       }
       return false;
     }
 
-    // TINY_DNG_DPRINTF("tag = %d\n", tag);
-
-    switch (tag) {
-      case 2:
-      case TAG_IMAGE_WIDTH:
-      case 61441:  // ImageWidth
-        if (!sr.read_uint(type,
-                          reinterpret_cast<unsigned int*>(&(image.width)))) {
-          if (err) {
-            (*err) += "Failed to read ImageWidth Tag.\n";
-          }
-          return false;
-        }
-        // TINY_DNG_DPRINTF("[%d] width = %d\n", idx, info.width);
-        break;
-
-      case 3:
-      case TAG_IMAGE_HEIGHT:
-      case 61442:  // ImageHeight
-        if (!sr.read_uint(type,
-                          reinterpret_cast<unsigned int*>(&(image.height)))) {
-          if (err) {
-            (*err) += "Failed to read ImageHeight Tag.\n";
-          }
-          return false;
-        }
-        // TINY_DNG_DPRINTF("height = %d\n", image.height);
-        break;
-
-      case TAG_BITS_PER_SAMPLE:
-      case 61443:  // BitsPerSample
-        // image->samples = len & 7;
-        if (!sr.read_uint(type, reinterpret_cast<unsigned int*>(
-                                    &(image.bits_per_sample_original)))) {
-          if (err) {
-            (*err) += "Failed to read BitsPerSample Tag.\n";
-          }
-          return false;
-        }
-        break;
-
-      case TAG_SAMPLES_PER_PIXEL: {
-        short spp = 0;
-        if (!sr.read2(&spp)) {
-          if (err) {
-            (*err) += "Failed to read SamplesPerPixel Tag.\n";
-          }
-          return false;
-        }
-
-        if (spp < 1) {
-          if (err) {
-            (*err) += "SamplesPerPixel must be 1 ~ 4, but got " + std::to_string(spp) + ".\n";
-          }
-          return false;
-        }
-
-        if (spp > 4) {
-          if (err) {
-            (*err) += "SamplesPerPixel must be less than or equal to 4.\n";
-          }
-          return false;
-        }
-
-        image.samples_per_pixel = static_cast<int>(spp);
-
-        // TINY_DNG_DPRINTF("spp = %d\n", image.samples_per_pixel);
-      } break;
-
-      case TAG_ROWS_PER_STRIP: {
-        // The TIFF Spec says data type may be SHORT, but assume LONG for a
-        // while.
-        if (!sr.read4(&image.rows_per_strip)) {
-          if (err) {
-            (*err) += "Failed to parse RowsPerStrip Tag.\n";
-          }
-          return false;
-        }
-        // NOTE: Compute strip_per_image in later since image.height is required
-        // to compute strips_per_image.
-      } break;
-
-      case TAG_COMPRESSION:
-        if (!sr.read_uint(
-                type, reinterpret_cast<unsigned int*>(&image.compression))) {
-          if (err) {
-            (*err) += "Failed to parse Compression Tag.\n";
-          }
-          return false;
-        }
-
-        // TINY_DNG_DPRINTF("tag-compression = %d\n", image.compression);
-        break;
-
-      case TAG_STRIP_OFFSET:
-      case TAG_JPEG_IF_OFFSET:
-        offt_strip_offset = static_cast<long>(sr.tell());
-        if (!sr.read4(&image.offset)) {
-          if (err) {
-            (*err) += "Failed to parse Compression Tag.\n";
-          }
-          return false;
-        }
-        // TINY_DNG_DPRINTF("strip_offset = %d\n", image.offset);
-        break;
+    fseek(fp, 0, SEEK_SET);
+  }
+  fclose(fp);
 
-      case TAG_JPEG_IF_BYTE_COUNT:
-        if (!sr.read4(&image.jpeg_byte_count)) {
-          if (err) {
-            (*err) = "Failed to parse JpegIfByteCount Tag.\n";
-          }
-          return false;
-        }
-        break;
+  // `whole_data` is freed on return, thus views can't be used.
+  LoadOption mem_option = option;
+  mem_option.uncompressed_view = false;
 
-      case TAG_ORIENTATION:
-        if (!sr.read2(&image.orientation)) {
-          if (err) {
-            (*err) = "Failed to parse Orientation Tag.\n";
-          }
-          return false;
-        }
-        break;
+  return LoadDNGFromMemory(reinterpret_cast<const char*>(whole_data.data()),
+                           static_cast<unsigned int>(whole_data.size()),
+                           custom_fields, images, warn, err, mem_option);
+}
 
-      case TAG_STRIP_BYTE_COUNTS:
-        offt_strip_byte_counts = static_cast<long>(sr.tell());
-        if (!sr.read4(&image.strip_byte_count)) {
-          if (err) {
-            (*err) = "Failed to parse StripByteCount Tag.\n";
-          }
-          return false;
-        }
-        TINY_DNG_DPRINTF("strip_byte_count = %d\n", image.strip_byte_count);
-        break;
+bool LoadDNGFromMemory(const char* mem, unsigned int size,
+                       std::vector<FieldInfo>& custom_fields,
+                       std::vector<DNGImage>* images, std::string* warn,
+                       std::string* err, const LoadOption& option) {
+  (void)warn;
 
-      case TAG_PLANAR_CONFIGURATION:
-        if (!sr.read2(&image.planar_configuration)) {
-          if (err) {
-            (*err) = "Failed to parse PlanarConfiguration Tag.\n";
-          }
-          return false;
-        }
-        break;
+  if ((mem == NULL) || (size < 32) || (!images)) {
+    if (err) {
+      (*err) = "Invalid argument. argument is null or invalid.\n";
+    }
+    return false;
+  }
 
-      case TAG_PREDICTOR:
-        if (!sr.read2(&image.predictor)) {
-          if (err) {
-            (*err) = "Failed to parse Predictor Tag.\n";
-          }
-          return false;
-        }
+  TINY_DNG_CHECK_AND_RETURN((option.preview_jpeg_scale_denom == 1) ||
+                                (option.preview_jpeg_scale_denom == 2) ||
+                                (option.preview_jpeg_scale_denom == 4) ||
+                                (option.preview_jpeg_scale_denom == 8),
+                            "preview_jpeg_scale_denom must be 1, 2, 4 or 8.",
+                            err);
 
-        if ((image.predictor < 1) || (image.predictor > 3)) {
-          if (err) {
-            (*err) = "Predictor value must be 1, 2 or 3.\n";
-          }
-          return false;
-        }
-        break;
+  bool is_dng_big_endian = false;
 
-      case TAG_SAMPLE_FORMAT: {
-        short format;
-        if (!sr.read2(&format)) {
-          if (err) {
-            (*err) = "Failed to parse SampleFormat.\n";
-          }
-          return false;
-        }
+  const unsigned short magic = *(reinterpret_cast<const unsigned short*>(mem));
 
-        if ((format == SAMPLEFORMAT_INT) || (format == SAMPLEFORMAT_UINT) ||
-            (format == SAMPLEFORMAT_IEEEFP)) {
-          image.sample_format = static_cast<SampleFormat>(format);
-        }
-      } break;
+  if (magic == 0x4949) {
+    // might be TIFF(DNG).
+  } else if (magic == 0x4d4d) {
+    // might be TIFF(DNG, bigendian).
+    is_dng_big_endian = true;
+    TINY_DNG_DPRINTF("DNG is big endian\n");
+  } else {
+    std::stringstream ss;
+    ss << "Seems the data is not a DNG format." << std::endl;
+    if (err) {
+      (*err) = ss.str();
+    }
 
-      case TAG_SUB_IFDS:
+    return false;
+  }
 
-      {
-        // TINY_DNG_DPRINTF("sub_ifds = %d\n", len);
-        for (size_t k = 0; k < len; k++) {
-          unsigned int i = static_cast<unsigned int>(sr.tell());
-          unsigned int offt;
-          if (!sr.read4(&offt)) {
-            if (err) {
-              (*err) += "Failed to parse SubIFDs Tag.\n";
-            }
-            return false;
-          }
+  const bool swap_endian = (is_dng_big_endian && (!IsBigEndian()));
+  StreamReader sr(reinterpret_cast<const uint8_t*>(mem), size, swap_endian);
 
-          unsigned int base = 0;  // @fixme
-          if (!sr.seek_set(offt + base)) {
-            if (err) {
-              (*err) += "Failed to seek to SubIFD Tag.\n";
-            }
-            return false;
-          }
+  char header[32];
 
-          // recursive call
-          if (call_depth > kMaxRecursiveIFDParse) {
-            if (err) {
-              (*err) += "Too many nested SUB_IFDS. Input DNG seems invalid or malcious.\n";
-            }
-            return false;
-          }
+  if (32 != sr.read(32, 32, reinterpret_cast<unsigned char*>(header))) {
+    if (err) {
+      (*err) = "Error reading header.\n";
+    }
+    return false;
+  }
 
-          if (!ParseTIFFIFD(sr, custom_field_lists, images, warn, err, call_depth+1)) {
-            if (err) {
-              (*err) += "Failed to Parse SubIFD Tag.\n";
-            }
-            return false;
-          }
+  // skip magic header
+  if (!sr.seek_set(4)) {
+    if (err) {
+      (*err) += "Failed to seek to offset 4.\n";
+    }
+    return false;
+  }
 
-          if (!sr.seek_set(i + 4)) {
-            if (err) {
-              (*err) += "Failed to rewind to SubIFD Tag position.\n";
-            }
-            return false;
-          }
-        }
-        // TINY_DNG_DPRINTF("sub_ifds DONE\n");
+  bool ret = ParseDNGFromMemory(sr, custom_fields, images, warn, err);
+
+  if (!ret) {
+    if (err) {
+      (*err) += "Failed to parse DNG data.\n";
+    }
+    return false;
+  }
+
+  //
+  // Decode image data.
+  //
+  for (size_t i = 0; i < images->size(); i++) {
+    tinydng::DNGImage* image = &((*images)[i]);
+
+    const size_t data_offset =
+        (image->offset > 0) ? image->offset : image->tile_offset;
+    TINY_DNG_DPRINTF("data_offset = %d\n", int(data_offset));
+    if ((data_offset == 0) || (data_offset > sr.size())) {
+      if (err) {
+        std::stringstream ss;
+        ss << i << "'th image data offset is zero or invalid.\n";
+        (*err) += ss.str();
       }
+      return false;
+    }
 
-      break;
+    // std::cout << "offt =\n" << image->offset << std::endl;
+    // std::cout << "tile_offt = \n" << image->tile_offset << std::endl;
+    // std::cout << "data_offset = " << data_offset << std::endl;
 
-      case TAG_TILE_WIDTH:
-        if (!sr.read_uint(type,
-                          reinterpret_cast<unsigned int*>(&image.tile_width))) {
-          if (err) {
-            (*err) += "Failed to parse TileWidth Tag.\n";
-          }
-        }
-        // TINY_DNG_DPRINTF("tile_width = %d\n", image.tile_width);
-        break;
+    TINY_DNG_DPRINTF("image[%d].compression = %d\n", int(i),
+                     image->compression);
 
-      case TAG_TILE_LENGTH:
-        // TINY_DNG_DPRINTF("tile_length = %d\n", image.tile_length);
-        if (!sr.read_uint(
-                type, reinterpret_cast<unsigned int*>(&image.tile_length))) {
-          if (err) {
-            (*err) += "Failed to parse TileLength Tag.\n";
-          }
-        }
-        break;
+    if (image->compression == COMPRESSION_NONE) {  // no compression
 
-      case TAG_TILE_OFFSETS:
-        if (len > 1) {
-          image.tile_offset = static_cast<unsigned int>(sr.tell());
-        } else {
-          if (!sr.read4(&image.tile_offset)) {
-            if (err) {
-              (*err) += "Failed to parse TileOffsets Tag.\n";
-            }
-          }
-        }
-        TINY_DNG_DPRINTF("tile_offt = %d\n", int(image.tile_offset));
-        break;
+      if (image->jpeg_byte_count > 0) {
+        // Looks like CR2 IFD#1(thumbnail jpeg image)
+        // Currently skip parsing jpeg data.
+        // TODO(syoyo): Decode jpeg data.
+        image->width = 0;
+        image->height = 0;
 
-      case TAG_TILE_BYTE_COUNTS:
-        if (len > 1) {
-          image.tile_byte_count = static_cast<unsigned int>(sr.tell());
-        } else {
-          if (!sr.read4(&image.tile_byte_count)) {
-            if (err) {
-              (*err) += "Failed to parse TileByteCounts Tag.\n";
-            }
-          }
+        if (image->bits_per_sample_original < 0) {
+          // Assume 8bit
+          image->bits_per_sample_original = 8;
         }
-        break;
 
-      case TAG_CFA_PATTERN_DIM:
-        if (!sr.read2(&image.cfa_pattern_dim)) {
+        image->bits_per_sample = image->bits_per_sample_original;
+
+      } else {
+
+        const size_t kMaxImageSize = size_t(1024)*size_t(1024)*size_t(1024)*size_t(2); // 2GB
+
+        if (image->bits_per_sample_original <= 0) {
           if (err) {
-            (*err) = "Failed to parse CFA PatternDim Tag.\n";
+            (*err) += "bits_per_sample information not found in the tag.\n";
           }
           return false;
         }
-        break;
 
-      case TAG_CFA_PATTERN: {
-        char buf[16];
-        size_t readLen = len;
-        if (readLen > 16) readLen = 16;
+        image->bits_per_sample = image->bits_per_sample_original;
+        // std::cout << "sample_per_pixel " << image->samples_per_pixel << "\n";
+        // std::cout << "width " << image->width << "\n";
+        // std::cout << "height " << image->height << "\n";
+        // std::cout << "bps " << image->bits_per_sample << "\n";
+
+        // Each row starts at a byte boundary.
+        const size_t row_bytes =
+            (size_t(image->samples_per_pixel) * size_t(image->width) *
+                 size_t(image->bits_per_sample) +
+             7) /
+            8;
+        const size_t len = row_bytes * size_t(image->height);
 
-        if (!sr.read(readLen, 16, reinterpret_cast<unsigned char*>(buf))) {
+        if (len == 0) {
           if (err) {
-            (*err) = "Failed to parse CFA Pattern Tag.\n";
+            (*err) += "Unexpected length.";
           }
           return false;
         }
 
-        // Only 2x2 CFAPattern is supported at the moment.
-        if (readLen == 4) {
-          image.cfa_pattern[0][0] = buf[0];
-          image.cfa_pattern[0][1] = buf[1];
-          image.cfa_pattern[1][0] = buf[2];
-          image.cfa_pattern[1][1] = buf[3];
-        } else {
+        if (len > kMaxImageSize) {
           if (err) {
-            (*err) =
-                "Length of CFA pattern other than 4(2x2) is not supported "
-                "yet.\n";
+            std::stringstream ss;
+            ss << "Image byte size too large. " << len << "bytes in file, but hard-limit is set to " << kMaxImageSize << " bytes.\n";
+            (*err) += ss.str();
           }
           return false;
         }
-      } break;
 
-      case TAG_DNG_VERSION: {
-        char data[4];
-        {
-          for (int i = 0; i < 4; i++) {
-            if (!sr.read1(&data[i])) {
-              if (err) {
-                (*err) += "Failed to parse DNGVersion Tag.\n";
-              }
-              return false;
+        // Strips are usually stored back to back. Otherwise gather them.
+        bool contiguous = true;
+        if ((image->strip_offsets.size() > 1) &&
+            (image->strip_offsets.size() == image->strip_byte_counts.size())) {
+          for (size_t k = 0; k + 1 < image->strip_offsets.size(); k++) {
+            if (size_t(image->strip_offsets[k]) +
+                    size_t(image->strip_byte_counts[k]) !=
+                size_t(image->strip_offsets[k + 1])) {
+              contiguous = false;
+              break;
             }
           }
         }
 
-        image.version =
-            (data[3] << 24) | (data[2] << 16) | (data[1] << 8) | data[0];
-      } break;
-
-      case TAG_CFA_PLANE_COLOR: {
-        char buf[4];
-        size_t readLen = len;
-        if (readLen > 4) readLen = 4;
-
-        if (!sr.read(readLen, readLen, reinterpret_cast<unsigned char*>(buf))) {
-          if (err) {
-            (*err) += "Failed to parse CFALayout Tag.\n";
-          }
-          return false;
-        }
+        // Samples of 16bit or more are stored in the file's byte order.
+        const bool needs_swap = sr.swap_endian() &&
+                                (image->bits_per_sample >= 16) &&
+                                ((image->bits_per_sample % 8) == 0);
 
-        for (size_t i = 0; i < readLen; i++) {
-          image.cfa_plane_color[i] = buf[i];
-        }
-      } break;
+        image->data.clear();
+        image->data_view = nullptr;
+        image->data_view_size = 0;
 
-      case TAG_CFA_LAYOUT: {
-        if (!sr.read4(&image.cfa_layout)) {
-          if (err) {
-            (*err) += "Failed to parse CFALayout Tag.\n";
+        if (contiguous) {
+          const uint8_t* src = sr.map_abs_addr(data_offset, len);
+          if (!src) {
+            if (err) {
+              (*err) += "Failed to read image data.\n";
+            }
+            return false;
           }
-          return false;
-        }
-      } break;
 
-      case TAG_ACTIVE_AREA: {
+          if (option.uncompressed_view && !needs_swap) {
+            image->data_view = src;
+            image->data_view_size = len;
+          } else {
+            image->data.assign(src, src + len);
+          }
+        } else {
+          image->data.resize(len);
+          size_t pos = 0;
+          for (size_t k = 0; (k < image->strip_offsets.size()) && (pos < len);
+               k++) {
+            const size_t n =
+                (std::min)(size_t(image->strip_byte_counts[k]), len - pos);
+            const uint8_t* src = sr.map_abs_addr(image->strip_offsets[k], n);
+            if (!src) {
+              if (err) {
+                (*err) += "Failed to read image data.\n";
+              }
+              return false;
+            }
+            memcpy(image->data.data() + pos, src, n);
+            pos += n;
+          }
 
-        for (size_t c = 0; c < 4; c++) {
-          if (!sr.read_uint(type, reinterpret_cast<unsigned int*>(
-                                      &image.active_area[c]))) {
+          if (pos < len) {
             if (err) {
-              (*err) += "Failed to parse ActiveArea Tag.\n";
+              (*err) += "Insufficient strip data.\n";
             }
             return false;
           }
         }
 
-        image.has_active_area = true;
+        if (needs_swap) {
+          SwapElements(image->data.data(),
+                       len / (size_t(image->bits_per_sample) / 8),
+                       size_t(image->bits_per_sample) / 8);
+        }
+      }
+    } else if (image->compression == COMPRESSION_LZW) {  // lzw compression
 
-      }  break;
+      if (image->bits_per_sample_original <= 0) {
+        if (err) {
+          (*err) += "bits_per_sample information not found in the tag.\n";
+        }
+        return false;
+      }
 
-      case TAG_PROFILE_NAME: {
+      image->bits_per_sample = image->bits_per_sample_original;
+      TINY_DNG_DPRINTF("bps = %d\n", image->bits_per_sample);
+      TINY_DNG_DPRINTF("counts = %d\n", int(image->strip_byte_counts.size()));
+      TINY_DNG_DPRINTF("offsets = %d\n", int(image->strip_offsets.size()));
 
-        size_t readLen = len;
-        if (readLen < 1) {
-          if (err) {
-            (*err) += "Null string for ProfileName Tag.\n";
-          }
+      image->data.clear();
 
-          return false;
-        }
+      if ((image->strip_byte_counts.size() > 0) &&
+          (image->strip_byte_counts.size() == image->strip_offsets.size())) {
+#if (__cplusplus > 199711L) && defined(TINY_DNG_LOADER_USE_THREAD)
 
-        const size_t kMaxNameSize = 1024 * 1024;
+        const int num_strips = int(image->strip_byte_counts.size());
 
-        if (readLen > kMaxNameSize) {
-          if (err) {
-            (*err) += "The length of ProfileName string too large.\n";
-          }
-          return false;
-        }
+        std::vector<std::thread> workers;
+        std::atomic<size_t> strip_count(0);
+        std::mutex err_mtx_;
 
-        std::vector<uint8_t> buf(readLen);  // readLen includes null char
-        if (!sr.read(readLen, readLen,
-                     reinterpret_cast<unsigned char*>(buf.data()))) {
-          if (err) {
-            (*err) += "Failed to parse ProfileName Tag.\n";
-          }
-          return false;
+        int num_threads = (std::max)(1, int(std::thread::hardware_concurrency()));
+        if (num_threads > num_strips) {
+          num_threads = num_strips;
         }
 
-        // TODO: Validate UTF-8 string.
-        image.profile_name = std::string(buf.begin(), buf.end());
+        bool failed = false;
 
-        TINY_DNG_DPRINTF("profile_name = %s\n", image.profile_name.c_str());
+        // Each row starts at a byte boundary.
+        const size_t dst_strip_len =
+            (size_t(image->samples_per_pixel) * size_t(image->width) *
+                 size_t(image->bits_per_sample) +
+             7) /
+            8 * size_t(image->rows_per_strip);
 
-      }  break;
+        image->data.resize(dst_strip_len * size_t(num_strips));
 
-      case TAG_PROFILE_TONE_CURVE: {
+        for (int t = 0; t < num_threads; t++) {
+          workers.emplace_back(std::thread([&]() {
+            size_t k = 0;
+            while ((k = strip_count++) < size_t(num_strips)) {
+              std::vector<unsigned char> src(image->strip_byte_counts[k]);
+              size_t strip_offset = image->strip_offsets[k];
+              size_t strip_bytesize = image->strip_byte_counts[k];
 
-        TINY_DNG_DPRINTF("tone curve datalen = %d\n", len);
+              std::vector<unsigned char> dst(dst_strip_len);
 
-        // len = samples * 2.
-        // It seems single channel tone curve only. 
-        if ((len % 2) != 0) {
-          if (err) {
-            (*err) += "Invalid data size for ProfileToneCurve Tag.\n";
-          }
+              const uint8_t* src_addr =
+                  sr.map_abs_addr(strip_offset, strip_bytesize);
 
-          return false;
+              if (!src_addr) {
+                // Atomic update
+                {
+                  std::lock_guard<std::mutex> lock(err_mtx_);
+                  if (err) {
+                    (*err) +=
+                        "Cannot read strip_byte_counts bytes from a memory.\n";
+                  }
+                }
+
+                failed = true;
+                break;
+              }
+
+              TINY_DNG_DPRINTF("easyDecode begin\n");
+              const size_t decoded_bytes = lzw::easyDecode(
+                  src_addr, strip_bytesize, strip_bytesize * 8,
+                  dst.data(), dst_strip_len);
+              TINY_DNG_DPRINTF("easyDecode done\n");
+              if (decoded_bytes == 0) {
+                {
+                  std::lock_guard<std::mutex> lock(err_mtx_);
+                  if (err) {
+                    (*err) +=
+                        "lzw decode failed.\n";
+                  }
+                }
+
+                failed = true;
+                break;
+              }
+
+              std::vector<uint8_t> row_buf;
+              std::string unpredict_err;
+              if (!UnpredictImage(dst.data(), image->predictor,
+                                  size_t(image->width),
+                                  size_t(image->rows_per_strip),
+                                  size_t(image->samples_per_pixel),
+                                  image->bits_per_sample, swap_endian,
+                                  &row_buf, &unpredict_err)) {
+                {
+                  std::lock_guard<std::mutex> lock(err_mtx_);
+                  if (err) {
+                    (*err) += unpredict_err;
+                  }
+                }
+                failed = true;
+                break;
+              }
+
+              memcpy(&image->data[k * dst_strip_len], dst.data(),
+                     dst_strip_len);
+            }
+          }));
         }
-        size_t readLen = len * sizeof(float);
 
-        const size_t kMaxSamples = 1024 * 1024;
+        for (auto& t : workers) {
+          t.join();
+        }
 
-        if (len > (kMaxSamples * 2)) {
-          if (err) {
-            (*err) += "The count of ProfileToneCurve too large.\n";
-          }
+        // something failed in a thread.
+        if (failed) {
           return false;
         }
 
-        std::vector<float> buf(len);
+#else
+        for (size_t k = 0; k < image->strip_byte_counts.size(); k++) {
+          std::vector<unsigned char> src(image->strip_byte_counts[k]);
+          if (!sr.seek_set(image->strip_offsets[k])) {
+            if (err) {
+              (*err) += "Failed to seek to strip offset.\n";
+            }
+            return false;
+          }
 
-        for (size_t k = 0; k < len; k++) {
-          if (!sr.read_float(&buf[k])) {
+          // Each row starts at a byte boundary.
+          const uint64_t dst_len =
+              (uint64_t(image->samples_per_pixel) * uint64_t(image->width) *
+                   uint64_t(image->bits_per_sample) +
+               7ull) /
+              8ull * uint64_t(image->rows_per_strip);
+          if (dst_len == 0) {
             if (err) {
-              (*err) += "Failed to parse ProfileToneCurve Tag.\n";
+              (*err) += "Image data size is zero. Something is wrong in Image parameter:\n";
+              (*err) += "  samples_per_pixel " + std::to_string(image->samples_per_pixel) + "\n";
+              (*err) += "  width " + std::to_string(image->width) + "\n";
+              (*err) += "  rows_per_strip " + std::to_string(image->rows_per_strip) + "\n";
+              (*err) += "  bits_per_sample " + std::to_string(image->bits_per_sample) + "\n";
+            }
+            return false;
+          }
+
+          if (dst_len > (kMaxImageSizeInMB * 1024ull * 1024ull)) {
+            if (err) {
+              (*err) += "Image data size too large. Exceeds " + std::to_string(kMaxImageSizeInMB) + " MB.\n";
+            }
+            return false;
+          }
+          std::vector<unsigned char> dst(dst_len);
+
+          if (!sr.read(image->strip_byte_counts[k], image->strip_byte_counts[k],
+                       src.data())) {
+            if (err) {
+              (*err) += "Cannot read strip_byte_counts bytes from stream.\n";
             }
             return false;
           }
+          TINY_DNG_DPRINTF("easyDecode begin\n");
+          const size_t decoded_bytes = lzw::easyDecode(
+              src.data(), size_t(image->strip_byte_counts[k]),
+              size_t(image->strip_byte_counts[k]) * 8, dst.data(),
+              size_t(dst_len));
+          TINY_DNG_DPRINTF("easyDecode done\n");
+          if (decoded_bytes == 0) {
+            TINY_DNG_ERROR_AND_RETURN("decoded_ bytes must be non-zero positive.", err);
+          }
+
+          std::vector<uint8_t> row_buf;
+          if (!UnpredictImage(dst.data(), image->predictor,
+                              size_t(image->width),
+                              size_t(image->rows_per_strip),
+                              size_t(image->samples_per_pixel),
+                              image->bits_per_sample, swap_endian, &row_buf,
+                              err)) {
+            return false;
+          }
+
+          std::copy(dst.begin(), dst.end(), std::back_inserter(image->data));
         }
 
-        // TODO: Validate curve data.
-        image.profile_tone_curve = buf;
+#endif
+      } else if ((image->tile_width > 0) && (image->tile_length > 0) &&
+                 !image->tile_offsets.empty()) {
+        if (!DecompressLZWTiles(sr, image, swap_endian, err)) {
+          TINY_DNG_ERROR_AND_RETURN("Failed to decode tiled LZW image.", err);
+        }
+      } else {
+        TINY_DNG_ERROR_AND_RETURN("Unsupported image strip configuration.", err);
+      }
+    } else if (image->compression ==
+               COMPRESSION_OLD_JPEG) {  // old jpeg compression
 
-        TINY_DNG_DPRINTF("profile_tone_curve.count = %d\n", int(image.profile_tone_curve.size()));
+      // std::cout << "IFD " << i << std::endl;
 
-      }  break;
+      // First check if JPEG is lossless JPEG
+      // TODO(syoyo): Compure conservative data_len.
+      if (sr.size() < data_offset) {
+        if (err) {
+          (*err) += "Unexpected data offset.\n";
+        }
+        return false;
+      }
+      size_t data_len = sr.size() - data_offset;
+      int lj_width = -1, lj_height = -1, lj_bits = -1, lj_components = -1;
+      if (IsLosslessJPEG(sr.data() + data_offset, static_cast<int>(data_len),
+                         &lj_width, &lj_height, &lj_bits, &lj_components)) {
+        // std::cout << "IFD " << i << " is LJPEG" << std::endl;
+        TINY_DNG_DPRINTF("IFD[%d] is LJPEG\n", int(i));
 
-      case TAG_PROFILE_EMBED_POLICY: {
-        int policy;
-        if (!sr.read4(&policy)) {
-          if (err) {
-            (*err) += "Failed to parse ProfileEmbedPolicy Tag.\n";
-          }
-          return false;
+        TINY_DNG_CHECK_AND_RETURN(
+            lj_width > 0 && lj_height > 0 && lj_bits > 0 && lj_components > 0,
+            "Image dimensions must be > 0.", err);
+
+        // Assume not in tiled format.
+        TINY_DNG_CHECK_AND_RETURN(image->tile_width == -1 && image->tile_length == -1,
+                        "Tiled format not supported tile size.", err);
+
+        image->height = lj_height;
+
+        // Is Canon CR2?
+        const bool is_cr2 = (image->cr2_slices[0] != 0) ? true : false;
+
+        if (is_cr2) {
+          // For CR2 RAW, slices[0] * slices[1] + slices[2] = image width
+          image->width = image->cr2_slices[0] * image->cr2_slices[1] +
+                         image->cr2_slices[2];
+        } else {
+          image->width = lj_width;
         }
 
-        if ((policy < 0) || (policy > 2)) {
+        image->bits_per_sample_original = lj_bits;
+
+        // lj92 decodes data into 16bits, so modify bps.
+        image->bits_per_sample = 16;
+
+        TINY_DNG_CHECK_AND_RETURN(
+            ((image->width * image->height * image->bits_per_sample) % 8) == 0,
+            "Image size must be multiple of 8.", err);
+        const size_t len =
+            static_cast<size_t>((image->samples_per_pixel * image->width *
+                                 image->height * image->bits_per_sample) /
+                                8);
+        // std::cout << "spp = " << image->samples_per_pixel;
+        // std::cout << ", w = " << image->width << ", h = " << image->height <<
+        // ", bps = " << image->bits_per_sample << std::endl;
+        TINY_DNG_CHECK_AND_RETURN(len > 0, "Invalid length.", err);
+        image->data.resize(len);
+
+        if (sr.size() < data_offset) {
           if (err) {
-            (*err) += "ProfileEmbedPolicy value must be 0, 1 or 2.\n";
+            (*err) += "Unexpected file size or data offset.\n";
           }
           return false;
         }
 
-        image.profile_embed_policy = policy;
-
-      } break;
-
-      case TAG_NOISE_PROFILE: {
-
-        TINY_DNG_DPRINTF("noise profile datalen = %d\n", len);
-
-        // DOUBLE * 2.
-        // or
-        // DOUBLE * 2 * colorPlanes
+        std::vector<unsigned short> buf;
+        buf.resize(static_cast<size_t>(image->width * image->height *
+                                       image->samples_per_pixel));
 
-        // It seems single channel tone curve only. 
-        if ((len % 2) != 0) {
+        bool ok = DecompressLosslessJPEG(sr, &buf.at(0), image->width, (*image),
+                                         NULL, err);
+        if (!ok) {
           if (err) {
-            (*err) += "Invalid data size for ProfileToneCurve Tag.\n";
+            std::stringstream ss;
+            ss << "Failed to decompress LJPEG." << std::endl;
+            (*err) = ss.str();
           }
-
           return false;
         }
 
-        if (len > 2) {
-          if ((image.samples_per_pixel < 1) || (image.samples_per_pixel > 4)) {
-            if (err) {
-              (*err) += "SamplesPerPixel Tag must exist before NoiseProfile Tag.\n";
-            }
-          }
-
-          if (len != (image.samples_per_pixel * 2)) {
-            if (err) {
-              (*err) += "Counts in NoisProfile must be 2 * SamplesPerPixel.\n";
-            }
-          }
-        }
+        if (is_cr2) {
+          // CR2 stores image in tiled format(image slices. left to right).
+          // Convert it to scanline format.
+          int nslices = image->cr2_slices[0];
+          int slice_width = image->cr2_slices[1];
+          int slice_remainder_width = image->cr2_slices[2];
+          size_t src_offset = 0;
 
-        const size_t kMaxSamples = 1024;
+          unsigned short* dst_ptr =
+              reinterpret_cast<unsigned short*>(image->data.data());
 
-        if (len > kMaxSamples) {
-          if (err) {
-            (*err) += "The count of NoiseProfile too large.\n";
+          for (int slice = 0; slice < nslices; slice++) {
+            int x_offset = slice * slice_width;
+            for (int y = 0; y < image->height; y++) {
+              size_t dst_offset =
+                  static_cast<size_t>(y * image->width + x_offset);
+              memcpy(&dst_ptr[dst_offset], &buf[src_offset],
+                     sizeof(unsigned short) * static_cast<size_t>(slice_width));
+              src_offset += static_cast<size_t>(slice_width);
+            }
           }
-          return false;
-        }
-
-        std::vector<double> buf(len);
 
-        for (size_t k = 0; k < len; k++) {
-          if (!sr.read_double(&buf[k])) {
-            if (err) {
-              (*err) += "Failed to parse NoiseProfile Tag.\n";
+          // remainder(the last slice).
+          {
+            int x_offset = nslices * slice_width;
+            for (int y = 0; y < image->height; y++) {
+              size_t dst_offset =
+                  static_cast<size_t>(y * image->width + x_offset);
+              // std::cout << "y = " << y << ", dst = " << dst_offset << ", src
+              // = " << src_offset << ", len = " << buf.size() << std::endl;
+              memcpy(&dst_ptr[dst_offset], &buf[src_offset],
+                     sizeof(unsigned short) *
+                         static_cast<size_t>(slice_remainder_width));
+              src_offset += static_cast<size_t>(slice_remainder_width);
             }
-            return false;
           }
-        }
-    
-        // TODO: Validate noise profile data.
-        image.noise_profile = buf;
 
-        TINY_DNG_DPRINTF("noise_profile.samples = %d\n", int(image.noise_profile.size()));
+        } else {
+          memcpy(image->data.data(), static_cast<void*>(&(buf.at(0))), len);
+        }
 
-      }  break;
+      } else {
+        // Baseline 8bit JPEG
 
-      case TAG_BLACK_LEVEL: {
-        // Assume TAG_SAMPLES_PER_PIXEL is read before
-        // FIXME(syoyo): scan TAG_SAMPLES_PER_PIXEL in IFD table in advance.
-        for (int s = 0; s < image.samples_per_pixel; s++) {
-          if (!sr.read_uint(type, reinterpret_cast<unsigned int*>(
-                                      &image.black_level[s]))) {
-            if (err) {
-              (*err) += "Failed to parse BlackLevel Tag.\n";
-            }
-            return false;
-          }
-        }
-      } break;
+        image->bits_per_sample_original = 8;
+        image->bits_per_sample = 8;
 
-      case TAG_WHITE_LEVEL: {
-        // Assume TAG_SAMPLES_PER_PIXEL is read before
-        // FIXME(syoyo): scan TAG_SAMPLES_PER_PIXEL in IFD table in advance.
-        for (int s = 0; s < image.samples_per_pixel; s++) {
-          if (!sr.read_uint(type, reinterpret_cast<unsigned int*>(
-                                      &image.white_level[s]))) {
+        size_t jpeg_len = static_cast<size_t>(image->jpeg_byte_count);
+        if (image->jpeg_byte_count == -1) {
+          // No jpeg datalen. Set to the size of file - offset.
+          if (sr.size() < data_offset) {
             if (err) {
-              (*err) += "Failed to parse WhiteLevel Tag.\n";
+              (*err) += "Unexpected file size or data offset.\n";
             }
             return false;
           }
+          jpeg_len = sr.size() - data_offset;
         }
-      } break;
 
-      case TAG_ANALOG_BALANCE:
-        // Assume RGB
-        if (!sr.read_real(type, &image.analog_balance[0])) {
+        if (jpeg_len == 0) {
           if (err) {
-            (*err) += "Failed to parse analog balance.\n";
+            (*err) += "Invalid jpeg data length.\n";
           }
           return false;
         }
-        if (!sr.read_real(type, &image.analog_balance[1])) {
+
+        // Assume RGB jpeg
+        //
+        // First check the header.
+        int w_info = 0, h_info = 0, components_info = 0;
+        if (!GetJPEGInfo(sr.data() + data_offset, jpeg_len, &w_info, &h_info,
+                         &components_info)) {
           if (err) {
-            (*err) += "Failed to parse analog balance.\n";
+            (*err) += "Not a JPEG data.\n";
           }
           return false;
         }
-        if (!sr.read_real(type, &image.analog_balance[2])) {
+
+        if ((components_info != 1) && (components_info != 3)) {
           if (err) {
-            (*err) += "Failed to parse analog balance.\n";
+            (*err) += "Unsupported channels in JPEG data.\n";
           }
           return false;
         }
 
-        image.has_analog_balance = true;
-        break;
-
-      case TAG_AS_SHOT_NEUTRAL:
-        // Assume RGB
-        // TINY_DNG_DPRINTF("ty = %d\n", type);
-        for (size_t c = 0; c < 3; c++) {
-          if (!sr.read_real(type, &image.as_shot_neutral[c])) {
-            if (err) {
-              (*err) += "Failed to parse AsShotNeutral Tag.\n";
-            }
-            return false;
-          }
-        }
-
-        image.has_as_shot_neutral = true;
-        break;
-
-      case TAG_CALIBRATION_ILLUMINANT1: {
-        unsigned short val;
-        if (!sr.read2(&val)) {
+        if ((w_info < 1) || (h_info < 1)) {
           if (err) {
-            (*err) += "Failed to parse CalibrartionIlluminant1 Tag.\n";
+            (*err) += "Invalid JPEG image resolution.\n";
           }
           return false;
         }
 
-        image.calibration_illuminant1 = static_cast<LightSource>(val);
-      } break;
-
-      case TAG_CALIBRATION_ILLUMINANT2: {
-        unsigned short val;
-        if (!sr.read2(&val)) {
+        // Check if data is in valid range.
+        if ((data_offset + jpeg_len) > sr.size()) {
           if (err) {
-            (*err) += "Failed to parse CalibrartionIlluminant2 Tag.\n";
+            (*err) += "Invalid JPEG image data size.\n";
           }
           return false;
         }
-        image.calibration_illuminant2 = static_cast<LightSource>(val);
-      } break;
 
-      case TAG_COLOR_MATRIX1: {
-        for (int c = 0; c < 3; c++) {
-          for (int k = 0; k < 3; k++) {
-            double val;
-            if (!sr.read_real(type, &val)) {
-              if (err) {
-                (*err) += "Failed to parse ColorMatrix1 Tag.\n";
-              }
-              return false;
-            }
+        // JPEG image would be just a thumbnail or LDR image of RAW, so decode
+        // it only on request. The header has the resolution.
+        image->width = w_info;
+        image->height = h_info;
 
-            image.color_matrix1[c][k] = val;
+        if (option.decode_preview_jpeg) {
+          int w = 0, h = 0, components = 0;
+          if (!DecodeJPEG(sr.data() + data_offset, jpeg_len,
+                          option.preview_jpeg_scale_denom, &image->data, &w,
+                          &h, &components, err)) {
+            return false;
           }
-        }
-      } break;
 
-      case TAG_COLOR_MATRIX2: {
-        for (int c = 0; c < 3; c++) {
-          for (int k = 0; k < 3; k++) {
-            double val;
-            if (!sr.read_real(type, &val)) {
-              if (err) {
-                (*err) += "Failed to parse ColorMatrix2 Tag.\n";
-              }
-              return false;
-            }
-            image.color_matrix2[c][k] = val;
-          }
+          image->width = w;
+          image->height = h;
+          image->samples_per_pixel = components;
         }
-      } break;
+      }
 
-      case TAG_FORWARD_MATRIX1: {
-        for (int c = 0; c < 3; c++) {
-          for (int k = 0; k < 3; k++) {
-            double val;
-            if (!sr.read_real(type, &val)) {
-              if (err) {
-                (*err) += "Failed to parse ForwardMatrix1 Tag.\n";
-              }
-              return false;
+    } else if (image->compression ==
+               COMPRESSION_NEW_JPEG) {  //  new JPEG(baseline DCT JPEG or
+                                        //  lossless JPEG)
+
+      bool decoded = false;
+
+      if (image->bits_per_sample_original == 8) {
+        // bps TAG exists. probably ordinal JPEG
+
+        size_t jpeg_len = static_cast<size_t>(image->jpeg_byte_count);
+        if (image->jpeg_byte_count == -1) {
+          // No jpeg datalen. Set to the size of file - offset.
+          if (sr.size() < data_offset) {
+            if (err) {
+              (*err) += "Unexpected file size or data offset.\n";
             }
-            image.forward_matrix1[c][k] = val;
+            return false;
           }
+          jpeg_len = sr.size() - data_offset;
         }
-      } break;
 
-      case TAG_FORWARD_MATRIX2: {
-        for (int c = 0; c < 3; c++) {
-          for (int k = 0; k < 3; k++) {
-            double val;
-            if (!sr.read_real(type, &val)) {
+        int w_info = 0, h_info = 0, components_info = 0;
+        if (!GetJPEGInfo(sr.data() + data_offset, jpeg_len, &w_info, &h_info,
+                         &components_info)) {
+          // Try to decode image as lossless JPEG.
+        } else {
+          const uint64_t len = uint64_t(components_info) * uint64_t(w_info) * uint64_t(h_info);
+          // For 32bit
+          if (sizeof(void *) == 4) {
+            // Use 2GB as a max
+            if (len > uint64_t((std::numeric_limits<int32_t>::max)())) {
               if (err) {
-                (*err) += "Failed to parse ForwardMatrix2 Tag.\n";
+                (*err) += "Decoded image size exceeds 2GB.\n";
               }
               return false;
             }
-            image.forward_matrix2[c][k] = val;
           }
-        }
-      } break;
-
-      case TAG_CAMERA_CALIBRATION1: {
-        for (int c = 0; c < 3; c++) {
-          for (int k = 0; k < 3; k++) {
-            double val;
-            if (!sr.read_real(type, &val)) {
-              if (err) {
-                (*err) += "Failed to parse CameraCalibration1 Tag.\n";
-              }
-              return false;
+
+          if (len > (kMaxImageSizeInMB * 1024ull * 1024ull)) {
+            if (err) {
+              (*err) += "Image data size too large. Exceeds " + std::to_string(kMaxImageSizeInMB) + " MB.\n";
             }
-            image.camera_calibration1[c][k] = val;
+            return false;
           }
-        }
-      } break;
 
-      case TAG_CAMERA_CALIBRATION2: {
-        for (int c = 0; c < 3; c++) {
-          for (int k = 0; k < 3; k++) {
-            double val;
-            if (!sr.read_real(type, &val)) {
+          if (len == 0) {
               if (err) {
-                (*err) += "Failed to parse CameraCalibration2 Tag.\n";
+                std::stringstream ss;
+                ss << "Image size is 0. Something is wrong in Image parameter:\n";
+                ss << "  width = " << w_info << "\n";
+                ss << "  height = " << h_info << "\n";
+                ss << "  spp = " << components_info << "\n";
+
+                (*err) += ss.str();
               }
               return false;
-            }
-            image.camera_calibration2[c][k] = val;
+          }
+
+          // Only a preview(reduced resolution image) is scaled on request.
+          // Other 8bit JPEG images are decoded at full resolution.
+          const bool is_preview = (image->new_subfile_type & 1u) != 0;
+          const int scale_denom =
+              (option.decode_preview_jpeg && is_preview)
+                  ? option.preview_jpeg_scale_denom
+                  : 1;
+
+          int w = 0, h = 0, components = 0;
+          std::string jpeg_err;
+          if (!DecodeJPEG(sr.data() + data_offset, jpeg_len, scale_denom,
+                          &image->data, &w, &h, &components, &jpeg_err)) {
+            // Try to decode image as lossless JPEG.
+            image->data.clear();
+          } else {
+            decoded = true;
+
+            image->width = w;
+            image->height = h;
+            image->samples_per_pixel = components;
+            image->bits_per_sample = image->bits_per_sample_original;
           }
         }
-      } break;
+      }
 
-      case TAG_CR2_SLICES: {
-        // Assume 3 ushorts;
-        for (size_t c = 0; c < 3; c++) {
-          if (!sr.read2(&image.cr2_slices[c])) {
+      if (!decoded) {
+        // Try to decode as lossless JPEG.
+
+        // lj92 decodes data into 16bits, so modify bps.
+        image->bits_per_sample = 16;
+
+        // std::cout << "w = " << image->width << ", h = " << image->height <<
+        // std::endl;
+
+        TINY_DNG_DPRINTF("image.width = %d\n", image->width);
+        TINY_DNG_DPRINTF("image.height = %d\n", image->height);
+        TINY_DNG_DPRINTF("image.bps = %d\n", image->bits_per_sample);
+        TINY_DNG_DPRINTF("image.spp = %d\n", image->samples_per_pixel);
+
+        TINY_DNG_CHECK_AND_RETURN(
+            ((image->width * image->height * image->bits_per_sample) % 8) == 0,
+            "Image must be multiple of 8.", err);
+        const uint64_t len = uint64_t(image->samples_per_pixel) * uint64_t(image->width) * uint64_t(image->height) * uint64_t(image->bits_per_sample / 8);
+        // For 32bit
+        if (sizeof(void *) == 4) {
+          // Use 2GB as a max
+          if (len > uint64_t((std::numeric_limits<int32_t>::max)())) {
             if (err) {
-              (*err) += "Failed to parse CR2Slices Tag.\n";
+              (*err) += "Decoded image size exceeds 2GB.\n";
             }
             return false;
           }
         }
-        // TINY_DNG_DPRINTF("cr2_slices = %d, %d, %d\n",
-        //  image.cr2_slices[0],
-        //  image.cr2_slices[1],
-        //  image.cr2_slices[2]);
-      } break;
 
-      case TAG_SEMANTIC_NAME: {
-        size_t readLen = len;
-        if (readLen < 1) {
+        if (len > (kMaxImageSizeInMB * 1024ull * 1024ull)) {
           if (err) {
-            (*err) += "Null string for SemanticName Tag.\n";
+            (*err) += "Image data size too large. Exceeds " + std::to_string(kMaxImageSizeInMB) + " MB.\n";
           }
+          return false;
+        }
 
+        if (len == 0) {
+          if (err) {
+            (*err) += "Invalid jpeg data length.\n";
+          }
           return false;
         }
+        TINY_DNG_DPRINTF("image.data.size = %lld\n", len);
 
-        const size_t kMaxNameSize = 1024 * 1024;
+        image->data.resize(len);
+        TINY_DNG_DPRINTF("image.data.size = %d\n", int(len));
 
-        if (readLen > kMaxNameSize) {
+        if (sr.size() < data_offset) {
           if (err) {
-            (*err) += "The length of SemanticName string too large.\n";
+            (*err) += "Unexpected file size or data offset.\n";
           }
           return false;
         }
 
-        std::vector<uint8_t> buf(readLen);  // readLen includes null char
-        if (!sr.read(readLen, readLen,
-                     reinterpret_cast<unsigned char*>(buf.data()))) {
+        if (!sr.seek_set(data_offset)) {
           if (err) {
-            (*err) += "Failed to parse SemanticName Tag.\n";
+            (*err) += "Failed to seek to data offset(NewJpeg).\n";
           }
           return false;
         }
 
-        image.semantic_name = std::string(buf.begin(), buf.end());
-
-        TINY_DNG_DPRINTF("semantic_name = %s\n", image.semantic_name.c_str());
-      } break;
-
-      case TAG_OPCODE_LIST1:
-      case TAG_OPCODE_LIST2:
-      case TAG_OPCODE_LIST3: {
-        const size_t kMaxOpcodeDataSize = 1024*1024*256;
+        int lj_bits = 0;
 
-        TINY_DNG_DPRINTF("opcodelist %d\n", tag);
-        size_t readLen = len;
-        if (readLen < 1) {
+        bool ok = DecompressLosslessJPEG(
+            sr, reinterpret_cast<unsigned short*>(&(image->data.at(0))),
+            image->width, (*image), &lj_bits, err);
+        if (!ok) {
           if (err) {
-            (*err) += "Empty data for OpCodeList Tag.\n";
+            std::stringstream ss;
+            ss << "Failed to decompress LJPEG." << std::endl;
+            (*err) = ss.str();
           }
-
           return false;
         }
 
-        if (readLen > kMaxOpcodeDataSize) {
-          if (err) {
-            (*err) += "OpCodeList data too large.\n";
-          }
+        if (image->bits_per_sample_original <= 0) {
+          image->bits_per_sample_original = lj_bits;
+        }
+      }
 
-          return false;
+    } else if (image->compression == COMPRESSION_ZIP) {  // ZIP
+#ifdef TINY_DNG_LOADER_ENABLE_ZIP
+      TINY_DNG_CHECK_AND_RETURN(image->bits_per_sample_original > 0,
+                      "bits_per_sample information not found in the tag.", err);
+      image->bits_per_sample = image->bits_per_sample_original;
+      TINY_DNG_DPRINTF("bps = %d\n", image->bits_per_sample);
+      TINY_DNG_DPRINTF("data_offset = %d\n", int(data_offset));
+
+      TINY_DNG_DPRINTF("width %d\n", image->width);
+      TINY_DNG_DPRINTF("height %d\n", image->height);
+      TINY_DNG_DPRINTF("samples_per_pixel %d\n", image->samples_per_pixel);
+      TINY_DNG_DPRINTF("bits_per_sample %d\n", image->bits_per_sample);
+
+      bool ok = DecompressZIPedTiles(sr, image, err);
+      if (!ok) {
+        if (err) {
+          std::stringstream ss;
+          ss << "Failed to decompress ZIP." << std::endl;
+          (*err) += ss.str();
         }
-        std::vector<uint8_t> buf(readLen);
-        if (!sr.read(readLen, readLen,
-                     reinterpret_cast<unsigned char*>(buf.data()))) {
+        return false;
+      }
+#else
+      if (err) {
+        std::stringstream ss;
+        ss << "ZIP compression is not supported." << std::endl;
+        (*err) = ss.str();
+      }
+#endif
+    } else if ((image->compression == COMPRESSION_LOSSY) &&
+               (((image->tile_width > 0) && (image->tile_length > 0) &&
+                 !image->tile_offsets.empty()) ||
+                (image->strip_offsets.size() > 1))) {  // tiled lossy JPEG
+
+      if (!DecompressLossyJPEGTiles(sr, image, err)) {
+        TINY_DNG_ERROR_AND_RETURN("Failed to decode tiled lossy JPEG image.",
+                                  err);
+      }
+
+    } else if (image->compression == COMPRESSION_LOSSY) {  // lossy JPEG
+
+      // TOOD: Check bps and photometric_interpretation.
+
+      size_t jpeg_len = static_cast<size_t>(image->jpeg_byte_count);
+      if (image->jpeg_byte_count == -1) {
+        // No jpeg datalen. Set to the size of file - offset.
+        if (sr.size() < data_offset) {
           if (err) {
-            (*err) += "Failed to read OpCodeList data.\n";
+            (*err) += "Unexpected file size or data offset.\n";
           }
           return false;
         }
+        jpeg_len = sr.size() - data_offset;
+      }
 
-        std::vector<GainMap> *gainmaps = NULL;
-        if (tag == TAG_OPCODE_LIST1) {
-          gainmaps = &image.opcodelist1_gainmap;
-        } else if (tag == TAG_OPCODE_LIST2) {
-          gainmaps = &image.opcodelist2_gainmap;
-        } else if (tag == TAG_OPCODE_LIST3) {
-          gainmaps = &image.opcodelist3_gainmap;
+      int w_info = 0, h_info = 0, components_info = 0;
+      if (!GetJPEGInfo(sr.data() + data_offset, jpeg_len, &w_info, &h_info,
+                       &components_info)) {
+        if (err) {
+          (*err) +=
+              "Currently We only supports Standard JPEG data for Lossy "
+              "compression(34892).\n";
+        }
+        return false;
+      }
+
+      if ((components_info != 1) && (components_info != 3)) {
+        if (err) {
+          (*err) += "Unsupported channels in JPEG data.\n";
+        }
+        return false;
+      }
+
+      if ((w_info < 1) || (h_info < 1)) {
+        if (err) {
+          (*err) += "Invalid JPEG image resolution.\n";
+        }
+        return false;
+      }
+
+      int w = 0, h = 0, components = 0;
+      std::string jpeg_err;
+      if (!DecodeJPEG(sr.data() + data_offset, jpeg_len, /* scale_denom */ 1,
+                      &image->data, &w, &h, &components, &jpeg_err)) {
+        // Probably 16bit JPEG?
+        image->bits_per_sample_original = 1;  // FIXME
+        image->bits_per_sample = 1;           // FIXME
+
+        if (err) {
+          std::stringstream ss;
+          ss << "Unsupported lossy JPEG compression(16bit JPEG?)." << std::endl;
+          (*err) = ss.str();
         }
 
-        if (!ParseOpcodeList(tag, buf.data(), buf.size(), gainmaps)) {
+      } else {
+        image->width = w;
+        image->height = h;
+        image->samples_per_pixel = components;
+        image->bits_per_sample = 8;
+
+#if defined(TINY_DNG_DEBUG_SAVEIMAGE)
+        std::string output_filename = "layer-" + std::to_string(i) + ".png";
+        stbi_write_png(output_filename.c_str(), w, h, components,
+                       reinterpret_cast<const void*>(image->data.data()),
+                       /* stride */ 0);
+#endif
+      }
+
+    } else if (image->compression == 34713) {  // NEF lossless?
+
+      image->bits_per_sample_original = 1;  // FIXME
+      image->bits_per_sample = 1;           // FIXME
+
+      if (err) {
+        std::stringstream ss;
+        ss << "Seems a NEF RAW. This compression is not supported."
+           << std::endl;
+        (*err) = ss.str();
+      }
+    } else {
+      if (err) {
+        std::stringstream ss;
+        ss << "IFD [" << i << "] "
+           << " Unsupported compression type : " << image->compression
+           << std::endl;
+        (*err) = ss.str();
+      }
+      return false;
+    }
+  }
+
+  if (option.unpack_to_uint16) {
+    for (size_t i = 0; i < images->size(); i++) {
+      tinydng::DNGImage* image = &((*images)[i]);
+
+      const int bps = image->bits_per_sample;
+      const unsigned char* src =
+          image->data_view ? image->data_view : image->data.data();
+      const size_t src_len =
+          image->data_view ? image->data_view_size : image->data.size();
+      if ((bps <= 0) || (bps >= 16) || (bps == 8) || (src_len == 0)) {
+        continue;
+      }
+
+      // Other compressions already decode into 8 or 16 bits.
+      if ((image->compression != COMPRESSION_NONE) &&
+          (image->compression != COMPRESSION_LZW) &&
+          (image->compression != COMPRESSION_ZIP)) {
+        continue;
+      }
+
+      // Rows of the stored image are padded to a byte boundary.
+      const size_t row_samples =
+          size_t(image->samples_per_pixel) * size_t(image->width);
+      const size_t rows = size_t(image->height);
+      std::vector<unsigned char> unpacked(row_samples * rows *
+                                          sizeof(uint16_t));
+      if (!UnpackBitsRowsToU16(src, src_len, row_samples, rows, bps,
+                               /* lsb_first */ false,
+                               reinterpret_cast<uint16_t*>(unpacked.data()),
+                               err)) {
+        return false;
+      }
+
+      image->data.swap(unpacked);
+      image->data_view = nullptr;
+      image->data_view_size = 0;
+      image->bits_per_sample = 16;
+    }
+  }
+
+  //
+  // Postprocessing. Calculate while_level.
+  //
+  for (size_t i = 0; i < images->size(); i++) {
+    tinydng::DNGImage* image = &((*images)[i]);
+
+    if (image->samples_per_pixel > 4) {
+      if (err) {
+        (*err) += "Cannot handle > 4 samples per pixel.\n";
+      }
+      return false;
+    }
+    for (int s = 0; s < image->samples_per_pixel; s++) {
+      if (image->white_level[s] == -1) {
+        // Set white level with (2 ** BitsPerSample) according to the DNG spec.
+        if (image->bits_per_sample_original == 0) {
           if (err) {
-            (*err) += "Failed to parse OpCodeList Tag.\n";
+            (*err) += "Bits per sample of image has to be > 0.\n";
           }
           return false;
         }
 
-        TINY_DNG_DPRINTF("opcodelist %d, dataLen = %d\n", tag, int(readLen));
-
-      } break;
+        if (image->bits_per_sample_original >=
+            32) {  // workaround for 32bit floating point TIFF.
+          image->white_level[s] = -1;
+        } else {
+          if (image->bits_per_sample_original >= 32) {
+            if (err) {
+              (*err) += "Cannot handle >= 32 bits per sample.\n";
+            }
+            return false;
+          }
 
-      default: {
-        FieldData data;
-        int ret = ParseCustomField(sr, custom_field_lists, tag, type, len,
-                                   &data, err);
-        if (ret == -1) {
-          return false;
+          image->white_level[s] = (1 << image->bits_per_sample_original) - 1;
         }
+      }
 
-        if (ret > 0) {
-          image.custom_fields.push_back(data);
+      // Shrink value when TIFF tag white level is larger than (2**bps)
+      // e.g. Set to 4096 if TIFF white_balance tag has 65535 but bps == 12
+      // FIXME: Is this ok according to DNG spec?
+      if ((image->bits_per_sample_original > 0) &&
+          (image->bits_per_sample_original < 30)) {
+        if (image->white_level[s] >= (1 << image->bits_per_sample_original)) {
+          image->white_level[s] = (1 << image->bits_per_sample_original) - 1;
         }
-        // TINY_DNG_DPRINTF("unknown or unsupported tag = %d\n", tag);
       }
     }
+  }
 
-    sr.seek_set(saved_offt);
+  return ret ? true : false;
+}
+
+bool IsDNGFromMemory(const char* mem, unsigned int size, std::string* msg) {
+  if ((mem == NULL) || (size < 32)) {
+    if (msg) {
+      (*msg) = "Invalid argument. argument is null or invalid.\n";
+    }
+    return false;
   }
 
-  if (image.rows_per_strip > 0) {
-    if (image.height == -1) {
-      if (err) {
-        (*err) = "image height tag is required to compute StripsPerImage.\n";
-      }
-      return false;
+  const unsigned short magic = *(reinterpret_cast<const unsigned short*>(mem));
+
+  if (magic == 0x4949) {
+    // might be TIFF(DNG).
+  } else if (magic == 0x4d4d) {
+    // might be TIFF(DNG, bigendian).
+    if (msg) {
+      (*msg) = "DNG is big endian";
     }
+  } else {
+    return false;
+  }
 
-    // http://www.awaresystems.be/imaging/tiff/tifftags/rowsperstrip.html
-    image.strips_per_image =
-        static_cast<int>(floor(double(image.height + image.rows_per_strip - 1) /
-                               double(image.rows_per_strip)));
-    TINY_DNG_DPRINTF("rows_per_strip = %d\n", image.samples_per_pixel);
-    TINY_DNG_DPRINTF("strips_per_image = %d\n", image.strips_per_image);
+  return true;
+}
+
+bool GetPreviewJPEGs(const char* mem, unsigned int size,
+                     std::vector<PreviewJPEG>* previews, std::string* warn,
+                     std::string* err) {
+  if ((mem == NULL) || (size < 32) || (!previews)) {
+    if (err) {
+      (*err) = "Invalid argument. argument is null or invalid.\n";
+    }
+    return false;
   }
 
-  // Delayed read of strip offsets and strip byte counts
-  if (image.strips_per_image > 0) {
-    image.strip_byte_counts.clear();
-    image.strip_offsets.clear();
+  previews->clear();
 
-    long curr_offt = static_cast<long>(sr.tell());
+  bool is_dng_big_endian = false;
 
-    if (offt_strip_byte_counts > 0) {
-      if (!sr.seek_set(uint64_t(offt_strip_byte_counts))) {
-        if (err) {
-          (*err) = "Failed to seek.\n";
-        }
-        return false;
-      }
+  const unsigned short magic = *(reinterpret_cast<const unsigned short*>(mem));
 
-      for (int k = 0; k < image.strips_per_image; k++) {
-        unsigned int strip_byte_count;
-        if (!sr.read4(&strip_byte_count)) {
-          if (err) {
-            (*err) += "Failed to read StripByteCount value.\n";
-          }
-          return false;
-        }
-        TINY_DNG_DPRINTF("strip_byte_counts[%d] = %u\n", k, strip_byte_count);
-        image.strip_byte_counts.push_back(strip_byte_count);
-      }
+  if (magic == 0x4949) {
+    // might be TIFF(DNG).
+  } else if (magic == 0x4d4d) {
+    // might be TIFF(DNG, bigendian).
+    is_dng_big_endian = true;
+  } else {
+    TINY_DNG_ERROR_AND_RETURN("Seems the data is not a DNG format.", err);
+  }
+
+  const bool swap_endian = (is_dng_big_endian && (!IsBigEndian()));
+  StreamReader sr(reinterpret_cast<const uint8_t*>(mem), size, swap_endian);
+
+  // skip magic header
+  if (!sr.seek_set(4)) {
+    TINY_DNG_ERROR_AND_RETURN("Failed to seek to offset 4.", err);
+  }
+
+  std::vector<FieldInfo> custom_fields;  // not used.
+  std::vector<DNGImage> images;
+  if (!ParseDNGFromMemory(sr, custom_fields, &images, warn, err)) {
+    TINY_DNG_ERROR_AND_RETURN("Failed to parse DNG data.", err);
+  }
+
+  for (size_t i = 0; i < images.size(); i++) {
+    const DNGImage& image = images[i];
+
+    if ((image.compression != COMPRESSION_OLD_JPEG) &&
+        (image.compression != COMPRESSION_NEW_JPEG) &&
+        (image.compression != COMPRESSION_LOSSY) &&
+        !((image.compression == COMPRESSION_NONE) &&
+          (image.jpeg_byte_count > 0))) {  // CR2 thumbnail
+      continue;
     }
 
-    if (offt_strip_offset > 0) {
-      if (!sr.seek_set(uint64_t(offt_strip_offset))) {
-        if (err) {
-          (*err) = "Failed to seek.\n";
-        }
-        return false;
-      }
+    // JPEG split into tiles or strips cannot be served as a single stream.
+    if ((image.offset == 0) || (image.tile_offsets.size() > 1) ||
+        (image.strip_byte_counts.size() > 1)) {
+      continue;
+    }
 
-      for (int k = 0; k < image.strips_per_image; k++) {
-        unsigned int strip_offset;
-        if (!sr.read4(&strip_offset)) {
-          if (err) {
-            (*err) += "Failed to read StripOffset value.\n";
-          }
-          return false;
-        }
+    size_t length = 0;
+    if (image.jpeg_byte_count > 0) {
+      length = size_t(image.jpeg_byte_count);
+    } else if (image.strip_byte_counts.size() == 1) {
+      length = size_t(image.strip_byte_counts[0]);
+    } else if (image.strip_byte_count > 0) {
+      length = size_t(image.strip_byte_count);
+    }
 
-        TINY_DNG_DPRINTF("strip_offset[%d] = %u\n", k, strip_offset);
-        image.strip_offsets.push_back(strip_offset);
+    const size_t offset = size_t(image.offset);
+    if ((length < 4) || (offset > sr.size()) || (length > (sr.size() - offset))) {
+      if (warn) {
+        std::stringstream ss;
+        ss << i << "'th image has an invalid JPEG data range. Skipped.\n";
+        (*warn) += ss.str();
       }
+      continue;
     }
 
-    if (!sr.seek_set(uint64_t(curr_offt))) {
-      if (err) {
-        (*err) = "Failed to seek.\n";
-      }
-      return false;
+    // Only JPEG markers up to SOF are read. Fails for lossless JPEG.
+    int w = 0, h = 0, components = 0;
+    if (!GetJPEGInfo(sr.data() + offset, length, &w, &h, &components)) {
+      continue;
     }
+
+    PreviewJPEG preview;
+    preview.offset = offset;
+    preview.length = length;
+    preview.image_index = static_cast<int>(i);
+    preview.compression = image.compression;
+    preview.width = w;
+    preview.height = h;
+    preview.components = components;
+
+    previews->push_back(preview);
   }
-  //
 
-  // Add to images.
-  if (images->size() < kMaxImages) {
-    images->push_back(image);
+  return true;
+}
+
+bool DecodeJPEG(const unsigned char* src, size_t src_len, int scale_denom,
+                std::vector<unsigned char>* dst, int* width, int* height,
+                int* components, std::string* err) {
+  TINY_DNG_CHECK_AND_RETURN(src && dst && width && height && components,
+                            "Invalid argument.", err);
+  TINY_DNG_CHECK_AND_RETURN((scale_denom == 1) || (scale_denom == 2) ||
+                                (scale_denom == 4) || (scale_denom == 8),
+                            "scale_denom must be 1, 2, 4 or 8.", err);
+  TINY_DNG_CHECK_AND_RETURN(
+      (src_len > 0) && (src_len <= size_t((std::numeric_limits<int>::max)())),
+      "Invalid JPEG data length.", err);
+
+#if defined(TINY_DNG_LOADER_USE_LIBJPEG_TURBO)
+  char message[JMSG_LENGTH_MAX];
+  message[0] = '\0';
+  if (!DecodeJPEGTurbo(src, src_len, scale_denom, dst, width, height,
+                       components, message)) {
+    dst->clear();
+    TINY_DNG_ERROR_AND_RETURN("Could not decode JPEG image. " << message, err);
+  }
+#else
+  int w_info = 0, h_info = 0, components_info = 0;
+  if (1 != stbi_info_from_memory(src, static_cast<int>(src_len), &w_info,
+                                 &h_info, &components_info)) {
+    TINY_DNG_ERROR_AND_RETURN("Not a JPEG data.", err);
+  }
+  TINY_DNG_CHECK_AND_RETURN((components_info == 1) || (components_info == 3),
+                            "Unsupported channels in JPEG data.", err);
+
+  int w = 0, h = 0, n = 0;
+  unsigned char* decoded_image =
+      stbi_load_from_memory(src, static_cast<int>(src_len), &w, &h, &n,
+                            /* desired_channels */ components_info);
+  TINY_DNG_CHECK_AND_RETURN(decoded_image, "Could not decode JPEG image.", err);
+
+  const int out_w = (w + scale_denom - 1) / scale_denom;
+  const int out_h = (h + scale_denom - 1) / scale_denom;
+  dst->resize(size_t(out_w) * size_t(out_h) * size_t(components_info));
+  if (scale_denom == 1) {
+    memcpy(dst->data(), decoded_image, dst->size());
   } else {
-    if (warn) {
-      (*warn) = "Too many images in one DNG file. Skipped some images\n";
-    }
+    DownscaleBox(decoded_image, w, h, components_info, scale_denom,
+                 dst->data());
   }
+  free(decoded_image);
 
-  // TINY_DNG_DPRINTF("DONE ---------\n");
+  (*width) = out_w;
+  (*height) = out_h;
+  (*components) = components_info;
+#endif
 
   return true;
 }
 
-static bool ParseDNGFromMemory(const StreamReader& sr,
-                               const std::vector<FieldInfo>& custom_fields,
-                               std::vector<tinydng::DNGImage>* images,
-                               std::string* warn, std::string* err) {
-  if (!images) {
-    if (err) {
-      (*err) += "Invalid `images` argument.\n";
+bool IsDNG(const char* filename, std::string* msg) {
+  std::stringstream ss;
+
+  FILE* fp = NULL;
+#if defined(_WIN32)
+
+#if defined(_MSC_VER) || defined(__MINGW32__)  // MSVC, MinGW gcc or clang
+  errno_t errcode = _wfopen_s(&fp, UTF8ToWchar(filename).c_str(), L"rb");
+  if (errcode != 0) {
+    if (msg) {
+      (*msg) += "Error opening file: " + std::string(filename) + "(errno " +
+                std::to_string(errcode) + ")\n";
     }
     return false;
   }
+#else
+  // Unknown compiler
+  fp = fopen(filename, "rb");
+#endif
 
-  unsigned int offt;
-  if (!sr.read4(&offt)) {
-    if (err) {
-      (*err) += "Failed to read offset.\n";
+#else
+  fp = fopen(filename, "rb");
+#endif
+  if (!fp) {
+    ss << "File not found or cannot open file " << filename << std::endl;
+    if (msg) {
+      (*msg) = ss.str();
     }
     return false;
   }
 
-  TINY_DNG_DPRINTF("First IFD offt: %d\n", offt);
+  if (0 != fseek(fp, 0, SEEK_END)) {
+    if (msg) {
+      (*msg) = "Error seeking.\n";
+    }
+    return false;
+  }
 
-  size_t count = 0;
+  size_t file_size = static_cast<size_t>(ftell(fp));
+
+  std::vector<unsigned char> whole_data;
+  {
+    whole_data.resize(file_size);
+    fseek(fp, 0, SEEK_SET);
+    size_t read_len = fread(whole_data.data(), 1, file_size, fp);
+    if (read_len != file_size) {
+      if (msg) {
+        (*msg) += "Unexpected file size.\n";
+      }
+      return false;
+    }
+
+    fseek(fp, 0, SEEK_SET);
+  }
+  fclose(fp);
+
+  return IsDNGFromMemory(reinterpret_cast<const char*>(whole_data.data()),
+                         static_cast<unsigned int>(whole_data.size()), msg);
+}
+
+bool UnpackBitsToU16(const unsigned char* src, size_t src_len,
+                     size_t num_samples, int bits_per_sample, bool lsb_first,
+                     unsigned short* dst, std::string* err) {
+  TINY_DNG_CHECK_AND_RETURN((bits_per_sample >= 1) && (bits_per_sample <= 16),
+                            "Invalid bits_per_sample " << bits_per_sample,
+                            err);
+  if (num_samples == 0) {
+    return true;
+  }
+  TINY_DNG_CHECK_AND_RETURN(src && dst, "Invalid argument. src or dst is null.",
+                            err);
+
+  const size_t bps = size_t(bits_per_sample);
+  TINY_DNG_CHECK_AND_RETURN(
+      num_samples <= (std::numeric_limits<size_t>::max)() / bps,
+      "Too many samples.", err);
+  const size_t packed_len = (num_samples * bps + 7) / 8;
+  TINY_DNG_CHECK_AND_RETURN(src_len >= packed_len,
+                            "Insufficient input. " << packed_len
+                                << " bytes required but got " << src_len,
+                            err);
+
+  // Each chunk has a multiple of 8 samples, thus starts at a byte boundary.
+  const size_t kChunkSamples = 1024 * 64;
+  const size_t num_chunks = (num_samples + kChunkSamples - 1) / kChunkSamples;
+
+  return ParallelFor(
+      num_chunks, GetNumWorkers(num_chunks), err,
+      [&](size_t k, int thread_id, std::string* thread_err) {
+        (void)thread_id;
+        (void)thread_err;
+        const size_t start = k * kChunkSamples;
+        const size_t n = (std::min)(kChunkSamples, num_samples - start);
+        const size_t offset = (start / 8) * bps;
+        UnpackBitsRange(src + offset, src_len - offset, n, bits_per_sample,
+                        lsb_first, dst + start);
+        return true;
+      });
+}
+
+bool UnpackBitsRowsToU16(const unsigned char* src, size_t src_len,
+                         size_t row_samples, size_t rows, int bits_per_sample,
+                         bool lsb_first, unsigned short* dst,
+                         std::string* err) {
+  TINY_DNG_CHECK_AND_RETURN((bits_per_sample >= 1) && (bits_per_sample <= 16),
+                            "Invalid bits_per_sample " << bits_per_sample,
+                            err);
+  if ((row_samples == 0) || (rows == 0)) {
+    return true;
+  }
+  TINY_DNG_CHECK_AND_RETURN(
+      rows <= (std::numeric_limits<size_t>::max)() / row_samples,
+      "Too many samples.", err);
+
+  const size_t bps = size_t(bits_per_sample);
+  if (((row_samples * bps) % 8) == 0) {
+    // No padding.
+    return UnpackBitsToU16(src, src_len, row_samples * rows, bits_per_sample,
+                           lsb_first, dst, err);
+  }
+
+  TINY_DNG_CHECK_AND_RETURN(src && dst, "Invalid argument. src or dst is null.",
+                            err);
+  TINY_DNG_CHECK_AND_RETURN(
+      row_samples <= (std::numeric_limits<size_t>::max)() / bps,
+      "Too many samples.", err);
+  const size_t stride = (row_samples * bps + 7) / 8;
+  TINY_DNG_CHECK_AND_RETURN(rows <= src_len / stride,
+                            "Insufficient input. " << stride * rows
+                                << " bytes required but got " << src_len,
+                            err);
+
+  // About 64K samples per chunk.
+  const size_t chunk_rows =
+      (std::max)(size_t(1), size_t(1024 * 64) / row_samples);
+  const size_t num_chunks = (rows + chunk_rows - 1) / chunk_rows;
+
+  return ParallelFor(
+      num_chunks, GetNumWorkers(num_chunks), err,
+      [&](size_t k, int thread_id, std::string* thread_err) {
+        (void)thread_id;
+        (void)thread_err;
+        const size_t y_end = (std::min)(rows, (k + 1) * chunk_rows);
+        for (size_t y = k * chunk_rows; y < y_end; y++) {
+          UnpackBitsRange(src + y * stride, src_len - y * stride, row_samples,
+                          bits_per_sample, lsb_first, dst + y * row_samples);
+        }
+        return true;
+      });
+}
+
+// ---------------------------------------------------------------------------
+// OpcodeList processing.
+
+///
+/// Image region processed by an opcode. Opcodes in OpcodeList1 work on the
+/// whole stored image(stage 1). OpcodeList2 and OpcodeList3 work on the
+/// ActiveArea(stage 2 and 3), so their coordinates are offset by the
+/// ActiveArea origin in `DNGImage::data`.
+///
+struct OpcodeBounds {
+  size_t top{0};  // origin in `DNGImage::data`
+  size_t left{0};
+  size_t height{0};
+  size_t width{0};
+};
+
+static bool GetOpcodeBounds(const DNGImage& image, unsigned int list_idx,
+                            OpcodeBounds* bounds, std::string* err) {
+  TINY_DNG_CHECK_AND_RETURN((image.width > 0) && (image.height > 0),
+                            "Invalid image size.", err);
+
+  bounds->top = 0;
+  bounds->left = 0;
+  bounds->height = size_t(image.height);
+  bounds->width = size_t(image.width);
+
+  if ((list_idx != 1) && image.has_active_area) {
+    const int top = image.active_area[0];
+    const int left = image.active_area[1];
+    const int bottom = image.active_area[2];
+    const int right = image.active_area[3];
+    TINY_DNG_CHECK_AND_RETURN((top >= 0) && (left >= 0) && (top < bottom) &&
+                                  (left < right) && (bottom <= image.height) &&
+                                  (right <= image.width),
+                              "Invalid ActiveArea.", err);
+    bounds->top = size_t(top);
+    bounds->left = size_t(left);
+    bounds->height = size_t(bottom - top);
+    bounds->width = size_t(right - left);
+  }
+
+  return true;
+}
+
+///
+/// Black level of each sample of the rows of the ActiveArea for each row
+/// phase of BlackLevelRepeatDim: BlackLevel per pattern position and sample
+/// (`black_level` per sample without the pattern), then BlackLevelDeltaH in
+/// `offsets`. BlackLevelDeltaV is added per row.
+///
+struct BlackLevelTable {
+  size_t phases{1};
+  size_t row_samples{0};
+  std::vector<float> levels;   // [phase][sample]
+  std::vector<float> offsets;  // [phase][sample], BlackLevelDeltaH added
+  const std::vector<float>* delta_v{nullptr};
 
-  while (offt) {
-    if (!sr.seek_set(offt)) {
-      if (err) {
-        (*err) += "Failed to seek to TIFF IFD.\n";
-      }
-      return false;
-    }
+  const float* Level(size_t row) const {
+    return levels.data() + (row % phases) * row_samples;
+  }
+  const float* Offset(size_t row) const {
+    return offsets.data() + (row % phases) * row_samples;
+  }
+  float DeltaV(size_t row) const {
+    return (!delta_v || delta_v->empty()) ? 0.0f : (*delta_v)[row];
+  }
 
-    // TINY_DNG_DPRINTF("Parse TIFF IFD\n");
-    if (!ParseTIFFIFD(sr, custom_fields, images, warn, err)) {
-      break;
+  // Whole black level of each sample of `row`. `scratch` has `row_samples`
+  // floats and is used when the row has BlackLevelDeltaV.
+  const float* RowOffsets(size_t row, float* scratch) const {
+    const float* offset = Offset(row);
+    const float delta = DeltaV(row);
+    if (delta == 0.0f) {
+      return offset;
     }
-    // Get next IFD offset(0 = end of file).
-    if (!sr.read4(&offt)) {
-      if (err) {
-        (*err) += "Failed to read next IDF offset.\n";
-      }
-      return false;
+    for (size_t i = 0; i < row_samples; i++) {
+      scratch[i] = offset[i] + delta;
     }
+    return scratch;
+  }
+};
 
-    TINY_DNG_DPRINTF("Next IFD offset = %d\n", offt);
+// Zero black level, for data which is not linear raw values.
+static void ZeroBlackLevelTable(size_t row_samples, BlackLevelTable* table) {
+  table->phases = 1;
+  table->row_samples = row_samples;
+  table->levels.assign(row_samples, 0.0f);
+  table->offsets.assign(row_samples, 0.0f);
+  table->delta_v = nullptr;
+}
 
-    // Avoid infinite loop
-    count++;
-    if (count > kMaxImages) {
-      if (warn) {
-        (*warn) += "Too many IFDs. IFD offset seems invalid.\n";
+// `width` x `height` is the size of the ActiveArea.
+static bool BuildBlackLevelTable(const DNGImage& image, size_t width,
+                                 size_t height, size_t spp,
+                                 BlackLevelTable* table, std::string* err) {
+  const std::vector<float>& repeat = image.black_level_repeat;
+  size_t black_rows = 1;
+  size_t black_cols = 1;
+  if (!repeat.empty()) {
+    black_rows = size_t((std::max)(image.black_level_repeat_dim[0], 1));
+    black_cols = size_t((std::max)(image.black_level_repeat_dim[1], 1));
+    TINY_DNG_CHECK_AND_RETURN(
+        repeat.size() == black_rows * black_cols * spp,
+        "Count of BlackLevel(" << repeat.size()
+                               << ") does not match BlackLevelRepeatDim("
+                               << black_rows << " x " << black_cols
+                               << ") x SamplesPerPixel.",
+        err);
+  }
+  const std::vector<float>& delta_h = image.black_level_delta_h;
+  const std::vector<float>& delta_v = image.black_level_delta_v;
+  TINY_DNG_CHECK_AND_RETURN(delta_h.empty() || (delta_h.size() == width),
+                            "Count of BlackLevelDeltaH must be the width of "
+                            "the ActiveArea.",
+                            err);
+  TINY_DNG_CHECK_AND_RETURN(delta_v.empty() || (delta_v.size() == height),
+                            "Count of BlackLevelDeltaV must be the height of "
+                            "the ActiveArea.",
+                            err);
+
+  const size_t row_samples = width * spp;
+  table->phases = black_rows;
+  table->row_samples = row_samples;
+  table->delta_v = &delta_v;
+  table->levels.resize(black_rows * row_samples);
+  table->offsets.resize(black_rows * row_samples);
+  for (size_t p = 0; p < black_rows; p++) {
+    float* level = table->levels.data() + p * row_samples;
+    float* offset = table->offsets.data() + p * row_samples;
+    for (size_t x = 0; x < width; x++) {
+      for (size_t s = 0; s < spp; s++) {
+        const float black =
+            repeat.empty()
+                ? float(image.black_level[(std::min)(s, size_t(3))])
+                : repeat[(p * black_cols + (x % black_cols)) * spp + s];
+        level[x * spp + s] = black;
+        offset[x * spp + s] = black + (delta_h.empty() ? 0.0f : delta_h[x]);
       }
-      break;
     }
   }
-
   return true;
 }
 
-static bool IsBigEndian() {
-  uint32_t i = 0x01020304;
-  char c[4];
-  memcpy(c, &i, 4);
-  return (c[0] == 1);
+///
+/// Area of the opcode clipped to the bounds. Rows and columns are
+/// `top + k * row_pitch` and `left + k * col_pitch`(relative to the bounds).
+///
+struct OpcodeArea {
+  size_t top{0};
+  size_t left{0};
+  size_t num_rows{0};
+  size_t num_cols{0};
+  size_t row_pitch{1};
+  size_t col_pitch{1};
+  size_t plane{0};
+  size_t num_planes{0};
+};
+
+static bool ComputeOpcodeArea(unsigned int top, unsigned int left,
+                              unsigned int bottom, unsigned int right,
+                              unsigned int plane, unsigned int planes,
+                              unsigned int row_pitch, unsigned int col_pitch,
+                              const OpcodeBounds& bounds, size_t spp,
+                              OpcodeArea* area) {
+  const size_t b = (std::min)(size_t(bottom), bounds.height);
+  const size_t r = (std::min)(size_t(right), bounds.width);
+  const size_t rp = (std::max)(size_t(1), size_t(row_pitch));
+  const size_t cp = (std::max)(size_t(1), size_t(col_pitch));
+
+  area->top = size_t(top);
+  area->left = size_t(left);
+  area->row_pitch = rp;
+  area->col_pitch = cp;
+  area->num_rows = (area->top < b) ? (b - area->top + rp - 1) / rp : 0;
+  area->num_cols = (area->left < r) ? (r - area->left + cp - 1) / cp : 0;
+  area->plane = size_t(plane);
+  area->num_planes =
+      (area->plane < spp) ? (std::min)(size_t(planes), spp - area->plane) : 0;
+
+  // false when nothing to process.
+  return (area->num_rows > 0) && (area->num_cols > 0) &&
+         (area->num_planes > 0);
 }
 
-// C++03 and tiff lzw port of https://github.com/glampert/compression-algorithms
-// =============================================================================
-//
-// File: lzw.hpp
-// Author: Guilherme R. Lampert
-// Created on: 17/02/16
-// Brief: LZW encoder/decoder in C++11 with varying length dictionary codes.
-//
-#ifdef __clang__
-#pragma clang diagnostic push
-#pragma clang diagnostic ignored "-Wpadded"
-#endif
-namespace lzw {
+// Map index and interpolation weight of a pixel(DNG SDK's
+// dng_gain_map_interpolator). `rel` is the pixel center relative to the
+// bounds(0.0 ~ 1.0).
+static inline void GainMapIndex(double rel, double origin, double spacing,
+                                size_t num_points, size_t* i0, size_t* i1,
+                                float* frac) {
+  const double f = (spacing == 0.0) ? 0.0 : (rel - origin) / spacing;
+  if ((f <= 0.0) || (num_points < 2)) {
+    (*i0) = 0;
+    (*i1) = 0;
+    (*frac) = 0.0f;
+  } else if (f >= double(num_points - 1)) {
+    (*i0) = num_points - 1;
+    (*i1) = num_points - 1;
+    (*frac) = 0.0f;
+  } else {
+    (*i0) = size_t(f);
+    (*i1) = (*i0) + 1;
+    (*frac) = float(f - double(*i0));
+  }
+}
 
-class Dictionary {
- public:
-  struct Entry {
-    int code;
-    int value;
-  };
+///
+/// GainMap prepared for the area. Each map row is interpolated horizontally
+/// at every column of the area in advance, so the gains of a pixel row are
+/// a linear interpolation of two contiguous arrays(separable bilinear
+/// interpolation).
+///
+struct GainMapPlan {
+  OpcodeArea area;
+  size_t map_points_v{0};
+  size_t map_planes{0};
+  double origin_v{0.0};
+  double spacing_v{0.0};
+  double bounds_height{1.0};
+
+  // [map_plane][map_row][area column]
+  std::vector<float> row_gains;
+};
 
-  // Dictionary entries 0-255 are always reserved to the byte/ASCII range.
-  int size_;
-  Entry entries_[4096];
+static bool BuildGainMapPlan(const GainMap& gmap, const OpcodeBounds& bounds,
+                             size_t spp, GainMapPlan* plan, std::string* err) {
+  TINY_DNG_CHECK_AND_RETURN(
+      (gmap.map_points_v > 0) && (gmap.map_points_h > 0) &&
+          (gmap.map_planes > 0) &&
+          (gmap.pixels.size() >= size_t(gmap.map_points_v) *
+                                     size_t(gmap.map_points_h) *
+                                     size_t(gmap.map_planes)),
+      "Invalid GainMap size.", err);
+
+  if (!ComputeOpcodeArea(gmap.top, gmap.left, gmap.bottom, gmap.right,
+                         gmap.plane, gmap.planes, gmap.row_pitch,
+                         gmap.col_pitch, bounds, spp, &plan->area)) {
+    plan->area.num_rows = 0;
+    return true;
+  }
 
-  Dictionary();
-  int findIndex(int code, int value) const;
-  bool add(int code, int value);
-  bool flush(int& codeBitsWidth);
-  void init();
-  int size() { return size_; }
-};
+  const OpcodeArea& area = plan->area;
+  const size_t points_v = size_t(gmap.map_points_v);
+  const size_t points_h = size_t(gmap.map_points_h);
+  const size_t map_planes = size_t(gmap.map_planes);
+
+  plan->map_points_v = points_v;
+  plan->map_planes = map_planes;
+  plan->origin_v = gmap.map_origin_v;
+  plan->spacing_v = gmap.map_spacing_v;
+  plan->bounds_height = double(bounds.height);
+
+  plan->row_gains.resize(map_planes * points_v * area.num_cols);
+
+  for (size_t x = 0; x < area.num_cols; x++) {
+    const size_t col = area.left + x * area.col_pitch;
+    const double rel = (double(col) + 0.5) / double(bounds.width);
+    size_t i0, i1;
+    float frac;
+    GainMapIndex(rel, gmap.map_origin_h, gmap.map_spacing_h, points_h, &i0,
+                 &i1, &frac);
+
+    for (size_t mp = 0; mp < map_planes; mp++) {
+      for (size_t v = 0; v < points_v; v++) {
+        const float g0 = gmap.pixels[(v * points_h + i0) * map_planes + mp];
+        const float g1 = gmap.pixels[(v * points_h + i1) * map_planes + mp];
+        plan->row_gains[(mp * points_v + v) * area.num_cols + x] =
+            g0 + (g1 - g0) * frac;
+      }
+    }
+  }
 
-// ========================================================
-// class Dictionary:
-// ========================================================
+  return true;
+}
 
-Dictionary::Dictionary() { init(); }
+// Two map rows(per area column) to interpolate with `frac` for the `y`th row
+// of the area and the map plane `mp`.
+static void GainMapRows(const GainMapPlan& plan, size_t y, size_t mp,
+                        const float** g0, const float** g1, float* frac) {
+  const OpcodeArea& area = plan.area;
+  const size_t row = area.top + y * area.row_pitch;
+  const double rel = (double(row) + 0.5) / plan.bounds_height;
+  size_t i0, i1;
+  GainMapIndex(rel, plan.origin_v, plan.spacing_v, plan.map_points_v, &i0,
+               &i1, frac);
+  (*g0) = &plan.row_gains[(mp * plan.map_points_v + i0) * area.num_cols];
+  (*g1) = &plan.row_gains[(mp * plan.map_points_v + i1) * area.num_cols];
+}
 
-void Dictionary::init() {
-  // First 256 dictionary entries are reserved to the byte/ASCII
-  // range. Additional entries follow for the character sequences
-  // found in the input. Up to 4096 - 256 (MaxDictEntries - FirstCode).
-  size_ = 256;
-  for (int i = 0; i < size_; ++i) {
-    entries_[i].code = -1;
-    entries_[i].value = i;
+// Multiply the gains of the `y`th row of the area for the map plane `mp` into
+// `gains`(every `stride` elements).
+static void GainMapRowGains(const GainMapPlan& plan, size_t y, size_t mp,
+                            size_t stride, float* gains) {
+  const OpcodeArea& area = plan.area;
+  const float* g0;
+  const float* g1;
+  float frac;
+  GainMapRows(plan, y, mp, &g0, &g1, &frac);
+
+  if (stride == 1) {
+    size_t x = 0;
+#if defined(TINY_DNG_LOADER_SIMD_SSE2)
+    const __m128 f = _mm_set1_ps(frac);
+    for (; x + 4 <= area.num_cols; x += 4) {
+      const __m128 a = _mm_loadu_ps(g0 + x);
+      const __m128 b = _mm_loadu_ps(g1 + x);
+      const __m128 g = _mm_add_ps(a, _mm_mul_ps(_mm_sub_ps(b, a), f));
+      _mm_storeu_ps(gains + x, _mm_mul_ps(_mm_loadu_ps(gains + x), g));
+    }
+#elif defined(TINY_DNG_LOADER_SIMD_NEON)
+    const float32x4_t f = vdupq_n_f32(frac);
+    for (; x + 4 <= area.num_cols; x += 4) {
+      const float32x4_t a = vld1q_f32(g0 + x);
+      const float32x4_t b = vld1q_f32(g1 + x);
+      const float32x4_t g = vmlaq_f32(a, vsubq_f32(b, a), f);
+      vst1q_f32(gains + x, vmulq_f32(vld1q_f32(gains + x), g));
+    }
+#endif
+    for (; x < area.num_cols; x++) {
+      gains[x] *= g0[x] + (g1[x] - g0[x]) * frac;
+    }
+  } else {
+    for (size_t x = 0; x < area.num_cols; x++) {
+      gains[x * stride] *= g0[x] + (g1[x] - g0[x]) * frac;
+    }
   }
+}
 
-  // 256 is reserved for ClearCode, 257 is reserved for end of stream, thus
-  // FistCode starts with 258
-  size_ = 258;  // = 256 + 2
+#if defined(TINY_DNG_LOADER_SIMD_SSE2)
+// Clamp to [0, 65535], round half up and store 8 values.
+static inline void StoreRoundedU16(uint16_t* p, __m128 lo, __m128 hi) {
+  const __m128 zero = _mm_setzero_ps();
+  const __m128 maxv = _mm_set1_ps(65535.0f);
+  const __m128 half = _mm_set1_ps(0.5f);
+  const __m128i bias32 = _mm_set1_epi32(32768);
+  const __m128i bias16 = _mm_set1_epi16(-32768);
+  lo = _mm_add_ps(_mm_min_ps(_mm_max_ps(lo, zero), maxv), half);
+  hi = _mm_add_ps(_mm_min_ps(_mm_max_ps(hi, zero), maxv), half);
+  // No packus_epi32 in SSE2. Pack as signed 16bit with bias.
+  const __m128i lo_i = _mm_sub_epi32(_mm_cvttps_epi32(lo), bias32);
+  const __m128i hi_i = _mm_sub_epi32(_mm_cvttps_epi32(hi), bias32);
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(p),
+                   _mm_xor_si128(_mm_packs_epi32(lo_i, hi_i), bias16));
 }
+#elif defined(TINY_DNG_LOADER_SIMD_NEON)
+static inline void StoreRoundedU16(uint16_t* p, float32x4_t lo,
+                                   float32x4_t hi) {
+  const float32x4_t zero = vdupq_n_f32(0.0f);
+  const float32x4_t maxv = vdupq_n_f32(65535.0f);
+  const float32x4_t half = vdupq_n_f32(0.5f);
+  lo = vaddq_f32(vminq_f32(vmaxq_f32(lo, zero), maxv), half);
+  hi = vaddq_f32(vminq_f32(vmaxq_f32(hi, zero), maxv), half);
+  vst1q_u16(p, vcombine_u16(vmovn_u32(vcvtq_u32_f32(lo)),
+                            vmovn_u32(vcvtq_u32_f32(hi))));
+}
+#endif
 
-int Dictionary::findIndex(const int code, const int value) const {
-  if (code == -1) {
-    return value;
+// value = offset + (value - offset) * gain, rounded and clamped to
+// [0, 65535]. `gains` and `offsets` are per sample.
+static void ApplyGainsU16(uint16_t* p, size_t n, const float* gains,
+                          const float* offsets) {
+  size_t x = 0;
+#if defined(TINY_DNG_LOADER_SIMD_SSE2)
+  const __m128i zeroi = _mm_setzero_si128();
+  for (; x + 8 <= n; x += 8) {
+    const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + x));
+    const __m128 off_lo = _mm_loadu_ps(offsets + x);
+    const __m128 off_hi = _mm_loadu_ps(offsets + x + 4);
+    __m128 lo = _mm_cvtepi32_ps(_mm_unpacklo_epi16(v, zeroi));
+    __m128 hi = _mm_cvtepi32_ps(_mm_unpackhi_epi16(v, zeroi));
+    lo = _mm_add_ps(
+        _mm_mul_ps(_mm_sub_ps(lo, off_lo), _mm_loadu_ps(gains + x)), off_lo);
+    hi = _mm_add_ps(
+        _mm_mul_ps(_mm_sub_ps(hi, off_hi), _mm_loadu_ps(gains + x + 4)),
+        off_hi);
+    StoreRoundedU16(p + x, lo, hi);
+  }
+#elif defined(TINY_DNG_LOADER_SIMD_NEON)
+  for (; x + 8 <= n; x += 8) {
+    const uint16x8_t v = vld1q_u16(p + x);
+    const float32x4_t off_lo = vld1q_f32(offsets + x);
+    const float32x4_t off_hi = vld1q_f32(offsets + x + 4);
+    float32x4_t lo = vcvtq_f32_u32(vmovl_u16(vget_low_u16(v)));
+    float32x4_t hi = vcvtq_f32_u32(vmovl_u16(vget_high_u16(v)));
+    lo = vmlaq_f32(off_lo, vsubq_f32(lo, off_lo), vld1q_f32(gains + x));
+    hi = vmlaq_f32(off_hi, vsubq_f32(hi, off_hi), vld1q_f32(gains + x + 4));
+    StoreRoundedU16(p + x, lo, hi);
   }
-
-  // Linear search for now.
-  // TODO: Worth optimizing with a proper hash-table?
-  for (int i = 0; i < size_; ++i) {
-    if (entries_[i].code == code && entries_[i].value == value) {
-      return i;
-    }
+#endif
+  for (; x < n; x++) {
+    const float v = offsets[x] + (float(p[x]) - offsets[x]) * gains[x];
+    p[x] = static_cast<uint16_t>((std::min)((std::max)(v, 0.0f), 65535.0f) +
+                                 0.5f);
   }
+}
 
-  return -1;
+static void ApplyGainsU8(uint8_t* p, size_t n, const float* gains,
+                         const float* offsets) {
+  for (size_t x = 0; x < n; x++) {
+    const float v = offsets[x] + (float(p[x]) - offsets[x]) * gains[x];
+    p[x] = static_cast<uint8_t>((std::min)((std::max)(v, 0.0f), 255.0f) + 0.5f);
+  }
 }
 
-bool Dictionary::add(const int code, const int value) {
-  //TINY_DNG_ASSERT(code <= size_,
-  //                "`code' must be less than or equal to dictionary size.");
-  TINY_DNG_CHECK_AND_RETURN_C(code <= size_, false);
-  if (size_ == 4096) {
-    TINY_DNG_DPRINTF("Dictionary overflowed!");
-    return false;
+static void ApplyGainsF32(float* p, size_t n, const float* gains) {
+  for (size_t x = 0; x < n; x++) {
+    p[x] *= gains[x];
   }
+}
 
-  TINY_DNG_DPRINTF("add[%d].code = %d\n", size_, code);
-  TINY_DNG_DPRINTF("add[%d].value = %d\n", size_, value);
-  entries_[size_].code = code;
-  entries_[size_].value = value;
-  ++size_;
-  return true;
+// Move the zero-copy view into `image->data` so that it can be modified.
+static void MaterializeDataView(DNGImage* image) {
+  if (image->data_view) {
+    image->data.assign(image->data_view,
+                       image->data_view + image->data_view_size);
+    image->data_view = nullptr;
+    image->data_view_size = 0;
+  }
 }
 
-bool Dictionary::flush(int& codeBitsWidth) {
-  if (size_ == ((1 << codeBitsWidth) - 1)) {
-    ++codeBitsWidth;
-    TINY_DNG_DPRINTF("expand: bits %d\n", codeBitsWidth);
-    if (codeBitsWidth > 12)  // MaxDictBits
-    {
-      // Clear the dictionary (except the first 256 byte entries).
-      codeBitsWidth = 9;  // StartBits
-      size_ = 256 + 2;    // 256 is reserved for ClearCode, 257 is reserved for
-                          // end of stream, thus FistCode starts with 258
-      return true;
+///
+/// Multiply the gains of the maps at `row`(relative to the bounds) into
+/// `row_gains`(per sample of the row of the bounds, initialized with 1.0).
+/// Returns the range of the touched samples as [*begin, *end).
+///
+static void ComposeGainMapRow(const std::vector<GainMapPlan>& plans,
+                              size_t row, size_t spp, float* row_gains,
+                              size_t* begin, size_t* end) {
+  (*begin) = (std::numeric_limits<size_t>::max)();
+  (*end) = 0;
+
+  for (size_t i = 0; i < plans.size(); i++) {
+    const GainMapPlan& plan = plans[i];
+    const OpcodeArea& area = plan.area;
+    if ((area.num_rows == 0) || (row < area.top) ||
+        (((row - area.top) % area.row_pitch) != 0)) {
+      continue;
+    }
+    const size_t y = (row - area.top) / area.row_pitch;
+    if (y >= area.num_rows) {
+      continue;
+    }
+
+    const size_t stride = area.col_pitch * spp;
+    for (size_t p = 0; p < area.num_planes; p++) {
+      float* dst = row_gains + area.left * spp + area.plane + p;
+      GainMapRowGains(plan, y, (std::min)(p, plan.map_planes - 1), stride,
+                      dst);
     }
+
+    const size_t first = area.left * spp + area.plane;
+    const size_t last = (area.left + (area.num_cols - 1) * area.col_pitch) *
+                            spp +
+                        area.plane + area.num_planes;
+    (*begin) = (std::min)((*begin), first);
+    (*end) = (std::max)((*end), last);
+  }
+}
+
+// Whether the index sets {begin + k * pitch | begin + k * pitch < end} are
+// disjoint. Conservative(false may be returned for disjoint sets).
+static bool PitchedRangesDisjoint(unsigned int begin0, unsigned int end0,
+                                  unsigned int pitch0, unsigned int begin1,
+                                  unsigned int end1, unsigned int pitch1) {
+  pitch0 = (std::max)(1u, pitch0);
+  pitch1 = (std::max)(1u, pitch1);
+  if ((begin0 >= end0) || (begin1 >= end1) || (end0 <= begin1) ||
+      (end1 <= begin0)) {
+    return true;
+  }
+  if ((pitch0 == pitch1) &&
+      (((begin0 > begin1) ? (begin0 - begin1) : (begin1 - begin0)) % pitch0) !=
+          0) {
+    return true;
   }
   return false;
 }
 
-class BitStreamReader {
- public:
-  // No copy/assignment.
-  // BitStreamReader(const BitStreamReader &) = delete;
-  // BitStreamReader & operator = (const BitStreamReader &) = delete;
+static bool GainMapsDisjoint(const GainMap& a, const GainMap& b) {
+  return PitchedRangesDisjoint(a.plane, a.plane + a.planes, 1, b.plane,
+                               b.plane + b.planes, 1) ||
+         PitchedRangesDisjoint(a.top, a.bottom, a.row_pitch, b.top, b.bottom,
+                               b.row_pitch) ||
+         PitchedRangesDisjoint(a.left, a.right, a.col_pitch, b.left, b.right,
+                               b.col_pitch);
+}
 
-  // BitStreamReader(const BitStreamWriter & bitStreamWriter);
-  BitStreamReader(const uint8_t* bitStream, int byteCount, int bitCount);
+bool ApplyGainMaps(const std::vector<GainMap>& gainmaps, DNGImage* image,
+                   std::string* err) {
+  TINY_DNG_CHECK_AND_RETURN(image, "Invalid argument.", err);
 
-  bool isEndOfStream() const;
-  bool readNextBitLE(int& bitOut);       // little endian
-  bool readNextBitBE(int& bitOut);       // big endian
-  uint64_t readBitsU64LE(int bitCount);  // little endian
-  uint64_t readBitsU64BE(int bitCount);  // big endian
-  void reset();
+  if (gainmaps.empty()) {
+    return true;
+  }
 
- private:
-  const uint8_t*
-      stream;  // Pointer to the external bit stream. Not owned by the reader.
-  const int
-      sizeInBytes;  // Size of the stream *in bytes*. Might include padding.
-  const int sizeInBits;  // Size of the stream *in bits*, padding *not* include.
-  int currBytePos;       // Current byte being read in the stream.
-  int nextBitPos;   // Bit position within the current byte to access next. 0 to
-                    // 7.
-  int numBitsRead;  // Total bits read from the stream so far. Never includes
-                    // byte-rounding padding.
-};
+  const bool is_float = (image->sample_format == SAMPLEFORMAT_IEEEFP);
+  const int bps = image->bits_per_sample;
+  TINY_DNG_CHECK_AND_RETURN(
+      (!is_float && ((bps == 8) || (bps == 16))) || (is_float && (bps == 32)),
+      "GainMap can be applied only to 8/16bit integer or 32bit float data. "
+      "bits_per_sample = " << bps,
+      err);
+
+  MaterializeDataView(image);
+
+  const size_t spp = size_t(image->samples_per_pixel);
+  const size_t bytes_per_sample = size_t(bps) / 8;
+  const size_t image_row_samples = size_t(image->width) * spp;
+  TINY_DNG_CHECK_AND_RETURN(
+      (spp > 0) &&
+          (image->data.size() >=
+           image_row_samples * size_t(image->height) * bytes_per_sample),
+      "Image data is smaller than its size.", err);
+
+  // Consecutive maps of the same OpcodeList processing disjoint samples(e.g.
+  // 4 maps for each Bayer phase) are fused, so the image is read and written
+  // once per row. Overlapping maps are applied one by one, since the value is
+  // clamped after each map.
+  size_t i = 0;
+  while (i < gainmaps.size()) {
+    const unsigned int list_idx = gainmaps[i].idx;
+    size_t group_end = i + 1;
+    while ((group_end < gainmaps.size()) &&
+           (gainmaps[group_end].idx == list_idx)) {
+      bool disjoint = true;
+      for (size_t k = i; k < group_end; k++) {
+        if (!GainMapsDisjoint(gainmaps[k], gainmaps[group_end])) {
+          disjoint = false;
+          break;
+        }
+      }
+      if (!disjoint) {
+        break;
+      }
+      group_end++;
+    }
 
-// BitStreamReader::BitStreamReader(const BitStreamWriter & bitStreamWriter)
-//    : stream(bitStreamWriter.getBitStream())
-//    , sizeInBytes(bitStreamWriter.getByteCount())
-//    , sizeInBits(bitStreamWriter.getBitCount())
-//{
-//    reset();
-//}
+    OpcodeBounds bounds;
+    if (!GetOpcodeBounds(*image, list_idx, &bounds, err)) {
+      return false;
+    }
 
-BitStreamReader::BitStreamReader(const unsigned char* bitStream,
-                                 const int byteCount, const int bitCount)
-    : stream(bitStream), sizeInBytes(byteCount), sizeInBits(bitCount) {
-  (void)sizeInBytes;
-  reset();
-}
+    std::vector<GainMapPlan> plans(group_end - i);
+    for (size_t k = i; k < group_end; k++) {
+      if (!BuildGainMapPlan(gainmaps[k], bounds, spp, &plans[k - i], err)) {
+        return false;
+      }
+    }
 
-bool BitStreamReader::readNextBitLE(int& bitOut) {
-  if (numBitsRead >= sizeInBits) {
-    return false;  // We are done.
-  }
+    const size_t row_samples = bounds.width * spp;
 
-  const uint32_t mask = uint32_t(1) << nextBitPos;
-  bitOut = !!(stream[currBytePos] & mask);
-  ++numBitsRead;
+    // Keep black level of stage 2 integer data.
+    BlackLevelTable black;
+    if ((list_idx == 2) && !is_float) {
+      if (!BuildBlackLevelTable(*image, bounds.width, bounds.height, spp,
+                                &black, err)) {
+        return false;
+      }
+    } else {
+      ZeroBlackLevelTable(row_samples, &black);
+    }
+
+    const size_t kRowsPerChunk = 32;
+    const size_t num_chunks =
+        (bounds.height + kRowsPerChunk - 1) / kRowsPerChunk;
+    const int num_threads = GetNumWorkers(num_chunks);
+    std::vector<std::vector<float> > row_gains(
+        static_cast<size_t>(num_threads));
+
+    bool ret = ParallelFor(
+        num_chunks, num_threads, err,
+        [&](size_t k, int thread_id, std::string* thread_err) -> bool {
+          (void)thread_err;
+          std::vector<float>& g = row_gains[size_t(thread_id)];
+          g.assign(2 * row_samples, 1.0f);
+          float* scratch = g.data() + row_samples;
+
+          const size_t y_end =
+              (std::min)(bounds.height, (k + 1) * kRowsPerChunk);
+          for (size_t y = k * kRowsPerChunk; y < y_end; y++) {
+            size_t begin = 0, end = 0;
+            ComposeGainMapRow(plans, y, spp, g.data(), &begin, &end);
+            if (begin >= end) {
+              continue;
+            }
 
-  if (++nextBitPos == 8) {
-    nextBitPos = 0;
-    ++currBytePos;
-  }
-  return true;
-}
+            const size_t offset = (bounds.top + y) * image_row_samples +
+                                  bounds.left * spp + begin;
+            const size_t n = end - begin;
+            const float* offsets = black.RowOffsets(y, scratch);
+            if (is_float) {
+              ApplyGainsF32(reinterpret_cast<float*>(image->data.data()) +
+                                offset,
+                            n, g.data() + begin);
+            } else if (bps == 16) {
+              ApplyGainsU16(reinterpret_cast<uint16_t*>(image->data.data()) +
+                                offset,
+                            n, g.data() + begin, offsets + begin);
+            } else {
+              ApplyGainsU8(image->data.data() + offset, n, g.data() + begin,
+                           offsets + begin);
+            }
 
-bool BitStreamReader::readNextBitBE(int& bitOut) {
-  if (numBitsRead >= sizeInBits) {
-    return false;  // We are done.
-  }
+            // Reset for the next row.
+            std::fill(g.begin() + std::ptrdiff_t(begin),
+                      g.begin() + std::ptrdiff_t(end), 1.0f);
+          }
+          return true;
+        });
 
-  const uint32_t mask = uint32_t(1) << (7 - nextBitPos);
-  bitOut = !!(stream[currBytePos] & mask);
-  ++numBitsRead;
+    if (!ret) {
+      return false;
+    }
 
-  if (++nextBitPos == 8) {
-    nextBitPos = 0;
-    ++currBytePos;
+    i = group_end;
   }
+
   return true;
 }
 
-uint64_t BitStreamReader::readBitsU64LE(const int bitCount) {
-  //TINY_DNG_ASSERT(bitCount <= 64,
-  //                "`bitCount' must be less than or equal to 64.");
-  TINY_DNG_CHECK_AND_RETURN_C(bitCount <= 64, 0);
-
-  uint64_t num = 0;
-  for (int b = 0; b < bitCount; ++b) {
-    int bit;
-    if (!readNextBitLE(bit)) {
-      TINY_DNG_DPRINTF(
-          "LE: Failed to read bits from stream! Unexpected end.\n");
-      break;
-    }
+// value = value * scale + bias, rounded and clamped to [0, 65535]. `scale`
+// and `bias` are per sample.
+static void ApplyAffineU16(uint16_t* p, size_t n, const float* scale,
+                           const float* bias) {
+  size_t x = 0;
+#if defined(TINY_DNG_LOADER_SIMD_SSE2)
+  const __m128i zeroi = _mm_setzero_si128();
+  for (; x + 8 <= n; x += 8) {
+    const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + x));
+    __m128 lo = _mm_cvtepi32_ps(_mm_unpacklo_epi16(v, zeroi));
+    __m128 hi = _mm_cvtepi32_ps(_mm_unpackhi_epi16(v, zeroi));
+    lo = _mm_add_ps(_mm_mul_ps(lo, _mm_loadu_ps(scale + x)),
+                    _mm_loadu_ps(bias + x));
+    hi = _mm_add_ps(_mm_mul_ps(hi, _mm_loadu_ps(scale + x + 4)),
+                    _mm_loadu_ps(bias + x + 4));
+    StoreRoundedU16(p + x, lo, hi);
+  }
+#elif defined(TINY_DNG_LOADER_SIMD_NEON)
+  for (; x + 8 <= n; x += 8) {
+    const uint16x8_t v = vld1q_u16(p + x);
+    float32x4_t lo = vcvtq_f32_u32(vmovl_u16(vget_low_u16(v)));
+    float32x4_t hi = vcvtq_f32_u32(vmovl_u16(vget_high_u16(v)));
+    lo = vmlaq_f32(vld1q_f32(bias + x), lo, vld1q_f32(scale + x));
+    hi = vmlaq_f32(vld1q_f32(bias + x + 4), hi, vld1q_f32(scale + x + 4));
+    StoreRoundedU16(p + x, lo, hi);
+  }
+#endif
+  for (; x < n; x++) {
+    const float v = float(p[x]) * scale[x] + bias[x];
+    p[x] = static_cast<uint16_t>((std::min)((std::max)(v, 0.0f), 65535.0f) +
+                                 0.5f);
+  }
+}
 
-    // Based on a "Stanford bit-hack":
-    // http://graphics.stanford.edu/~seander/bithacks.html#ConditionalSetOrClearBitsWithoutBranching
-    const uint64_t mask = uint64_t(1) << b;
-    num = (num & ~mask) | (uint64_t(-bit) & mask);
+static void ApplyAffineF32(float* p, size_t n, const float* scale,
+                           const float* bias) {
+  size_t x = 0;
+#if defined(TINY_DNG_LOADER_SIMD_SSE2)
+  for (; x + 4 <= n; x += 4) {
+    _mm_storeu_ps(p + x, _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(p + x),
+                                               _mm_loadu_ps(scale + x)),
+                                    _mm_loadu_ps(bias + x)));
+  }
+#elif defined(TINY_DNG_LOADER_SIMD_NEON)
+  for (; x + 4 <= n; x += 4) {
+    vst1q_f32(p + x, vmlaq_f32(vld1q_f32(bias + x), vld1q_f32(p + x),
+                               vld1q_f32(scale + x)));
+  }
+#endif
+  for (; x < n; x++) {
+    p[x] = p[x] * scale[x] + bias[x];
   }
-
-  return num;
 }
 
-uint64_t BitStreamReader::readBitsU64BE(const int bitCount) {
-  //TINY_DNG_ASSERT(bitCount <= 64,
-  //                "`bitCount' must be less than or equal to 64.");
-  TINY_DNG_CHECK_AND_RETURN_C(bitCount <= 64, 0);
-
-  uint64_t num = 0;
-  for (int b = 0; b < bitCount; ++b) {
-    int bit;
-    if (!readNextBitBE(bit)) {
-      TINY_DNG_DPRINTF("BE: Failed to read bits from stream! Unexpected end.");
-      break;
+// value = value * scale + bias for every `stride` samples.
+static void ApplyAffineConstU16(uint16_t* p, size_t stride, size_t n,
+                                float scale, float bias) {
+  size_t x = 0;
+  if (stride == 1) {
+#if defined(TINY_DNG_LOADER_SIMD_SSE2)
+    const __m128i zeroi = _mm_setzero_si128();
+    const __m128 s = _mm_set1_ps(scale);
+    const __m128 b = _mm_set1_ps(bias);
+    for (; x + 8 <= n; x += 8) {
+      const __m128i v =
+          _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + x));
+      const __m128 lo = _mm_cvtepi32_ps(_mm_unpacklo_epi16(v, zeroi));
+      const __m128 hi = _mm_cvtepi32_ps(_mm_unpackhi_epi16(v, zeroi));
+      StoreRoundedU16(p + x, _mm_add_ps(_mm_mul_ps(lo, s), b),
+                      _mm_add_ps(_mm_mul_ps(hi, s), b));
+    }
+#elif defined(TINY_DNG_LOADER_SIMD_NEON)
+    const float32x4_t s = vdupq_n_f32(scale);
+    const float32x4_t b = vdupq_n_f32(bias);
+    for (; x + 8 <= n; x += 8) {
+      const uint16x8_t v = vld1q_u16(p + x);
+      const float32x4_t lo = vcvtq_f32_u32(vmovl_u16(vget_low_u16(v)));
+      const float32x4_t hi = vcvtq_f32_u32(vmovl_u16(vget_high_u16(v)));
+      StoreRoundedU16(p + x, vmlaq_f32(b, lo, s), vmlaq_f32(b, hi, s));
     }
+#endif
+  }
+  for (; x < n; x++) {
+    const float v = float(p[x * stride]) * scale + bias;
+    p[x * stride] = static_cast<uint16_t>(
+        (std::min)((std::max)(v, 0.0f), 65535.0f) + 0.5f);
+  }
+}
 
-    TINY_DNG_DPRINTF("bit[%d](count %d) = %d\n", b, bitCount, bit);
-
-    // Based on a "Stanford bit-hack":
-    // http://graphics.stanford.edu/~seander/bithacks.html#ConditionalSetOrClearBitsWithoutBranching
-    const uint64_t mask = uint64_t(1) << (bitCount - b - 1);
-    num = (num & ~mask) | (uint64_t(-bit) & mask);
+static void ApplyAffineConstF32(float* p, size_t stride, size_t n,
+                                float scale, float bias) {
+  for (size_t x = 0; x < n; x++) {
+    p[x * stride] = p[x * stride] * scale + bias;
   }
+}
 
-  TINY_DNG_DPRINTF("num = %d\n", int(num));
-  return num;
+static inline void ApplyAffine(uint16_t* p, size_t n, const float* scale,
+                               const float* bias) {
+  ApplyAffineU16(p, n, scale, bias);
 }
 
-void BitStreamReader::reset() {
-  currBytePos = 0;
-  nextBitPos = 0;
-  numBitsRead = 0;
+static inline void ApplyAffine(float* p, size_t n, const float* scale,
+                               const float* bias) {
+  ApplyAffineF32(p, n, scale, bias);
 }
 
-bool BitStreamReader::isEndOfStream() const {
-  return numBitsRead >= sizeInBits;
+static inline void ApplyAffineConst(uint16_t* p, size_t stride, size_t n,
+                                    float scale, float bias) {
+  ApplyAffineConstU16(p, stride, n, scale, bias);
 }
 
-// ========================================================
-// easyDecode() and helpers:
-// ========================================================
+static inline void ApplyAffineConst(float* p, size_t stride, size_t n,
+                                    float scale, float bias) {
+  ApplyAffineConstF32(p, stride, n, scale, bias);
+}
 
-static bool outputByte(int code, unsigned char*& output, int outputSizeBytes,
-                       int& bytesDecodedSoFar) {
-  if (bytesDecodedSoFar >= outputSizeBytes) {
-    // LZW_ERROR("Decoder output buffer too small!");
-    return false;
-  }
+static inline void ApplyGains(uint16_t* p, size_t n, const float* gains,
+                              const float* offsets) {
+  ApplyGainsU16(p, n, gains, offsets);
+}
 
-  //TINY_DNG_ASSERT(code >= 0 && code < 256, "`code' must be within [0, 255].");
-  TINY_DNG_CHECK_AND_RETURN_C(code >= 0 && code < 256, false);
-  *output++ = static_cast<unsigned char>(code);
-  ++bytesDecodedSoFar;
-  return true;
+static inline void ApplyGains(float* p, size_t n, const float* gains,
+                              const float* offsets) {
+  (void)offsets;
+  ApplyGainsF32(p, n, gains);
 }
 
-static bool outputSequence(const Dictionary& dict, int code,
-                           unsigned char*& output, int outputSizeBytes,
-                           int& bytesDecodedSoFar, int& firstByte) {
-  const int MaxDictEntries = 4096;
-  (void)MaxDictEntries;
+// Number of r^2 intervals in the FixVignetteRadial gain table.
+static const size_t kVignetteLUTSize = 1024;
 
-  // A sequence is stored backwards, so we have to write
-  // it to a temp then output the buffer in reverse.
-  int i = 0;
-  unsigned char sequence[4096];
-  do {
-    //TINY_DNG_ASSERT(i < MaxDictEntries - 1 && code >= 0,
-    //                "Invalid value for `i' or `code'.");
-    TINY_DNG_CHECK_AND_RETURN_C(i < MaxDictEntries - 1 && code >= 0, false);
-    TINY_DNG_DPRINTF("i = %d, ent[%d].value = %d\n", i, code,
-                     dict.entries_[code].value);
-    sequence[i++] = static_cast<unsigned char>(dict.entries_[code].value);
-    code = dict.entries_[code].code;
-  } while (code >= 0);
+///
+/// FixVignetteRadial prepared for row passes. The gain
+/// 1 + k0 r^2 + k1 r^4 + k2 r^6 + k3 r^8 + k4 r^10 is tabulated over the
+/// normalized r^2(0.0 ~ 1.0, 1.0 at the farthest corner), so a pixel costs a
+/// linear interpolation instead of the polynomial.
+///
+struct VignettePlan {
+  size_t width{0};  // of the bounds
+  float cx{0.0f};   // optical center in pixels
+  float cy{0.0f};
+  float inv_max_dist2{0.0f};
+  std::vector<float> lut;  // kVignetteLUTSize + 2 items
+  std::vector<float> xx;   // (x + 0.5 - cx)^2 * inv_max_dist2 for each column
+};
 
-  firstByte = sequence[--i];
-  for (; i >= 0; --i) {
-    if (!outputByte(sequence[i], output, outputSizeBytes, bytesDecodedSoFar)) {
-      return false;
+static void BuildVignettePlan(const Opcode& op, const OpcodeBounds& bounds,
+                              VignettePlan* plan) {
+  const double cx = op.center_x * double(bounds.width);
+  const double cy = op.center_y * double(bounds.height);
+  const double dx = (std::max)(cx, double(bounds.width) - cx);
+  const double dy = (std::max)(cy, double(bounds.height) - cy);
+  const double max_dist2 = dx * dx + dy * dy;
+
+  plan->width = bounds.width;
+  plan->cx = float(cx);
+  plan->cy = float(cy);
+  plan->inv_max_dist2 = (max_dist2 > 0.0) ? float(1.0 / max_dist2) : 0.0f;
+
+  const double* k = op.coefficients.data();
+  plan->lut.resize(kVignetteLUTSize + 2);
+  for (size_t i = 0; i < plan->lut.size(); i++) {
+    const double r2 = double(i) / double(kVignetteLUTSize);
+    plan->lut[i] = float(
+        1.0 + r2 * (k[0] + r2 * (k[1] + r2 * (k[2] + r2 * (k[3] + r2 * k[4])))));
+  }
+
+  plan->xx.resize(bounds.width);
+  for (size_t x = 0; x < bounds.width; x++) {
+    const double d = double(x) + 0.5 - cx;
+    plan->xx[x] = float(d * d) * plan->inv_max_dist2;
+  }
+}
+
+// Multiply FixVignetteRadial gains of `row` to all samples of `row_gains`.
+static void ComposeVignetteRow(const VignettePlan& plan, size_t row,
+                               size_t spp, float* row_gains) {
+  const float d = float(row) + 0.5f - plan.cy;
+  const float yy = d * d * plan.inv_max_dist2;
+  const float lut_scale = float(kVignetteLUTSize);
+  const float* lut = plan.lut.data();
+  const float* xx = plan.xx.data();
+
+  for (size_t x = 0; x < plan.width; x++) {
+    const float f = (std::min)((xx[x] + yy) * lut_scale, lut_scale);
+    const int32_t idx = int32_t(f);
+    const float t = f - float(idx);
+    const float gain = lut[idx] + (lut[idx + 1] - lut[idx]) * t;
+    if (spp == 1) {
+      row_gains[x] *= gain;
+    } else {
+      float* g = row_gains + x * spp;
+      for (size_t c = 0; c < spp; c++) {
+        g[c] *= gain;
+      }
     }
   }
-  return true;
 }
 
-static int easyDecode(const unsigned char* compressed,
-                      const int compressedSizeBytes,
-                      const int compressedSizeBits, unsigned char* uncompressed,
-                      const int uncompressedSizeBytes, const bool swap_endian) {
-  const int Nil = -1;
-  const int MaxDictBits = 12;
-  const int StartBits = 9;
+///
+/// Pointwise opcode prepared for `ApplyOpcodeList`. Consecutive GainMaps
+/// processing disjoint samples are fused into one step as `ApplyGainMaps`,
+/// and FixVignetteRadial next to them multiplies its gains into the same
+/// step.
+///
+struct OpcodeStep {
+  unsigned int id{0};
+  OpcodeArea area;
+  std::vector<uint16_t> lut;        // MapTable and MapPolynomial(16bit)
+  std::vector<float> coefficients;  // MapPolynomial(float)
+  const std::vector<float>* values{nullptr};  // Delta/ScalePerRow
+  // Delta/ScalePerColumn: per sample scale and bias of the row from
+  // `first`(x * 1 + 0 for the samples not processed).
+  size_t first{0};
+  std::vector<float> scale;
+  std::vector<float> bias;
+  std::vector<GainMapPlan> plans;       // GainMap
+  std::vector<VignettePlan> vignettes;  // FixVignetteRadial
+  const Opcode* op{nullptr};            // FixBadPixelsConstant/List
+};
 
-  // TIFF specific values
-  const int ClearCode = 256;
-  const int EndOfInformation = 257;
+// Opcodes which read neighbor pixels. They can't be fused with other opcodes
+// in a row pass.
+static inline bool OpcodeNeedsNeighbors(unsigned int id) {
+  return (id == OPCODE_LIST_WARP_RECTILINEAR) ||
+         (id == OPCODE_LIST_WARP_FISHEYE) ||
+         (id == OPCODE_LIST_FIX_BAD_PIXELS_CONSTANT) ||
+         (id == OPCODE_LIST_FIX_BAD_PIXELS_LIST);
+}
 
-  if (compressed == NULL || uncompressed == NULL) {
-    TINY_DNG_DPRINTF("lzw::easyDecode(): Null data pointer(s)!\n");
-    return 0;
+static void MapSamples(const OpcodeStep& step, size_t stride, size_t n,
+                       uint16_t* p) {
+  const uint16_t* lut = step.lut.data();
+  if (stride == 1) {
+    for (size_t x = 0; x < n; x++) {
+      p[x] = lut[p[x]];
+    }
+  } else {
+    for (size_t x = 0; x < n; x++) {
+      p[x * stride] = lut[p[x * stride]];
+    }
   }
+}
 
-  if (compressedSizeBytes <= 0 || compressedSizeBits <= 0 ||
-      uncompressedSizeBytes <= 0) {
-    TINY_DNG_DPRINTF("lzw::easyDecode(): Bad in/out sizes!n");
-    return 0;
+static void MapSamples(const OpcodeStep& step, size_t stride, size_t n,
+                       float* p) {
+  const float* c = step.coefficients.data();
+  const size_t degree = step.coefficients.size() - 1;
+  for (size_t x = 0; x < n; x++) {
+    const float v = p[x * stride];
+    float y = c[degree];
+    for (size_t d = degree; d > 0; d--) {
+      y = y * v + c[d - 1];
+    }
+    p[x * stride] = y;
   }
+}
 
-  int code = Nil;
-  int prevCode = Nil;
-  int firstByte = 0;
-  int bytesDecoded = 0;
-  int codeBitsWidth = StartBits;
+///
+/// Apply `step` to `row`(relative to the bounds). `data` is the first sample of
+/// the row in the bounds. `offsets` is the GainMap offset per sample, and
+/// `gains` is a per sample scratch buffer initialized with 1.0(restored on
+/// return).
+///
+template <typename T>
+static void ApplyOpcodeStepRow(const OpcodeStep& step, size_t row, size_t spp,
+                               T* data, const float* offsets, float* gains) {
+  if ((step.id == OPCODE_LIST_GAIN_MAP) ||
+      (step.id == OPCODE_LIST_FIX_VIGNETTE_RADIAL)) {
+    size_t begin = 0, end = 0;
+    ComposeGainMapRow(step.plans, row, spp, gains, &begin, &end);
+    if (!step.vignettes.empty()) {
+      for (size_t i = 0; i < step.vignettes.size(); i++) {
+        ComposeVignetteRow(step.vignettes[i], row, spp, gains);
+      }
+      begin = 0;
+      end = step.vignettes[0].width * spp;
+    }
+    if (begin < end) {
+      ApplyGains(data + begin, end - begin, gains + begin, offsets + begin);
+      std::fill(gains + begin, gains + end, 1.0f);
+    }
+    return;
+  }
 
-  // We'll reconstruct the dictionary based on the
-  // bit stream codes. Unlike Huffman encoding, we
-  // don't store the dictionary as a prefix to the data.
-  Dictionary dictionary;
-  BitStreamReader bitStream(compressed, compressedSizeBytes,
-                            compressedSizeBits);
+  const OpcodeArea& area = step.area;
+  if ((row < area.top) || (((row - area.top) % area.row_pitch) != 0)) {
+    return;
+  }
+  const size_t y = (row - area.top) / area.row_pitch;
+  if (y >= area.num_rows) {
+    return;
+  }
 
-  // We check to avoid an overflow of the user buffer.
-  // If the buffer is smaller than the decompressed size,
-  // TINY_DNG_DPRINTF() is called. If that doesn't throw or
-  // terminate we break the loop and return the current
-  // decompression count.
-  while (!bitStream.isEndOfStream()) {
-    //TINY_DNG_ASSERT(
-    //    codeBitsWidth <= MaxDictBits,
-    //    "`codeBitsWidth must be less than or equal to `MaxDictBits'.");
-    TINY_DNG_CHECK_AND_RETURN_C(codeBitsWidth <= MaxDictBits, 0);
-    (void)MaxDictBits;
+  if ((step.id == OPCODE_LIST_DELTA_PER_COLUMN) ||
+      (step.id == OPCODE_LIST_SCALE_PER_COLUMN)) {
+    if (!step.scale.empty()) {
+      ApplyAffine(data + step.first, step.scale.size(), step.scale.data(),
+                  step.bias.data());
+    }
+    return;
+  }
 
-    if (!swap_endian) {  // TODO(syoyo): Detect BE or LE depending on endianness
-                         // in stored format and host endian
-      code = static_cast<int>(bitStream.readBitsU64BE(codeBitsWidth));
+  float scale = 1.0f, bias = 0.0f;
+  if ((step.id == OPCODE_LIST_DELTA_PER_ROW) ||
+      (step.id == OPCODE_LIST_SCALE_PER_ROW)) {
+    if (y >= step.values->size()) {
+      return;
+    }
+    if (step.id == OPCODE_LIST_DELTA_PER_ROW) {
+      bias = (*step.values)[y];
     } else {
-      code = static_cast<int>(bitStream.readBitsU64LE(codeBitsWidth));
+      scale = (*step.values)[y];
     }
+  }
 
-    TINY_DNG_DPRINTF("code = %d(swap_endian = %d)\n", code, swap_endian);
-
-    // if (code >= dictionary.size()) {
-    //  std::cerr << "code = " << code << "dict.size = " << dictionary.size() <<
-    //  std::endl;
-    //}
-
-    // TINY_DNG_ASSERT(code <= dictionary.size(),
-    //                "`code' must be less than or equal to dictionary size.");
+  const size_t stride = area.col_pitch * spp;
+  T* p = data + area.left * spp + area.plane;
+  // Process the whole row at once when all samples of the area are processed.
+  const bool contiguous = (stride == area.num_planes);
+  const size_t num_planes = contiguous ? 1 : area.num_planes;
+  const size_t n = contiguous ? (area.num_cols * stride) : area.num_cols;
+  const size_t s = contiguous ? 1 : stride;
 
-    if (code == EndOfInformation) {
-      TINY_DNG_DPRINTF("EoI\n");
-      break;
+  for (size_t k = 0; k < num_planes; k++) {
+    if ((step.id == OPCODE_LIST_MAP_TABLE) ||
+        (step.id == OPCODE_LIST_MAP_POLYNOMIAL)) {
+      MapSamples(step, s, n, p + k);
+    } else {
+      ApplyAffineConst(p + k, s, n, scale, bias);
     }
+  }
+}
 
-    if (code == ClearCode) {
-      // Initialize dict.
-      dictionary.init();
-      codeBitsWidth = StartBits;
+// Bad pixels in [begin, end) columns of `row`(relative to the bounds).
+struct BadPixelRun {
+  uint32_t row;
+  uint32_t begin;
+  uint32_t end;
+};
 
-      if (!swap_endian) {
-        code = static_cast<int>(bitStream.readBitsU64BE(codeBitsWidth));
+///
+/// Bad pixels indexed by row. Bad columns of row `r` are sorted, disjoint
+/// [first, second) spans in `spans[row_start[r]]` ~ `spans[row_start[r + 1] -
+/// 1]`, so a lookup is a binary search in a row and the repair visits only
+/// bad pixels.
+///
+struct BadPixelIndex {
+  std::vector<size_t> row_start;
+  std::vector<std::pair<uint32_t, uint32_t> > spans;
+
+  bool IsBad(size_t row, size_t col) const {
+    size_t lo = row_start[row];
+    size_t hi = row_start[row + 1];
+    // Find the first span which begins after `col`.
+    while (lo < hi) {
+      const size_t mid = (lo + hi) / 2;
+      if (spans[mid].first <= col) {
+        lo = mid + 1;
       } else {
-        code = static_cast<int>(bitStream.readBitsU64LE(codeBitsWidth));
+        hi = mid;
       }
+    }
+    return (lo > row_start[row]) && (col < spans[lo - 1].second);
+  }
+};
 
-      if (code == EndOfInformation) {
-        TINY_DNG_DPRINTF("EoI\n");
-        break;
+// `runs` may be in any order and may overlap.
+static void BuildBadPixelIndex(size_t height,
+                               const std::vector<BadPixelRun>& runs,
+                               BadPixelIndex* index) {
+  // Bucket sort by row.
+  std::vector<size_t> start(height + 1, 0);
+  for (size_t i = 0; i < runs.size(); i++) {
+    start[runs[i].row + 1]++;
+  }
+  for (size_t r = 0; r < height; r++) {
+    start[r + 1] += start[r];
+  }
+  std::vector<std::pair<uint32_t, uint32_t> > spans(runs.size());
+  std::vector<size_t> pos(start.begin(), start.end() - 1);
+  for (size_t i = 0; i < runs.size(); i++) {
+    spans[pos[runs[i].row]++] = std::make_pair(runs[i].begin, runs[i].end);
+  }
+
+  // Sort and merge the spans of each row.
+  index->row_start.assign(height + 1, 0);
+  index->spans.clear();
+  index->spans.reserve(spans.size());
+  for (size_t r = 0; r < height; r++) {
+    std::sort(spans.begin() + std::ptrdiff_t(start[r]),
+              spans.begin() + std::ptrdiff_t(start[r + 1]));
+    for (size_t i = start[r]; i < start[r + 1]; i++) {
+      if ((index->spans.size() > index->row_start[r]) &&
+          (spans[i].first <= index->spans.back().second)) {
+        index->spans.back().second =
+            (std::max)(index->spans.back().second, spans[i].second);
+      } else {
+        index->spans.push_back(spans[i]);
       }
+    }
+    index->row_start[r + 1] = index->spans.size();
+  }
+}
 
-      if (!outputByte(code, uncompressed, uncompressedSizeBytes,
-                      bytesDecoded)) {
+// Append runs of the pixels whose sample is `value` in a row.
+static void FindConstantPixels(const uint16_t* p, size_t width, size_t spp,
+                               uint16_t value, uint32_t row,
+                               std::vector<BadPixelRun>* runs) {
+  const size_t n = width * spp;
+  size_t x = 0;
+  while (x < n) {
+#if defined(TINY_DNG_LOADER_SIMD_SSE2)
+    // Skip 8 samples at once while there is no match.
+    const __m128i v = _mm_set1_epi16(static_cast<short>(value));
+    while ((x + 8 <= n) &&
+           (_mm_movemask_epi8(_mm_cmpeq_epi16(
+                _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + x)),
+                v)) == 0)) {
+      x += 8;
+    }
+#elif defined(TINY_DNG_LOADER_SIMD_NEON)
+    const uint16x8_t v = vdupq_n_u16(value);
+    while (x + 8 <= n) {
+      const uint64x2_t m =
+          vreinterpretq_u64_u16(vceqq_u16(vld1q_u16(p + x), v));
+      if ((vgetq_lane_u64(m, 0) | vgetq_lane_u64(m, 1)) != 0) {
         break;
       }
-
-      prevCode = code;
-      continue;
+      x += 8;
+    }
+#endif
+    const size_t x_end = (std::min)(n, x + 8);
+    for (; x < x_end; x++) {
+      if (p[x] == value) {
+        const uint32_t col = uint32_t(x / spp);
+        if (!runs->empty() && (runs->back().row == row) &&
+            (runs->back().end >= col)) {
+          runs->back().end = col + 1;
+        } else {
+          BadPixelRun run = {row, col, col + 1};
+          runs->push_back(run);
+        }
+      }
     }
+  }
+}
 
-    if (prevCode == Nil) {
-      if (!outputByte(code, uncompressed, uncompressedSizeBytes,
-                      bytesDecoded)) {
-        break;
+static void FindConstantPixels(const float* p, size_t width, size_t spp,
+                               float value, uint32_t row,
+                               std::vector<BadPixelRun>* runs) {
+  for (size_t x = 0; x < width * spp; x++) {
+    if (p[x] == value) {
+      const uint32_t col = uint32_t(x / spp);
+      if (!runs->empty() && (runs->back().row == row) &&
+          (runs->back().end >= col)) {
+        runs->back().end = col + 1;
+      } else {
+        BadPixelRun run = {row, col, col + 1};
+        runs->push_back(run);
       }
-      firstByte = code;
-      prevCode = code;
-      continue;
     }
+  }
+}
 
-    if (code >= dictionary.size()) {
-      if (!outputSequence(dictionary, prevCode, uncompressed,
-                          uncompressedSizeBytes, bytesDecoded, firstByte)) {
+static inline void StoreSample(uint16_t* p, float v) {
+  (*p) = static_cast<uint16_t>((std::min)((std::max)(v, 0.0f), 65535.0f) +
+                               0.5f);
+}
+
+static inline void StoreSample(float* p, float v) { (*p) = v; }
+
+///
+/// CFA pattern of the image for FixBadPixels* when it is not 2x2(e.g. 6x6
+/// X-Trans). Rows and columns relative to the bounds are shifted by
+/// `origin_row` and `origin_col` to the pattern origin(the ActiveArea).
+///
+struct BadPixelCFA {
+  const std::vector<int>* pattern{nullptr};  // nullptr: 2x2 Bayer
+  size_t rows{2};
+  size_t cols{2};
+  std::ptrdiff_t origin_row{0};
+  std::ptrdiff_t origin_col{0};
+
+  int At(std::ptrdiff_t row, std::ptrdiff_t col) const {
+    const std::ptrdiff_t r = std::ptrdiff_t(rows);
+    const std::ptrdiff_t c = std::ptrdiff_t(cols);
+    const std::ptrdiff_t y = (((row - origin_row) % r) + r) % r;
+    const std::ptrdiff_t x = (((col - origin_col) % c) + c) % c;
+    return (*pattern)[size_t(y * c + x)];
+  }
+};
+
+static BadPixelCFA GetBadPixelCFA(const DNGImage& image,
+                                  const OpcodeBounds& bounds) {
+  BadPixelCFA cfa;
+  const size_t rows = size_t((std::max)(image.cfa_repeat_dim[0], 1));
+  const size_t cols = size_t((std::max)(image.cfa_repeat_dim[1], 1));
+  if ((image.samples_per_pixel == 1) &&
+      (image.cfa_repeat_pattern.size() == rows * cols) &&
+      ((rows != 2) || (cols != 2))) {
+    cfa.pattern = &image.cfa_repeat_pattern;
+    cfa.rows = rows;
+    cfa.cols = cols;
+    if (image.has_active_area) {
+      cfa.origin_row = std::ptrdiff_t(image.active_area[0]) -
+                       std::ptrdiff_t(bounds.top);
+      cfa.origin_col = std::ptrdiff_t(image.active_area[1]) -
+                       std::ptrdiff_t(bounds.left);
+    }
+  }
+  return cfa;
+}
+
+///
+/// Replace the bad pixel at (row, col) with the inverse distance weighted
+/// average of the nearest good pixel of the same color in each direction.
+/// For 2x2 Bayer CFA(spp = 1), the same color is 2 pixels apart horizontally
+/// and vertically, and green also has diagonal neighbors 1 pixel apart. For
+/// other CFA patterns(`cfa.pattern`), pixels of other colors are skipped in
+/// each of the 8 directions. Only good pixels are read, so bad pixels can be
+/// repaired in place in parallel.
+///
+template <typename T>
+static void RepairBadPixel(T* data, size_t row_samples,
+                           const OpcodeBounds& bounds, size_t spp,
+                           unsigned int bayer_phase, const BadPixelCFA& cfa,
+                           const BadPixelIndex& index, size_t row,
+                           size_t col) {
+  static const int kDirs[8][2] = {{-1, 0}, {1, 0}, {0, -1}, {0, 1},
+                                  {-1, -1}, {-1, 1}, {1, -1}, {1, 1}};
+  const size_t kMaxSteps = 16;
+
+  bool diagonal = true;
+  int axis_step = 1;
+  int color = -1;  // Color to match for CFA patterns other than 2x2
+  if ((spp == 1) && cfa.pattern) {
+    color = cfa.At(std::ptrdiff_t(row), std::ptrdiff_t(col));
+  } else if (spp == 1) {
+    // Green when (row + col) is odd for phase 0(RGGB) and 3(BGGR).
+    const size_t g = ((bayer_phase == 1) || (bayer_phase == 2)) ? 1 : 0;
+    diagonal = ((row + col + g) & 1) != 0;
+    axis_step = 2;
+  }
+
+  float sum[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+  float weight_sum = 0.0f;
+  const size_t num_dirs = diagonal ? 8 : 4;
+  const size_t num_planes = (std::min)(spp, size_t(4));
+  for (size_t d = 0; d < num_dirs; d++) {
+    const int step = (d < 4) ? axis_step : 1;
+    const std::ptrdiff_t dy = kDirs[d][0] * step;
+    const std::ptrdiff_t dx = kDirs[d][1] * step;
+    std::ptrdiff_t y = std::ptrdiff_t(row);
+    std::ptrdiff_t x = std::ptrdiff_t(col);
+    for (size_t k = 1; k <= kMaxSteps; k++) {
+      y += dy;
+      x += dx;
+      if ((y < 0) || (x < 0) || (size_t(y) >= bounds.height) ||
+          (size_t(x) >= bounds.width)) {
         break;
       }
-      if (!outputByte(firstByte, uncompressed, uncompressedSizeBytes,
-                      bytesDecoded)) {
-        break;
+      if ((color >= 0) && (cfa.At(y, x) != color)) {
+        continue;
       }
-    } else {
-      if (!outputSequence(dictionary, code, uncompressed, uncompressedSizeBytes,
-                          bytesDecoded, firstByte)) {
+      if (!index.IsBad(size_t(y), size_t(x))) {
+        const float dist = float(k) * float(step) * ((d < 4) ? 1.0f : 1.41421356f);
+        const float w = 1.0f / dist;
+        const T* p = data + (bounds.top + size_t(y)) * row_samples +
+                     (bounds.left + size_t(x)) * spp;
+        for (size_t c = 0; c < num_planes; c++) {
+          sum[c] += w * float(p[c]);
+        }
+        weight_sum += w;
         break;
       }
     }
+  }
 
-    dictionary.add(prevCode, firstByte);
-    if (dictionary.flush(codeBitsWidth)) {
-      TINY_DNG_DPRINTF("flush\n");
-      prevCode = Nil;
-    } else {
-      prevCode = code;
+  if (weight_sum > 0.0f) {
+    T* p = data + (bounds.top + row) * row_samples + (bounds.left + col) * spp;
+    for (size_t c = 0; c < num_planes; c++) {
+      StoreSample(&p[c], sum[c] / weight_sum);
+    }
+  }
+}
+
+// FixBadPixelsConstant/List.
+template <typename T>
+static bool FixBadPixels(const Opcode& op, const OpcodeBounds& bounds,
+                         const BadPixelCFA& cfa, size_t spp, T* data,
+                         size_t row_samples, std::string* err) {
+  const size_t kRowsPerChunk = 64;
+  const size_t num_chunks = (bounds.height + kRowsPerChunk - 1) / kRowsPerChunk;
+  const int num_threads = GetNumWorkers(num_chunks);
+
+  std::vector<BadPixelRun> runs;
+  if (op.id == OPCODE_LIST_FIX_BAD_PIXELS_CONSTANT) {
+    if ((sizeof(T) == 2) && (op.constant > 65535)) {
+      return true;
+    }
+    const T value = static_cast<T>(op.constant);
+    std::vector<std::vector<BadPixelRun> > chunk_runs(num_chunks);
+    if (!ParallelFor(
+            num_chunks, num_threads, err,
+            [&](size_t k, int thread_id, std::string* thread_err) -> bool {
+              (void)thread_id;
+              (void)thread_err;
+              const size_t y_end =
+                  (std::min)(bounds.height, (k + 1) * kRowsPerChunk);
+              for (size_t y = k * kRowsPerChunk; y < y_end; y++) {
+                FindConstantPixels(
+                    data + (bounds.top + y) * row_samples + bounds.left * spp,
+                    bounds.width, spp, value, uint32_t(y), &chunk_runs[k]);
+              }
+              return true;
+            })) {
+      return false;
+    }
+    for (size_t k = 0; k < num_chunks; k++) {
+      runs.insert(runs.end(), chunk_runs[k].begin(), chunk_runs[k].end());
+    }
+  } else {
+    TINY_DNG_CHECK_AND_RETURN(
+        ((op.bad_points.size() % 2) == 0) && ((op.bad_rects.size() % 4) == 0),
+        "Invalid FixBadPixelsList.", err);
+    for (size_t i = 0; i < op.bad_points.size(); i += 2) {
+      const uint32_t r = op.bad_points[i];
+      const uint32_t c = op.bad_points[i + 1];
+      if ((r < bounds.height) && (c < bounds.width)) {
+        BadPixelRun run = {r, c, c + 1};
+        runs.push_back(run);
+      }
+    }
+    for (size_t i = 0; i < op.bad_rects.size(); i += 4) {
+      const uint32_t bottom = uint32_t(
+          (std::min)(size_t(op.bad_rects[i + 2]), bounds.height));
+      const uint32_t right =
+          uint32_t((std::min)(size_t(op.bad_rects[i + 3]), bounds.width));
+      for (uint32_t r = op.bad_rects[i]; r < bottom; r++) {
+        if (op.bad_rects[i + 1] < right) {
+          BadPixelRun run = {r, op.bad_rects[i + 1], right};
+          runs.push_back(run);
+        }
+      }
+    }
+  }
+
+  if (runs.empty()) {
+    return true;
+  }
+
+  BadPixelIndex index;
+  BuildBadPixelIndex(bounds.height, runs, &index);
+  runs.clear();
+
+  return ParallelFor(
+      num_chunks, num_threads, err,
+      [&](size_t k, int thread_id, std::string* thread_err) -> bool {
+        (void)thread_id;
+        (void)thread_err;
+        const size_t y_end = (std::min)(bounds.height, (k + 1) * kRowsPerChunk);
+        for (size_t y = k * kRowsPerChunk; y < y_end; y++) {
+          for (size_t i = index.row_start[y]; i < index.row_start[y + 1]; i++) {
+            for (size_t x = index.spans[i].first; x < index.spans[i].second;
+                 x++) {
+              RepairBadPixel(data, row_samples, bounds, spp, op.bayer_phase,
+                             cfa, index, y, x);
+            }
+          }
+        }
+        return true;
+      });
+}
+
+///
+/// Distortion mapping of WarpRectilinear/Fisheye for a set of planes.
+/// Coordinates are relative to the bounds, and distances from the optical
+/// center are normalized by the maximum distance to the corners.
+///
+struct WarpMapping {
+  bool fisheye{false};
+  float kr[4];  // radial
+  float kt[2];  // tangential(rectilinear)
+  float cx{0.0f};
+  float cy{0.0f};
+  float max_dist{1.0f};
+  // Fisheye: source radius / destination radius sampled at
+  // r^2 = k / kFisheyeLUTSize(k = 0 ~ kFisheyeLUTSize + 1).
+  std::vector<float> ratio_lut;
+};
+
+static const size_t kFisheyeLUTSize = 1024;
+
+static void BuildWarpMapping(const Opcode& op, size_t plane,
+                             const OpcodeBounds& bounds, WarpMapping* m) {
+  const bool fisheye = (op.id == OPCODE_LIST_WARP_FISHEYE);
+  const size_t n = fisheye ? 4 : 6;
+  const double* k = &op.coefficients[plane * n];
+
+  m->fisheye = fisheye;
+  for (size_t i = 0; i < 4; i++) {
+    m->kr[i] = float(k[i]);
+  }
+  m->kt[0] = fisheye ? 0.0f : float(k[4]);
+  m->kt[1] = fisheye ? 0.0f : float(k[5]);
+
+  const double cx = op.center_x * double(bounds.width);
+  const double cy = op.center_y * double(bounds.height);
+  const double dx = (std::max)(cx, double(bounds.width) - cx);
+  const double dy = (std::max)(cy, double(bounds.height) - cy);
+  m->cx = float(cx);
+  m->cy = float(cy);
+  m->max_dist = float(std::sqrt(dx * dx + dy * dy));
+
+  if (fisheye) {
+    // theta = atan(r), r_src = kr0 theta + kr1 theta^3 + kr2 theta^5 +
+    // kr3 theta^7. The ratio is smooth in r^2, so linear interpolation of the
+    // table is accurate enough and avoids atan per pixel.
+    m->ratio_lut.resize(kFisheyeLUTSize + 2);
+    for (size_t i = 0; i < m->ratio_lut.size(); i++) {
+      const double r = std::sqrt(double(i) / double(kFisheyeLUTSize));
+      double ratio = k[0];
+      if (r > 0.0) {
+        const double t = std::atan(r);
+        const double t2 = t * t;
+        ratio = t * (k[0] + t2 * (k[1] + t2 * (k[2] + t2 * k[3]))) / r;
+      }
+      m->ratio_lut[i] = float(ratio);
+    }
+  }
+}
+
+///
+/// Source coordinates(in samples, pixel centers at integers) of `n` pixels
+/// from column `x0` of row `y`. Four pixels are evaluated at once with
+/// SSE2/NEON.
+///
+static void WarpRowCoords(const WarpMapping& m, size_t y, size_t x0, size_t n,
+                          float* sx, float* sy) {
+  const float inv = (m.max_dist > 0.0f) ? 1.0f / m.max_dist : 0.0f;
+  const float dy = (float(y) + 0.5f - m.cy) * inv;
+  const float dy2 = dy * dy;
+  const float base_x = float(x0) + 0.5f - m.cx;
+
+  if (m.fisheye) {
+    const float lut_scale = float(kFisheyeLUTSize);
+    for (size_t i = 0; i < n; i++) {
+      const float dx = (base_x + float(i)) * inv;
+      const float f = (std::min)((dx * dx + dy2) * lut_scale, lut_scale);
+      const int32_t idx = int32_t(f);
+      const float t = f - float(idx);
+      const float ratio = m.ratio_lut[idx] +
+                          (m.ratio_lut[idx + 1] - m.ratio_lut[idx]) * t;
+      sx[i] = m.cx + m.max_dist * dx * ratio - 0.5f;
+      sy[i] = m.cy + m.max_dist * dy * ratio - 0.5f;
+    }
+    return;
+  }
+
+  // Rectilinear:
+  //   f = kr0 + kr1 r^2 + kr2 r^4 + kr3 r^6
+  //   x' = x f + kt0 2xy + kt1 (r^2 + 2x^2)
+  //   y' = y f + kt1 2xy + kt0 (r^2 + 2y^2)
+  size_t i = 0;
+#if defined(TINY_DNG_LOADER_SIMD_SSE2)
+  {
+    const __m128 vinv = _mm_set1_ps(inv);
+    const __m128 vdy = _mm_set1_ps(dy);
+    const __m128 vdy2 = _mm_set1_ps(dy2);
+    const __m128 kr0 = _mm_set1_ps(m.kr[0]);
+    const __m128 kr1 = _mm_set1_ps(m.kr[1]);
+    const __m128 kr2 = _mm_set1_ps(m.kr[2]);
+    const __m128 kr3 = _mm_set1_ps(m.kr[3]);
+    const __m128 kt0 = _mm_set1_ps(m.kt[0]);
+    const __m128 kt1 = _mm_set1_ps(m.kt[1]);
+    const __m128 two = _mm_set1_ps(2.0f);
+    const __m128 vcx = _mm_set1_ps(m.cx - 0.5f);
+    const __m128 vcy = _mm_set1_ps(m.cy - 0.5f);
+    const __m128 vmax = _mm_set1_ps(m.max_dist);
+    const __m128 lane = _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f);
+    for (; i + 4 <= n; i += 4) {
+      const __m128 dx = _mm_mul_ps(
+          _mm_add_ps(_mm_set1_ps(base_x + float(i)), lane), vinv);
+      const __m128 r2 = _mm_add_ps(_mm_mul_ps(dx, dx), vdy2);
+      const __m128 f = _mm_add_ps(
+          kr0,
+          _mm_mul_ps(r2, _mm_add_ps(kr1, _mm_mul_ps(
+                                             r2, _mm_add_ps(kr2, _mm_mul_ps(
+                                                                     r2, kr3))))));
+      const __m128 xy2 = _mm_mul_ps(two, _mm_mul_ps(dx, vdy));
+      const __m128 wx = _mm_add_ps(
+          _mm_add_ps(_mm_mul_ps(dx, f), _mm_mul_ps(kt0, xy2)),
+          _mm_mul_ps(kt1, _mm_add_ps(r2, _mm_mul_ps(two, _mm_mul_ps(dx, dx)))));
+      const __m128 wy = _mm_add_ps(
+          _mm_add_ps(_mm_mul_ps(vdy, f), _mm_mul_ps(kt1, xy2)),
+          _mm_mul_ps(kt0, _mm_add_ps(r2, _mm_mul_ps(two, vdy2))));
+      _mm_storeu_ps(sx + i, _mm_add_ps(vcx, _mm_mul_ps(vmax, wx)));
+      _mm_storeu_ps(sy + i, _mm_add_ps(vcy, _mm_mul_ps(vmax, wy)));
+    }
+  }
+#elif defined(TINY_DNG_LOADER_SIMD_NEON)
+  {
+    const float32x4_t vdy = vdupq_n_f32(dy);
+    const float32x4_t vdy2 = vdupq_n_f32(dy2);
+    const float32x4_t kr0 = vdupq_n_f32(m.kr[0]);
+    const float32x4_t kr1 = vdupq_n_f32(m.kr[1]);
+    const float32x4_t kr2 = vdupq_n_f32(m.kr[2]);
+    const float32x4_t kr3 = vdupq_n_f32(m.kr[3]);
+    const float32x4_t two = vdupq_n_f32(2.0f);
+    const float32x4_t vcx = vdupq_n_f32(m.cx - 0.5f);
+    const float32x4_t vcy = vdupq_n_f32(m.cy - 0.5f);
+    const float lane_init[4] = {0.0f, 1.0f, 2.0f, 3.0f};
+    const float32x4_t lane = vld1q_f32(lane_init);
+    for (; i + 4 <= n; i += 4) {
+      const float32x4_t dx =
+          vmulq_n_f32(vaddq_f32(vdupq_n_f32(base_x + float(i)), lane), inv);
+      const float32x4_t r2 = vmlaq_f32(vdy2, dx, dx);
+      const float32x4_t f =
+          vmlaq_f32(kr0, r2, vmlaq_f32(kr1, r2, vmlaq_f32(kr2, r2, kr3)));
+      const float32x4_t xy2 = vmulq_f32(two, vmulq_f32(dx, vdy));
+      float32x4_t wx = vmulq_f32(dx, f);
+      wx = vmlaq_n_f32(wx, xy2, m.kt[0]);
+      wx = vmlaq_n_f32(wx, vmlaq_f32(r2, two, vmulq_f32(dx, dx)), m.kt[1]);
+      float32x4_t wy = vmulq_f32(vdy, f);
+      wy = vmlaq_n_f32(wy, xy2, m.kt[1]);
+      wy = vmlaq_n_f32(wy, vmlaq_f32(r2, two, vdy2), m.kt[0]);
+      vst1q_f32(sx + i, vmlaq_n_f32(vcx, wx, m.max_dist));
+      vst1q_f32(sy + i, vmlaq_n_f32(vcy, wy, m.max_dist));
     }
   }
-
-  return bytesDecoded;
-}
-
-// =============================================================================
-#ifdef __clang__
-#pragma clang diagnostic pop
 #endif
+  for (; i < n; i++) {
+    const float dx = (base_x + float(i)) * inv;
+    const float r2 = dx * dx + dy2;
+    const float f = m.kr[0] + r2 * (m.kr[1] + r2 * (m.kr[2] + r2 * m.kr[3]));
+    const float xy2 = 2.0f * dx * dy;
+    const float wx = dx * f + m.kt[0] * xy2 + m.kt[1] * (r2 + 2.0f * dx * dx);
+    const float wy = dy * f + m.kt[1] * xy2 + m.kt[0] * (r2 + 2.0f * dy2);
+    sx[i] = (m.cx - 0.5f) + m.max_dist * wx;
+    sy[i] = (m.cy - 0.5f) + m.max_dist * wy;
+  }
+}
 
-}  // namespace lzw
+// Catmull-Rom weights of the 4 taps around `t`(0.0 ~ 1.0).
+static inline void CubicWeights(float t, float w[4]) {
+  const float t2 = t * t;
+  const float t3 = t2 * t;
+  w[0] = -0.5f * t3 + t2 - 0.5f * t;
+  w[1] = 1.5f * t3 - 2.5f * t2 + 1.0f;
+  w[2] = -1.5f * t3 + 2.0f * t2 + 0.5f * t;
+  w[3] = 0.5f * t3 - 0.5f * t2;
+}
 
-#if defined(_WIN32)
-namespace {
+// Number of pixels whose taps are prepared at once by WarpRow.
+static const size_t kWarpChunk = 64;
+
+// Taps of up to kWarpChunk pixels: integer position of the top-left tap,
+// fractions and(bicubic only) 4 weights per pixel along each axis.
+struct WarpTaps {
+  int32_t ix[kWarpChunk];
+  int32_t iy[kWarpChunk];
+  float tx[kWarpChunk];
+  float ty[kWarpChunk];
+  float wx[4 * kWarpChunk];
+  float wy[4 * kWarpChunk];
+};
 
-static inline std::wstring UTF8ToWchar(const std::string& str) {
-  int wstr_size =
-      MultiByteToWideChar(CP_UTF8, 0, str.data(), int(str.size()), NULL, 0);
-  if (wstr_size < 0) {
-    // ??? wstr_size must be positive
-    return std::wstring();
+static inline void ScalarWarpTap(float x, float y, float max_x, float max_y,
+                                 bool cubic, WarpTaps* taps, size_t i) {
+  // Keep the coordinates(including NaN) in a range convertible to integers.
+  if (!(x >= -2.0f)) x = -2.0f;
+  if (!(y >= -2.0f)) y = -2.0f;
+  x = (std::min)(x, max_x);
+  y = (std::min)(y, max_y);
+
+  // floor() by truncation of non-negative values.
+  const int32_t ix = int32_t(x + 2.0f) - 2;
+  const int32_t iy = int32_t(y + 2.0f) - 2;
+  taps->ix[i] = ix;
+  taps->iy[i] = iy;
+  taps->tx[i] = x - float(ix);
+  taps->ty[i] = y - float(iy);
+  if (cubic) {
+    CubicWeights(taps->tx[i], &taps->wx[4 * i]);
+    CubicWeights(taps->ty[i], &taps->wy[4 * i]);
   }
-  std::wstring wstr(size_t(wstr_size), 0);
-  MultiByteToWideChar(CP_UTF8, 0, str.data(), int(str.size()), &wstr[0],
-                      int(wstr.size()));
-  return wstr;
 }
 
-}  // namespace
+#if defined(TINY_DNG_LOADER_SIMD_SSE2)
+static inline void CubicWeights4(__m128 t, float* w) {
+  const __m128 t2 = _mm_mul_ps(t, t);
+  const __m128 t3 = _mm_mul_ps(t2, t);
+  const __m128 h = _mm_set1_ps(0.5f);
+  const __m128 ht = _mm_mul_ps(h, t);
+  const __m128 ht2 = _mm_mul_ps(h, t2);
+  const __m128 ht3 = _mm_mul_ps(h, t3);
+  __m128 w0 = _mm_sub_ps(_mm_sub_ps(t2, ht3), ht);
+  __m128 w1 = _mm_add_ps(
+      _mm_sub_ps(_mm_mul_ps(_mm_set1_ps(1.5f), t3),
+                 _mm_mul_ps(_mm_set1_ps(2.5f), t2)),
+      _mm_set1_ps(1.0f));
+  __m128 w2 = _mm_add_ps(
+      _mm_sub_ps(_mm_add_ps(t2, t2), _mm_mul_ps(_mm_set1_ps(1.5f), t3)), ht);
+  __m128 w3 = _mm_sub_ps(ht3, ht2);
+  _MM_TRANSPOSE4_PS(w0, w1, w2, w3);
+  _mm_storeu_ps(w, w0);
+  _mm_storeu_ps(w + 4, w1);
+  _mm_storeu_ps(w + 8, w2);
+  _mm_storeu_ps(w + 12, w3);
+}
+#elif defined(TINY_DNG_LOADER_SIMD_NEON)
+static inline void CubicWeights4(float32x4_t t, float* w) {
+  const float32x4_t t2 = vmulq_f32(t, t);
+  const float32x4_t t3 = vmulq_f32(t2, t);
+  const float32x4_t ht = vmulq_n_f32(t, 0.5f);
+  const float32x4_t ht2 = vmulq_n_f32(t2, 0.5f);
+  const float32x4_t ht3 = vmulq_n_f32(t3, 0.5f);
+  float32x4x4_t v;
+  v.val[0] = vsubq_f32(vsubq_f32(t2, ht3), ht);
+  v.val[1] = vaddq_f32(vmlsq_n_f32(vmulq_n_f32(t3, 1.5f), t2, 2.5f),
+                       vdupq_n_f32(1.0f));
+  v.val[2] = vaddq_f32(vmlsq_n_f32(vaddq_f32(t2, t2), t3, 1.5f), ht);
+  v.val[3] = vsubq_f32(ht3, ht2);
+  vst4q_f32(w, v);  // interleave to 4 weights per pixel.
+}
 #endif
 
-bool LoadDNG(const char* filename, std::vector<FieldInfo>& custom_fields,
-             std::vector<DNGImage>* images, std::string* warn,
-             std::string* err) {
-  (void)warn;
-  std::stringstream ss;
-
-  if (!images) {
-    if (err) {
-      (*err) += "Invalid `images` pointer.\n";
+// Prepare taps of `n`(<= kWarpChunk) pixels at (sx[i], sy[i]).
+static void PrepareWarpTaps(const float* sx, const float* sy, size_t n,
+                            float max_x, float max_y, bool cubic,
+                            WarpTaps* taps) {
+  size_t i = 0;
+#if defined(TINY_DNG_LOADER_SIMD_SSE2)
+  const __m128 lo = _mm_set1_ps(-2.0f);
+  const __m128 hi_x = _mm_set1_ps(max_x);
+  const __m128 hi_y = _mm_set1_ps(max_y);
+  const __m128 two = _mm_set1_ps(2.0f);
+  const __m128i two_i = _mm_set1_epi32(2);
+  for (; i + 4 <= n; i += 4) {
+    // maxps returns the second operand for NaN.
+    const __m128 x = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(sx + i), lo), hi_x);
+    const __m128 y = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(sy + i), lo), hi_y);
+    const __m128i ix =
+        _mm_sub_epi32(_mm_cvttps_epi32(_mm_add_ps(x, two)), two_i);
+    const __m128i iy =
+        _mm_sub_epi32(_mm_cvttps_epi32(_mm_add_ps(y, two)), two_i);
+    const __m128 tx = _mm_sub_ps(x, _mm_cvtepi32_ps(ix));
+    const __m128 ty = _mm_sub_ps(y, _mm_cvtepi32_ps(iy));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(taps->ix + i), ix);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(taps->iy + i), iy);
+    _mm_storeu_ps(taps->tx + i, tx);
+    _mm_storeu_ps(taps->ty + i, ty);
+    if (cubic) {
+      CubicWeights4(tx, &taps->wx[4 * i]);
+      CubicWeights4(ty, &taps->wy[4 * i]);
+    }
+  }
+#elif defined(TINY_DNG_LOADER_SIMD_NEON)
+  const float32x4_t lo = vdupq_n_f32(-2.0f);
+  const float32x4_t hi_x = vdupq_n_f32(max_x);
+  const float32x4_t hi_y = vdupq_n_f32(max_y);
+  const int32x4_t two_i = vdupq_n_s32(2);
+  for (; i + 4 <= n; i += 4) {
+    // `x >= -2` is false for NaN.
+    float32x4_t x = vld1q_f32(sx + i);
+    float32x4_t y = vld1q_f32(sy + i);
+    x = vminq_f32(vbslq_f32(vcgeq_f32(x, lo), x, lo), hi_x);
+    y = vminq_f32(vbslq_f32(vcgeq_f32(y, lo), y, lo), hi_y);
+    const int32x4_t ix =
+        vsubq_s32(vcvtq_s32_f32(vaddq_f32(x, vdupq_n_f32(2.0f))), two_i);
+    const int32x4_t iy =
+        vsubq_s32(vcvtq_s32_f32(vaddq_f32(y, vdupq_n_f32(2.0f))), two_i);
+    const float32x4_t tx = vsubq_f32(x, vcvtq_f32_s32(ix));
+    const float32x4_t ty = vsubq_f32(y, vcvtq_f32_s32(iy));
+    vst1q_s32(taps->ix + i, ix);
+    vst1q_s32(taps->iy + i, iy);
+    vst1q_f32(taps->tx + i, tx);
+    vst1q_f32(taps->ty + i, ty);
+    if (cubic) {
+      CubicWeights4(tx, &taps->wx[4 * i]);
+      CubicWeights4(ty, &taps->wy[4 * i]);
     }
-    return false;
   }
+#endif
+  for (; i < n; i++) {
+    ScalarWarpTap(sx[i], sy[i], max_x, max_y, cubic, taps, i);
+  }
+}
 
-  FILE* fp;
-#if defined(_WIN32)
+static inline size_t ClampIndex(std::ptrdiff_t i, size_t n) {
+  return (i < 0) ? 0 : ((size_t(i) >= n) ? n - 1 : size_t(i));
+}
 
-#if defined(_MSC_VER) || defined(__MINGW32__)  // MSVC, MinGW gcc or clang
-  errno_t errcode = _wfopen_s(&fp, UTF8ToWchar(filename).c_str(), L"rb");
-  if (errcode != 0) {
-    if (err) {
-      (*err) += "Error opening file: " + std::string(filename) + "(errno " +
-                std::to_string(errcode) + ")\n";
-    }
-    return false;
-  }
+// Sum of 4x4 samples(`stride` samples between rows) weighted by wx * wy.
+static inline float Dot4x4(const uint16_t* p, size_t stride, const float* wx,
+                           const float* wy) {
+#if defined(TINY_DNG_LOADER_SIMD_SSE2)
+  const __m128i zero = _mm_setzero_si128();
+  const __m128 w = _mm_loadu_ps(wx);
+  __m128 acc = _mm_setzero_ps();
+  for (size_t j = 0; j < 4; j++) {
+    const __m128i v =
+        _mm_loadl_epi64(reinterpret_cast<const __m128i*>(p + j * stride));
+    const __m128 f = _mm_cvtepi32_ps(_mm_unpacklo_epi16(v, zero));
+    acc = _mm_add_ps(acc, _mm_mul_ps(_mm_mul_ps(f, w), _mm_set1_ps(wy[j])));
+  }
+  acc = _mm_add_ps(acc, _mm_movehl_ps(acc, acc));
+  acc = _mm_add_ss(acc, _mm_shuffle_ps(acc, acc, 1));
+  return _mm_cvtss_f32(acc);
+#elif defined(TINY_DNG_LOADER_SIMD_NEON)
+  const float32x4_t w = vld1q_f32(wx);
+  float32x4_t acc = vdupq_n_f32(0.0f);
+  for (size_t j = 0; j < 4; j++) {
+    const float32x4_t f = vcvtq_f32_u32(vmovl_u16(vld1_u16(p + j * stride)));
+    acc = vmlaq_n_f32(acc, vmulq_f32(f, w), wy[j]);
+  }
+  const float32x2_t s = vadd_f32(vget_low_f32(acc), vget_high_f32(acc));
+  return vget_lane_f32(vpadd_f32(s, s), 0);
 #else
-  // Unknown compiler
-  fp = fopen(filename, "rb");
+  float acc = 0.0f;
+  for (size_t j = 0; j < 4; j++) {
+    const uint16_t* r = p + j * stride;
+    acc += wy[j] * (wx[0] * float(r[0]) + wx[1] * float(r[1]) +
+                    wx[2] * float(r[2]) + wx[3] * float(r[3]));
+  }
+  return acc;
 #endif
+}
 
+static inline float Dot4x4(const float* p, size_t stride, const float* wx,
+                           const float* wy) {
+#if defined(TINY_DNG_LOADER_SIMD_SSE2)
+  const __m128 w = _mm_loadu_ps(wx);
+  __m128 acc = _mm_setzero_ps();
+  for (size_t j = 0; j < 4; j++) {
+    acc = _mm_add_ps(acc, _mm_mul_ps(_mm_mul_ps(_mm_loadu_ps(p + j * stride), w),
+                                     _mm_set1_ps(wy[j])));
+  }
+  acc = _mm_add_ps(acc, _mm_movehl_ps(acc, acc));
+  acc = _mm_add_ss(acc, _mm_shuffle_ps(acc, acc, 1));
+  return _mm_cvtss_f32(acc);
+#elif defined(TINY_DNG_LOADER_SIMD_NEON)
+  const float32x4_t w = vld1q_f32(wx);
+  float32x4_t acc = vdupq_n_f32(0.0f);
+  for (size_t j = 0; j < 4; j++) {
+    acc = vmlaq_n_f32(acc, vmulq_f32(vld1q_f32(p + j * stride), w), wy[j]);
+  }
+  const float32x2_t s = vadd_f32(vget_low_f32(acc), vget_high_f32(acc));
+  return vget_lane_f32(vpadd_f32(s, s), 0);
 #else
-  fp = fopen(filename, "rb");
+  float acc = 0.0f;
+  for (size_t j = 0; j < 4; j++) {
+    const float* r = p + j * stride;
+    acc += wy[j] * (wx[0] * r[0] + wx[1] * r[1] + wx[2] * r[2] + wx[3] * r[3]);
+  }
+  return acc;
 #endif
+}
 
-  if (!fp) {
-    ss << "File not found or cannot open file " << filename << std::endl;
-    if (err) {
-      (*err) = ss.str();
+template <typename T>
+static void WarpChunkBilinear(const T* src, size_t width, size_t height,
+                              size_t spp, size_t plane, size_t planes,
+                              const WarpTaps& taps, size_t n, T* dst) {
+  const size_t stride = width * spp;
+  const std::ptrdiff_t w = std::ptrdiff_t(width);
+  const std::ptrdiff_t h = std::ptrdiff_t(height);
+
+  for (size_t i = 0; i < n; i++) {
+    const std::ptrdiff_t ix = taps.ix[i];
+    const std::ptrdiff_t iy = taps.iy[i];
+    const float tx = taps.tx[i];
+    const float ty = taps.ty[i];
+    const T* r0;
+    const T* r1;
+    size_t x0, x1;
+    if ((ix >= 0) && (iy >= 0) && (ix + 1 < w) && (iy + 1 < h)) {
+      r0 = src + size_t(iy) * stride;
+      r1 = r0 + stride;
+      x0 = size_t(ix) * spp + plane;
+      x1 = x0 + spp;
+    } else {
+      r0 = src + ClampIndex(iy, height) * stride;
+      r1 = src + ClampIndex(iy + 1, height) * stride;
+      x0 = ClampIndex(ix, width) * spp + plane;
+      x1 = ClampIndex(ix + 1, width) * spp + plane;
     }
-    return false;
-  }
-
-  if (0 != fseek(fp, 0, SEEK_END)) {
-    if (err) {
-      (*err) = "Error seeking.\n";
+    T* out = dst + i * spp;
+    for (size_t c = 0; c < planes; c++) {
+      const float a = float(r0[x0 + c]);
+      const float b = float(r1[x0 + c]);
+      const float top = a + tx * (float(r0[x1 + c]) - a);
+      const float bottom = b + tx * (float(r1[x1 + c]) - b);
+      StoreSample(&out[c], top + ty * (bottom - top));
     }
-    return false;
   }
+}
 
-  size_t file_size = static_cast<size_t>(ftell(fp));
-
-  std::vector<unsigned char> whole_data;
-  {
-    whole_data.resize(file_size);
-    fseek(fp, 0, SEEK_SET);
-    size_t read_len = fread(whole_data.data(), 1, file_size, fp);
-    if (read_len != file_size) {
-      if (err) {
-        (*err) += "Unexpected file size.\n";
+template <typename T>
+static void WarpChunkBicubic(const T* src, size_t width, size_t height,
+                             size_t spp, size_t plane, size_t planes,
+                             const WarpTaps& taps, size_t n, T* dst) {
+  const size_t stride = width * spp;
+  const std::ptrdiff_t w = std::ptrdiff_t(width);
+  const std::ptrdiff_t h = std::ptrdiff_t(height);
+
+  for (size_t i = 0; i < n; i++) {
+    const std::ptrdiff_t ix = taps.ix[i];
+    const std::ptrdiff_t iy = taps.iy[i];
+    const float* wx = &taps.wx[4 * i];
+    const float* wy = &taps.wy[4 * i];
+    T* out = dst + i * spp;
+
+    if ((ix >= 1) && (iy >= 1) && (ix + 2 < w) && (iy + 2 < h)) {
+      const T* p = src + size_t(iy - 1) * stride + size_t(ix - 1) * spp + plane;
+      if (spp == 1) {
+        StoreSample(&out[0], Dot4x4(p, stride, wx, wy));
+        continue;
       }
-      return false;
+      for (size_t c = 0; c < planes; c++) {
+        float acc = 0.0f;
+        for (size_t j = 0; j < 4; j++) {
+          const T* r = p + j * stride + c;
+          acc += wy[j] * (wx[0] * float(r[0]) + wx[1] * float(r[spp]) +
+                          wx[2] * float(r[2 * spp]) + wx[3] * float(r[3 * spp]));
+        }
+        StoreSample(&out[c], acc);
+      }
+      continue;
     }
 
-    fseek(fp, 0, SEEK_SET);
+    size_t xs[4];
+    for (size_t k = 0; k < 4; k++) {
+      xs[k] = ClampIndex(ix - 1 + std::ptrdiff_t(k), width) * spp + plane;
+    }
+    for (size_t c = 0; c < planes; c++) {
+      float acc = 0.0f;
+      for (size_t j = 0; j < 4; j++) {
+        const T* r =
+            src + ClampIndex(iy - 1 + std::ptrdiff_t(j), height) * stride + c;
+        acc += wy[j] * (wx[0] * float(r[xs[0]]) + wx[1] * float(r[xs[1]]) +
+                        wx[2] * float(r[xs[2]]) + wx[3] * float(r[xs[3]]));
+      }
+      StoreSample(&out[c], acc);
+    }
   }
-  fclose(fp);
-
-  return LoadDNGFromMemory(reinterpret_cast<const char*>(whole_data.data()),
-                           static_cast<unsigned int>(whole_data.size()),
-                           custom_fields, images, warn, err);
 }
 
-bool LoadDNGFromMemory(const char* mem, unsigned int size,
-                       std::vector<FieldInfo>& custom_fields,
-                       std::vector<DNGImage>* images, std::string* warn,
-                       std::string* err) {
-  (void)warn;
-
-  if ((mem == NULL) || (size < 32) || (!images)) {
-    if (err) {
-      (*err) = "Invalid argument. argument is null or invalid.\n";
+///
+/// Resample `planes` planes from `src`(the bounds region, `width` x `height`
+/// pixels) at (sx[i], sy[i]) and store them to `dst + i * spp`. Taps outside
+/// of the source are clamped to the edge.
+///
+template <typename T>
+static void WarpRow(const T* src, size_t width, size_t height, size_t spp,
+                    size_t plane, size_t planes, WarpFilter filter,
+                    const float* sx, const float* sy, size_t n, T* dst) {
+  const bool cubic = (filter == WARP_FILTER_BICUBIC);
+  const float max_x = float(width) + 1.0f;
+  const float max_y = float(height) + 1.0f;
+  WarpTaps taps;
+
+  for (size_t i = 0; i < n; i += kWarpChunk) {
+    const size_t m = (std::min)(kWarpChunk, n - i);
+    PrepareWarpTaps(sx + i, sy + i, m, max_x, max_y, cubic, &taps);
+    if (cubic) {
+      WarpChunkBicubic(src, width, height, spp, plane, planes, taps, m,
+                       dst + i * spp);
+    } else {
+      WarpChunkBilinear(src, width, height, spp, plane, planes, taps, m,
+                        dst + i * spp);
     }
-    return false;
   }
+}
 
-  bool is_dng_big_endian = false;
+// WarpRectilinear/Fisheye.
+template <typename T>
+static bool WarpImage(const Opcode& op, WarpFilter filter,
+                      const OpcodeBounds& bounds, size_t spp, T* data,
+                      size_t row_samples, std::string* err) {
+  const size_t num_coeffs = (op.id == OPCODE_LIST_WARP_FISHEYE) ? 4 : 6;
+  const size_t num_planes = op.coefficients.size() / num_coeffs;
+  TINY_DNG_CHECK_AND_RETURN(
+      (num_planes > 0) && ((op.coefficients.size() % num_coeffs) == 0) &&
+          ((num_planes == 1) || (num_planes >= spp)),
+      "Invalid number of planes in Warp opcode: " << num_planes, err);
+
+  // Planes with the same coefficients share the mapping.
+  bool same = true;
+  for (size_t p = 1; p < (std::min)(num_planes, spp); p++) {
+    if (!std::equal(op.coefficients.begin(),
+                    op.coefficients.begin() + std::ptrdiff_t(num_coeffs),
+                    op.coefficients.begin() + std::ptrdiff_t(p * num_coeffs))) {
+      same = false;
+    }
+  }
+  const size_t num_mappings = same ? 1 : spp;
+  std::vector<WarpMapping> mappings(num_mappings);
+  for (size_t p = 0; p < num_mappings; p++) {
+    BuildWarpMapping(op, (std::min)(p, num_planes - 1), bounds, &mappings[p]);
+  }
+
+  // Source copy of the bounds.
+  const size_t width = bounds.width;
+  const size_t height = bounds.height;
+  std::vector<T> src(width * height * spp);
+  for (size_t y = 0; y < height; y++) {
+    const T* p = data + (bounds.top + y) * row_samples + bounds.left * spp;
+    std::copy(p, p + width * spp, src.begin() + std::ptrdiff_t(y * width * spp));
+  }
+
+  // Output is processed in tiles, so the source pixels read by a tile stay in
+  // cache. Tiles are wide rather than square to touch fewer pages per tile.
+  const size_t kTileWidth = 256;
+  const size_t kTileHeight = 16;
+  const size_t tiles_x = (width + kTileWidth - 1) / kTileWidth;
+  const size_t tiles_y = (height + kTileHeight - 1) / kTileHeight;
+  const int num_threads = GetNumWorkers(tiles_x * tiles_y);
+  std::vector<std::vector<float> > scratch(static_cast<size_t>(num_threads));
+
+  return ParallelFor(
+      tiles_x * tiles_y, num_threads, err,
+      [&](size_t k, int thread_id, std::string* thread_err) -> bool {
+        (void)thread_err;
+        std::vector<float>& coords = scratch[size_t(thread_id)];
+        coords.resize(2 * kTileWidth);
+        float* sx = coords.data();
+        float* sy = sx + kTileWidth;
+
+        const size_t x0 = (k % tiles_x) * kTileWidth;
+        const size_t y0 = (k / tiles_x) * kTileHeight;
+        const size_t n = (std::min)(kTileWidth, width - x0);
+        const size_t y_end = (std::min)(height, y0 + kTileHeight);
+        const size_t planes = same ? spp : 1;
+        for (size_t y = y0; y < y_end; y++) {
+          T* dst = data + (bounds.top + y) * row_samples +
+                   (bounds.left + x0) * spp;
+          for (size_t p = 0; p < num_mappings; p++) {
+            WarpRowCoords(mappings[p], y, x0, n, sx, sy);
+            WarpRow(src.data(), width, height, spp, p, planes, filter, sx, sy,
+                    n, dst + p);
+          }
+        }
+        return true;
+      });
+}
 
-  const unsigned short magic = *(reinterpret_cast<const unsigned short*>(mem));
+// Apply steps[begin, end) which don't need neighbor pixels. Each row goes
+// through all steps while it is in cache.
+template <typename T>
+static bool ApplyFusedOpcodeSteps(const std::vector<OpcodeStep>& steps,
+                                  size_t begin, size_t end,
+                                  const OpcodeBounds& bounds, size_t spp,
+                                  const BlackLevelTable& black, T* data,
+                                  size_t row_samples, std::string* err) {
+  const size_t kRowsPerChunk = 32;
+  const size_t num_chunks = (bounds.height + kRowsPerChunk - 1) / kRowsPerChunk;
+  const int num_threads = GetNumWorkers(num_chunks);
+  std::vector<std::vector<float> > scratch(static_cast<size_t>(num_threads));
+
+  return ParallelFor(
+      num_chunks, num_threads, err,
+      [&](size_t k, int thread_id, std::string* thread_err) -> bool {
+        (void)thread_err;
+        std::vector<float>& gains = scratch[size_t(thread_id)];
+        gains.assign(2 * bounds.width * spp, 1.0f);
+        float* offset_scratch = gains.data() + bounds.width * spp;
+
+        const size_t y_end = (std::min)(bounds.height, (k + 1) * kRowsPerChunk);
+        for (size_t y = k * kRowsPerChunk; y < y_end; y++) {
+          T* row = data + (bounds.top + y) * row_samples + bounds.left * spp;
+          const float* offsets = black.RowOffsets(y, offset_scratch);
+          for (size_t s = begin; s < end; s++) {
+            ApplyOpcodeStepRow(steps[s], y, spp, row, offsets, gains.data());
+          }
+        }
+        return true;
+      });
+}
 
-  if (magic == 0x4949) {
-    // might be TIFF(DNG).
-  } else if (magic == 0x4d4d) {
-    // might be TIFF(DNG, bigendian).
-    is_dng_big_endian = true;
-    TINY_DNG_DPRINTF("DNG is big endian\n");
-  } else {
-    std::stringstream ss;
-    ss << "Seems the data is not a DNG format." << std::endl;
-    if (err) {
-      (*err) = ss.str();
+template <typename T>
+static bool ApplyOpcodeSteps(const std::vector<OpcodeStep>& steps,
+                             const OpcodeBounds& bounds, size_t spp,
+                             const BlackLevelTable& black,
+                             const BadPixelCFA& cfa,
+                             const OpcodeOption& option, T* data,
+                             size_t row_samples, std::string* err) {
+  size_t begin = 0;
+  while (begin < steps.size()) {
+    if (OpcodeNeedsNeighbors(steps[begin].id)) {
+      const Opcode& op = *steps[begin].op;
+      if ((op.id == OPCODE_LIST_WARP_RECTILINEAR) ||
+          (op.id == OPCODE_LIST_WARP_FISHEYE)) {
+        if (!WarpImage(op, option.warp_filter, bounds, spp, data, row_samples,
+                       err)) {
+          return false;
+        }
+      } else if (!FixBadPixels(op, bounds, cfa, spp, data, row_samples,
+                               err)) {
+        return false;
+      }
+      begin++;
+      continue;
     }
 
-    return false;
+    size_t end = begin + 1;
+    while ((end < steps.size()) && !OpcodeNeedsNeighbors(steps[end].id)) {
+      end++;
+    }
+    if (!ApplyFusedOpcodeSteps(steps, begin, end, bounds, spp, black, data,
+                               row_samples, err)) {
+      return false;
+    }
+    begin = end;
   }
+  return true;
+}
 
-  const bool swap_endian = (is_dng_big_endian && (!IsBigEndian()));
-  StreamReader sr(reinterpret_cast<const uint8_t*>(mem), size, swap_endian);
-
-  char header[32];
+bool ApplyOpcodeList(const std::vector<Opcode>& opcodes,
+                     const std::vector<GainMap>& gainmaps, DNGImage* image,
+                     std::string* warn, std::string* err,
+                     const OpcodeOption& option) {
+  TINY_DNG_CHECK_AND_RETURN(image, "Invalid argument.", err);
 
-  if (32 != sr.read(32, 32, reinterpret_cast<unsigned char*>(header))) {
-    if (err) {
-      (*err) = "Error reading header.\n";
-    }
-    return false;
+  if (opcodes.empty()) {
+    return true;
   }
 
-  // skip magic header
-  if (!sr.seek_set(4)) {
-    if (err) {
-      (*err) += "Failed to seek to offset 4.\n";
-    }
+  const bool is_float = (image->sample_format == SAMPLEFORMAT_IEEEFP);
+  const int bps = image->bits_per_sample;
+  TINY_DNG_CHECK_AND_RETURN(
+      (!is_float && (bps == 16)) || (is_float && (bps == 32)),
+      "OpcodeList can be applied only to 16bit integer or 32bit float data. "
+      "bits_per_sample = " << bps,
+      err);
+
+  const unsigned int list_idx = opcodes[0].list_idx;
+  for (size_t i = 0; i < opcodes.size(); i++) {
+    TINY_DNG_CHECK_AND_RETURN(
+        (opcodes[i].list_idx == list_idx) && (list_idx >= 1) && (list_idx <= 3),
+        "Opcodes must be in the same OpcodeList. list_idx = "
+            << opcodes[i].list_idx,
+        err);
+  }
+
+  MaterializeDataView(image);
+
+  const size_t spp = size_t(image->samples_per_pixel);
+  const size_t bytes_per_sample = size_t(bps) / 8;
+  const size_t image_row_samples = size_t(image->width) * spp;
+  TINY_DNG_CHECK_AND_RETURN(
+      (spp > 0) &&
+          (image->data.size() >=
+           image_row_samples * size_t(image->height) * bytes_per_sample),
+      "Image data is smaller than its size.", err);
+
+  OpcodeBounds bounds;
+  if (!GetOpcodeBounds(*image, list_idx, &bounds, err)) {
     return false;
   }
 
-  bool ret = ParseDNGFromMemory(sr, custom_fields, images, warn, err);
+  std::vector<OpcodeStep> steps;
+  size_t i = 0;
+  while (i < opcodes.size()) {
+    const Opcode& op = opcodes[i];
+    OpcodeStep step;
+    step.id = op.id;
+
+    if ((op.id == OPCODE_LIST_GAIN_MAP) ||
+        (op.id == OPCODE_LIST_FIX_VIGNETTE_RADIAL)) {
+      // Gains of consecutive GainMaps(processing disjoint samples) and
+      // FixVignetteRadials are multiplied and applied at once.
+      size_t group_end = i;
+      while (group_end < opcodes.size()) {
+        const Opcode& g = opcodes[group_end];
+        if (g.id == OPCODE_LIST_FIX_VIGNETTE_RADIAL) {
+          TINY_DNG_CHECK_AND_RETURN(
+              g.coefficients.size() == 5,
+              "FixVignetteRadial must have 5 coefficients. coefficients = "
+                  << g.coefficients.size(),
+              err);
+          group_end++;
+          continue;
+        }
+        if (g.id != OPCODE_LIST_GAIN_MAP) {
+          break;
+        }
+        const int gi = g.gainmap_index;
+        TINY_DNG_CHECK_AND_RETURN((gi >= 0) && (size_t(gi) < gainmaps.size()),
+                                  "Invalid GainMap index " << gi, err);
+        bool disjoint = true;
+        for (size_t k = i; k < group_end; k++) {
+          if ((opcodes[k].id == OPCODE_LIST_GAIN_MAP) &&
+              !GainMapsDisjoint(gainmaps[size_t(opcodes[k].gainmap_index)],
+                                gainmaps[size_t(gi)])) {
+            disjoint = false;
+            break;
+          }
+        }
+        if (!disjoint) {
+          break;
+        }
+        group_end++;
+      }
 
-  if (!ret) {
-    if (err) {
-      (*err) += "Failed to parse DNG data.\n";
+      for (size_t k = i; k < group_end; k++) {
+        if (opcodes[k].id == OPCODE_LIST_FIX_VIGNETTE_RADIAL) {
+          step.vignettes.push_back(VignettePlan());
+          BuildVignettePlan(opcodes[k], bounds, &step.vignettes.back());
+          continue;
+        }
+        step.plans.push_back(GainMapPlan());
+        if (!BuildGainMapPlan(gainmaps[size_t(opcodes[k].gainmap_index)],
+                              bounds, spp, &step.plans.back(), err)) {
+          return false;
+        }
+      }
+      steps.push_back(std::move(step));
+      i = group_end;
+      continue;
     }
-    return false;
-  }
 
-  //
-  // Decode image data.
-  //
-  for (size_t i = 0; i < images->size(); i++) {
-    tinydng::DNGImage* image = &((*images)[i]);
+    i++;
 
-    const size_t data_offset =
-        (image->offset > 0) ? image->offset : image->tile_offset;
-    TINY_DNG_DPRINTF("data_offset = %d\n", int(data_offset));
-    if ((data_offset == 0) || (data_offset > sr.size())) {
-      if (err) {
+    if (OpcodeNeedsNeighbors(op.id)) {
+      step.op = &op;
+      steps.push_back(std::move(step));
+      continue;
+    }
+
+    const bool supported = ((op.id == OPCODE_LIST_MAP_TABLE) && !is_float) ||
+                           (op.id == OPCODE_LIST_MAP_POLYNOMIAL) ||
+                           (op.id == OPCODE_LIST_DELTA_PER_ROW) ||
+                           (op.id == OPCODE_LIST_DELTA_PER_COLUMN) ||
+                           (op.id == OPCODE_LIST_SCALE_PER_ROW) ||
+                           (op.id == OPCODE_LIST_SCALE_PER_COLUMN);
+    if (!supported) {
+      TINY_DNG_CHECK_AND_RETURN(
+          op.flags & 1, "Unsupported opcode " << op.id << " in OpcodeList"
+                                              << list_idx,
+          err);
+      if (warn) {
         std::stringstream ss;
-        ss << i << "'th image data offset is zero or invalid.\n";
-        (*err) += ss.str();
+        ss << "Skipped optional opcode " << op.id << " in OpcodeList"
+           << list_idx << ".\n";
+        (*warn) += ss.str();
       }
-      return false;
+      continue;
     }
 
-    // std::cout << "offt =\n" << image->offset << std::endl;
-    // std::cout << "tile_offt = \n" << image->tile_offset << std::endl;
-    // std::cout << "data_offset = " << data_offset << std::endl;
-
-    TINY_DNG_DPRINTF("image[%d].compression = %d\n", int(i),
-                     image->compression);
-
-    if (image->compression == COMPRESSION_NONE) {  // no compression
-
-      if (image->jpeg_byte_count > 0) {
-        // Looks like CR2 IFD#1(thumbnail jpeg image)
-        // Currently skip parsing jpeg data.
-        // TODO(syoyo): Decode jpeg data.
-        image->width = 0;
-        image->height = 0;
+    if (!ComputeOpcodeArea(op.top, op.left, op.bottom, op.right, op.plane,
+                           op.planes, op.row_pitch, op.col_pitch, bounds, spp,
+                           &step.area)) {
+      continue;
+    }
 
-        if (image->bits_per_sample_original < 0) {
-          // Assume 8bit
-          image->bits_per_sample_original = 8;
+    if (op.id == OPCODE_LIST_MAP_TABLE) {
+      TINY_DNG_CHECK_AND_RETURN(!op.table.empty(), "Empty MapTable.", err);
+      // Values beyond the table are mapped to the last entry.
+      step.lut.resize(65536);
+      for (size_t v = 0; v < 65536; v++) {
+        step.lut[v] = op.table[(std::min)(v, op.table.size() - 1)];
+      }
+    } else if (op.id == OPCODE_LIST_MAP_POLYNOMIAL) {
+      TINY_DNG_CHECK_AND_RETURN(!op.coefficients.empty(),
+                                "Empty MapPolynomial.", err);
+      if (is_float) {
+        for (size_t k = 0; k < op.coefficients.size(); k++) {
+          step.coefficients.push_back(float(op.coefficients[k]));
         }
-
-        image->bits_per_sample = image->bits_per_sample_original;
-
       } else {
-
-        const size_t kMaxImageSize = size_t(1024)*size_t(1024)*size_t(1024)*size_t(2); // 2GB
-
-        if (image->bits_per_sample_original <= 0) {
-          if (err) {
-            (*err) += "bits_per_sample information not found in the tag.\n";
+        step.lut.resize(65536);
+        for (size_t v = 0; v < 65536; v++) {
+          const double x = double(v) / 65535.0;
+          double y = 0.0;
+          for (size_t k = op.coefficients.size(); k > 0; k--) {
+            y = y * x + op.coefficients[k - 1];
           }
-          return false;
+          y = (std::min)((std::max)(y * 65535.0, 0.0), 65535.0);
+          step.lut[v] = static_cast<uint16_t>(y + 0.5);
         }
-
-        image->bits_per_sample = image->bits_per_sample_original;
-        // std::cout << "sample_per_pixel " << image->samples_per_pixel << "\n";
-        // std::cout << "width " << image->width << "\n";
-        // std::cout << "height " << image->height << "\n";
-        // std::cout << "bps " << image->bits_per_sample << "\n";
-
-        if (((image->width * image->height * image->bits_per_sample) % 8) ==
-            0) {
-          // OK
-        } else {
-          if (err) {
-            (*err) += "Image size must be multiple of 8.";
+      }
+    } else if ((op.id == OPCODE_LIST_DELTA_PER_COLUMN) ||
+               (op.id == OPCODE_LIST_SCALE_PER_COLUMN)) {
+      // Same for every row. Scatter values to per sample arrays in advance.
+      const OpcodeArea& area = step.area;
+      const size_t num_cols = (std::min)(area.num_cols, op.values.size());
+      if (num_cols > 0) {
+        const size_t stride = area.col_pitch * spp;
+        const bool is_delta = (op.id == OPCODE_LIST_DELTA_PER_COLUMN);
+        step.first = area.left * spp + area.plane;
+        step.scale.assign((num_cols - 1) * stride + area.num_planes, 1.0f);
+        step.bias.assign(step.scale.size(), 0.0f);
+        float* dst = is_delta ? step.bias.data() : step.scale.data();
+        for (size_t x = 0; x < num_cols; x++) {
+          for (size_t k = 0; k < area.num_planes; k++) {
+            dst[x * stride + k] = op.values[x];
           }
-          return false;
         }
+      }
+    } else {
+      step.values = &op.values;
+    }
 
-        const size_t len = size_t(image->samples_per_pixel) *
-                           size_t(image->width) * size_t(image->height) *
-                           size_t(image->bits_per_sample) / size_t(8);
+    steps.push_back(std::move(step));
+  }
 
-        if (len == 0) {
-          if (err) {
-            (*err) += "Unexpected length.";
-          }
-          return false;
-        }
+  if (steps.empty()) {
+    return true;
+  }
 
-        if (len > kMaxImageSize) {
-          if (err) {
-            std::stringstream ss;
-            ss << "Image byte size too large. " << len << "bytes in file, but hard-limit is set to " << kMaxImageSize << " bytes.\n";
-            (*err) += ss.str();
-          }
-          return false;
-        }
+  const size_t row_samples = bounds.width * spp;
+
+  // Keep black level of stage 2 integer data for GainMap.
+  BlackLevelTable black;
+  if ((list_idx == 2) && !is_float) {
+    if (!BuildBlackLevelTable(*image, bounds.width, bounds.height, spp, &black,
+                              err)) {
+      return false;
+    }
+  } else {
+    ZeroBlackLevelTable(row_samples, &black);
+  }
+
+  const BadPixelCFA cfa = GetBadPixelCFA(*image, bounds);
+  if (is_float) {
+    return ApplyOpcodeSteps(steps, bounds, spp, black, cfa, option,
+                            reinterpret_cast<float*>(image->data.data()),
+                            image_row_samples, err);
+  }
+  return ApplyOpcodeSteps(steps, bounds, spp, black, cfa, option,
+                          reinterpret_cast<uint16_t*>(image->data.data()),
+                          image_row_samples, err);
+}
 
-        image->data.resize(len);
-        if (!sr.seek_set(data_offset)) {
-          if (err) {
-            (*err) += "Failed to seek to uncompressed image data position.\n";
-          }
-          return false;
-        }
+// ---------------------------------------------------------------------------
+// Demosaic.
+
+// 4 float lanes, so that kernels are written once for SSE2, NEON and scalar.
+#if defined(TINY_DNG_LOADER_SIMD_SSE2)
+typedef __m128 Float4;
+static inline Float4 Float4Load(const float* p) { return _mm_loadu_ps(p); }
+static inline void Float4Store(float* p, Float4 v) { _mm_storeu_ps(p, v); }
+static inline Float4 Float4Set(float v) { return _mm_set1_ps(v); }
+static inline Float4 Float4Add(Float4 a, Float4 b) { return _mm_add_ps(a, b); }
+static inline Float4 Float4Sub(Float4 a, Float4 b) { return _mm_sub_ps(a, b); }
+static inline Float4 Float4Mul(Float4 a, Float4 b) { return _mm_mul_ps(a, b); }
+static inline Float4 Float4Min(Float4 a, Float4 b) { return _mm_min_ps(a, b); }
+static inline Float4 Float4Max(Float4 a, Float4 b) { return _mm_max_ps(a, b); }
+// Lanes of `mask` are all 0 or all 1 bits.
+static inline Float4 Float4Select(Float4 mask, Float4 a, Float4 b) {
+  return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+// Mask of the lanes whose index has the parity `parity`.
+static inline Float4 Float4ParityMask(int parity) {
+  const int m0 = (parity == 0) ? -1 : 0;
+  return _mm_castsi128_ps(_mm_set_epi32(~m0, m0, ~m0, m0));
+}
+#elif defined(TINY_DNG_LOADER_SIMD_NEON)
+typedef float32x4_t Float4;
+static inline Float4 Float4Load(const float* p) { return vld1q_f32(p); }
+static inline void Float4Store(float* p, Float4 v) { vst1q_f32(p, v); }
+static inline Float4 Float4Set(float v) { return vdupq_n_f32(v); }
+static inline Float4 Float4Add(Float4 a, Float4 b) { return vaddq_f32(a, b); }
+static inline Float4 Float4Sub(Float4 a, Float4 b) { return vsubq_f32(a, b); }
+static inline Float4 Float4Mul(Float4 a, Float4 b) { return vmulq_f32(a, b); }
+static inline Float4 Float4Min(Float4 a, Float4 b) { return vminq_f32(a, b); }
+static inline Float4 Float4Max(Float4 a, Float4 b) { return vmaxq_f32(a, b); }
+static inline Float4 Float4Select(Float4 mask, Float4 a, Float4 b) {
+  return vbslq_f32(vreinterpretq_u32_f32(mask), a, b);
+}
+static inline Float4 Float4ParityMask(int parity) {
+  const uint32_t m0 = (parity == 0) ? 0xffffffffu : 0u;
+  const uint32_t bits[4] = {m0, ~m0, m0, ~m0};
+  return vreinterpretq_f32_u32(vld1q_u32(bits));
+}
+#else
+struct Float4 {
+  float v[4];
+};
+static inline Float4 Float4Load(const float* p) {
+  Float4 r;
+  memcpy(r.v, p, sizeof(r.v));
+  return r;
+}
+static inline void Float4Store(float* p, Float4 v) {
+  memcpy(p, v.v, sizeof(v.v));
+}
+static inline Float4 Float4Set(float v) {
+  Float4 r = {{v, v, v, v}};
+  return r;
+}
+#define TINY_DNG_FLOAT4_OP(name, expr)                 \
+  static inline Float4 name(Float4 a, Float4 b) {      \
+    Float4 r;                                          \
+    for (int i = 0; i < 4; i++) {                      \
+      r.v[i] = (expr);                                 \
+    }                                                  \
+    return r;                                          \
+  }
+TINY_DNG_FLOAT4_OP(Float4Add, a.v[i] + b.v[i])
+TINY_DNG_FLOAT4_OP(Float4Sub, a.v[i] - b.v[i])
+TINY_DNG_FLOAT4_OP(Float4Mul, a.v[i] * b.v[i])
+TINY_DNG_FLOAT4_OP(Float4Min, (std::min)(a.v[i], b.v[i]))
+TINY_DNG_FLOAT4_OP(Float4Max, (std::max)(a.v[i], b.v[i]))
+#undef TINY_DNG_FLOAT4_OP
+// Lanes of `mask` are 1.0(select `a`) or 0.0(select `b`).
+static inline Float4 Float4Select(Float4 mask, Float4 a, Float4 b) {
+  Float4 r;
+  for (int i = 0; i < 4; i++) {
+    r.v[i] = (mask.v[i] != 0.0f) ? a.v[i] : b.v[i];
+  }
+  return r;
+}
+static inline Float4 Float4ParityMask(int parity) {
+  const float m0 = (parity == 0) ? 1.0f : 0.0f;
+  Float4 r = {{m0, 1.0f - m0, m0, 1.0f - m0}};
+  return r;
+}
+#endif
 
-        if (!sr.read(len, len, image->data.data())) {
-          if (err) {
-            (*err) += "Failed to read image data.\n";
-          }
-          return false;
-        }
-      }
-    } else if (image->compression == COMPRESSION_LZW) {  // lzw compression
+///
+/// Samples of the image(ActiveArea) to process. Rows and columns are relative
+/// to the ActiveArea.
+///
+struct RawSource {
+  const unsigned char* data{nullptr};
+  size_t bytes_per_sample{2};
+  bool is_float{false};
+  size_t spp{1};          // samples per pixel
+  size_t row_samples{0};  // of the whole image
+  size_t top{0};
+  size_t left{0};
+  size_t width{0};
+  size_t height{0};
+
+  // Pointer to the first sample of the pixel (`col`, `row`).
+  const unsigned char* At(size_t row, size_t col) const {
+    return data +
+           ((top + row) * row_samples + (left + col) * spp) * bytes_per_sample;
+  }
+};
 
-      if (image->bits_per_sample_original <= 0) {
-        if (err) {
-          (*err) += "bits_per_sample information not found in the tag.\n";
-        }
-        return false;
-      }
+// 8/16bit integer or 32bit float image with 1 ~ 4 samples per pixel.
+static bool GetRawSource(const DNGImage& image, RawSource* src,
+                         std::string* err) {
+  TINY_DNG_CHECK_AND_RETURN(
+      (image.samples_per_pixel >= 1) && (image.samples_per_pixel <= 4),
+      "Invalid samples_per_pixel: " << image.samples_per_pixel, err);
+
+  const bool is_float = (image.sample_format == SAMPLEFORMAT_IEEEFP);
+  const int bps = image.bits_per_sample;
+  TINY_DNG_CHECK_AND_RETURN(
+      (!is_float && ((bps == 8) || (bps == 16))) || (is_float && (bps == 32)),
+      "Image data must be 8/16bit integer or 32bit float(unpack bit-packed "
+      "data with LoadOption::unpack_to_uint16). bits_per_sample = "
+          << bps,
+      err);
+
+  const size_t image_width = size_t((std::max)(image.width, 0));
+  const size_t image_height = size_t((std::max)(image.height, 0));
+  src->data = image.data_view ? image.data_view : image.data.data();
+  const size_t data_size =
+      image.data_view ? image.data_view_size : image.data.size();
+  src->bytes_per_sample = size_t(bps) / 8;
+  src->is_float = is_float;
+  src->spp = size_t(image.samples_per_pixel);
+  src->row_samples = image_width * src->spp;
+  TINY_DNG_CHECK_AND_RETURN(
+      data_size >= src->row_samples * image_height * src->bytes_per_sample,
+      "Image data is smaller than its size.", err);
+
+  src->top = 0;
+  src->left = 0;
+  src->width = image_width;
+  src->height = image_height;
+  if (image.has_active_area) {
+    const int* a = image.active_area;
+    TINY_DNG_CHECK_AND_RETURN(
+        (a[0] >= 0) && (a[1] >= 0) && (a[0] < a[2]) && (a[1] < a[3]) &&
+            (a[2] <= image.height) && (a[3] <= image.width),
+        "Invalid ActiveArea: " << a[0] << ", " << a[1] << ", " << a[2]
+                               << ", " << a[3],
+        err);
+    src->top = size_t(a[0]);
+    src->left = size_t(a[1]);
+    src->width = size_t(a[3] - a[1]);
+    src->height = size_t(a[2] - a[0]);
+  }
+  TINY_DNG_CHECK_AND_RETURN((src->width > 0) && (src->height > 0),
+                            "Empty image.", err);
+  return true;
+}
 
-      image->bits_per_sample = image->bits_per_sample_original;
-      TINY_DNG_DPRINTF("bps = %d\n", image->bits_per_sample);
-      TINY_DNG_DPRINTF("counts = %d\n", int(image->strip_byte_counts.size()));
-      TINY_DNG_DPRINTF("offsets = %d\n", int(image->strip_offsets.size()));
+static bool GetCFASource(const DNGImage& image, RawSource* src,
+                         std::string* err) {
+  TINY_DNG_CHECK_AND_RETURN(
+      image.samples_per_pixel == 1,
+      "CFA image must have 1 sample per pixel. samples_per_pixel = "
+          << image.samples_per_pixel,
+      err);
+  return GetRawSource(image, src, err);
+}
 
-      image->data.clear();
+// Convert `n` samples from (`row`, `col`) of `src` to float.
+static void LoadCFASamples(const RawSource& src, size_t row, size_t col,
+                           size_t n, float* dst) {
+  if (src.is_float) {
+    memcpy(dst, src.At(row, col), n * sizeof(float));
+    return;
+  }
+  if (src.bytes_per_sample == 1) {
+    const uint8_t* p = src.At(row, col);
+    for (size_t x = 0; x < n; x++) {
+      dst[x] = float(p[x]);
+    }
+    return;
+  }
 
-      if ((image->strip_byte_counts.size() > 0) &&
-          (image->strip_byte_counts.size() == image->strip_offsets.size())) {
-#if (__cplusplus > 199711L) && defined(TINY_DNG_LOADER_USE_THREAD)
+  const uint16_t* p = reinterpret_cast<const uint16_t*>(src.At(row, col));
+  size_t x = 0;
+#if defined(TINY_DNG_LOADER_SIMD_SSE2)
+  const __m128i zero = _mm_setzero_si128();
+  for (; x + 8 <= n; x += 8) {
+    const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + x));
+    _mm_storeu_ps(dst + x, _mm_cvtepi32_ps(_mm_unpacklo_epi16(v, zero)));
+    _mm_storeu_ps(dst + x + 4, _mm_cvtepi32_ps(_mm_unpackhi_epi16(v, zero)));
+  }
+#elif defined(TINY_DNG_LOADER_SIMD_NEON)
+  for (; x + 8 <= n; x += 8) {
+    const uint16x8_t v = vld1q_u16(p + x);
+    vst1q_f32(dst + x, vcvtq_f32_u32(vmovl_u16(vget_low_u16(v))));
+    vst1q_f32(dst + x + 4, vcvtq_f32_u32(vmovl_u16(vget_high_u16(v))));
+  }
+#endif
+  for (; x < n; x++) {
+    dst[x] = float(p[x]);
+  }
+}
 
-        const int num_strips = int(image->strip_byte_counts.size());
+// Reflect `i` into [0, n) keeping its parity, so a reflected sample has the
+// same CFA color.
+static inline size_t MirrorIndex(std::ptrdiff_t i, size_t n) {
+  const std::ptrdiff_t m = std::ptrdiff_t(n);
+  if (i < 0) {
+    i = -i;
+  }
+  if (i >= m) {
+    i = 2 * (m - 1) - i;
+  }
+  return size_t((std::min)((std::max)(i, std::ptrdiff_t(0)), m - 1));
+}
 
-        std::vector<std::thread> workers;
-        std::atomic<size_t> strip_count(0);
-        std::mutex err_mtx_;
+///
+/// Load the tile of `w` x `h` pixels at (`x0`, `y0`) and `halo` pixels around
+/// it to `tile`(`stride` floats per row). Pixels outside of the image are
+/// mirrored, so kernels read neighbors without bounds checks.
+///
+static void LoadCFATile(const RawSource& src, size_t x0, size_t y0, size_t w,
+                        size_t h, size_t halo, size_t stride, float* tile) {
+  const std::ptrdiff_t left = std::ptrdiff_t(x0) - std::ptrdiff_t(halo);
+  const std::ptrdiff_t right = std::ptrdiff_t(x0 + w + halo);
+  const std::ptrdiff_t begin = (std::max)(left, std::ptrdiff_t(0));
+  const std::ptrdiff_t end = (std::min)(right, std::ptrdiff_t(src.width));
 
-        int num_threads = (std::max)(1, int(std::thread::hardware_concurrency()));
-        if (num_threads > num_strips) {
-          num_threads = num_strips;
-        }
+  for (size_t j = 0; j < h + 2 * halo; j++) {
+    const size_t sy =
+        MirrorIndex(std::ptrdiff_t(y0 + j) - std::ptrdiff_t(halo), src.height);
+    float* dst = tile + j * stride;
+    if (begin < end) {
+      LoadCFASamples(src, sy, size_t(begin), size_t(end - begin),
+                     dst + (begin - left));
+    }
+    for (std::ptrdiff_t x = left; x < begin; x++) {
+      LoadCFASamples(src, sy, MirrorIndex(x, src.width), 1, dst + (x - left));
+    }
+    for (std::ptrdiff_t x = (std::max)(end, left); x < right; x++) {
+      LoadCFASamples(src, sy, MirrorIndex(x, src.width), 1, dst + (x - left));
+    }
+  }
+}
 
-        bool failed = false;
+// Largest CFA repeat pattern `Demosaic` handles.
+static const size_t kMaxCFADim = 8;
 
-        const size_t dst_strip_len = static_cast<size_t>(
-            (image->samples_per_pixel * image->width * image->rows_per_strip *
-             image->bits_per_sample) /
-            8);
+// Colors(0: red, 1: green, 2: blue) of the CFA repeat pattern.
+struct CFAColors {
+  size_t rows{2};
+  size_t cols{2};
+  int color[kMaxCFADim][kMaxCFADim];
 
-        image->data.resize(dst_strip_len * size_t(num_strips));
+  // Color at (x, y) relative to the pattern origin. Negative coordinates are
+  // allowed.
+  int At(std::ptrdiff_t x, std::ptrdiff_t y) const {
+    const std::ptrdiff_t r = std::ptrdiff_t(rows);
+    const std::ptrdiff_t c = std::ptrdiff_t(cols);
+    return color[size_t(((y % r) + r) % r)][size_t(((x % c) + c) % c)];
+  }
+};
 
-        for (int t = 0; t < num_threads; t++) {
-          workers.emplace_back(std::thread([&]() {
-            size_t k = 0;
-            while ((k = strip_count++) < size_t(num_strips)) {
-              std::vector<unsigned char> src(image->strip_byte_counts[k]);
-              size_t strip_offset = image->strip_offsets[k];
-              size_t strip_bytesize = image->strip_byte_counts[k];
+static bool GetCFAColors(const DNGImage& image, CFAColors* cfa,
+                         std::string* err) {
+  TINY_DNG_CHECK_AND_RETURN(
+      image.cfa_layout == 1,
+      "Only rectangular CFA layout is supported. cfa_layout = "
+          << image.cfa_layout,
+      err);
+
+  // Images without the whole pattern(e.g. built by the user) use the 2x2
+  // `cfa_pattern`.
+  std::vector<int> pattern;
+  if (image.cfa_repeat_pattern.empty()) {
+    cfa->rows = 2;
+    cfa->cols = 2;
+    pattern.assign(&image.cfa_pattern[0][0], &image.cfa_pattern[0][0] + 4);
+  } else {
+    TINY_DNG_CHECK_AND_RETURN(
+        (image.cfa_repeat_dim[0] >= 1) &&
+            (size_t(image.cfa_repeat_dim[0]) <= kMaxCFADim) &&
+            (image.cfa_repeat_dim[1] >= 1) &&
+            (size_t(image.cfa_repeat_dim[1]) <= kMaxCFADim),
+        "CFA pattern larger than " << kMaxCFADim << "x" << kMaxCFADim
+                                   << " is not supported: "
+                                   << image.cfa_repeat_dim[0] << "x"
+                                   << image.cfa_repeat_dim[1],
+        err);
+    cfa->rows = size_t(image.cfa_repeat_dim[0]);
+    cfa->cols = size_t(image.cfa_repeat_dim[1]);
+    TINY_DNG_CHECK_AND_RETURN(
+        image.cfa_repeat_pattern.size() == cfa->rows * cfa->cols,
+        "CFA pattern does not match CFARepeatPatternDim.", err);
+    pattern = image.cfa_repeat_pattern;
+  }
+
+  int count[3] = {0, 0, 0};
+  for (size_t y = 0; y < cfa->rows; y++) {
+    for (size_t x = 0; x < cfa->cols; x++) {
+      const int idx = pattern[y * cfa->cols + x];
+      TINY_DNG_CHECK_AND_RETURN((idx >= 0) && (idx < 4),
+                                "CFA pattern is not set.", err);
+      const int c = image.cfa_plane_color[idx];
+      TINY_DNG_CHECK_AND_RETURN(
+          (c >= 0) && (c <= 2),
+          "Only red, green and blue CFA colors are supported. color = " << c,
+          err);
+      cfa->color[y][x] = c;
+      count[c]++;
+    }
+  }
+  TINY_DNG_CHECK_AND_RETURN((count[0] > 0) && (count[1] > 0) && (count[2] > 0),
+                            "CFA pattern must have red, green and blue.", err);
+  return true;
+}
 
-              std::vector<unsigned char> dst(dst_strip_len);
+// Position of red in the 2x2 Bayer pattern(blue is at the opposite corner).
+struct BayerPhase {
+  int red_x{0};
+  int red_y{0};
+};
 
-              const uint8_t* src_addr =
-                  sr.map_abs_addr(strip_offset, strip_bytesize);
+// Returns false when `cfa` is not a 2x2 Bayer pattern.
+static bool GetBayerPhase(const CFAColors& cfa, BayerPhase* phase) {
+  if ((cfa.rows != 2) || (cfa.cols != 2)) {
+    return false;
+  }
+  for (int y = 0; y < 2; y++) {
+    for (int x = 0; x < 2; x++) {
+      if ((cfa.color[y][x] == 0) && (cfa.color[y][1 - x] == 1) &&
+          (cfa.color[1 - y][x] == 1) && (cfa.color[1 - y][1 - x] == 2)) {
+        phase->red_x = x;
+        phase->red_y = y;
+        return true;
+      }
+    }
+  }
+  return false;
+}
 
-              if (!src_addr) {
-                // Atomic update
-                {
-                  std::lock_guard<std::mutex> lock(err_mtx_);
-                  if (err) {
-                    (*err) +=
-                        "Cannot read strip_byte_counts bytes from a memory.\n";
-                  }
-                }
+///
+/// Bayer kernels. `in` is the first pixel of the tile(with a halo of at least
+/// 2 pixels) and `w` is a multiple of 4. The tile origin has the same parity
+/// as the image origin. Output is planar.
+///
+/// All candidates are computed for 4 pixels, and the one for the CFA color of
+/// each lane is selected: in a row of red(blue) and green, red(blue) sites
+/// take green from the cross, blue(red) from the diagonals, and green sites
+/// take red(blue) from the row and blue(red) from the column.
+///
+static void DemosaicBilinearTile(const float* in, size_t stride, size_t w,
+                                 size_t h, const BayerPhase& phase, float* r,
+                                 float* g, float* b, size_t out_stride) {
+  const Float4 quarter = Float4Set(0.25f);
+  const Float4 half = Float4Set(0.5f);
+
+  for (size_t y = 0; y < h; y++) {
+    const float* p = in + y * stride;
+    const float* pn = p - stride;
+    const float* ps = p + stride;
+    const bool red_row = (int(y & 1) == phase.red_y);
+    const Float4 mask =
+        Float4ParityMask(red_row ? phase.red_x : (1 - phase.red_x));
+    float* own = (red_row ? r : b) + y * out_stride;
+    float* other = (red_row ? b : r) + y * out_stride;
+    float* green = g + y * out_stride;
+
+    for (size_t x = 0; x < w; x += 4) {
+      const Float4 c = Float4Load(p + x);
+      const Float4 e1 = Float4Add(Float4Load(p + x - 1), Float4Load(p + x + 1));
+      const Float4 n1 = Float4Add(Float4Load(pn + x), Float4Load(ps + x));
+      const Float4 d1 =
+          Float4Add(Float4Add(Float4Load(pn + x - 1), Float4Load(pn + x + 1)),
+                    Float4Add(Float4Load(ps + x - 1), Float4Load(ps + x + 1)));
+
+      Float4Store(own + x, Float4Select(mask, c, Float4Mul(e1, half)));
+      Float4Store(green + x,
+                  Float4Select(mask, Float4Mul(Float4Add(e1, n1), quarter), c));
+      Float4Store(other + x, Float4Select(mask, Float4Mul(d1, quarter),
+                                          Float4Mul(n1, half)));
+    }
+  }
+}
 
-                failed = true;
-                break;
-              }
+// Malvar, He and Cutler, "High-quality linear interpolation for demosaicing of
+// Bayer-patterned color images", ICASSP 2004. Bilinear plus the Laplacian of
+// the center color.
+static void DemosaicMalvarTile(const float* in, size_t stride, size_t w,
+                               size_t h, const BayerPhase& phase, float* r,
+                               float* g, float* b, size_t out_stride) {
+  const Float4 k05 = Float4Set(0.5f / 8.0f);
+  const Float4 k1 = Float4Set(1.0f / 8.0f);
+  const Float4 k15 = Float4Set(1.5f / 8.0f);
+  const Float4 k2 = Float4Set(2.0f / 8.0f);
+  const Float4 k4 = Float4Set(4.0f / 8.0f);
+  const Float4 k5 = Float4Set(5.0f / 8.0f);
+  const Float4 k6 = Float4Set(6.0f / 8.0f);
+
+  for (size_t y = 0; y < h; y++) {
+    const float* p = in + y * stride;
+    const float* pn = p - stride;
+    const float* ps = p + stride;
+    const float* pn2 = pn - stride;
+    const float* ps2 = ps + stride;
+    const bool red_row = (int(y & 1) == phase.red_y);
+    const Float4 mask =
+        Float4ParityMask(red_row ? phase.red_x : (1 - phase.red_x));
+    float* own = (red_row ? r : b) + y * out_stride;
+    float* other = (red_row ? b : r) + y * out_stride;
+    float* green = g + y * out_stride;
+
+    for (size_t x = 0; x < w; x += 4) {
+      const Float4 c = Float4Load(p + x);
+      const Float4 e1 = Float4Add(Float4Load(p + x - 1), Float4Load(p + x + 1));
+      const Float4 e2 = Float4Add(Float4Load(p + x - 2), Float4Load(p + x + 2));
+      const Float4 n1 = Float4Add(Float4Load(pn + x), Float4Load(ps + x));
+      const Float4 n2 = Float4Add(Float4Load(pn2 + x), Float4Load(ps2 + x));
+      const Float4 d1 =
+          Float4Add(Float4Add(Float4Load(pn + x - 1), Float4Load(pn + x + 1)),
+                    Float4Add(Float4Load(ps + x - 1), Float4Load(ps + x + 1)));
+
+      // Green at red/blue: (4C + 2(N1 + E1) - (N2 + E2)) / 8
+      const Float4 cross = Float4Sub(
+          Float4Add(Float4Mul(c, k4), Float4Mul(Float4Add(n1, e1), k2)),
+          Float4Mul(Float4Add(n2, e2), k1));
+      // Red/blue at green from the row: (5C + 4E1 - E2 - D1 + 0.5N2) / 8
+      const Float4 row = Float4Add(
+          Float4Sub(Float4Add(Float4Mul(c, k5), Float4Mul(e1, k4)),
+                    Float4Mul(Float4Add(e2, d1), k1)),
+          Float4Mul(n2, k05));
+      // Red/blue at green from the column: (5C + 4N1 - N2 - D1 + 0.5E2) / 8
+      const Float4 col = Float4Add(
+          Float4Sub(Float4Add(Float4Mul(c, k5), Float4Mul(n1, k4)),
+                    Float4Mul(Float4Add(n2, d1), k1)),
+          Float4Mul(e2, k05));
+      // Blue/red at red/blue: (6C + 2D1 - 1.5(N2 + E2)) / 8
+      const Float4 diag =
+          Float4Sub(Float4Add(Float4Mul(c, k6), Float4Mul(d1, k2)),
+                    Float4Mul(Float4Add(n2, e2), k15));
+
+      Float4Store(own + x, Float4Select(mask, c, row));
+      Float4Store(green + x, Float4Select(mask, cross, c));
+      Float4Store(other + x, Float4Select(mask, diag, col));
+    }
+  }
+}
 
-              TINY_DNG_DPRINTF("easyDecode begin\n");
-              int decoded_bytes = lzw::easyDecode(
-                  src_addr, int(strip_bytesize),
-                  int(strip_bytesize) *
-                      image
-                          ->bits_per_sample /* FIXME(syoyo): Is this correct? */
-                  ,
-                  dst.data(), int(dst_strip_len), swap_endian);
-              TINY_DNG_DPRINTF("easyDecode done\n");
-              if (decoded_bytes <= 0) {
-                {
-                  std::lock_guard<std::mutex> lock(err_mtx_);
-                  if (err) {
-                    (*err) +=
-                        "lzw decode failed.\n";
-                  }
-                }
+// f(t) of CIELab for t = 0.0 ~ 1.0.
+static const size_t kLabLUTSize = 4096;
 
-                failed = true;
-                break;
-              }
+static void BuildLabLUT(std::vector<float>* lut) {
+  lut->resize(kLabLUTSize + 1);
+  for (size_t i = 0; i <= kLabLUTSize; i++) {
+    const double t = double(i) / double(kLabLUTSize);
+    (*lut)[i] = float((t > 0.008856) ? std::cbrt(t)
+                                      : (7.787 * t + 16.0 / 116.0));
+  }
+}
 
-              if (image->predictor == 1) {
-                // no prediction shceme
-              } else if (image->predictor == 2) {
-                // horizontal diff
-
-                const size_t stride =
-                    size_t(image->width * image->samples_per_pixel);
-                const size_t spp = size_t(image->samples_per_pixel);
-                for (size_t row = 0; row < size_t(image->rows_per_strip);
-                     row++) {
-                  for (size_t c = 0; c < size_t(image->samples_per_pixel);
-                       c++) {
-                    unsigned int b = dst[row * stride + c];
-                    for (size_t col = 1; col < size_t(image->width); col++) {
-                      // value may overflow(wrap over), but its expected
-                      // behavior.
-                      b += dst[stride * row + spp * col + c];
-                      dst[stride * row + spp * col + c] =
-                          static_cast<unsigned char>(b & 0xFF);
-                    }
-                  }
-                }
+static inline float LabF(const float* lut, float t) {
+  const float f =
+      (std::min)((std::max)(t, 0.0f), 1.0f) * float(kLabLUTSize - 1);
+  const int32_t i = int32_t(f);
+  return lut[i] + (lut[i + 1] - lut[i]) * (f - float(i));
+}
 
-              } else if (image->predictor == 3) {
-                // fp horizontal diff.
-                //TINY_DNG_ABORT("[TODO] FP horizontal differencing predictor.");
-                {
-                  std::lock_guard<std::mutex> lock(err_mtx_);
-                  if (err) {
-                    (*err) +=
-                        "[TODO] FP horizontal differencing predictor(3)\n";
-                  }
-                }
-                failed = true;
-                break;
-              } else {
-                //TINY_DNG_ABORT("Invalid predictor value.");
-                {
-                  std::lock_guard<std::mutex> lock(err_mtx_);
-                  if (err) {
-                    (*err) +=
-                        "Invalid predictor value.\n";
-                  }
-                }
-                failed = true;
-                break;
-              }
+///
+/// AHD(Hirakawa and Parks, "Adaptive homogeneity-directed demosaicing
+/// algorithm", 2005) as in dcraw. Green is interpolated horizontally and
+/// vertically, red/blue are interpolated from the color difference of each
+/// direction, and each pixel takes the direction whose CIELab neighborhood is
+/// more homogeneous. `in` needs a halo of 6 pixels. `scale` maps sample
+/// values to 0.0 ~ 1.0.
+///
+static void DemosaicAHDTile(const float* in, size_t stride, size_t w,
+                            size_t h, const BayerPhase& phase, float scale,
+                            const std::vector<float>& lab_lut,
+                            std::vector<float>* scratch, float* r, float* g,
+                            float* b, size_t out_stride) {
+  // Green: 3 pixels around the tile, RGB and Lab: 2 pixels, homogeneity: 1.
+  const std::ptrdiff_t gw = std::ptrdiff_t(w) + 6;
+  const std::ptrdiff_t cw = std::ptrdiff_t(w) + 4;
+  const std::ptrdiff_t hw = std::ptrdiff_t(w) + 2;
+  const size_t green_size = size_t(gw) * (h + 6);
+  const size_t color_size = size_t(cw) * (h + 4);
+  const size_t homo_size = size_t(hw) * (h + 2);
+  scratch->resize(2 * green_size + 12 * color_size + 2 * homo_size);
+  float* green[2] = {scratch->data(), scratch->data() + green_size};
+  float* rgb[2][3];
+  float* lab[2][3];
+  float* homo[2];
+  {
+    float* q = scratch->data() + 2 * green_size;
+    for (int d = 0; d < 2; d++) {
+      for (int c = 0; c < 3; c++) {
+        rgb[d][c] = q;
+        q += color_size;
+        lab[d][c] = q;
+        q += color_size;
+      }
+    }
+    homo[0] = q;
+    homo[1] = q + homo_size;
+  }
+
+  const std::ptrdiff_t s = std::ptrdiff_t(stride);
+  const std::ptrdiff_t iw = std::ptrdiff_t(w);
+  const std::ptrdiff_t ih = std::ptrdiff_t(h);
+  // 0: red, 1: green, 2: blue
+  const int red_x = phase.red_x;
+  const int red_y = phase.red_y;
+  const auto color_at = [red_x, red_y](std::ptrdiff_t x,
+                                       std::ptrdiff_t y) -> int {
+    const bool red_row = (int(y & 1) == red_y);
+    const bool chroma = (int(x & 1) == (red_row ? red_x : 1 - red_x));
+    return chroma ? (red_row ? 0 : 2) : 1;
+  };
 
-              memcpy(&image->data[k * dst_strip_len], dst.data(),
-                     dst_strip_len);
-            }
-          }));
+  // Green in each direction, limited to the range of the 2 green neighbors.
+  for (std::ptrdiff_t y = -3; y < ih + 3; y++) {
+    const float* p = in + y * s;
+    float* gh = green[0] + (y + 3) * gw + 3;
+    float* gv = green[1] + (y + 3) * gw + 3;
+    for (std::ptrdiff_t x = -3; x < iw + 3; x++) {
+      const float c = p[x];
+      if (color_at(x, y) == 1) {
+        gh[x] = c;
+        gv[x] = c;
+        continue;
+      }
+      const float l = p[x - 1], rr = p[x + 1];
+      const float hval = 0.5f * (l + rr) + 0.25f * (2.0f * c - p[x - 2] - p[x + 2]);
+      gh[x] = (std::min)((std::max)(hval, (std::min)(l, rr)), (std::max)(l, rr));
+      const float u = p[x - s], dn = p[x + s];
+      const float vval =
+          0.5f * (u + dn) + 0.25f * (2.0f * c - p[x - 2 * s] - p[x + 2 * s]);
+      gv[x] = (std::min)((std::max)(vval, (std::min)(u, dn)), (std::max)(u, dn));
+    }
+  }
+
+  // Red and blue from the color difference with the green of each direction,
+  // then CIELab(sRGB primaries, D65).
+  const float m[3][3] = {
+      {0.412453f / 0.950456f, 0.357580f / 0.950456f, 0.180423f / 0.950456f},
+      {0.212671f, 0.715160f, 0.072169f},
+      {0.019334f / 1.088754f, 0.119193f / 1.088754f, 0.950227f / 1.088754f}};
+  const float* lut = lab_lut.data();
+  for (int d = 0; d < 2; d++) {
+    for (std::ptrdiff_t y = -2; y < ih + 2; y++) {
+      const float* p = in + y * s;
+      const float* gd = green[d] + (y + 3) * gw + 3;
+      const std::ptrdiff_t o = (y + 2) * cw + 2;
+      for (std::ptrdiff_t x = -2; x < iw + 2; x++) {
+        const int col = color_at(x, y);
+        float v[3];
+        v[1] = gd[x];
+        if (col == 1) {
+          // Row neighbors have the color of the row, column neighbors the
+          // other one.
+          const int row_color = color_at(x + 1, y);
+          const float hd = 0.5f * ((p[x - 1] - gd[x - 1]) + (p[x + 1] - gd[x + 1]));
+          const float vd = 0.5f * ((p[x - s] - gd[x - gw]) +
+                                   (p[x + s] - gd[x + gw]));
+          v[row_color] = gd[x] + hd;
+          v[2 - row_color] = gd[x] + vd;
+        } else {
+          const float dd =
+              0.25f * ((p[x - s - 1] - gd[x - gw - 1]) +
+                       (p[x - s + 1] - gd[x - gw + 1]) +
+                       (p[x + s - 1] - gd[x + gw - 1]) +
+                       (p[x + s + 1] - gd[x + gw + 1]));
+          v[col] = p[x];
+          v[2 - col] = gd[x] + dd;
         }
-
-        for (auto& t : workers) {
-          t.join();
+        for (int c = 0; c < 3; c++) {
+          rgb[d][c][o + x] = v[c];
         }
 
-        // something failed in a thread.
-        if (failed) {
-          return false;
+        float f[3];
+        for (int k = 0; k < 3; k++) {
+          f[k] = LabF(lut, (m[k][0] * v[0] + m[k][1] * v[1] + m[k][2] * v[2]) *
+                               scale);
         }
+        lab[d][0][o + x] = 116.0f * f[1] - 16.0f;
+        lab[d][1][o + x] = 500.0f * (f[0] - f[1]);
+        lab[d][2][o + x] = 200.0f * (f[1] - f[2]);
+      }
+    }
+  }
 
-#else
-        for (size_t k = 0; k < image->strip_byte_counts.size(); k++) {
-          std::vector<unsigned char> src(image->strip_byte_counts[k]);
-          if (!sr.seek_set(image->strip_offsets[k])) {
-            if (err) {
-              (*err) += "Failed to seek to strip offset.\n";
-            }
-            return false;
-          }
+  // Number of the 4 neighbors whose color is close in each direction.
+  const std::ptrdiff_t nb[4] = {-1, 1, -cw, cw};
+  for (std::ptrdiff_t y = -1; y < ih + 1; y++) {
+    for (std::ptrdiff_t x = -1; x < iw + 1; x++) {
+      const std::ptrdiff_t o = (y + 2) * cw + (x + 2);
+      float ldiff[2][4], abdiff[2][4];
+      for (int d = 0; d < 2; d++) {
+        for (int k = 0; k < 4; k++) {
+          const std::ptrdiff_t q = o + nb[k];
+          const float da = lab[d][1][o] - lab[d][1][q];
+          const float db = lab[d][2][o] - lab[d][2][q];
+          ldiff[d][k] = std::fabs(lab[d][0][o] - lab[d][0][q]);
+          abdiff[d][k] = da * da + db * db;
+        }
+      }
+      const float leps = (std::min)((std::max)(ldiff[0][0], ldiff[0][1]),
+                                    (std::max)(ldiff[1][2], ldiff[1][3]));
+      const float abeps = (std::min)((std::max)(abdiff[0][0], abdiff[0][1]),
+                                     (std::max)(abdiff[1][2], abdiff[1][3]));
+      for (int d = 0; d < 2; d++) {
+        int n = 0;
+        for (int k = 0; k < 4; k++) {
+          n += ((ldiff[d][k] <= leps) && (abdiff[d][k] <= abeps)) ? 1 : 0;
+        }
+        homo[d][(y + 1) * hw + (x + 1)] = float(n);
+      }
+    }
+  }
 
-          const uint64_t dst_len = uint64_t(image->samples_per_pixel) * uint64_t(image->width) * uint64_t(image->rows_per_strip) *
-               uint64_t(image->bits_per_sample) / 8ull;
-          if (dst_len == 0) {
-            if (err) {
-              (*err) += "Image data size is zero. Something is wrong in Image parameter:\n";
-              (*err) += "  samples_per_pixel " + std::to_string(image->samples_per_pixel) + "\n";
-              (*err) += "  width " + std::to_string(image->width) + "\n";
-              (*err) += "  rows_per_strip " + std::to_string(image->rows_per_strip) + "\n";
-              (*err) += "  bits_per_sample " + std::to_string(image->bits_per_sample) + "\n";
-            }
-            return false;
-          }
+  // Take the direction which is more homogeneous in 3x3 pixels.
+  for (std::ptrdiff_t y = 0; y < ih; y++) {
+    for (std::ptrdiff_t x = 0; x < iw; x++) {
+      float sum[2] = {0.0f, 0.0f};
+      for (int d = 0; d < 2; d++) {
+        const float* hp = homo[d] + (y + 1) * hw + (x + 1);
+        for (std::ptrdiff_t j = -1; j <= 1; j++) {
+          sum[d] += hp[j * hw - 1] + hp[j * hw] + hp[j * hw + 1];
+        }
+      }
+      const std::ptrdiff_t o = (y + 2) * cw + (x + 2);
+      const size_t dst = size_t(y) * out_stride + size_t(x);
+      float* out[3] = {r, g, b};
+      for (int c = 0; c < 3; c++) {
+        if (sum[0] > sum[1]) {
+          out[c][dst] = rgb[0][c][o];
+        } else if (sum[0] < sum[1]) {
+          out[c][dst] = rgb[1][c][o];
+        } else {
+          out[c][dst] = 0.5f * (rgb[0][c][o] + rgb[1][c][o]);
+        }
+      }
+    }
+  }
+}
 
-          if (dst_len > (kMaxImageSizeInMB * 1024ull * 1024ull)) {
-            if (err) {
-              (*err) += "Image data size too large. Exceeds " + std::to_string(kMaxImageSizeInMB) + " MB.\n";
-            }
-            return false;
-          }
-          std::vector<unsigned char> dst(dst_len);
+// Samples within this distance are used to interpolate non-Bayer patterns
+// (any pixel of a pattern up to 8x8 has every color within 4 pixels).
+static const int kMaxCFATapRadius = 4;
+static const size_t kMaxCFATaps = 8 * kMaxCFATapRadius;
+
+// Samples of a color used to interpolate it at a pixel.
+struct CFATaps {
+  size_t count{0};
+  int radius{0};  // max(|dx|, |dy|) of the samples
+  std::ptrdiff_t offset[kMaxCFATaps];  // dy * stride + dx
+  float weight[kMaxCFATaps];           // sum = 1
+};
 
-          if (!sr.read(image->strip_byte_counts[k], image->strip_byte_counts[k],
-                       src.data())) {
-            if (err) {
-              (*err) += "Cannot read strip_byte_counts bytes from stream.\n";
-            }
-            return false;
-          }
-          TINY_DNG_DPRINTF("easyDecode begin\n");
-          int decoded_bytes = lzw::easyDecode(
-              src.data(), int(image->strip_byte_counts[k]),
-              int(image->strip_byte_counts[k]) *
-                  image->bits_per_sample /* FIXME(syoyo): Is this correct? */,
-              dst.data(), int(dst_len), swap_endian);
-          TINY_DNG_DPRINTF("easyDecode done\n");
-          if (decoded_bytes <= 0) {
-            TINY_DNG_ERROR_AND_RETURN("decoded_ bytes must be non-zero positive.", err);
-          }
+///
+/// Samples of color `c` in the nearest ring around (x, y) which has any,
+/// weighted by the inverse squared distance. `color_at(x, y)` returns the
+/// color of a sample. Falls back to the sample itself when no ring within
+/// `max_radius` has the color.
+///
+template <typename ColorFunc>
+static void BuildCFATaps(const ColorFunc& color_at, std::ptrdiff_t x,
+                         std::ptrdiff_t y, int c, std::ptrdiff_t stride,
+                         int max_radius, CFATaps* taps) {
+  taps->count = 1;
+  taps->radius = 0;
+  taps->offset[0] = 0;
+  taps->weight[0] = 1.0f;
+  if (color_at(x, y) == c) {
+    return;
+  }
+
+  taps->count = 0;
+  for (int r = 1; r <= max_radius; r++) {
+    float sum = 0.0f;
+    for (int dy = -r; dy <= r; dy++) {
+      for (int dx = -r; dx <= r; dx++) {
+        if (((std::max)(std::abs(dx), std::abs(dy)) != r) ||
+            (color_at(x + dx, y + dy) != c)) {
+          continue;
+        }
+        const float w = 1.0f / float(dx * dx + dy * dy);
+        taps->offset[taps->count] = std::ptrdiff_t(dy) * stride + dx;
+        taps->weight[taps->count] = w;
+        taps->count++;
+        sum += w;
+      }
+    }
+    if (taps->count > 0) {
+      taps->radius = r;
+      for (size_t k = 0; k < taps->count; k++) {
+        taps->weight[k] /= sum;
+      }
+      return;
+    }
+  }
+  taps->count = 1;
+}
 
-          if (image->predictor == 1) {
-            // no prediction shceme
-          } else if (image->predictor == 2) {
-            // horizontal diff
-
-            const size_t stride =
-                size_t(image->width * image->samples_per_pixel);
-            const size_t spp = size_t(image->samples_per_pixel);
-            for (size_t row = 0; row < size_t(image->rows_per_strip); row++) {
-              for (size_t c = 0; c < size_t(image->samples_per_pixel); c++) {
-                unsigned int b = dst[row * stride + c];
-                for (size_t col = 1; col < size_t(image->width); col++) {
-                  // value may overflow(wrap over), but its expected behavior.
-                  b += dst[stride * row + spp * col + c];
-                  dst[stride * row + spp * col + c] =
-                      static_cast<unsigned char>(b & 0xFF);
-                }
-              }
-            }
+static inline float ApplyCFATaps(const CFATaps& taps, const float* p) {
+  float sum = 0.0f;
+  for (size_t k = 0; k < taps.count; k++) {
+    sum += taps.weight[k] * p[taps.offset[k]];
+  }
+  return sum;
+}
 
-          } else if (image->predictor == 3) {
-            // fp horizontal diff.
-            TINY_DNG_ERROR_AND_RETURN("[TODO} FP horizontal differencing predictor(3).", err);
-          } else {
-            TINY_DNG_ERROR_AND_RETURN("Invalid predictor value.", err);
-          }
+///
+/// Taps of each color at each pixel of the repeat pattern, for pixels whose
+/// neighbors are all in the image. The radii also cover the pixels near the
+/// image border, where mirrored samples may have other colors.
+///
+struct CFATapTable {
+  std::vector<CFATaps> taps;  // [(y * cols + x) * 3 + color]
+  int green_radius{0};
+  int chroma_radius{0};
+};
 
-          std::copy(dst.begin(), dst.end(), std::back_inserter(image->data));
-        }
+static void BuildCFATapTable(const CFAColors& cfa, size_t width, size_t height,
+                             std::ptrdiff_t stride, CFATapTable* table) {
+  table->taps.resize(cfa.rows * cfa.cols * 3);
+  table->green_radius = 0;
+  table->chroma_radius = 0;
 
-#endif
-      } else {
-        TINY_DNG_ERROR_AND_RETURN("Unsupported image strip configuration.", err);
+  const auto periodic = [&cfa](std::ptrdiff_t x, std::ptrdiff_t y) -> int {
+    return cfa.At(x, y);
+  };
+  for (size_t y = 0; y < cfa.rows; y++) {
+    for (size_t x = 0; x < cfa.cols; x++) {
+      for (int c = 0; c < 3; c++) {
+        CFATaps& t = table->taps[(y * cfa.cols + x) * 3 + size_t(c)];
+        BuildCFATaps(periodic, std::ptrdiff_t(x), std::ptrdiff_t(y), c, stride,
+                     kMaxCFATapRadius, &t);
+        int& radius = (c == 1) ? table->green_radius : table->chroma_radius;
+        radius = (std::max)(radius, t.radius);
       }
-    } else if (image->compression ==
-               COMPRESSION_OLD_JPEG) {  // old jpeg compression
-
-      // std::cout << "IFD " << i << std::endl;
+    }
+  }
 
-      // First check if JPEG is lossless JPEG
-      // TODO(syoyo): Compure conservative data_len.
-      if (sr.size() < data_offset) {
-        if (err) {
-          (*err) += "Unexpected data offset.\n";
-        }
-        return false;
+  // Neighborhoods repeat with the pattern away from the border, so pixels
+  // within kMaxCFADim + kMaxCFATapRadius of each border cover all of them.
+  const auto mirrored = [&](std::ptrdiff_t x, std::ptrdiff_t y) -> int {
+    return cfa.At(std::ptrdiff_t(MirrorIndex(x, width)),
+                  std::ptrdiff_t(MirrorIndex(y, height)));
+  };
+  const size_t band = kMaxCFADim + size_t(kMaxCFATapRadius);
+  const auto in_band = [band](size_t i, size_t n) -> bool {
+    return (i < band) || (i + band >= n);
+  };
+  CFATaps t;
+  for (size_t y = 0; y < height; y++) {
+    if (!in_band(y, height)) {
+      y = height - band - 1;
+      continue;
+    }
+    for (size_t x = 0; x < width; x++) {
+      if (!in_band(x, width)) {
+        x = width - band - 1;
+        continue;
       }
-      size_t data_len = sr.size() - data_offset;
-      int lj_width = -1, lj_height = -1, lj_bits = -1, lj_components = -1;
-      if (IsLosslessJPEG(sr.data() + data_offset, static_cast<int>(data_len),
-                         &lj_width, &lj_height, &lj_bits, &lj_components)) {
-        // std::cout << "IFD " << i << " is LJPEG" << std::endl;
-        TINY_DNG_DPRINTF("IFD[%d] is LJPEG\n", int(i));
+      for (int c = 0; c < 3; c++) {
+        BuildCFATaps(mirrored, std::ptrdiff_t(x), std::ptrdiff_t(y), c, 0,
+                     kMaxCFATapRadius, &t);
+        int& radius = (c == 1) ? table->green_radius : table->chroma_radius;
+        radius = (std::max)(radius, t.radius);
+      }
+    }
+  }
+}
 
-        TINY_DNG_CHECK_AND_RETURN(
-            lj_width > 0 && lj_height > 0 && lj_bits > 0 && lj_components > 0,
-            "Image dimensions must be > 0.", err);
+///
+/// Calls `fn(x, taps)` for pixels [x_begin, x_end) of row `y` of the tile at
+/// (x0, y0) with the taps of color `c`. Pixels with all samples within
+/// `radius` in the image use the table, the others taps built from the
+/// colors of the mirrored samples.
+///
+template <typename Func>
+static void ForEachCFATaps(const RawSource& src, const CFAColors& cfa,
+                           const CFATapTable& table, size_t x0, size_t y0,
+                           std::ptrdiff_t stride, std::ptrdiff_t y,
+                           std::ptrdiff_t x_begin, std::ptrdiff_t x_end, int c,
+                           std::ptrdiff_t radius, const Func& fn) {
+  const std::ptrdiff_t ox = std::ptrdiff_t(x0);
+  const std::ptrdiff_t oy = std::ptrdiff_t(y0);
+  const auto color_at = [&](std::ptrdiff_t x, std::ptrdiff_t yy) -> int {
+    return cfa.At(std::ptrdiff_t(MirrorIndex(ox + x, src.width)),
+                  std::ptrdiff_t(MirrorIndex(oy + yy, src.height)));
+  };
 
-        // Assume not in tiled format.
-        TINY_DNG_CHECK_AND_RETURN(image->tile_width == -1 && image->tile_length == -1,
-                        "Tiled format not supported tile size.", err);
+  std::ptrdiff_t in_begin = x_end;
+  std::ptrdiff_t in_end = x_end;
+  if ((oy + y >= radius) && (oy + y + radius < std::ptrdiff_t(src.height))) {
+    in_begin = (std::min)((std::max)(x_begin, radius - ox), x_end);
+    in_end = (std::max)(
+        (std::min)(x_end, std::ptrdiff_t(src.width) - radius - ox), in_begin);
+  }
 
-        image->height = lj_height;
+  CFATaps local;
+  for (std::ptrdiff_t x = x_begin; x < in_begin; x++) {
+    BuildCFATaps(color_at, x, y, c, stride, int(radius), &local);
+    fn(x, local);
+  }
+  if (in_begin < in_end) {
+    const CFATaps* row = &table.taps[(size_t(oy + y) % cfa.rows) * cfa.cols * 3];
+    size_t px = size_t(ox + in_begin) % cfa.cols;
+    for (std::ptrdiff_t x = in_begin; x < in_end; x++) {
+      fn(x, row[px * 3 + size_t(c)]);
+      px = (px + 1 == cfa.cols) ? 0 : px + 1;
+    }
+  }
+  for (std::ptrdiff_t x = in_end; x < x_end; x++) {
+    BuildCFATaps(color_at, x, y, c, stride, int(radius), &local);
+    fn(x, local);
+  }
+}
 
-        // Is Canon CR2?
-        const bool is_cr2 = (image->cr2_slices[0] != 0) ? true : false;
+///
+/// Demosaic a tile of a non-Bayer pattern(e.g. X-Trans). Green is
+/// interpolated from the nearest green samples first, then red and blue from
+/// the color difference to green at the nearest samples of the color.
+/// `in` needs a halo of green_radius + chroma_radius pixels.
+///
+static void DemosaicPatternTile(const float* in, size_t stride, size_t w,
+                                size_t h, size_t x0, size_t y0,
+                                const RawSource& src, const CFAColors& cfa,
+                                const CFATapTable& table,
+                                std::vector<float>* scratch, float* r,
+                                float* g, float* b, size_t out_stride) {
+  const std::ptrdiff_t rg = table.green_radius;
+  const std::ptrdiff_t rc = table.chroma_radius;
+  const std::ptrdiff_t s = std::ptrdiff_t(stride);
+  const std::ptrdiff_t iw = std::ptrdiff_t(w);
+  const std::ptrdiff_t ih = std::ptrdiff_t(h);
+
+  // Green of the tile and `rc` pixels around it, and the difference of the
+  // samples to it, in the layout of `in`.
+  const std::ptrdiff_t halo = rg + rc;
+  const size_t plane_size = stride * (h + 2 * size_t(halo));
+  scratch->resize(2 * plane_size);
+  float* green = scratch->data() + halo * s + halo;
+  float* diff = green + plane_size;
+  for (std::ptrdiff_t y = -rc; y < ih + rc; y++) {
+    ForEachCFATaps(src, cfa, table, x0, y0, s, y, -rc, iw + rc, 1, rg,
+                   [&](std::ptrdiff_t x, const CFATaps& t) {
+                     const std::ptrdiff_t o = y * s + x;
+                     green[o] = ApplyCFATaps(t, in + o);
+                     diff[o] = in[o] - green[o];
+                   });
+  }
+
+  float* out[3] = {r, g, b};
+  for (std::ptrdiff_t y = 0; y < ih; y++) {
+    const float* green_row = green + y * s;
+    const float* diff_row = diff + y * s;
+    float* g_row = g + size_t(y) * out_stride;
+    std::memcpy(g_row, green_row, size_t(iw) * sizeof(float));
+    for (int c = 0; c < 3; c += 2) {
+      float* c_row = out[c] + size_t(y) * out_stride;
+      ForEachCFATaps(src, cfa, table, x0, y0, s, y, 0, iw, c, rc,
+                     [&](std::ptrdiff_t x, const CFATaps& t) {
+                       c_row[x] = green_row[x] + ApplyCFATaps(t, diff_row + x);
+                     });
+    }
+  }
+}
 
-        if (is_cr2) {
-          // For CR2 RAW, slices[0] * slices[1] + slices[2] = image width
-          image->width = image->cr2_slices[0] * image->cr2_slices[1] +
-                         image->cr2_slices[2];
-        } else {
-          image->width = lj_width;
-        }
+// Tiles are wide to touch fewer pages per tile. The tile origin is always
+// even, so every tile has the Bayer phase of the image.
+static const size_t kDemosaicTileWidth = 256;
+static const size_t kDemosaicTileHeight = 32;
 
-        image->bits_per_sample_original = lj_bits;
+///
+/// Kernel and tile layout of `Demosaic` for an image.
+///
+struct DemosaicPlan {
+  CFAColors cfa;
+  BayerPhase phase;
+  bool bayer{true};
+  DemosaicMethod method{DEMOSAIC_MALVAR};
+  float white{1.0f};
+  std::vector<float> lab_lut;  // AHD
+  CFATapTable tap_table;       // non-Bayer
+  size_t halo{2};
+  size_t in_stride{0};  // floats per row of the input tile
+  size_t in_size{0};    // floats of the input tile
+};
 
-        // lj92 decodes data into 16bits, so modify bps.
-        image->bits_per_sample = 16;
+// `white` is the sample value of the white, used by AHD.
+static bool BuildDemosaicPlan(const DNGImage& image, const RawSource& src,
+                              DemosaicMethod method, float white,
+                              DemosaicPlan* plan, std::string* err) {
+  if (!GetCFAColors(image, &plan->cfa, err)) {
+    return false;
+  }
+  plan->bayer = GetBayerPhase(plan->cfa, &plan->phase);
+  plan->method = plan->bayer ? method : DEMOSAIC_BILINEAR;
+  plan->white = white;
+  if (plan->method == DEMOSAIC_AHD) {
+    BuildLabLUT(&plan->lab_lut);
+  }
+
+  // The stride of non-Bayer tiles fits the largest halo, as the tap offsets
+  // are built before the radii are known.
+  const size_t bayer_halo = (plan->method == DEMOSAIC_AHD) ? 6 : 2;
+  plan->in_stride =
+      kDemosaicTileWidth +
+      2 * (plan->bayer ? bayer_halo : 2 * size_t(kMaxCFATapRadius));
+  if (!plan->bayer) {
+    BuildCFATapTable(plan->cfa, src.width, src.height,
+                     std::ptrdiff_t(plan->in_stride), &plan->tap_table);
+  }
+  plan->halo = plan->bayer ? bayer_halo
+                           : size_t(plan->tap_table.green_radius +
+                                    plan->tap_table.chroma_radius);
+  plan->in_size = plan->in_stride * (kDemosaicTileHeight + 2 * plan->halo);
+  return true;
+}
 
-        TINY_DNG_CHECK_AND_RETURN(
-            ((image->width * image->height * image->bits_per_sample) % 8) == 0,
-            "Image size must be multiple of 8.", err);
-        const size_t len =
-            static_cast<size_t>((image->samples_per_pixel * image->width *
-                                 image->height * image->bits_per_sample) /
-                                8);
-        // std::cout << "spp = " << image->samples_per_pixel;
-        // std::cout << ", w = " << image->width << ", h = " << image->height <<
-        // ", bps = " << image->bits_per_sample << std::endl;
-        TINY_DNG_CHECK_AND_RETURN(len > 0, "Invalid length.", err);
-        image->data.resize(len);
+///
+/// Demosaic the `w` x `h` tile at (`x0`, `y0`). `tile` is the input loaded with
+/// `plan.halo` pixels around it(`plan.in_stride` floats per row). Output is
+/// planar with kDemosaicTileWidth floats per row.
+///
+static void DemosaicTile(const DemosaicPlan& plan, const RawSource& src,
+                         const float* tile, size_t x0, size_t y0, size_t w,
+                         size_t h, std::vector<float>* scratch, float* r,
+                         float* g, float* b) {
+  // Kernels process 4 pixels at once.
+  const size_t w4 = (w + 3) & ~size_t(3);
+  const float* in = tile + plan.halo * plan.in_stride + plan.halo;
+  if (!plan.bayer) {
+    DemosaicPatternTile(in, plan.in_stride, w, h, x0, y0, src, plan.cfa,
+                        plan.tap_table, scratch, r, g, b, kDemosaicTileWidth);
+  } else if (plan.method == DEMOSAIC_BILINEAR) {
+    DemosaicBilinearTile(in, plan.in_stride, w4, h, plan.phase, r, g, b,
+                         kDemosaicTileWidth);
+  } else if (plan.method == DEMOSAIC_AHD) {
+    DemosaicAHDTile(in, plan.in_stride, w4, h, plan.phase, 1.0f / plan.white,
+                    plan.lab_lut, scratch, r, g, b, kDemosaicTileWidth);
+  } else {
+    DemosaicMalvarTile(in, plan.in_stride, w4, h, plan.phase, r, g, b,
+                       kDemosaicTileWidth);
+  }
+}
 
-        if (sr.size() < data_offset) {
-          if (err) {
-            (*err) += "Unexpected file size or data offset.\n";
-          }
-          return false;
-        }
+bool Demosaic(const DNGImage& image, std::vector<float>* rgb, int* width,
+              int* height, std::string* err, const DemosaicOption& option) {
+  TINY_DNG_CHECK_AND_RETURN(rgb && width && height, "Invalid argument.", err);
 
-        std::vector<unsigned short> buf;
-        buf.resize(static_cast<size_t>(image->width * image->height *
-                                       image->samples_per_pixel));
+  RawSource src;
+  if (!GetCFASource(image, &src, err)) {
+    return false;
+  }
+  float white = option.white;
+  if (white <= 0.0f) {
+    white = src.is_float ? 1.0f
+                         : ((image.white_level[0] > 0)
+                                ? float(image.white_level[0])
+                                : float((1 << image.bits_per_sample) - 1));
+  }
+  DemosaicPlan plan;
+  if (!BuildDemosaicPlan(image, src, option.method, white, &plan, err)) {
+    return false;
+  }
 
-        bool ok = DecompressLosslessJPEG(sr, &buf.at(0), image->width, (*image),
-                                         NULL, err);
-        if (!ok) {
-          if (err) {
-            std::stringstream ss;
-            ss << "Failed to decompress LJPEG." << std::endl;
-            (*err) = ss.str();
+  const size_t tiles_x =
+      (src.width + kDemosaicTileWidth - 1) / kDemosaicTileWidth;
+  const size_t tiles_y =
+      (src.height + kDemosaicTileHeight - 1) / kDemosaicTileHeight;
+  const size_t out_size = kDemosaicTileWidth * kDemosaicTileHeight;
+  const int num_threads = GetNumWorkers(tiles_x * tiles_y);
+  std::vector<std::vector<float> > buffers(static_cast<size_t>(num_threads));
+  std::vector<std::vector<float> > scratch(static_cast<size_t>(num_threads));
+
+  rgb->resize(src.width * src.height * 3);
+  float* dst = rgb->data();
+
+  const bool ret = ParallelFor(
+      tiles_x * tiles_y, num_threads, err,
+      [&](size_t k, int thread_id, std::string* thread_err) -> bool {
+        (void)thread_err;
+        std::vector<float>& buf = buffers[size_t(thread_id)];
+        buf.resize(plan.in_size + 3 * out_size);
+        float* tile = buf.data();
+        float* planes[3] = {tile + plan.in_size, tile + plan.in_size + out_size,
+                            tile + plan.in_size + 2 * out_size};
+
+        const size_t x0 = (k % tiles_x) * kDemosaicTileWidth;
+        const size_t y0 = (k / tiles_x) * kDemosaicTileHeight;
+        const size_t w = (std::min)(kDemosaicTileWidth, src.width - x0);
+        const size_t h = (std::min)(kDemosaicTileHeight, src.height - y0);
+        const size_t w4 = (w + 3) & ~size_t(3);
+
+        LoadCFATile(src, x0, y0, w4, h, plan.halo, plan.in_stride, tile);
+        DemosaicTile(plan, src, tile, x0, y0, w, h, &scratch[size_t(thread_id)],
+                     planes[0], planes[1], planes[2]);
+
+        for (size_t y = 0; y < h; y++) {
+          float* out = dst + ((y0 + y) * src.width + x0) * 3;
+          const float* pr = planes[0] + y * kDemosaicTileWidth;
+          const float* pg = planes[1] + y * kDemosaicTileWidth;
+          const float* pb = planes[2] + y * kDemosaicTileWidth;
+          for (size_t x = 0; x < w; x++) {
+            out[3 * x + 0] = pr[x];
+            out[3 * x + 1] = pg[x];
+            out[3 * x + 2] = pb[x];
           }
-          return false;
         }
+        return true;
+      });
+  if (!ret) {
+    return false;
+  }
 
-        if (is_cr2) {
-          // CR2 stores image in tiled format(image slices. left to right).
-          // Convert it to scanline format.
-          int nslices = image->cr2_slices[0];
-          int slice_width = image->cr2_slices[1];
-          int slice_remainder_width = image->cr2_slices[2];
-          size_t src_offset = 0;
+  (*width) = int(src.width);
+  (*height) = int(src.height);
+  return true;
+}
 
-          unsigned short* dst_ptr =
-              reinterpret_cast<unsigned short*>(image->data.data());
+// ---------------------------------------------------------------------------
+// Normalize.
 
-          for (int slice = 0; slice < nslices; slice++) {
-            int x_offset = slice * slice_width;
-            for (int y = 0; y < image->height; y++) {
-              size_t dst_offset =
-                  static_cast<size_t>(y * image->width + x_offset);
-              memcpy(&dst_ptr[dst_offset], &buf[src_offset],
-                     sizeof(unsigned short) * static_cast<size_t>(slice_width));
-              src_offset += static_cast<size_t>(slice_width);
-            }
-          }
+// Load 4 samples as float.
+static inline Float4 Float4LoadSamples(const float* p) { return Float4Load(p); }
+static inline Float4 Float4LoadSamples(const uint8_t* p) {
+  const float v[4] = {float(p[0]), float(p[1]), float(p[2]), float(p[3])};
+  return Float4Load(v);
+}
+static inline Float4 Float4LoadSamples(const uint16_t* p) {
+#if defined(TINY_DNG_LOADER_SIMD_SSE2)
+  const __m128i v = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(p));
+  return _mm_cvtepi32_ps(_mm_unpacklo_epi16(v, _mm_setzero_si128()));
+#elif defined(TINY_DNG_LOADER_SIMD_NEON)
+  return vcvtq_f32_u32(vmovl_u16(vld1_u16(p)));
+#else
+  const float v[4] = {float(p[0]), float(p[1]), float(p[2]), float(p[3])};
+  return Float4Load(v);
+#endif
+}
 
-          // remainder(the last slice).
-          {
-            int x_offset = nslices * slice_width;
-            for (int y = 0; y < image->height; y++) {
-              size_t dst_offset =
-                  static_cast<size_t>(y * image->width + x_offset);
-              // std::cout << "y = " << y << ", dst = " << dst_offset << ", src
-              // = " << src_offset << ", len = " << buf.size() << std::endl;
-              memcpy(&dst_ptr[dst_offset], &buf[src_offset],
-                     sizeof(unsigned short) *
-                         static_cast<size_t>(slice_remainder_width));
-              src_offset += static_cast<size_t>(slice_remainder_width);
-            }
-          }
+static inline void Float4StoreSamples(float* p, Float4 v) {
+  Float4Store(p, v);
+}
+// Lanes of `v` are in [0, 65535].
+static inline void Float4StoreSamples(uint16_t* p, Float4 v) {
+#if defined(TINY_DNG_LOADER_SIMD_SSE2)
+  // packs_epi32 saturates to int16, so pack with an offset of 32768.
+  __m128i i = _mm_cvttps_epi32(_mm_add_ps(v, _mm_set1_ps(0.5f)));
+  i = _mm_sub_epi32(i, _mm_set1_epi32(32768));
+  i = _mm_xor_si128(_mm_packs_epi32(i, i), _mm_set1_epi16(-32768));
+  _mm_storel_epi64(reinterpret_cast<__m128i*>(p), i);
+#elif defined(TINY_DNG_LOADER_SIMD_NEON)
+  vst1_u16(p, vmovn_u32(vcvtq_u32_f32(vaddq_f32(v, vdupq_n_f32(0.5f)))));
+#else
+  for (int i = 0; i < 4; i++) {
+    StoreSample(p + i, v.v[i]);
+  }
+#endif
+}
 
-        } else {
-          memcpy(image->data.data(), static_cast<void*>(&(buf.at(0))), len);
-        }
+///
+/// dst[x] = (src[x] - offset[x] - delta) * scale[x], clamped to [lo, hi] when
+/// `clamp` is true.
+///
+template <typename In, typename Out>
+static void NormalizeRow(const In* src, size_t n, const float* offset,
+                         const float* scale, float delta, bool clamp, float lo,
+                         float hi, Out* dst) {
+  const Float4 vdelta = Float4Set(delta);
+  const Float4 vlo = Float4Set(lo);
+  const Float4 vhi = Float4Set(hi);
+  size_t x = 0;
+  for (; x + 4 <= n; x += 4) {
+    Float4 v = Float4Sub(Float4LoadSamples(src + x), Float4Load(offset + x));
+    v = Float4Mul(Float4Sub(v, vdelta), Float4Load(scale + x));
+    if (clamp) {
+      v = Float4Min(Float4Max(v, vlo), vhi);
+    }
+    Float4StoreSamples(dst + x, v);
+  }
+  for (; x < n; x++) {
+    float v = ((float(src[x]) - offset[x]) - delta) * scale[x];
+    if (clamp) {
+      v = (std::min)((std::max)(v, lo), hi);
+    }
+    StoreSample(dst + x, v);
+  }
+}
 
-      } else {
-        // Baseline 8bit JPEG
+static size_t GreatestCommonDivisor(size_t a, size_t b) {
+  while (b != 0) {
+    const size_t t = a % b;
+    a = b;
+    b = t;
+  }
+  return a;
+}
 
-        image->bits_per_sample_original = 8;
-        image->bits_per_sample = 8;
+///
+/// Offset and scale of each sample of a row for each row phase of the CFA and
+/// black level patterns. BlackLevelDeltaH is in the offset. BlackLevelDeltaV
+/// is subtracted per row and not in the scale.
+///
+struct NormalizeTables {
+  size_t phases{1};
+  size_t row_samples{0};
+  std::vector<float> offsets;  // [phase][sample]
+  std::vector<float> scales;   // [phase][sample]
+  const std::vector<float>* delta_v{nullptr};
 
-        size_t jpeg_len = static_cast<size_t>(image->jpeg_byte_count);
-        if (image->jpeg_byte_count == -1) {
-          // No jpeg datalen. Set to the size of file - offset.
-          if (sr.size() < data_offset) {
-            if (err) {
-              (*err) += "Unexpected file size or data offset.\n";
-            }
-            return false;
-          }
-          jpeg_len = sr.size() - data_offset;
-        }
+  const float* Offset(size_t row) const {
+    return offsets.data() + (row % phases) * row_samples;
+  }
+  const float* Scale(size_t row) const {
+    return scales.data() + (row % phases) * row_samples;
+  }
+  float DeltaV(size_t row) const {
+    return delta_v->empty() ? 0.0f : (*delta_v)[row];
+  }
+};
 
-        if (jpeg_len == 0) {
-          if (err) {
-            (*err) += "Invalid jpeg data length.\n";
-          }
-          return false;
-        }
+// `neutral` is the camera neutral to white balance CFA images and images with
+// 3 samples per pixel with, or nullptr.
+static bool BuildNormalizeTables(const DNGImage& image, const RawSource& src,
+                                 const double* neutral, float out_white,
+                                 NormalizeTables* tables, std::string* err) {
+  const size_t spp = src.spp;
+  const size_t row_samples = src.width * spp;
+
+  // White balance per color. The color of a CFA sample comes from the CFA
+  // pattern, the other images have the colors as samples.
+  float wb[3] = {1.0f, 1.0f, 1.0f};
+  const bool is_cfa = (spp == 1) && (image.cfa_pattern[0][0] >= 0);
+  const bool use_wb = neutral && (is_cfa || (spp == 3));
+  CFAColors cfa;
+  cfa.rows = 1;
+  cfa.cols = 1;
+  if (use_wb) {
+    const double* n = neutral;
+    TINY_DNG_CHECK_AND_RETURN((n[0] > 0.0) && (n[1] > 0.0) && (n[2] > 0.0),
+                              "Invalid AsShotNeutral: " << n[0] << ", " << n[1]
+                                                        << ", " << n[2],
+                              err);
+    const double max_neutral = (std::max)((std::max)(n[0], n[1]), n[2]);
+    for (int c = 0; c < 3; c++) {
+      wb[c] = float(max_neutral / n[c]);
+    }
+    if (is_cfa && !GetCFAColors(image, &cfa, err)) {
+      return false;
+    }
+  }
 
-        // Assume RGB jpeg
-        //
-        // First check the header.
-        int w_info = 0, h_info = 0, components_info = 0;
-        int is_jpeg = stbi_info_from_memory(sr.data() + data_offset,
-                                            static_cast<int>(jpeg_len), &w_info,
-                                            &h_info, &components_info);
-        if (is_jpeg != 1) {
-          if (err) {
-            (*err) += "Not a JPEG data.\n";
-          }
-          return false;
-        }
+  BlackLevelTable black;
+  if (!BuildBlackLevelTable(image, src.width, src.height, spp, &black, err)) {
+    return false;
+  }
 
-        if ((components_info != 1) && (components_info != 3)) {
-          if (err) {
-            (*err) += "Unsupported channels in JPEG data.\n";
-          }
-          return false;
-        }
+  const size_t phases =
+      cfa.rows / GreatestCommonDivisor(cfa.rows, black.phases) * black.phases;
+  tables->phases = phases;
+  tables->row_samples = row_samples;
+  tables->delta_v = &image.black_level_delta_v;
+  tables->offsets.resize(phases * row_samples);
+  tables->scales.resize(phases * row_samples);
+  for (size_t p = 0; p < phases; p++) {
+    const float* level = black.Level(p);
+    memcpy(tables->offsets.data() + p * row_samples, black.Offset(p),
+           row_samples * sizeof(float));
+    float* scale = tables->scales.data() + p * row_samples;
+    for (size_t x = 0; x < src.width; x++) {
+      for (size_t s = 0; s < spp; s++) {
+        float white = float(image.white_level[s]);
+        if (white <= 0.0f) {
+          white = src.is_float ? 1.0f
+                               : float((1u << (8 * src.bytes_per_sample)) - 1);
+        }
+        const int color =
+            is_cfa ? cfa.At(std::ptrdiff_t(x), std::ptrdiff_t(p)) : int(s);
+        const float gain = ((color >= 0) && (color < 3)) ? wb[color] : 1.0f;
+        const float range = white - level[x * spp + s];
+        TINY_DNG_CHECK_AND_RETURN(range > 0.0f,
+                                  "White level(" << white
+                                                 << ") must be larger than "
+                                                    "black level("
+                                                 << level[x * spp + s] << ").",
+                                  err);
+        scale[x * spp + s] = out_white * gain / range;
+      }
+    }
+  }
+  return true;
+}
 
-        if ((w_info < 1) || (h_info < 1)) {
-          if (err) {
-            (*err) += "Invalid JPEG image resolution.\n";
-          }
-          return false;
-        }
+template <typename T>
+static bool NormalizeImageImpl(const DNGImage& image, std::vector<T>* out,
+                               int* width, int* height, std::string* err,
+                               const NormalizeOption& option, float out_white,
+                               bool clamp) {
+  TINY_DNG_CHECK_AND_RETURN(out && width && height, "Invalid argument.", err);
+
+  RawSource src;
+  if (!GetRawSource(image, &src, err)) {
+    return false;
+  }
+  const size_t row_samples = src.width * src.spp;
 
-        int w = 0, h = 0, components = 0;
+  NormalizeTables tables;
+  const bool use_wb = option.white_balance && image.has_as_shot_neutral;
+  if (!BuildNormalizeTables(image, src,
+                            use_wb ? image.as_shot_neutral : nullptr,
+                            out_white, &tables, err)) {
+    return false;
+  }
 
-        // Check if data is in valid range.
-        if ((sr.tell() + data_offset + static_cast<uint32_t>(jpeg_len)) >= sr.size()) {
-          if (err) {
-            (*err) += "Invalid JPEG image data size.\n";
+  out->resize(row_samples * src.height);
+  T* dst = out->data();
+
+  const size_t kRowsPerChunk = 32;
+  const size_t num_chunks = (src.height + kRowsPerChunk - 1) / kRowsPerChunk;
+  const int num_threads = GetNumWorkers(num_chunks);
+  const bool ret = ParallelFor(
+      num_chunks, num_threads, err,
+      [&](size_t k, int thread_id, std::string* thread_err) -> bool {
+        (void)thread_id;
+        (void)thread_err;
+        const size_t y_end = (std::min)(src.height, (k + 1) * kRowsPerChunk);
+        for (size_t y = k * kRowsPerChunk; y < y_end; y++) {
+          const float* offset = tables.Offset(y);
+          const float* scale = tables.Scale(y);
+          const float delta = tables.DeltaV(y);
+          T* row = dst + y * row_samples;
+          const unsigned char* row_src = src.At(y, 0);
+          if (src.is_float) {
+            NormalizeRow(reinterpret_cast<const float*>(row_src), row_samples,
+                         offset, scale, delta, clamp, 0.0f, out_white, row);
+          } else if (src.bytes_per_sample == 1) {
+            NormalizeRow(reinterpret_cast<const uint8_t*>(row_src),
+                         row_samples, offset, scale, delta, clamp, 0.0f,
+                         out_white, row);
+          } else {
+            NormalizeRow(reinterpret_cast<const uint16_t*>(row_src),
+                         row_samples, offset, scale, delta, clamp, 0.0f,
+                         out_white, row);
           }
-          return false;
         }
+        return true;
+      });
+  if (!ret) {
+    return false;
+  }
 
-        unsigned char* decoded_image = stbi_load_from_memory(
-            sr.data() + data_offset, static_cast<uint32_t>(jpeg_len), &w, &h,
-            &components, /* desired_channels */ components_info);
-        TINY_DNG_CHECK_AND_RETURN(decoded_image, "Could not decode JPEG image.", err);
-
-        // Currently we just discard JPEG image(since JPEG image would be just a
-        // thumbnail or LDR image of RAW).
-        // TODO(syoyo): Do not discard JPEG image.
-        free(decoded_image);
-
-        // std::cout << "w = " << w << std::endl;
-        // std::cout << "h = " << w << std::endl;
-        // std::cout << "c = " << components << std::endl;
+  (*width) = int(src.width);
+  (*height) = int(src.height);
+  return true;
+}
 
-        TINY_DNG_CHECK_AND_RETURN(w > 0 && h > 0, "Image dimensions must be > 0.", err);
+bool NormalizeImage(const DNGImage& image, std::vector<float>* out,
+                    int* width, int* height, std::string* err,
+                    const NormalizeOption& option) {
+  return NormalizeImageImpl(image, out, width, height, err, option, 1.0f,
+                            option.clamp);
+}
 
-        image->width = w;
-        image->height = h;
-      }
+bool NormalizeImage(const DNGImage& image, std::vector<unsigned short>* out,
+                    int* width, int* height, std::string* err,
+                    const NormalizeOption& option) {
+  return NormalizeImageImpl(image, out, width, height, err, option, 65535.0f,
+                            /* clamp */ true);
+}
 
-    } else if (image->compression ==
-               COMPRESSION_NEW_JPEG) {  //  new JPEG(baseline DCT JPEG or
-                                        //  lossless JPEG)
+// ---------------------------------------------------------------------------
+// Color.
 
-      bool decoded = false;
+struct Matrix3 {
+  double m[3][3];
+};
 
-      if (image->bits_per_sample_original == 8) {
-        // bps TAG exists. probably ordinal JPEG
+static Matrix3 Matrix3FromArray(const double a[3][3]) {
+  Matrix3 r;
+  memcpy(r.m, a, sizeof(r.m));
+  return r;
+}
 
-        size_t jpeg_len = static_cast<size_t>(image->jpeg_byte_count);
-        if (image->jpeg_byte_count == -1) {
-          // No jpeg datalen. Set to the size of file - offset.
-          if (sr.size() < data_offset) {
-            if (err) {
-              (*err) += "Unexpected file size or data offset.\n";
-            }
-            return false;
-          }
-          jpeg_len = sr.size() - data_offset;
-        }
+static Matrix3 Matrix3Diagonal(double a, double b, double c) {
+  Matrix3 r = {{{a, 0.0, 0.0}, {0.0, b, 0.0}, {0.0, 0.0, c}}};
+  return r;
+}
 
-        int w_info = 0, h_info = 0, components_info = 0;
-        int is_jpeg = stbi_info_from_memory(sr.data() + data_offset,
-                                            static_cast<int>(jpeg_len), &w_info,
-                                            &h_info, &components_info);
+static Matrix3 Matrix3Mul(const Matrix3& a, const Matrix3& b) {
+  Matrix3 r;
+  for (int i = 0; i < 3; i++) {
+    for (int j = 0; j < 3; j++) {
+      r.m[i][j] =
+          a.m[i][0] * b.m[0][j] + a.m[i][1] * b.m[1][j] + a.m[i][2] * b.m[2][j];
+    }
+  }
+  return r;
+}
 
-        if (is_jpeg != 1) {
-          // Try to decode image as lossless JPEG.
-        } else {
-          int w = 0, h = 0, components = 0;
-          unsigned char* decoded_image = stbi_load_from_memory(
-              sr.data() + data_offset, static_cast<int>(jpeg_len), &w, &h,
-              &components, /* desired_channels */ components_info);
+static void Matrix3MulVector(const Matrix3& a, const double v[3],
+                             double r[3]) {
+  for (int i = 0; i < 3; i++) {
+    r[i] = a.m[i][0] * v[0] + a.m[i][1] * v[1] + a.m[i][2] * v[2];
+  }
+}
 
-          if (!decoded_image) {
-            // Try to decode image as lossless JPEG.
-          } else {
-            decoded = true;
+// w * a + (1 - w) * b
+static Matrix3 Matrix3Lerp(const Matrix3& a, const Matrix3& b, double w) {
+  Matrix3 r;
+  for (int i = 0; i < 3; i++) {
+    for (int j = 0; j < 3; j++) {
+      r.m[i][j] = w * a.m[i][j] + (1.0 - w) * b.m[i][j];
+    }
+  }
+  return r;
+}
 
-            image->width = w;
-            image->height = h;
-            image->samples_per_pixel = components;
-            image->bits_per_sample = image->bits_per_sample_original;
+// Returns false when `a` is singular.
+static bool Matrix3Inverse(const Matrix3& a, Matrix3* inv) {
+  const double(*m)[3] = a.m;
+  const double c00 = m[1][1] * m[2][2] - m[1][2] * m[2][1];
+  const double c01 = m[1][2] * m[2][0] - m[1][0] * m[2][2];
+  const double c02 = m[1][0] * m[2][1] - m[1][1] * m[2][0];
+  const double det = m[0][0] * c00 + m[0][1] * c01 + m[0][2] * c02;
+  if (!(std::fabs(det) > 1.0e-12)) {
+    return false;
+  }
+  const double s = 1.0 / det;
+  inv->m[0][0] = c00 * s;
+  inv->m[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * s;
+  inv->m[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * s;
+  inv->m[1][0] = c01 * s;
+  inv->m[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * s;
+  inv->m[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * s;
+  inv->m[2][0] = c02 * s;
+  inv->m[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * s;
+  inv->m[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * s;
+  return true;
+}
 
-            const uint64_t len = uint64_t(image->samples_per_pixel) * uint64_t(image->width) * uint64_t(image->height) * uint64_t(image->bits_per_sample / 8);
-            // For 32bit
-            if (sizeof(void *) == 4) {
-              // Use 2GB as a max
-              if (len > uint64_t((std::numeric_limits<int32_t>::max)())) {
-                if (err) {
-                  (*err) += "Decoded image size exceeds 2GB.\n";
-                }
-                return false;
-              }
-            }
+// White points of the DNG SDK.
+static const double kD50xy[2] = {0.3457, 0.3585};
+static const double kD65xy[2] = {0.3127, 0.3290};
 
-            if (len > (kMaxImageSizeInMB * 1024ull * 1024ull)) {
-              if (err) {
-                (*err) += "Image data size too large. Exceeds " + std::to_string(kMaxImageSizeInMB) + " MB.\n";
-              }
-              return false;
-            }
+static void XYToXYZ(const double xy[2], double xyz[3]) {
+  const double x = (std::min)((std::max)(xy[0], 0.000001), 0.999999);
+  double y = (std::min)((std::max)(xy[1], 0.000001), 0.999999);
+  if (x + y > 0.999999) {
+    y = 0.999999 - x;
+  }
+  xyz[0] = x / y;
+  xyz[1] = 1.0;
+  xyz[2] = (1.0 - x - y) / y;
+}
 
-            if (len == 0) {
-                if (err) {
-                  std::stringstream ss;
-                  ss << "Image size is 0. Something is wrong in Image parameter:\n";
-                  ss << "  width = " << image->width << "\n";
-                  ss << "  height = " << image->height << "\n";
-                  ss << "  spp = " << image->samples_per_pixel << "\n";
-                  ss << "  bps = " << image->bits_per_sample << "\n";
+static void XYZToXY(const double xyz[3], double xy[2]) {
+  const double total = xyz[0] + xyz[1] + xyz[2];
+  if (total > 0.0) {
+    xy[0] = xyz[0] / total;
+    xy[1] = xyz[1] / total;
+  } else {
+    xy[0] = kD50xy[0];
+    xy[1] = kD50xy[1];
+  }
+}
 
-                  (*err) += ss.str();
-                }
-                return false;
-            }
+// Chromatic adaptation from `white1` to `white2` in the Bradford cone space.
+static Matrix3 MapWhiteMatrix(const double white1[2], const double white2[2]) {
+  static const double kBradford[3][3] = {{0.8951, 0.2664, -0.1614},
+                                         {-0.7502, 1.7135, 0.0367},
+                                         {0.0389, -0.0685, 1.0296}};
+  const Matrix3 mb = Matrix3FromArray(kBradford);
+  double xyz1[3], xyz2[3], w1[3], w2[3];
+  XYToXYZ(white1, xyz1);
+  XYToXYZ(white2, xyz2);
+  Matrix3MulVector(mb, xyz1, w1);
+  Matrix3MulVector(mb, xyz2, w2);
+
+  // Limit the scaling to something reasonable.
+  double a[3];
+  for (int i = 0; i < 3; i++) {
+    a[i] = (w1[i] > 0.0) ? (std::max)(w2[i], 0.0) / w1[i] : 10.0;
+    a[i] = (std::min)((std::max)(a[i], 0.1), 10.0);
+  }
+  Matrix3 mb_inv;
+  Matrix3Inverse(mb, &mb_inv);
+  return Matrix3Mul(mb_inv, Matrix3Mul(Matrix3Diagonal(a[0], a[1], a[2]), mb));
+}
 
-            image->data.resize(len);
+// Robertson's isotemperature lines: reciprocal megakelvin, u, v, slope.
+static const double kTemperatureTable[31][4] = {
+    {0, 0.18006, 0.26352, -0.24341},   {10, 0.18066, 0.26589, -0.25479},
+    {20, 0.18133, 0.26846, -0.26876},  {30, 0.18208, 0.27119, -0.28539},
+    {40, 0.18293, 0.27407, -0.30470},  {50, 0.18388, 0.27709, -0.32675},
+    {60, 0.18494, 0.28021, -0.35156},  {70, 0.18611, 0.28342, -0.37915},
+    {80, 0.18740, 0.28668, -0.40955},  {90, 0.18880, 0.28997, -0.44278},
+    {100, 0.19032, 0.29326, -0.47888}, {125, 0.19462, 0.30141, -0.58204},
+    {150, 0.19962, 0.30921, -0.70471}, {175, 0.20525, 0.31647, -0.84901},
+    {200, 0.21142, 0.32312, -1.0182},  {225, 0.21807, 0.32909, -1.2168},
+    {250, 0.22511, 0.33439, -1.4512},  {275, 0.23247, 0.33904, -1.7298},
+    {300, 0.24010, 0.34308, -2.0637},  {325, 0.24792, 0.34655, -2.4681},
+    {350, 0.25591, 0.34951, -2.9641},  {375, 0.26400, 0.35200, -3.5814},
+    {400, 0.27218, 0.35407, -4.3633},  {425, 0.28039, 0.35577, -5.3762},
+    {450, 0.28863, 0.35714, -6.7262},  {475, 0.29685, 0.35823, -8.5955},
+    {500, 0.30505, 0.35907, -11.324},  {525, 0.31320, 0.35968, -15.628},
+    {550, 0.32129, 0.36011, -23.325},  {575, 0.32931, 0.36038, -40.770},
+    {600, 0.33724, 0.36051, -116.45}};
+
+// Correlated color temperature(K) of the chromaticity `xy`.
+static double XYToTemperature(const double xy[2]) {
+  const double d = 1.5 - xy[0] + 6.0 * xy[1];
+  const double u = 2.0 * xy[0] / d;
+  const double v = 3.0 * xy[1] / d;
+
+  double last_dt = 0.0;
+  for (int i = 1; i <= 30; i++) {
+    const double* t = kTemperatureTable[i];
+    const double len = std::sqrt(1.0 + t[3] * t[3]);
+    const double du = 1.0 / len;
+    const double dv = t[3] / len;
+
+    // Distance above or below the line. Below the line, `xy` is between this
+    // and the previous line.
+    double dt = -(u - t[1]) * dv + (v - t[2]) * du;
+    if ((dt <= 0.0) || (i == 30)) {
+      dt = -(std::min)(dt, 0.0);
+      const double f = (i == 1) ? 0.0 : dt / (last_dt + dt);
+      return 1.0e6 / (kTemperatureTable[i - 1][0] * f + t[0] * (1.0 - f));
+    }
+    last_dt = dt;
+  }
+  return 0.0;  // never reached
+}
 
-            memcpy(image->data.data(), decoded_image, len);
+// Correlated color temperature(K) of a calibration illuminant, 0 if unknown.
+static double IlluminantToTemperature(int light_source) {
+  switch (light_source) {
+    case LIGHTSOURCE_STANDARD_LIGHT_A:
+    case LIGHTSOURCE_TUNGSTEN:
+      return 2850.0;
+    case LIGHTSOURCE_ISO_STUDIO_TUNGSTEN:
+      return 3200.0;
+    case LIGHTSOURCE_D50:
+      return 5000.0;
+    case LIGHTSOURCE_D55:
+    case LIGHTSOURCE_DAYLIGHT:
+    case LIGHTSOURCE_FINE_WEATHER:
+    case LIGHTSOURCE_FLASH:
+    case LIGHTSOURCE_STANDARD_LIGHT_B:
+      return 5500.0;
+    case LIGHTSOURCE_D65:
+    case LIGHTSOURCE_STANDARD_LIGHT_C:
+    case LIGHTSOURCE_CLOUDY_WEATHER:
+      return 6500.0;
+    case LIGHTSOURCE_D75:
+    case LIGHTSOURCE_SHADE:
+      return 7500.0;
+    case LIGHTSOURCE_DAYLIGHT_FLUORESCENT:
+      return (5700.0 + 7100.0) * 0.5;
+    case LIGHTSOURCE_DAY_WHITE_FLUORESCENT:
+      return (4600.0 + 5500.0) * 0.5;
+    case LIGHTSOURCE_COOL_WHITE_FLUORESCENT:
+    case LIGHTSOURCE_FLUORESCENT:
+      return (3800.0 + 4500.0) * 0.5;
+    case LIGHTSOURCE_WHITE_FLUORESCENT:
+      return (3250.0 + 3800.0) * 0.5;
+    case 16:  // Warm white fluorescent
+      return (2600.0 + 3250.0) * 0.5;
+    default:
+      return 0.0;
+  }
+}
 
-            free(decoded_image);
-          }
-        }
-      }
+///
+/// Matrices of a camera profile. Index 0 is the lower temperature illuminant.
+///
+struct ColorProfile {
+  Matrix3 color_matrix[2];
+  Matrix3 forward_matrix[2];
+  Matrix3 camera_calibration[2];
+  Matrix3 analog_balance;
+  double temperature[2];  // K
+  bool dual_illuminant{false};
+  bool has_forward_matrix{false};
+};
 
-      if (!decoded) {
-        // Try to decode as lossless JPEG.
+static bool GetColorProfile(const DNGImage& image, ColorProfile* profile,
+                            std::string* err) {
+  TINY_DNG_CHECK_AND_RETURN(image.has_color_matrix1,
+                            "ColorMatrix1 is required for color conversion.",
+                            err);
+
+  profile->color_matrix[0] = Matrix3FromArray(image.color_matrix1);
+  profile->color_matrix[1] = Matrix3FromArray(image.color_matrix2);
+  profile->forward_matrix[0] = Matrix3FromArray(image.forward_matrix1);
+  profile->forward_matrix[1] = Matrix3FromArray(image.forward_matrix2);
+  profile->camera_calibration[0] = Matrix3FromArray(image.camera_calibration1);
+  profile->camera_calibration[1] = Matrix3FromArray(image.camera_calibration2);
+  profile->temperature[0] =
+      IlluminantToTemperature(int(image.calibration_illuminant1));
+  profile->temperature[1] =
+      IlluminantToTemperature(int(image.calibration_illuminant2));
+  profile->analog_balance =
+      image.has_analog_balance
+          ? Matrix3Diagonal(image.analog_balance[0], image.analog_balance[1],
+                            image.analog_balance[2])
+          : Matrix3Diagonal(1.0, 1.0, 1.0);
+
+  // Two matrices are interpolated only when both illuminants are known.
+  profile->dual_illuminant =
+      image.has_color_matrix2 && (profile->temperature[0] > 0.0) &&
+      (profile->temperature[1] > 0.0) &&
+      (profile->temperature[0] != profile->temperature[1]);
+  profile->has_forward_matrix =
+      image.has_forward_matrix1 &&
+      (!profile->dual_illuminant || image.has_forward_matrix2);
+  if (profile->dual_illuminant &&
+      (profile->temperature[0] > profile->temperature[1])) {
+    std::swap(profile->color_matrix[0], profile->color_matrix[1]);
+    std::swap(profile->forward_matrix[0], profile->forward_matrix[1]);
+    std::swap(profile->camera_calibration[0], profile->camera_calibration[1]);
+    std::swap(profile->temperature[0], profile->temperature[1]);
+  }
+
+  // Scale ForwardMatrix so that camera white(1, 1, 1) maps to D50.
+  if (profile->has_forward_matrix) {
+    double d50[3];
+    XYToXYZ(kD50xy, d50);
+    const double one[3] = {1.0, 1.0, 1.0};
+    for (int k = 0; k < 2; k++) {
+      double xyz[3];
+      Matrix3MulVector(profile->forward_matrix[k], one, xyz);
+      TINY_DNG_CHECK_AND_RETURN((xyz[0] > 0.0) && (xyz[1] > 0.0) &&
+                                    (xyz[2] > 0.0),
+                                "Invalid ForwardMatrix.", err);
+      profile->forward_matrix[k] =
+          Matrix3Mul(Matrix3Diagonal(d50[0] / xyz[0], d50[1] / xyz[1],
+                                     d50[2] / xyz[2]),
+                     profile->forward_matrix[k]);
+    }
+  }
+  return true;
+}
 
-        // lj92 decodes data into 16bits, so modify bps.
-        image->bits_per_sample = 16;
+// Weight of the illuminant 0 matrices for the white `xy`.
+static double ColorProfileWeight(const ColorProfile& profile,
+                                 const double xy[2]) {
+  if (!profile.dual_illuminant) {
+    return 1.0;
+  }
+  const double t = XYToTemperature(xy);
+  if (t <= profile.temperature[0]) {
+    return 1.0;
+  }
+  if (t >= profile.temperature[1]) {
+    return 0.0;
+  }
+  const double inv_t2 = 1.0 / profile.temperature[1];
+  return (1.0 / t - inv_t2) / (1.0 / profile.temperature[0] - inv_t2);
+}
 
-        // std::cout << "w = " << image->width << ", h = " << image->height <<
-        // std::endl;
+// AB * CC * CM interpolated with `weight`.
+static Matrix3 XYZToCameraMatrix(const ColorProfile& profile, double weight) {
+  const Matrix3 cm = Matrix3Lerp(profile.color_matrix[0],
+                                 profile.color_matrix[1], weight);
+  const Matrix3 cc = Matrix3Lerp(profile.camera_calibration[0],
+                                 profile.camera_calibration[1], weight);
+  return Matrix3Mul(profile.analog_balance, Matrix3Mul(cc, cm));
+}
 
-        TINY_DNG_DPRINTF("image.width = %d\n", image->width);
-        TINY_DNG_DPRINTF("image.height = %d\n", image->height);
-        TINY_DNG_DPRINTF("image.bps = %d\n", image->bits_per_sample);
-        TINY_DNG_DPRINTF("image.spp = %d\n", image->samples_per_pixel);
+// White chromaticity of the camera neutral, by iterating the white and the
+// matrices interpolated for it.
+static bool NeutralToXY(const ColorProfile& profile, const double neutral[3],
+                        double xy[2], std::string* err) {
+  double last[2] = {kD50xy[0], kD50xy[1]};
+  for (int pass = 0; pass < 30; pass++) {
+    Matrix3 camera_to_xyz;
+    TINY_DNG_CHECK_AND_RETURN(
+        Matrix3Inverse(
+            XYZToCameraMatrix(profile, ColorProfileWeight(profile, last)),
+            &camera_to_xyz),
+        "ColorMatrix is singular.", err);
+    double xyz[3], next[2];
+    Matrix3MulVector(camera_to_xyz, neutral, xyz);
+    XYZToXY(xyz, next);
+    if (std::fabs(next[0] - last[0]) + std::fabs(next[1] - last[1]) <
+        1.0e-7) {
+      last[0] = next[0];
+      last[1] = next[1];
+      break;
+    }
+    // Converge oscillation.
+    if (pass == 29) {
+      next[0] = (last[0] + next[0]) * 0.5;
+      next[1] = (last[1] + next[1]) * 0.5;
+    }
+    last[0] = next[0];
+    last[1] = next[1];
+  }
+  xy[0] = last[0];
+  xy[1] = last[1];
+  return true;
+}
 
-        TINY_DNG_CHECK_AND_RETURN(
-            ((image->width * image->height * image->bits_per_sample) % 8) == 0,
-            "Image must be multiple of 8.", err);
-        const uint64_t len = uint64_t(image->samples_per_pixel) * uint64_t(image->width) * uint64_t(image->height) * uint64_t(image->bits_per_sample / 8);
-        // For 32bit
-        if (sizeof(void *) == 4) {
-          // Use 2GB as a max
-          if (len > uint64_t((std::numeric_limits<int32_t>::max)())) {
-            if (err) {
-              (*err) += "Decoded image size exceeds 2GB.\n";
-            }
-            return false;
-          }
-        }
+// XYZ(D50) to linear RGB of `color_space`(Bradford adapted to D50).
+static Matrix3 XYZD50ToOutputMatrix(ColorSpace color_space) {
+  static const double kSRGB[3][3] = {{3.1338561, -1.6168667, -0.4906146},
+                                     {-0.9787684, 1.9161415, 0.0334540},
+                                     {0.0719453, -0.2289914, 1.4052427}};
+  static const double kAdobeRGB[3][3] = {{1.9624274, -0.6105343, -0.3413404},
+                                         {-0.9787684, 1.9161415, 0.0334540},
+                                         {0.0286869, -0.1406752, 1.3487655}};
+  static const double kProPhotoRGB[3][3] = {
+      {1.3459433, -0.2556075, -0.0511118},
+      {-0.5445989, 1.5081673, 0.0205351},
+      {0.0000000, 0.0000000, 1.2118128}};
+  if (color_space == COLOR_SPACE_XYZ_D50) {
+    return Matrix3Diagonal(1.0, 1.0, 1.0);
+  }
+  Matrix3 m = Matrix3FromArray(
+      (color_space == COLOR_SPACE_ADOBE_RGB)
+          ? kAdobeRGB
+          : ((color_space == COLOR_SPACE_PROPHOTO_RGB) ? kProPhotoRGB : kSRGB));
+
+  // Map the D50 of the DNG SDK to exactly 1.0.
+  double d50[3], rgb[3];
+  XYToXYZ(kD50xy, d50);
+  Matrix3MulVector(m, d50, rgb);
+  for (int i = 0; i < 3; i++) {
+    for (int j = 0; j < 3; j++) {
+      m.m[i][j] /= rgb[i];
+    }
+  }
+  return m;
+}
 
-        if (len > (kMaxImageSizeInMB * 1024ull * 1024ull)) {
-          if (err) {
-            (*err) += "Image data size too large. Exceeds " + std::to_string(kMaxImageSizeInMB) + " MB.\n";
-          }
-          return false;
-        }
+static bool ComputeColorTransformUncached(const DNGImage& image,
+                                          const double neutral[3],
+                                          const ColorOption& option,
+                                          ColorTransform* transform,
+                                          std::string* err) {
+  ColorProfile profile;
+  if (!GetColorProfile(image, &profile, err)) {
+    return false;
+  }
 
-        if (len == 0) {
-          if (err) {
-            (*err) += "Invalid jpeg data length.\n";
-          }
-          return false;
-        }
-        TINY_DNG_DPRINTF("image.data.size = %lld\n", len);
+  double white[2];
+  if (!NeutralToXY(profile, neutral, white, err)) {
+    return false;
+  }
+  const double weight = ColorProfileWeight(profile, white);
+  const Matrix3 xyz_to_camera = XYZToCameraMatrix(profile, weight);
+
+  Matrix3 camera_to_pcs;
+  double pcs_white[3];
+  XYToXYZ(kD50xy, pcs_white);
+  if (profile.has_forward_matrix) {
+    // CameraToPCS = FM * Inverse(D(ReferenceCameraWhite)) * Inverse(AB * CC)
+    double white_xyz[3], camera_white[3];
+    XYToXYZ(white, white_xyz);
+    Matrix3MulVector(xyz_to_camera, white_xyz, camera_white);
+    const double max_white = (std::max)(
+        (std::max)(camera_white[0], camera_white[1]), camera_white[2]);
+    TINY_DNG_CHECK_AND_RETURN(max_white > 0.0, "Invalid camera white.", err);
+    for (int i = 0; i < 3; i++) {
+      camera_white[i] =
+          (std::min)((std::max)(camera_white[i] / max_white, 0.001), 1.0);
+    }
+
+    const Matrix3 cc = Matrix3Lerp(profile.camera_calibration[0],
+                                   profile.camera_calibration[1], weight);
+    Matrix3 individual_to_reference;
+    TINY_DNG_CHECK_AND_RETURN(
+        Matrix3Inverse(Matrix3Mul(profile.analog_balance, cc),
+                       &individual_to_reference),
+        "CameraCalibration is singular.", err);
+    double ref_white[3];
+    Matrix3MulVector(individual_to_reference, camera_white, ref_white);
+    TINY_DNG_CHECK_AND_RETURN(
+        (ref_white[0] > 0.0) && (ref_white[1] > 0.0) && (ref_white[2] > 0.0),
+        "Invalid camera white.", err);
+    const Matrix3 fm = Matrix3Lerp(profile.forward_matrix[0],
+                                   profile.forward_matrix[1], weight);
+    camera_to_pcs = Matrix3Mul(
+        fm, Matrix3Mul(Matrix3Diagonal(1.0 / ref_white[0], 1.0 / ref_white[1],
+                                       1.0 / ref_white[2]),
+                       individual_to_reference));
+  } else {
+    // Adapt D50 to the white, then scale so that the brightest camera channel
+    // of D50 is 1.0.
+    Matrix3 pcs_to_camera =
+        Matrix3Mul(xyz_to_camera, MapWhiteMatrix(kD50xy, white));
+    double camera[3];
+    Matrix3MulVector(pcs_to_camera, pcs_white, camera);
+    const double scale =
+        (std::max)((std::max)(camera[0], camera[1]), camera[2]);
+    TINY_DNG_CHECK_AND_RETURN(scale > 0.0, "Invalid ColorMatrix.", err);
+    for (int i = 0; i < 3; i++) {
+      for (int j = 0; j < 3; j++) {
+        pcs_to_camera.m[i][j] /= scale;
+      }
+    }
+    TINY_DNG_CHECK_AND_RETURN(Matrix3Inverse(pcs_to_camera, &camera_to_pcs),
+                              "ColorMatrix is singular.", err);
+  }
+
+  Matrix3 m = Matrix3Mul(XYZD50ToOutputMatrix(option.color_space),
+                         camera_to_pcs);
+
+  // Undo the white balance of `NormalizeImage`(max(neutral) / neutral).
+  if (option.white_balanced_input) {
+    const double max_neutral =
+        (std::max)((std::max)(neutral[0], neutral[1]), neutral[2]);
+    m = Matrix3Mul(m, Matrix3Diagonal(neutral[0] / max_neutral,
+                                      neutral[1] / max_neutral,
+                                      neutral[2] / max_neutral));
+  }
+
+  transform->color_space = option.color_space;
+  transform->encode_gamma = option.encode_gamma;
+  transform->clamp = option.clamp;
+  memcpy(transform->matrix, m.m, sizeof(m.m));
+  transform->white_xy[0] = white[0];
+  transform->white_xy[1] = white[1];
+  transform->temperature = XYToTemperature(white);
+  transform->weight1 = weight;
+  // `weight` is for the lower temperature illuminant.
+  if (profile.dual_illuminant &&
+      (IlluminantToTemperature(int(image.calibration_illuminant1)) >
+       IlluminantToTemperature(int(image.calibration_illuminant2)))) {
+    transform->weight1 = 1.0 - weight;
+  }
+
+  transform->tone_curve.lut.clear();
+  if (option.apply_tone_curve && !image.profile_tone_curve.empty()) {
+    if (!BuildToneCurve(image.profile_tone_curve, &transform->tone_curve,
+                        err)) {
+      return false;
+    }
+  }
+  return true;
+}
 
-        image->data.resize(len);
-        TINY_DNG_DPRINTF("image.data.size = %d\n", int(len));
+// Camera neutral of the D65 white.
+static bool D65CameraNeutral(const DNGImage& image, double neutral[3],
+                             std::string* err) {
+  ColorProfile profile;
+  if (!GetColorProfile(image, &profile, err)) {
+    return false;
+  }
+  double d65[3];
+  XYToXYZ(kD65xy, d65);
+  Matrix3MulVector(
+      XYZToCameraMatrix(profile, ColorProfileWeight(profile, kD65xy)), d65,
+      neutral);
+  TINY_DNG_CHECK_AND_RETURN(
+      (neutral[0] > 0.0) && (neutral[1] > 0.0) && (neutral[2] > 0.0),
+      "Invalid ColorMatrix.", err);
+  return true;
+}
 
-        if (sr.size() < data_offset) {
-          if (err) {
-            (*err) += "Unexpected file size or data offset.\n";
-          }
-          return false;
-        }
+bool ComputeColorTransform(const DNGImage& image, const double* camera_neutral,
+                           ColorTransform* transform, std::string* err,
+                           const ColorOption& option,
+                           ColorTransformCache* cache) {
+  TINY_DNG_CHECK_AND_RETURN(transform, "Invalid argument.", err);
+
+  double neutral[3] = {1.0, 1.0, 1.0};
+  bool has_neutral = true;
+  if (camera_neutral) {
+    memcpy(neutral, camera_neutral, sizeof(neutral));
+  } else if (image.has_as_shot_neutral) {
+    memcpy(neutral, image.as_shot_neutral, sizeof(neutral));
+  } else {
+    has_neutral = false;
+  }
+  if (has_neutral) {
+    TINY_DNG_CHECK_AND_RETURN(
+        (neutral[0] > 0.0) && (neutral[1] > 0.0) && (neutral[2] > 0.0),
+        "Invalid camera neutral: " << neutral[0] << ", " << neutral[1] << ", "
+                                   << neutral[2],
+        err);
+  }
+
+  std::vector<double> key;
+  if (cache) {
+    const double(*matrices[6])[3] = {
+        image.color_matrix1,       image.color_matrix2,
+        image.forward_matrix1,     image.forward_matrix2,
+        image.camera_calibration1, image.camera_calibration2};
+    key.reserve(6 * 9 + 18);
+    for (size_t k = 0; k < 6; k++) {
+      key.insert(key.end(), &matrices[k][0][0], &matrices[k][0][0] + 9);
+    }
+    for (int i = 0; i < 3; i++) {
+      key.push_back(image.has_analog_balance ? image.analog_balance[i] : 1.0);
+      key.push_back(neutral[i]);
+    }
+    const double flags[] = {
+        double(image.has_color_matrix1),   double(image.has_color_matrix2),
+        double(image.has_forward_matrix1), double(image.has_forward_matrix2),
+        double(image.calibration_illuminant1),
+        double(image.calibration_illuminant2),
+        double(has_neutral),               double(option.color_space),
+        double(option.white_balanced_input), double(option.encode_gamma),
+        double(option.clamp),              double(option.apply_tone_curve)};
+    key.insert(key.end(), flags, flags + sizeof(flags) / sizeof(flags[0]));
+    if (option.apply_tone_curve) {
+      key.insert(key.end(), image.profile_tone_curve.begin(),
+                 image.profile_tone_curve.end());
+    }
+
+    for (size_t i = 0; i < cache->keys.size(); i++) {
+      if (cache->keys[i] == key) {
+        (*transform) = cache->transforms[i];
+        return true;
+      }
+    }
+  }
 
-        if (!sr.seek_set(data_offset)) {
-          if (err) {
-            (*err) += "Failed to seek to data offset(NewJpeg).\n";
-          }
-          return false;
-        }
+  if (!has_neutral && !D65CameraNeutral(image, neutral, err)) {
+    return false;
+  }
 
-        int lj_bits = 0;
+  if (!ComputeColorTransformUncached(image, neutral, option, transform, err)) {
+    return false;
+  }
 
-        bool ok = DecompressLosslessJPEG(
-            sr, reinterpret_cast<unsigned short*>(&(image->data.at(0))),
-            image->width, (*image), &lj_bits, err);
-        if (!ok) {
-          if (err) {
-            std::stringstream ss;
-            ss << "Failed to decompress LJPEG." << std::endl;
-            (*err) = ss.str();
-          }
-          return false;
-        }
+  if (cache && (cache->max_entries > 0)) {
+    if (cache->keys.size() < cache->max_entries) {
+      cache->keys.push_back(key);
+      cache->transforms.push_back(*transform);
+    } else {
+      const size_t i = cache->next % cache->keys.size();
+      cache->keys[i] = key;
+      cache->transforms[i] = *transform;
+      cache->next = i + 1;
+    }
+  }
+  return true;
+}
 
-        if (image->bits_per_sample_original <= 0) {
-          image->bits_per_sample_original = lj_bits;
-        }
-      }
+// Transfer curve: slope * x below `threshold`, otherwise
+// scale * x^exponent - offset.
+struct TransferCurve {
+  bool linear{true};
+  float threshold{0.0f};
+  float slope{0.0f};
+  float scale{1.0f};
+  float exponent{1.0f};
+  float offset{0.0f};
+};
 
-    } else if (image->compression == COMPRESSION_ZIP) {  // ZIP
-#ifdef TINY_DNG_LOADER_ENABLE_ZIP
-      TINY_DNG_CHECK_AND_RETURN(image->bits_per_sample_original > 0,
-                      "bits_per_sample information not found in the tag.", err);
-      image->bits_per_sample = image->bits_per_sample_original;
-      TINY_DNG_DPRINTF("bps = %d\n", image->bits_per_sample);
-      TINY_DNG_DPRINTF("data_offset = %d\n", int(data_offset));
+static TransferCurve GetTransferCurve(ColorSpace color_space,
+                                      bool encode_gamma) {
+  TransferCurve curve;
+  if (!encode_gamma || (color_space == COLOR_SPACE_XYZ_D50)) {
+    return curve;
+  }
+  curve.linear = false;
+  if (color_space == COLOR_SPACE_ADOBE_RGB) {
+    curve.exponent = 256.0f / 563.0f;
+  } else if (color_space == COLOR_SPACE_PROPHOTO_RGB) {
+    curve.threshold = 1.0f / 512.0f;
+    curve.slope = 16.0f;
+    curve.exponent = 1.0f / 1.8f;
+  } else {
+    curve.threshold = 0.0031308f;
+    curve.slope = 12.92f;
+    curve.scale = 1.055f;
+    curve.exponent = 1.0f / 2.4f;
+    curve.offset = 0.055f;
+  }
+  return curve;
+}
 
-      TINY_DNG_DPRINTF("width %d\n", image->width);
-      TINY_DNG_DPRINTF("height %d\n", image->height);
-      TINY_DNG_DPRINTF("samples_per_pixel %d\n", image->samples_per_pixel);
-      TINY_DNG_DPRINTF("bits_per_sample %d\n", image->bits_per_sample);
+// log2 and exp2 for x^y. Polynomials are least squares fits with about 4e-7
+// relative error.
+#if defined(TINY_DNG_LOADER_SIMD_SSE2)
+static inline Float4 Float4Less(Float4 a, Float4 b) { return _mm_cmplt_ps(a, b); }
+static inline Float4 Float4Sqrt(Float4 x) { return _mm_sqrt_ps(x); }
+// `x` > 0
+static inline Float4 Float4Log2(Float4 x, Float4* mantissa) {
+  const __m128i bits = _mm_castps_si128(x);
+  const __m128 e = _mm_cvtepi32_ps(
+      _mm_sub_epi32(_mm_srli_epi32(bits, 23), _mm_set1_epi32(127)));
+  (*mantissa) = _mm_sub_ps(
+      _mm_castsi128_ps(_mm_or_si128(_mm_and_si128(bits, _mm_set1_epi32(0x7fffff)),
+                                    _mm_set1_epi32(0x3f800000))),
+      _mm_set1_ps(1.0f));
+  return e;
+}
+// 2^i * p for the integer part `i` of `y` + 127(in [0, 254]).
+static inline Float4 Float4Exp2Split(Float4 y, Float4* fraction) {
+  const __m128i i = _mm_cvttps_epi32(y);
+  (*fraction) = _mm_sub_ps(y, _mm_cvtepi32_ps(i));
+  return _mm_castsi128_ps(_mm_slli_epi32(i, 23));
+}
+#elif defined(TINY_DNG_LOADER_SIMD_NEON)
+static inline Float4 Float4Less(Float4 a, Float4 b) {
+  return vreinterpretq_f32_u32(vcltq_f32(a, b));
+}
+// ARMv7 has no vsqrtq_f32: x * rsqrt(x) with 2 Newton steps. `x` >= 0
+static inline Float4 Float4Sqrt(Float4 x) {
+  const float32x4_t y = vmaxq_f32(x, vdupq_n_f32(1.0e-30f));
+  float32x4_t e = vrsqrteq_f32(y);
+  e = vmulq_f32(e, vrsqrtsq_f32(vmulq_f32(y, e), e));
+  e = vmulq_f32(e, vrsqrtsq_f32(vmulq_f32(y, e), e));
+  return vmulq_f32(y, e);
+}
+static inline Float4 Float4Log2(Float4 x, Float4* mantissa) {
+  const uint32x4_t bits = vreinterpretq_u32_f32(x);
+  const float32x4_t e = vcvtq_f32_s32(vsubq_s32(
+      vreinterpretq_s32_u32(vshrq_n_u32(bits, 23)), vdupq_n_s32(127)));
+  (*mantissa) = vsubq_f32(
+      vreinterpretq_f32_u32(vorrq_u32(vandq_u32(bits, vdupq_n_u32(0x7fffff)),
+                                      vdupq_n_u32(0x3f800000))),
+      vdupq_n_f32(1.0f));
+  return e;
+}
+static inline Float4 Float4Exp2Split(Float4 y, Float4* fraction) {
+  const int32x4_t i = vcvtq_s32_f32(y);
+  (*fraction) = vsubq_f32(y, vcvtq_f32_s32(i));
+  return vreinterpretq_f32_s32(vshlq_n_s32(i, 23));
+}
+#endif
 
-      const size_t len =
-          static_cast<size_t>((image->samples_per_pixel * image->width *
-                               image->height * image->bits_per_sample) /
-                              8);
-      if (len == 0) {
-        if (err) {
-          (*err) += "Invalid length. in ZIP compressed data.\n";
-        }
-        return false;
-      }
+#if defined(TINY_DNG_LOADER_SIMD_SSE2) || defined(TINY_DNG_LOADER_SIMD_NEON)
+static inline Float4 Float4Pow(Float4 x, float y) {
+  // log2(x) = e + t * P(t), t = mantissa - 1
+  Float4 t;
+  const Float4 e = Float4Log2(Float4Max(x, Float4Set(1.0e-30f)), &t);
+  Float4 p = Float4Set(0.0151279160f);
+  p = Float4Add(Float4Mul(p, t), Float4Set(-0.0781582083f));
+  p = Float4Add(Float4Mul(p, t), Float4Set(0.192385055f));
+  p = Float4Add(Float4Mul(p, t), Float4Set(-0.324616384f));
+  p = Float4Add(Float4Mul(p, t), Float4Set(0.473113345f));
+  p = Float4Add(Float4Mul(p, t), Float4Set(-0.720515514f));
+  p = Float4Add(Float4Mul(p, t), Float4Set(1.44266405f));
+  const Float4 log2_x = Float4Add(e, Float4Mul(p, t));
+
+  // 2^z = 2^i * Q(f), i = floor(z), f = z - i
+  const Float4 z = Float4Min(Float4Max(Float4Mul(log2_x, Float4Set(y)),
+                                       Float4Set(-126.0f)),
+                             Float4Set(127.0f));
+  Float4 f;
+  const Float4 scale = Float4Exp2Split(Float4Add(z, Float4Set(127.0f)), &f);
+  Float4 q = Float4Set(0.00188540379f);
+  q = Float4Add(Float4Mul(q, f), Float4Set(0.00897289930f));
+  q = Float4Add(Float4Mul(q, f), Float4Set(0.0558365980f));
+  q = Float4Add(Float4Mul(q, f), Float4Set(0.240152445f));
+  q = Float4Add(Float4Mul(q, f), Float4Set(0.693152535f));
+  q = Float4Add(Float4Mul(q, f), Float4Set(1.0f));
+  return Float4Mul(q, scale);
+}
+#else
+static inline Float4 Float4Less(Float4 a, Float4 b) {
+  Float4 r;
+  for (int i = 0; i < 4; i++) {
+    r.v[i] = (a.v[i] < b.v[i]) ? 1.0f : 0.0f;
+  }
+  return r;
+}
+static inline Float4 Float4Pow(Float4 x, float y) {
+  Float4 r;
+  for (int i = 0; i < 4; i++) {
+    r.v[i] = std::pow((std::max)(x.v[i], 1.0e-30f), y);
+  }
+  return r;
+}
+static inline Float4 Float4Sqrt(Float4 x) {
+  Float4 r;
+  for (int i = 0; i < 4; i++) {
+    r.v[i] = std::sqrt((std::max)(x.v[i], 0.0f));
+  }
+  return r;
+}
+#endif
 
-      image->data.resize(len);
+static double EncodeTransferCurve(const TransferCurve& curve, double x) {
+  if (curve.linear) {
+    return x;
+  }
+  if (x < double(curve.threshold)) {
+    return double(curve.slope) * x;
+  }
+  return double(curve.scale) * std::pow(x, double(curve.exponent)) -
+         double(curve.offset);
+}
 
-      if (sr.size() < data_offset) {
-        if (err) {
-          (*err) +=
-              "Unexpected file size or data offset in ZIP compressed data.\n";
-        }
-        return false;
-      }
+static inline Float4 EncodeTransferCurve(const TransferCurve& curve,
+                                         Float4 x) {
+  const Float4 lin = Float4Mul(x, Float4Set(curve.slope));
+  const Float4 pow = Float4Sub(
+      Float4Mul(Float4Pow(x, curve.exponent), Float4Set(curve.scale)),
+      Float4Set(curve.offset));
+  return Float4Select(Float4Less(x, Float4Set(curve.threshold)), lin, pow);
+}
 
-      if (!sr.seek_set(data_offset)) {
-        if (err) {
-          (*err) += "Failed to seek to data offset(ZIP).\n";
-        }
-        return false;
+// ---------------------------------------------------------------------------
+// Tone curve.
+
+static const int kToneCurveLUTSize = 4096;
+
+// Cubic spline through (x, y) with the slopes of dng_spline_solver.
+struct ToneSpline {
+  std::vector<double> x, y, s;
+
+  void Solve() {
+    const size_t n = x.size();
+    s.resize(n);
+    double a = x[1] - x[0];
+    double b = (y[1] - y[0]) / a;
+    s[0] = b;
+    // Weighted average of the slopes to the adjacent points.
+    for (size_t j = 2; j < n; j++) {
+      const double c = x[j] - x[j - 1];
+      const double d = (y[j] - y[j - 1]) / c;
+      s[j - 1] = (b * c + d * a) / (a + c);
+      a = c;
+      b = d;
+    }
+    s[n - 1] = 2.0 * b - s[n - 2];
+    s[0] = 2.0 * s[0] - s[1];
+    if (n <= 2) {
+      return;
+    }
+
+    // Tridiagonal solve for C2 continuity.
+    std::vector<double> e(n), f(n), g(n);
+    f[0] = 0.5;
+    e[n - 1] = 0.5;
+    g[0] = 0.75 * (s[0] + s[1]);
+    g[n - 1] = 0.75 * (s[n - 2] + s[n - 1]);
+    for (size_t j = 1; j + 1 < n; j++) {
+      const double t = (x[j + 1] - x[j - 1]) * 2.0;
+      e[j] = (x[j + 1] - x[j]) / t;
+      f[j] = (x[j] - x[j - 1]) / t;
+      g[j] = 1.5 * s[j];
+    }
+    for (size_t j = 1; j < n; j++) {
+      const double t = 1.0 - f[j - 1] * e[j];
+      if (j != n - 1) {
+        f[j] /= t;
       }
+      g[j] = (g[j] - g[j - 1] * e[j]) / t;
+    }
+    for (size_t j = n - 1; j-- > 0;) {
+      g[j] -= f[j] * g[j + 1];
+    }
+    s = g;
+  }
 
-      bool ok = DecompressZIPedTile(sr, &(image->data.at(0)), image->width,
-                                    (*image), err);
-      if (!ok) {
-        if (err) {
-          std::stringstream ss;
-          ss << "Failed to decompress ZIP." << std::endl;
-          (*err) += ss.str();
-        }
-        return false;
+  // Hermite segment between the points `j - 1` and `j`.
+  double Evaluate(size_t j, double v) const {
+    const double a = x[j] - x[j - 1];
+    const double b = (v - x[j - 1]) / a;
+    const double c = (x[j] - v) / a;
+    return ((y[j - 1] * (2.0 - c + b) + s[j - 1] * a * b) * (c * c)) +
+           ((y[j] * (2.0 - b + c) - s[j] * a * c) * (b * b));
+  }
+};
+
+bool BuildToneCurve(const std::vector<float>& points, ToneCurve* curve,
+                    std::string* err) {
+  TINY_DNG_CHECK_AND_RETURN(curve, "Invalid argument.", err);
+  TINY_DNG_CHECK_AND_RETURN(
+      (points.size() >= 4) && ((points.size() % 2) == 0),
+      "Tone curve requires 2 or more (input, output) pairs.", err);
+
+  ToneSpline spline;
+  const size_t n = points.size() / 2;
+  spline.x.resize(n);
+  spline.y.resize(n);
+  for (size_t i = 0; i < n; i++) {
+    spline.x[i] = double(points[2 * i + 0]);
+    spline.y[i] = double(points[2 * i + 1]);
+    TINY_DNG_CHECK_AND_RETURN(
+        (spline.x[i] >= 0.0) && (spline.x[i] <= 1.0) &&
+            (spline.y[i] >= 0.0) && (spline.y[i] <= 1.0),
+        "Tone curve point " << i << " is out of [0, 1].", err);
+    TINY_DNG_CHECK_AND_RETURN((i == 0) || (spline.x[i] > spline.x[i - 1]),
+                              "Tone curve input must be increasing.", err);
+  }
+  spline.Solve();
+
+  curve->lut.resize(kToneCurveLUTSize + 1);
+  size_t j = 1;
+  for (int i = 0; i <= kToneCurveLUTSize; i++) {
+    const double v = double(i) / double(kToneCurveLUTSize);
+    double r;
+    if (v <= spline.x[0]) {
+      r = spline.y[0];
+    } else if (v >= spline.x[n - 1]) {
+      r = spline.y[n - 1];
+    } else {
+      while (spline.x[j] < v) {
+        j++;
       }
+      r = spline.Evaluate(j, v);
+    }
+    curve->lut[size_t(i)] = float((std::min)((std::max)(r, 0.0), 1.0));
+  }
+  return true;
+}
+
+// Linear interpolation of `lut`(`size` + 1 entries over [0, 1]) at `x`.
+static inline Float4 Float4LookupLUT(const float* lut, int size, Float4 x) {
+  const Float4 t = Float4Mul(
+      Float4Min(Float4Max(x, Float4Set(0.0f)), Float4Set(1.0f)),
+      Float4Set(float(size)));
+#if defined(TINY_DNG_LOADER_SIMD_SSE2)
+  const __m128i i = _mm_cvttps_epi32(_mm_min_ps(t, _mm_set1_ps(size - 1.0f)));
+  const __m128 f = _mm_sub_ps(t, _mm_cvtepi32_ps(i));
+#if defined(TINY_DNG_LOADER_SIMD_AVX2)
+  const __m128 y0 = _mm_i32gather_ps(lut, i, 4);
+  const __m128 y1 = _mm_i32gather_ps(lut + 1, i, 4);
 #else
-      if (err) {
-        std::stringstream ss;
-        ss << "ZIP compression is not supported." << std::endl;
-        (*err) = ss.str();
-      }
+  alignas(16) int32_t index[4];
+  _mm_store_si128(reinterpret_cast<__m128i*>(index), i);
+  const __m128 y0 = _mm_setr_ps(lut[index[0]], lut[index[1]], lut[index[2]],
+                                lut[index[3]]);
+  const __m128 y1 =
+      _mm_setr_ps(lut[index[0] + 1], lut[index[1] + 1], lut[index[2] + 1],
+                  lut[index[3] + 1]);
 #endif
-    } else if (image->compression == COMPRESSION_LOSSY) {  // lossy JPEG
-
-      // TOOD: Check bps and photometric_interpretation.
+  return _mm_add_ps(y0, _mm_mul_ps(_mm_sub_ps(y1, y0), f));
+#elif defined(TINY_DNG_LOADER_SIMD_NEON)
+  const int32x4_t i = vcvtq_s32_f32(vminq_f32(t, vdupq_n_f32(size - 1.0f)));
+  const float32x4_t f = vsubq_f32(t, vcvtq_f32_s32(i));
+  int32_t index[4];
+  vst1q_s32(index, i);
+  float y0[4], y1[4];
+  for (int k = 0; k < 4; k++) {
+    y0[k] = lut[index[k]];
+    y1[k] = lut[index[k] + 1];
+  }
+  const float32x4_t a = vld1q_f32(y0);
+  return vmlaq_f32(a, vsubq_f32(vld1q_f32(y1), a), f);
+#else
+  Float4 r;
+  for (int k = 0; k < 4; k++) {
+    const int i = (std::min)(int(t.v[k]), size - 1);
+    const float f = t.v[k] - float(i);
+    r.v[k] = lut[i] + (lut[i + 1] - lut[i]) * f;
+  }
+  return r;
+#endif
+}
 
-      size_t jpeg_len = static_cast<size_t>(image->jpeg_byte_count);
-      if (image->jpeg_byte_count == -1) {
-        // No jpeg datalen. Set to the size of file - offset.
-        if (sr.size() < data_offset) {
-          if (err) {
-            (*err) += "Unexpected file size or data offset.\n";
+bool ApplyToneCurve(const ToneCurve& curve, const float* in,
+                    size_t num_values, float* out, std::string* err) {
+  TINY_DNG_CHECK_AND_RETURN(in && out, "Invalid argument.", err);
+  TINY_DNG_CHECK_AND_RETURN(
+      curve.lut.empty() || (curve.lut.size() == size_t(kToneCurveLUTSize + 1)),
+      "Invalid tone curve LUT size: " << curve.lut.size(), err);
+
+  const float* lut = curve.lut.empty() ? nullptr : curve.lut.data();
+  const size_t kValuesPerChunk = 65536;
+  const size_t num_chunks = (num_values + kValuesPerChunk - 1) / kValuesPerChunk;
+  const int num_threads = GetNumWorkers(num_chunks);
+  return ParallelFor(
+      num_chunks, num_threads, err,
+      [&](size_t k, int thread_id, std::string* thread_err) -> bool {
+        (void)thread_id;
+        (void)thread_err;
+        const size_t begin = k * kValuesPerChunk;
+        const size_t end = (std::min)(begin + kValuesPerChunk, num_values);
+        size_t i = begin;
+        for (; i + 4 <= end; i += 4) {
+          const Float4 x =
+              Float4Min(Float4Max(Float4Load(in + i), Float4Set(0.0f)),
+                        Float4Set(1.0f));
+          Float4Store(out + i,
+                      lut ? Float4LookupLUT(lut, kToneCurveLUTSize, x) : x);
+        }
+        if (i < end) {
+          float tail[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+          memcpy(tail, in + i, (end - i) * sizeof(float));
+          Float4 x = Float4Min(Float4Max(Float4Load(tail), Float4Set(0.0f)),
+                               Float4Set(1.0f));
+          if (lut) {
+            x = Float4LookupLUT(lut, kToneCurveLUTSize, x);
           }
-          return false;
+          Float4Store(tail, x);
+          memcpy(out + i, tail, (end - i) * sizeof(float));
         }
-        jpeg_len = sr.size() - data_offset;
-      }
+        return true;
+      });
+}
+
+// Parameters of `ColorTransformPlanes` for `transform`.
+struct ColorKernel {
+  float m[9];
+  const float* tone_lut{nullptr};
+  TransferCurve curve;
+  bool clamp{true};
+
+  // Tone and transfer curves over sqrt(x), used instead of them when not
+  // empty. See `BuildOutputLUT`.
+  std::vector<float> output_lut;
+};
+
+static bool GetColorKernel(const ColorTransform& transform,
+                           ColorKernel* kernel, std::string* err) {
+  for (int i = 0; i < 3; i++) {
+    for (int j = 0; j < 3; j++) {
+      kernel->m[3 * i + j] = float(transform.matrix[i][j]);
+    }
+  }
+  TINY_DNG_CHECK_AND_RETURN(transform.tone_curve.lut.empty() ||
+                                (transform.tone_curve.lut.size() ==
+                                 size_t(kToneCurveLUTSize + 1)),
+                            "Invalid tone curve LUT size: "
+                                << transform.tone_curve.lut.size(),
+                            err);
+  kernel->tone_lut = transform.tone_curve.lut.empty()
+                         ? nullptr
+                         : transform.tone_curve.lut.data();
+  kernel->curve =
+      GetTransferCurve(transform.color_space, transform.encode_gamma);
+  kernel->clamp = transform.clamp;
+  return true;
+}
 
-      int w_info = 0, h_info = 0, components_info = 0;
-      int is_jpeg = stbi_info_from_memory(sr.data() + data_offset,
-                                          static_cast<int>(jpeg_len), &w_info,
-                                          &h_info, &components_info);
+static const int kOutputLUTSize = 8192;
 
-      if (is_jpeg != 1) {
-        if (err) {
-          (*err) +=
-              "Currently We only supports Standard JPEG data for Lossy "
-              "compression(34892).\n";
-        }
-        return false;
-      }
+///
+/// Fold the tone and transfer curves of `kernel` into one LUT for integer
+/// output, where the precision of `Float4Pow` is not needed. The LUT is
+/// indexed by sqrt(x) to be dense near black, where the transfer curves are
+/// steep. Requires `kernel->clamp`.
+///
+static void BuildOutputLUT(ColorKernel* kernel) {
+  if (!kernel->tone_lut && kernel->curve.linear) {
+    return;
+  }
+  kernel->output_lut.resize(kOutputLUTSize + 1);
+  for (int i = 0; i <= kOutputLUTSize; i++) {
+    const double u = double(i) / double(kOutputLUTSize);
+    double v = u * u;
+    if (kernel->tone_lut) {
+      const double t = v * double(kToneCurveLUTSize);
+      const int k = (std::min)(int(t), kToneCurveLUTSize - 1);
+      v = double(kernel->tone_lut[k]) +
+          double(kernel->tone_lut[k + 1] - kernel->tone_lut[k]) *
+              (t - double(k));
+    }
+    kernel->output_lut[size_t(i)] =
+        float(EncodeTransferCurve(kernel->curve, v));
+  }
+}
 
-      if ((components_info != 1) && (components_info != 3)) {
-        if (err) {
-          (*err) += "Unsupported channels in JPEG data.\n";
-        }
-        return false;
+///
+/// Transform planar RGB `r`, `g` and `b` in place with the matrix, clamp, tone
+/// curve and transfer curve of `kernel`. `n` is a multiple of 4.
+///
+static void ColorTransformPlanes(const ColorKernel& kernel, float* r,
+                                 float* g, float* b, size_t n) {
+  const float* m = kernel.m;
+  const float* tone_lut = kernel.tone_lut;
+  const TransferCurve& curve = kernel.curve;
+  const bool clamp = kernel.clamp;
+  const float* output_lut =
+      kernel.output_lut.empty() ? nullptr : kernel.output_lut.data();
+  const Float4 zero = Float4Set(0.0f);
+  const Float4 one = Float4Set(1.0f);
+  Float4 mv[9];
+  for (int k = 0; k < 9; k++) {
+    mv[k] = Float4Set(m[k]);
+  }
+  float* planes[3] = {r, g, b};
+
+  for (size_t i = 0; i < n; i += 4) {
+    const Float4 vr = Float4Load(r + i);
+    const Float4 vg = Float4Load(g + i);
+    const Float4 vb = Float4Load(b + i);
+    for (int c = 0; c < 3; c++) {
+      Float4 v = Float4Add(
+          Float4Add(Float4Mul(mv[3 * c + 0], vr), Float4Mul(mv[3 * c + 1], vg)),
+          Float4Mul(mv[3 * c + 2], vb));
+      if (clamp) {
+        v = Float4Min(Float4Max(v, zero), one);
       }
-
-      if ((w_info < 1) || (h_info < 1)) {
-        if (err) {
-          (*err) += "Invalid JPEG image resolution.\n";
+      if (output_lut) {
+        v = Float4LookupLUT(output_lut, kOutputLUTSize, Float4Sqrt(v));
+      } else {
+        if (tone_lut) {
+          v = Float4LookupLUT(tone_lut, kToneCurveLUTSize, v);
+        }
+        if (!curve.linear) {
+          v = EncodeTransferCurve(curve, v);
         }
-        return false;
       }
+      Float4Store(planes[c] + i, v);
+    }
+  }
+}
 
-      int w = 0, h = 0, components = 0;
-      unsigned char* decoded_image = stbi_load_from_memory(
-          sr.data() + data_offset, static_cast<int>(jpeg_len), &w, &h,
-          &components, /* desired_channels */ components_info);
-
+// `ColorTransformPlanes` for `n` interleaved RGB pixels.
+static void ColorTransformPixels(const ColorKernel& kernel, const float* in,
+                                 size_t n, float* out) {
+  const size_t kChunk = 64;
+  float planes[3][kChunk];
 
-      if (!decoded_image) {
-        // Probably 16bit JPEG?
-        image->bits_per_sample_original = 1;  // FIXME
-        image->bits_per_sample = 1;           // FIXME
+  for (size_t base = 0; base < n; base += kChunk) {
+    const size_t count = (std::min)(kChunk, n - base);
+    const size_t count4 = (count + 3) & ~size_t(3);
+    for (size_t i = 0; i < count; i++) {
+      planes[0][i] = in[3 * (base + i) + 0];
+      planes[1][i] = in[3 * (base + i) + 1];
+      planes[2][i] = in[3 * (base + i) + 2];
+    }
+    for (size_t i = count; i < count4; i++) {
+      planes[0][i] = planes[1][i] = planes[2][i] = 0.0f;
+    }
 
-        if (err) {
-          std::stringstream ss;
-          ss << "Unsupported lossy JPEG compression(16bit JPEG?)." << std::endl;
-          (*err) = ss.str();
-        }
+    ColorTransformPlanes(kernel, planes[0], planes[1], planes[2], count4);
 
-      } else {
-        image->width = w;
-        image->height = h;
-        image->samples_per_pixel = components;
-        image->bits_per_sample = 8;
+    for (size_t i = 0; i < count; i++) {
+      out[3 * (base + i) + 0] = planes[0][i];
+      out[3 * (base + i) + 1] = planes[1][i];
+      out[3 * (base + i) + 2] = planes[2][i];
+    }
+  }
+}
 
-        const size_t len =
-            static_cast<size_t>((image->samples_per_pixel * image->width *
-                                 image->height * image->bits_per_sample) /
-                                8);
-        image->data.resize(len);
+bool ApplyColorTransform(const ColorTransform& transform, const float* in,
+                         size_t num_pixels, float* out, std::string* err) {
+  TINY_DNG_CHECK_AND_RETURN(in && out, "Invalid argument.", err);
 
-        memcpy(image->data.data(), decoded_image, len);
+  ColorKernel kernel;
+  if (!GetColorKernel(transform, &kernel, err)) {
+    return false;
+  }
 
-#if defined(TINY_DNG_DEBUG_SAVEIMAGE)
-        std::string output_filename = "layer-" + std::to_string(i) + ".png";
-        stbi_write_png(output_filename.c_str(), w, h, components,
-                       reinterpret_cast<const void*>(decoded_image),
-                       /* stride */ 0);
-#endif
-        free(decoded_image);
-      }
+  const size_t kPixelsPerChunk = 16384;
+  const size_t num_chunks =
+      (num_pixels + kPixelsPerChunk - 1) / kPixelsPerChunk;
+  const int num_threads = GetNumWorkers(num_chunks);
+  return ParallelFor(
+      num_chunks, num_threads, err,
+      [&](size_t k, int thread_id, std::string* thread_err) -> bool {
+        (void)thread_id;
+        (void)thread_err;
+        const size_t begin = k * kPixelsPerChunk;
+        const size_t n = (std::min)(kPixelsPerChunk, num_pixels - begin);
+        ColorTransformPixels(kernel, in + 3 * begin, n, out + 3 * begin);
+        return true;
+      });
+}
 
-    } else if (image->compression == 34713) {  // NEF lossless?
+// ---------------------------------------------------------------------------
+// Develop.
+
+// Multiply the gains of the maps at (`row`, [`col_begin`, `col_end`)) of a
+// 1 sample per pixel image into `gains`.
+static void GainMapSpanGains(const std::vector<GainMapPlan>& plans, size_t row,
+                             size_t col_begin, size_t col_end, float* gains) {
+  for (size_t i = 0; i < plans.size(); i++) {
+    const GainMapPlan& plan = plans[i];
+    const OpcodeArea& area = plan.area;
+    if ((area.num_rows == 0) || (row < area.top) ||
+        (((row - area.top) % area.row_pitch) != 0)) {
+      continue;
+    }
+    const size_t y = (row - area.top) / area.row_pitch;
+    if (y >= area.num_rows) {
+      continue;
+    }
 
-      image->bits_per_sample_original = 1;  // FIXME
-      image->bits_per_sample = 1;           // FIXME
+    const float* g0;
+    const float* g1;
+    float frac;
+    GainMapRows(plan, y, 0, &g0, &g1, &frac);
 
-      if (err) {
-        std::stringstream ss;
-        ss << "Seems a NEF RAW. This compression is not supported."
-           << std::endl;
-        (*err) = ss.str();
-      }
-    } else {
-      if (err) {
-        std::stringstream ss;
-        ss << "IFD [" << i << "] "
-           << " Unsupported compression type : " << image->compression
-           << std::endl;
-        (*err) = ss.str();
-      }
-      return false;
+    // Columns of the area in [col_begin, col_end).
+    if (col_end <= area.left) {
+      continue;
+    }
+    const size_t pitch = area.col_pitch;
+    size_t k = (col_begin <= area.left)
+                   ? 0
+                   : (col_begin - area.left + pitch - 1) / pitch;
+    const size_t k_end = (std::min)(
+        area.num_cols, (col_end - area.left + pitch - 1) / pitch);
+    float* dst = gains + (area.left + k * pitch - col_begin);
+    for (; k < k_end; k++, dst += pitch) {
+      (*dst) *= g0[k] + (g1[k] - g0[k]) * frac;
     }
   }
+}
 
-  //
-  // Postprocessing. Calculate while_level.
-  //
-  for (size_t i = 0; i < images->size(); i++) {
-    tinydng::DNGImage* image = &((*images)[i]);
+// `NormalizeRow` of `n` samples from (`row`, `col`) of `src` to [0, 1].
+// Integer samples are mapped through `linearization` first if not empty, using
+// `linear`(`n` floats) as a scratch.
+static void NormalizeSourceRow(const RawSource& src,
+                               const std::vector<unsigned short>& linearization,
+                               size_t row, size_t col, size_t n,
+                               const float* offset, const float* scale,
+                               float delta, float* linear, float* dst) {
+  const unsigned char* p = src.At(row, col);
+  if (!linearization.empty() && !src.is_float) {
+    const size_t last = linearization.size() - 1;
+    for (size_t i = 0; i < n; i++) {
+      const size_t v = (src.bytes_per_sample == 1)
+                           ? size_t(p[i])
+                           : size_t(reinterpret_cast<const uint16_t*>(p)[i]);
+      linear[i] = float(linearization[(std::min)(v, last)]);
+    }
+    NormalizeRow(linear, n, offset, scale, delta, true, 0.0f, 1.0f, dst);
+  } else if (src.is_float) {
+    NormalizeRow(reinterpret_cast<const float*>(p), n, offset, scale, delta,
+                 true, 0.0f, 1.0f, dst);
+  } else if (src.bytes_per_sample == 1) {
+    NormalizeRow(p, n, offset, scale, delta, true, 0.0f, 1.0f, dst);
+  } else {
+    NormalizeRow(reinterpret_cast<const uint16_t*>(p), n, offset, scale,
+                 delta, true, 0.0f, 1.0f, dst);
+  }
+}
 
-    if (image->samples_per_pixel > 4) {
-      if (err) {
-        (*err) += "Cannot handle > 4 samples per pixel.\n";
+///
+/// Stages of `DevelopImage` before the demosaic.
+///
+struct DevelopInput {
+  RawSource src;
+  NormalizeTables tables;
+  const std::vector<unsigned short>* linearization{nullptr};
+  std::vector<GainMapPlan> gain_plans;
+};
+
+///
+/// Load the tile like `LoadCFATile`, linearized, normalized to [0, 1] and
+/// multiplied by the gain maps and the white balance.
+///
+static void LoadDevelopTile(const DevelopInput& input, size_t x0, size_t y0,
+                            size_t w, size_t h, size_t halo, size_t stride,
+                            float* tile, std::vector<float>* scratch) {
+  const RawSource& src = input.src;
+  const std::ptrdiff_t left = std::ptrdiff_t(x0) - std::ptrdiff_t(halo);
+  const std::ptrdiff_t right = std::ptrdiff_t(x0 + w + halo);
+  const std::ptrdiff_t begin = (std::max)(left, std::ptrdiff_t(0));
+  const std::ptrdiff_t end = (std::min)(right, std::ptrdiff_t(src.width));
+
+  // Source columns of a tile row, including mirrored ones.
+  size_t col_min = src.width;
+  size_t col_max = 0;
+  for (std::ptrdiff_t x = left; x < right; x++) {
+    const size_t c = MirrorIndex(x, src.width);
+    col_min = (std::min)(col_min, c);
+    col_max = (std::max)(col_max, c);
+  }
+  const size_t n = col_max - col_min + 1;
+  scratch->resize(3 * n);
+  float* values = scratch->data();
+  float* gains = values + n;
+  float* linear = gains + n;
+
+  for (size_t j = 0; j < h + 2 * halo; j++) {
+    const size_t sy =
+        MirrorIndex(std::ptrdiff_t(y0 + j) - std::ptrdiff_t(halo), src.height);
+    const float* offset = input.tables.Offset(sy) + col_min;
+    const float* scale = input.tables.Scale(sy) + col_min;
+    const float delta = input.tables.DeltaV(sy);
+    if (!input.gain_plans.empty()) {
+      std::fill(gains, gains + n, 1.0f);
+      GainMapSpanGains(input.gain_plans, sy, col_min, col_max + 1, gains);
+      for (size_t i = 0; i < n; i++) {
+        gains[i] *= scale[i];
       }
-      return false;
+      scale = gains;
     }
-    for (int s = 0; s < image->samples_per_pixel; s++) {
-      if (image->white_level[s] == -1) {
-        // Set white level with (2 ** BitsPerSample) according to the DNG spec.
-        if (image->bits_per_sample_original == 0) {
-          if (err) {
-            (*err) += "Bits per sample of image has to be > 0.\n";
-          }
-          return false;
-        }
-
-        if (image->bits_per_sample_original >=
-            32) {  // workaround for 32bit floating point TIFF.
-          image->white_level[s] = -1;
-        } else {
-          if (image->bits_per_sample_original >= 32) {
-            if (err) {
-              (*err) += "Cannot handle >= 32 bits per sample.\n";
-            }
-            return false;
-          }
 
-          image->white_level[s] = (1 << image->bits_per_sample_original) - 1;
-        }
-      }
+    NormalizeSourceRow(src, *input.linearization, sy, col_min, n, offset,
+                       scale, delta, linear, values);
 
-      // Shrink value when TIFF tag white level is larger than (2**bps)
-      // e.g. Set to 4096 if TIFF white_balance tag has 65535 but bps == 12
-      // FIXME: Is this ok according to DNG spec?
-      if ((image->bits_per_sample_original > 0) &&
-          (image->bits_per_sample_original < 30)) {
-        if (image->white_level[s] >= (1 << image->bits_per_sample_original)) {
-          image->white_level[s] = (1 << image->bits_per_sample_original) - 1;
-        }
-      }
+    float* dst = tile + j * stride;
+    if (begin < end) {
+      memcpy(dst + (begin - left), values + (size_t(begin) - col_min),
+             size_t(end - begin) * sizeof(float));
+    }
+    for (std::ptrdiff_t x = left; x < begin; x++) {
+      dst[x - left] = values[MirrorIndex(x, src.width) - col_min];
+    }
+    for (std::ptrdiff_t x = (std::max)(end, left); x < right; x++) {
+      dst[x - left] = values[MirrorIndex(x, src.width) - col_min];
     }
   }
-
-  return ret ? true : false;
 }
 
-bool IsDNGFromMemory(const char* mem, unsigned int size, std::string* msg) {
-  if ((mem == NULL) || (size < 32)) {
-    if (msg) {
-      (*msg) = "Invalid argument. argument is null or invalid.\n";
+// Interleave `n` pixels of planar RGB in [0, 1] to `out` scaled to
+// `max_value`.
+template <typename T>
+static void StoreDevelopRow(const float* r, const float* g, const float* b,
+                            size_t n, float max_value, T* out) {
+  const float* planes[3] = {r, g, b};
+  for (size_t x = 0; x < n; x++) {
+    for (int c = 0; c < 3; c++) {
+      const float v = (std::min)((std::max)(planes[c][x], 0.0f), 1.0f);
+      out[3 * x + size_t(c)] = static_cast<T>(v * max_value + 0.5f);
     }
+  }
+}
+
+template <typename T>
+static bool DevelopImageImpl(const DNGImage& image, std::vector<T>* rgb,
+                             int* width, int* height, std::string* err,
+                             const DevelopOption& option, float max_value) {
+  TINY_DNG_CHECK_AND_RETURN(rgb && width && height, "Invalid argument.", err);
+
+  DevelopInput input;
+  if (!GetCFASource(image, &input.src, err)) {
     return false;
   }
+  const RawSource& src = input.src;
 
-  const unsigned short magic = *(reinterpret_cast<const unsigned short*>(mem));
+  double neutral[3];
+  if (option.camera_neutral) {
+    memcpy(neutral, option.camera_neutral, sizeof(neutral));
+  } else if (image.has_as_shot_neutral) {
+    memcpy(neutral, image.as_shot_neutral, sizeof(neutral));
+  } else if (!D65CameraNeutral(image, neutral, err)) {
+    return false;
+  }
 
-  if (magic == 0x4949) {
-    // might be TIFF(DNG).
-  } else if (magic == 0x4d4d) {
-    // might be TIFF(DNG, bigendian).
-    if (msg) {
-      (*msg) = "DNG is big endian";
+  ColorOption color_option;
+  color_option.color_space = option.color_space;
+  color_option.white_balanced_input = true;
+  color_option.encode_gamma = option.encode_gamma;
+  color_option.clamp = true;
+  color_option.apply_tone_curve = option.apply_tone_curve;
+  ColorTransform transform;
+  if (!ComputeColorTransform(image, neutral, &transform, err, color_option)) {
+    return false;
+  }
+  ColorKernel kernel;
+  if (!GetColorKernel(transform, &kernel, err)) {
+    return false;
+  }
+  BuildOutputLUT(&kernel);
+
+  if (!BuildNormalizeTables(image, src, neutral, 1.0f, &input.tables, err)) {
+    return false;
+  }
+  input.linearization = &image.linearization_table;
+  if (option.apply_gain_maps && !image.opcodelist2_gainmap.empty()) {
+    OpcodeBounds bounds;
+    if (!GetOpcodeBounds(image, 2, &bounds, err)) {
+      return false;
     }
-  } else {
+    input.gain_plans.resize(image.opcodelist2_gainmap.size());
+    for (size_t i = 0; i < input.gain_plans.size(); i++) {
+      if (!BuildGainMapPlan(image.opcodelist2_gainmap[i], bounds, 1,
+                            &input.gain_plans[i], err)) {
+        return false;
+      }
+    }
+  }
+
+  DemosaicPlan plan;
+  if (!BuildDemosaicPlan(image, src, option.demosaic_method, 1.0f, &plan,
+                         err)) {
+    return false;
+  }
+
+  const size_t tiles_x =
+      (src.width + kDemosaicTileWidth - 1) / kDemosaicTileWidth;
+  const size_t tiles_y =
+      (src.height + kDemosaicTileHeight - 1) / kDemosaicTileHeight;
+  const size_t out_size = kDemosaicTileWidth * kDemosaicTileHeight;
+  const int num_threads = GetNumWorkers(tiles_x * tiles_y);
+  std::vector<std::vector<float> > buffers(static_cast<size_t>(num_threads));
+  std::vector<std::vector<float> > scratch(static_cast<size_t>(num_threads));
+
+  rgb->resize(src.width * src.height * 3);
+  T* dst = rgb->data();
+
+  const bool ret = ParallelFor(
+      tiles_x * tiles_y, num_threads, err,
+      [&](size_t k, int thread_id, std::string* thread_err) -> bool {
+        (void)thread_err;
+        std::vector<float>& buf = buffers[size_t(thread_id)];
+        buf.resize(plan.in_size + 3 * out_size);
+        float* tile = buf.data();
+        float* planes[3] = {tile + plan.in_size,
+                            tile + plan.in_size + out_size,
+                            tile + plan.in_size + 2 * out_size};
+
+        const size_t x0 = (k % tiles_x) * kDemosaicTileWidth;
+        const size_t y0 = (k / tiles_x) * kDemosaicTileHeight;
+        const size_t w = (std::min)(kDemosaicTileWidth, src.width - x0);
+        const size_t h = (std::min)(kDemosaicTileHeight, src.height - y0);
+        const size_t w4 = (w + 3) & ~size_t(3);
+
+        LoadDevelopTile(input, x0, y0, w4, h, plan.halo, plan.in_stride, tile,
+                        &scratch[size_t(thread_id)]);
+        DemosaicTile(plan, src, tile, x0, y0, w, h,
+                     &scratch[size_t(thread_id)], planes[0], planes[1],
+                     planes[2]);
+
+        for (size_t y = 0; y < h; y++) {
+          float* r = planes[0] + y * kDemosaicTileWidth;
+          float* g = planes[1] + y * kDemosaicTileWidth;
+          float* b = planes[2] + y * kDemosaicTileWidth;
+          ColorTransformPlanes(kernel, r, g, b, w4);
+          StoreDevelopRow(r, g, b, w, max_value,
+                          dst + ((y0 + y) * src.width + x0) * 3);
+        }
+        return true;
+      });
+  if (!ret) {
     return false;
   }
 
+  (*width) = int(src.width);
+  (*height) = int(src.height);
   return true;
 }
 
-bool IsDNG(const char* filename, std::string* msg) {
-  std::stringstream ss;
+bool DevelopImage(const DNGImage& image, std::vector<unsigned char>* rgb,
+                  int* width, int* height, std::string* err,
+                  const DevelopOption& option) {
+  return DevelopImageImpl(image, rgb, width, height, err, option, 255.0f);
+}
 
-  FILE* fp = NULL;
-#if defined(_WIN32)
+bool DevelopImage(const DNGImage& image, std::vector<unsigned short>* rgb,
+                  int* width, int* height, std::string* err,
+                  const DevelopOption& option) {
+  return DevelopImageImpl(image, rgb, width, height, err, option, 65535.0f);
+}
 
-#if defined(_MSC_VER) || defined(__MINGW32__)  // MSVC, MinGW gcc or clang
-  errno_t errcode = _wfopen_s(&fp, UTF8ToWchar(filename).c_str(), L"rb");
-  if (errcode != 0) {
-    if (msg) {
-      (*msg) += "Error opening file: " + std::string(filename) + "(errno " +
-                std::to_string(errcode) + ")\n";
+// ---------------------------------------------------------------------------
+// Preview.
+
+// Whether every `n` x `n` block of `cfa` aligned to `n` has all colors.
+static bool CFABlocksHaveAllColors(const CFAColors& cfa, size_t n) {
+  for (size_t by = 0; by < cfa.rows; by++) {
+    for (size_t bx = 0; bx < cfa.cols; bx++) {
+      bool seen[3] = {false, false, false};
+      for (size_t y = 0; y < n; y++) {
+        for (size_t x = 0; x < n; x++) {
+          seen[cfa.At(std::ptrdiff_t(bx * n + x), std::ptrdiff_t(by * n + y))] =
+              true;
+        }
+      }
+      if (!seen[0] || !seen[1] || !seen[2]) {
+        return false;
+      }
     }
-    return false;
   }
-#else
-  // Unknown compiler
-  fp = fopen(filename, "rb");
-#endif
+  return true;
+}
 
-#else
-  fp = fopen(filename, "rb");
-#endif
-  if (!fp) {
-    ss << "File not found or cannot open file " << filename << std::endl;
-    if (msg) {
-      (*msg) = ss.str();
+bool DevelopPreview(const DNGImage& image, std::vector<unsigned char>* rgb,
+                    int* width, int* height, std::string* err,
+                    const PreviewOption& option) {
+  TINY_DNG_CHECK_AND_RETURN(rgb && width && height, "Invalid argument.", err);
+  TINY_DNG_CHECK_AND_RETURN((option.scale >= 1) && (option.scale <= 64),
+                            "Invalid preview scale: " << option.scale, err);
+
+  RawSource src;
+  if (!GetRawSource(image, &src, err)) {
+    return false;
+  }
+  const size_t spp = src.spp;
+  TINY_DNG_CHECK_AND_RETURN((spp == 1) || (spp == 3),
+                            "Preview requires a CFA image or 3 samples per "
+                            "pixel. samples_per_pixel = "
+                                << spp,
+                            err);
+  const bool is_cfa = (spp == 1);
+  CFAColors cfa;
+  cfa.rows = 1;
+  cfa.cols = 1;
+  size_t n = size_t(option.scale);
+  if (is_cfa) {
+    if (!GetCFAColors(image, &cfa, err)) {
+      return false;
+    }
+    while ((n <= kMaxCFADim * 2) && !CFABlocksHaveAllColors(cfa, n)) {
+      n++;
+    }
+    TINY_DNG_CHECK_AND_RETURN(n <= kMaxCFADim * 2,
+                              "CFA pattern is not supported for preview.",
+                              err);
+  }
+  const size_t out_width = src.width / n;
+  const size_t out_height = src.height / n;
+  TINY_DNG_CHECK_AND_RETURN((out_width > 0) && (out_height > 0),
+                            "Image is smaller than the preview scale " << n,
+                            err);
+
+  // White balance and camera to sRGB. Images without ColorMatrix1 are shown
+  // in the camera RGB.
+  double neutral[3] = {1.0, 1.0, 1.0};
+  bool has_neutral = false;
+  if (image.has_as_shot_neutral) {
+    memcpy(neutral, image.as_shot_neutral, sizeof(neutral));
+    has_neutral = true;
+  } else if (image.has_color_matrix1) {
+    if (!D65CameraNeutral(image, neutral, err)) {
+      return false;
+    }
+    has_neutral = true;
+  }
+  ColorTransform transform;
+  if (image.has_color_matrix1) {
+    ColorOption color_option;
+    color_option.apply_tone_curve = option.apply_tone_curve;
+    if (!ComputeColorTransform(image, neutral, &transform, err,
+                               color_option)) {
+      return false;
+    }
+  } else {
+    for (int i = 0; i < 3; i++) {
+      for (int j = 0; j < 3; j++) {
+        transform.matrix[i][j] = (i == j) ? 1.0 : 0.0;
+      }
     }
+    if (option.apply_tone_curve && !image.profile_tone_curve.empty() &&
+        !BuildToneCurve(image.profile_tone_curve, &transform.tone_curve,
+                        err)) {
+      return false;
+    }
+  }
+  ColorKernel kernel;
+  if (!GetColorKernel(transform, &kernel, err)) {
     return false;
   }
+  BuildOutputLUT(&kernel);
 
-  if (0 != fseek(fp, 0, SEEK_END)) {
-    if (msg) {
-      (*msg) = "Error seeking.\n";
-    }
+  NormalizeTables tables;
+  if (!BuildNormalizeTables(image, src, has_neutral ? neutral : nullptr, 1.0f,
+                            &tables, err)) {
     return false;
   }
 
-  size_t file_size = static_cast<size_t>(ftell(fp));
+  // Color of each sample of a row for each CFA row phase.
+  const size_t row_samples = out_width * n * spp;
+  std::vector<unsigned char> colors(cfa.rows * row_samples);
+  for (size_t p = 0; p < cfa.rows; p++) {
+    for (size_t i = 0; i < row_samples; i++) {
+      colors[p * row_samples + i] = static_cast<unsigned char>(
+          is_cfa ? cfa.At(std::ptrdiff_t(i), std::ptrdiff_t(p)) : (i % 3));
+    }
+  }
 
-  std::vector<unsigned char> whole_data;
-  {
-    whole_data.resize(file_size);
-    fseek(fp, 0, SEEK_SET);
-    size_t read_len = fread(whole_data.data(), 1, file_size, fp);
-    if (read_len != file_size) {
-      if (msg) {
-        (*msg) += "Unexpected file size.\n";
+  // 1 / (samples of each color in a block) for each CFA phase(`py`, `px`) of
+  // the block origin.
+  std::vector<float> inv_counts(cfa.rows * cfa.cols * 3);
+  for (size_t py = 0; py < cfa.rows; py++) {
+    for (size_t px = 0; px < cfa.cols; px++) {
+      float count[3] = {0.0f, 0.0f, 0.0f};
+      for (size_t y = 0; y < n; y++) {
+        for (size_t x = 0; x < n * spp; x++) {
+          count[is_cfa ? cfa.At(std::ptrdiff_t(px + x), std::ptrdiff_t(py + y))
+                       : (x % 3)] += 1.0f;
+        }
+      }
+      // Phases which are not a block origin may miss a color.
+      for (int c = 0; c < 3; c++) {
+        inv_counts[(py * cfa.cols + px) * 3 + size_t(c)] =
+            (count[c] > 0.0f) ? 1.0f / count[c] : 0.0f;
       }
-      return false;
     }
+  }
 
-    fseek(fp, 0, SEEK_SET);
+  const size_t out_width4 = (out_width + 3) & ~size_t(3);
+  const size_t kRowsPerChunk = 8;
+  const size_t num_chunks = (out_height + kRowsPerChunk - 1) / kRowsPerChunk;
+  const int num_threads = GetNumWorkers(num_chunks);
+  std::vector<std::vector<float> > buffers(static_cast<size_t>(num_threads));
+
+  rgb->resize(out_width * out_height * 3);
+  unsigned char* dst = rgb->data();
+
+  const bool ret = ParallelFor(
+      num_chunks, num_threads, err,
+      [&](size_t k, int thread_id, std::string* thread_err) -> bool {
+        (void)thread_err;
+        std::vector<float>& buf = buffers[size_t(thread_id)];
+        buf.resize(2 * row_samples + 3 * out_width4);
+        float* row = buf.data();
+        float* linear = row + row_samples;
+        float* sums = linear + row_samples;
+
+        const size_t oy_end = (std::min)(out_height, (k + 1) * kRowsPerChunk);
+        for (size_t oy = k * kRowsPerChunk; oy < oy_end; oy++) {
+          // Sum of each color in the blocks of the row.
+          std::fill(sums, sums + 3 * out_width4, 0.0f);
+          for (size_t j = 0; j < n; j++) {
+            const size_t y = oy * n + j;
+            NormalizeSourceRow(src, image.linearization_table, y, 0,
+                               row_samples, tables.Offset(y), tables.Scale(y),
+                               tables.DeltaV(y), linear, row);
+            const unsigned char* color =
+                colors.data() + (y % cfa.rows) * row_samples;
+            const size_t block = n * spp;
+            for (size_t ox = 0; ox < out_width; ox++) {
+              const float* v = row + ox * block;
+              const unsigned char* c = color + ox * block;
+              for (size_t i = 0; i < block; i++) {
+                sums[size_t(c[i]) * out_width4 + ox] += v[i];
+              }
+            }
+          }
+
+          const float* inv_row =
+              inv_counts.data() + ((oy * n) % cfa.rows) * cfa.cols * 3;
+          for (size_t ox = 0; ox < out_width; ox++) {
+            const float* inv = inv_row + ((ox * n) % cfa.cols) * 3;
+            sums[ox] *= inv[0];
+            sums[out_width4 + ox] *= inv[1];
+            sums[2 * out_width4 + ox] *= inv[2];
+          }
+
+          float* r = sums;
+          float* g = sums + out_width4;
+          float* b = sums + 2 * out_width4;
+          ColorTransformPlanes(kernel, r, g, b, out_width4);
+          StoreDevelopRow(r, g, b, out_width, 255.0f,
+                          dst + oy * out_width * 3);
+        }
+        return true;
+      });
+  if (!ret) {
+    return false;
   }
-  fclose(fp);
 
-  return IsDNGFromMemory(reinterpret_cast<const char*>(whole_data.data()),
-                         static_cast<unsigned int>(whole_data.size()), msg);
+  (*width) = int(out_width);
+  (*height) = int(out_height);
+  return true;
 }
 
 #ifdef __clang__
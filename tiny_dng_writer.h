@@ -56,6 +56,12 @@ typedef enum {
 
   TIFFTAG_SOFTWARE = 305,
 
+  TIFFTAG_PREDICTOR = 317,
+  TIFFTAG_TILE_WIDTH = 322,
+  TIFFTAG_TILE_LENGTH = 323,
+  TIFFTAG_TILE_OFFSETS = 324,
+  TIFFTAG_TILE_BYTE_COUNTS = 325,
+
   TIFFTAG_SAMPLEFORMAT = 339,
 
   // DNG extension
@@ -100,6 +106,12 @@ static const int PLANARCONFIG_SEPARATE = 2;
 // TODO(syoyo) more compressin types.
 static const int COMPRESSION_NONE = 1;
 static const int COMPRESSION_NEW_JPEG = 7;
+static const int COMPRESSION_ZIP = 8;  // Adobe Deflate
+
+// PREDICTOR
+static const int PREDICTOR_NONE = 1;
+static const int PREDICTOR_HORIZONTAL = 2;     // Horizontal differencing
+static const int PREDICTOR_FLOATINGPOINT = 3;  // Floating point horizontal differencing
 
 // ORIENTATION
 static const int ORIENTATION_TOPLEFT = 1;
@@ -247,6 +259,31 @@ class DNGImage {
   /// Set image data.
   bool SetImageDataJpeg(const unsigned short *data, unsigned int width, unsigned int height, unsigned int bpp);
 
+  ///
+  /// Set image data with ZIP(Deflate) compression.
+  /// Requires TINY_DNG_WRITER_ENABLE_ZIP(miniz, or zlib with
+  /// TINY_DNG_WRITER_USE_SYSTEM_ZLIB).
+  ///
+  /// Image is stored as tiles(TileWidth, TileLength, TileOffsets and
+  /// TileByteCounts tags are written) and each tile is compressed
+  /// independently, in parallel when TINY_DNG_WRITER_USE_THREAD is defined.
+  ///
+  /// `SetSamplesPerPixel()` and `SetBitsPerSample()` must be called in
+  /// advance. Call `SetCompression(COMPRESSION_ZIP)` and do not call
+  /// `SetRowsPerStrip()` for tiled image.
+  ///
+  /// @param[in] data Chunky image data(width * height * spp samples) in native byte order.
+  /// @param[in] tile_width Tile width. Must be multiple of 16.
+  /// @param[in] tile_length Tile length. Must be multiple of 16.
+  /// @param[in] predictor PREDICTOR_NONE, PREDICTOR_HORIZONTAL(8, 16 or 32 bits integer) or PREDICTOR_FLOATINGPOINT(16, 32 or 64 bits floating point).
+  /// @param[in] level Compression level(1 = fastest, 9 = smallest).
+  ///
+  bool SetImageDataZIP(const unsigned char *data, unsigned int width,
+                       unsigned int height, unsigned int tile_width = 256,
+                       unsigned int tile_length = 256,
+                       unsigned short predictor = PREDICTOR_NONE,
+                       int level = 6);
+
   /// Set custom field.
   bool SetCustomFieldLong(const unsigned short tag, const int value);
   bool SetCustomFieldULong(const unsigned short tag, const unsigned int value);
@@ -284,6 +321,10 @@ class DNGImage {
   size_t data_strip_offset_{0};
   size_t data_strip_bytes_{0};
 
+  // Tiled(ZIP compressed) image data. Offsets are relative to `data_os_`.
+  std::vector<size_t> data_tile_offsets_;
+  size_t data_tile_offsets_table_{0};  // Location of TileOffsets values in `data_os_`.
+
   mutable std::string err_;  // Error message
 
   std::vector<IFDTag> ifd_tags_;
@@ -344,6 +385,39 @@ class DNGWriter {
 #include <sstream>
 #include <limits>
 
+#ifdef TINY_DNG_WRITER_ENABLE_ZIP
+#ifdef TINY_DNG_WRITER_USE_SYSTEM_ZLIB
+#include <zlib.h>
+#else
+#include "miniz.h"
+#endif
+#endif
+
+#ifdef TINY_DNG_WRITER_USE_THREAD
+#include <atomic>
+#include <thread>
+#endif
+
+// SIMD byte swap. Define TINY_DNG_WRITER_NO_SIMD to use scalar code only.
+#if !defined(TINY_DNG_WRITER_NO_SIMD)
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#define TINY_DNG_WRITER_SIMD_SSE2
+#include <emmintrin.h>
+#if defined(__SSSE3__) || defined(__AVX2__)
+#define TINY_DNG_WRITER_SIMD_SSSE3
+#include <tmmintrin.h>
+#endif
+#if defined(__AVX2__)
+#define TINY_DNG_WRITER_SIMD_AVX2
+#include <immintrin.h>
+#endif
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define TINY_DNG_WRITER_SIMD_NEON
+#include <arm_neon.h>
+#endif
+#endif
+
 // Undef if you want to use builtin function for clz
 #if 0
 #ifdef _MSC_VER
@@ -1049,21 +1123,147 @@ static void swap4(unsigned int *val) {
   dst[3] = src[0];
 }
 
-static void swap8(uint64_t *val) {
-  uint64_t tmp = *val;
-  unsigned char *dst = reinterpret_cast<unsigned char *>(val);
-  unsigned char *src = reinterpret_cast<unsigned char *>(&tmp);
+// Reverse byte order of each `bytes` bytes sample.
+static void SwapSamples(unsigned char *data, size_t num_samples,
+                        size_t bytes) {
+  const size_t num_bytes = num_samples * bytes;
+  size_t i = 0;
+
+  // 16 and 32 bytes blocks always contain whole 2, 4 or 8 bytes samples.
+  if ((bytes == 2) || (bytes == 4) || (bytes == 8)) {
+#if defined(TINY_DNG_WRITER_SIMD_SSSE3)
+    const int e = int(bytes);
+    // pshufb index reversing each sample: (e - 1 - b % e) + (b / e) * e
+    unsigned char index[16];
+    for (int b = 0; b < 16; b++) {
+      index[b] = static_cast<unsigned char>((e - 1 - (b % e)) + (b / e) * e);
+    }
+    const __m128i shuffle =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(index));
+#if defined(TINY_DNG_WRITER_SIMD_AVX2)
+    const __m256i shuffle256 = _mm256_broadcastsi128_si256(shuffle);
+    for (; i + 32 <= num_bytes; i += 32) {
+      __m256i *p = reinterpret_cast<__m256i *>(data + i);
+      _mm256_storeu_si256(
+          p, _mm256_shuffle_epi8(_mm256_loadu_si256(p), shuffle256));
+    }
+#endif
+    for (; i + 16 <= num_bytes; i += 16) {
+      __m128i *p = reinterpret_cast<__m128i *>(data + i);
+      _mm_storeu_si128(p, _mm_shuffle_epi8(_mm_loadu_si128(p), shuffle));
+    }
+#elif defined(TINY_DNG_WRITER_SIMD_SSE2)
+    for (; i + 16 <= num_bytes; i += 16) {
+      __m128i *p = reinterpret_cast<__m128i *>(data + i);
+      __m128i v = _mm_loadu_si128(p);
+      // Reverse 16bit words in the sample, then bytes in each word.
+      if (bytes == 4) {
+        v = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, 0xB1), 0xB1);
+      } else if (bytes == 8) {
+        v = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, 0x1B), 0x1B);
+      }
+      v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+      _mm_storeu_si128(p, v);
+    }
+#elif defined(TINY_DNG_WRITER_SIMD_NEON)
+    for (; i + 16 <= num_bytes; i += 16) {
+      const uint8x16_t v = vld1q_u8(data + i);
+      if (bytes == 2) {
+        vst1q_u8(data + i, vrev16q_u8(v));
+      } else if (bytes == 4) {
+        vst1q_u8(data + i, vrev32q_u8(v));
+      } else {
+        vst1q_u8(data + i, vrev64q_u8(v));
+      }
+    }
+#endif
+  }
+
+  if (bytes > 1) {
+    for (; i < num_bytes; i += bytes) {
+      std::reverse(data + i, data + i + bytes);
+    }
+  }
+}
+
+#ifdef TINY_DNG_WRITER_ENABLE_ZIP
 
-  dst[0] = src[7];
-  dst[1] = src[6];
-  dst[2] = src[5];
-  dst[3] = src[4];
-  dst[4] = src[3];
-  dst[5] = src[2];
-  dst[6] = src[1];
-  dst[7] = src[0];
+template <typename T>
+static void DifferenceRow(T *row, size_t num_samples, size_t stride) {
+  // value may wrap around, but it's expected behavior.
+  for (size_t i = num_samples - 1; i >= stride; i--) {
+    row[i] = static_cast<T>(row[i] - row[i - stride]);
+  }
 }
 
+///
+/// Apply TIFF predictor and convert samples to the byte order of the file.
+/// `tile` contains `rows` rows of `width` * `spp` samples in native byte order.
+/// `row_buf` is a scratch buffer for the floating point predictor.
+///
+static bool EncodePredictor(unsigned char *tile, size_t width, size_t rows,
+                            size_t spp, size_t bytes_per_sample,
+                            unsigned short predictor, bool swap_endian,
+                            std::vector<unsigned char> *row_buf) {
+  const size_t num_samples = width * spp;
+  const size_t row_bytes = num_samples * bytes_per_sample;
+
+  if (predictor == PREDICTOR_NONE) {
+    if (swap_endian) {
+      SwapSamples(tile, num_samples * rows, bytes_per_sample);
+    }
+    return true;
+  } else if (predictor == PREDICTOR_HORIZONTAL) {
+    for (size_t y = 0; y < rows; y++) {
+      unsigned char *row = tile + y * row_bytes;
+      if (num_samples > spp) {
+        if (bytes_per_sample == 1) {
+          DifferenceRow(row, num_samples, spp);
+        } else if (bytes_per_sample == 2) {
+          DifferenceRow(reinterpret_cast<uint16_t *>(row), num_samples, spp);
+        } else if (bytes_per_sample == 4) {
+          DifferenceRow(reinterpret_cast<uint32_t *>(row), num_samples, spp);
+        } else {
+          return false;
+        }
+      }
+      if (swap_endian) {
+        SwapSamples(row, num_samples, bytes_per_sample);
+      }
+    }
+    return true;
+  } else if (predictor == PREDICTOR_FLOATINGPOINT) {
+    // Split each row into byte planes(most significant byte first, regardless
+    // of the byte order of the file), then difference bytes.
+    if ((bytes_per_sample != 2) && (bytes_per_sample != 4) &&
+        (bytes_per_sample != 8)) {
+      return false;
+    }
+
+    const bool big_endian = IsBigEndian();
+    row_buf->resize(row_bytes);
+    unsigned char *buf = row_buf->data();
+    for (size_t y = 0; y < rows; y++) {
+      unsigned char *row = tile + y * row_bytes;
+      for (size_t i = 0; i < num_samples; i++) {
+        for (size_t b = 0; b < bytes_per_sample; b++) {
+          const size_t src_b = big_endian ? b : (bytes_per_sample - 1 - b);
+          buf[b * num_samples + i] = row[i * bytes_per_sample + src_b];
+        }
+      }
+      if (row_bytes > spp) {
+        DifferenceRow(buf, row_bytes, spp);
+      }
+      memcpy(row, buf, row_bytes);
+    }
+    return true;
+  }
+
+  return false;
+}
+
+#endif
+
 static void Write1(const unsigned char c, std::ostringstream *out) {
   unsigned char value = c;
   out->write(reinterpret_cast<const char *>(&value), 1);
@@ -1089,9 +1289,15 @@ static void Write4(const unsigned int c, std::ostringstream *out,
   out->write(reinterpret_cast<const char *>(&value), 4);
 }
 
+///
+/// Add a TIFF tag. `data` contains `count` values of `type` in native byte
+/// order. Values are converted to the byte order of the file(`swap_endian`),
+/// then stored in the tag itself when they fit in 4 bytes, or appended to
+/// `data_out` otherwise.
+///
 static bool WriteTIFFTag(const unsigned short tag, const unsigned short type,
                          const unsigned int count, const unsigned char *data,
-                         std::vector<IFDTag> *tags_out,
+                         const bool swap_endian, std::vector<IFDTag> *tags_out,
                          std::ostringstream *data_out) {
   assert(sizeof(IFDTag) ==
          12);  // FIXME(syoyo): Use static_assert for C++11 compiler
@@ -1104,6 +1310,24 @@ static bool WriteTIFFTag(const unsigned short tag, const unsigned short type,
   size_t typesize_table[] = {1, 1, 1, 2, 4, 8, 1, 1, 2, 4, 8, 4, 8, 4};
 
   size_t len = count * (typesize_table[(type) < 14 ? (type) : 0]);
+
+  // Byte swapping unit. (S)RATIONAL is a pair of 4 bytes integers.
+  size_t swap_bytes = 1;
+  if ((type == TIFF_SHORT) || (type == TIFF_SSHORT)) {
+    swap_bytes = 2;
+  } else if ((type == TIFF_LONG) || (type == TIFF_SLONG) ||
+             (type == TIFF_RATIONAL) || (type == TIFF_SRATIONAL) ||
+             (type == TIFF_FLOAT) || (type == TIFF_IFD)) {
+    swap_bytes = 4;
+  } else if (type == TIFF_DOUBLE) {
+    swap_bytes = 8;
+  }
+
+  std::vector<unsigned char> buf(data, data + len);
+  if (swap_endian && (swap_bytes > 1)) {
+    SwapSamples(buf.data(), len / swap_bytes, swap_bytes);
+  }
+
   if (len > 4) {
     assert(data_out);
     if (!data_out) {
@@ -1116,25 +1340,14 @@ static bool WriteTIFFTag(const unsigned short tag, const unsigned short type,
         static_cast<unsigned int>(data_out->tellp()) + kHeaderSize;
     ifd.offset_or_value = offset;
 
-    data_out->write(reinterpret_cast<const char *>(data),
+    data_out->write(reinterpret_cast<const char *>(buf.data()),
                     static_cast<std::streamsize>(len));
 
   } else {
+    // 4 bytes or less = store data itself(in the byte order of the file,
+    // left-justified).
     ifd.offset_or_value = 0;
-
-    // less than 4 bytes = store data itself.
-    if (len == 1) {
-      unsigned char value = *(data);
-      memcpy(&(ifd.offset_or_value), &value, sizeof(unsigned char));
-    } else if (len == 2) {
-      unsigned short value = *(reinterpret_cast<const unsigned short *>(data));
-      memcpy(&(ifd.offset_or_value), &value, sizeof(unsigned short));
-    } else if (len == 4) {
-      unsigned int value = *(reinterpret_cast<const unsigned int *>(data));
-      ifd.offset_or_value = value;
-    } else {
-      assert(0);
-    }
+    memcpy(&(ifd.offset_or_value), buf.data(), len);
   }
 
   tags_out->push_back(ifd);
@@ -1191,7 +1404,8 @@ bool DNGImage::SetSubfileType(bool reduced_image, bool page, bool mask) {
 
   bool ret = WriteTIFFTag(
       static_cast<unsigned short>(TIFFTAG_SUB_FILETYPE), TIFF_LONG, count,
-      reinterpret_cast<const unsigned char *>(&bits), &ifd_tags_, &data_os_);
+      reinterpret_cast<const unsigned char *>(&bits),
+      swap_endian_, &ifd_tags_, &data_os_);
 
   if (!ret) {
     return false;
@@ -1207,7 +1421,8 @@ bool DNGImage::SetImageWidth(const unsigned int width) {
   unsigned int data = width;
   bool ret = WriteTIFFTag(
       static_cast<unsigned short>(TIFFTAG_IMAGE_WIDTH), TIFF_LONG, count,
-      reinterpret_cast<const unsigned char *>(&data), &ifd_tags_, &data_os_);
+      reinterpret_cast<const unsigned char *>(&data),
+      swap_endian_, &ifd_tags_, &data_os_);
 
   if (!ret) {
     return false;
@@ -1223,7 +1438,8 @@ bool DNGImage::SetImageLength(const unsigned int length) {
   const unsigned int data = length;
   bool ret = WriteTIFFTag(
       static_cast<unsigned short>(TIFFTAG_IMAGE_LENGTH), TIFF_LONG, count,
-      reinterpret_cast<const unsigned char *>(&data), &ifd_tags_, &data_os_);
+      reinterpret_cast<const unsigned char *>(&data),
+      swap_endian_, &ifd_tags_, &data_os_);
 
   if (!ret) {
     return false;
@@ -1243,7 +1459,8 @@ bool DNGImage::SetRowsPerStrip(const unsigned int rows) {
   const unsigned int data = rows;
   bool ret = WriteTIFFTag(
       static_cast<unsigned short>(TIFFTAG_ROWS_PER_STRIP), TIFF_LONG, count,
-      reinterpret_cast<const unsigned char *>(&data), &ifd_tags_, &data_os_);
+      reinterpret_cast<const unsigned char *>(&data),
+      swap_endian_, &ifd_tags_, &data_os_);
 
   if (!ret) {
     return false;
@@ -1268,7 +1485,8 @@ bool DNGImage::SetSamplesPerPixel(const unsigned short value) {
   const unsigned short data = value;
   bool ret = WriteTIFFTag(
       static_cast<unsigned short>(TIFFTAG_SAMPLES_PER_PIXEL), TIFF_SHORT, count,
-      reinterpret_cast<const unsigned char *>(&data), &ifd_tags_, &data_os_);
+      reinterpret_cast<const unsigned char *>(&data),
+      swap_endian_, &ifd_tags_, &data_os_);
 
   if (!ret) {
     err_ += "Failed to write `TIFFTAG_SAMPLES_PER_PIXEL` tag.\n";
@@ -1316,11 +1534,6 @@ bool DNGImage::SetBitsPerSample(const unsigned int num_samples,
     }
 
     vs[i] = values[i];
-
-    // TODO(syoyo): Swap values when writing IFD tag, not here.
-    if (swap_endian_) {
-      swap2(&vs[i]);
-    }
   }
 
   unsigned int count = num_samples;
@@ -1328,7 +1541,7 @@ bool DNGImage::SetBitsPerSample(const unsigned int num_samples,
   bool ret = WriteTIFFTag(static_cast<unsigned short>(TIFFTAG_BITS_PER_SAMPLE),
                           TIFF_SHORT, count,
                           reinterpret_cast<const unsigned char *>(vs.data()),
-                          &ifd_tags_, &data_os_);
+                          swap_endian_, &ifd_tags_, &data_os_);
 
   if (!ret) {
     return false;
@@ -1360,7 +1573,8 @@ bool DNGImage::SetPhotometric(const unsigned short value) {
   const unsigned short data = value;
   bool ret = WriteTIFFTag(
       static_cast<unsigned short>(TIFFTAG_PHOTOMETRIC), TIFF_SHORT, count,
-      reinterpret_cast<const unsigned char *>(&data), &ifd_tags_, &data_os_);
+      reinterpret_cast<const unsigned char *>(&data),
+      swap_endian_, &ifd_tags_, &data_os_);
 
   if (!ret) {
     return false;
@@ -1382,7 +1596,8 @@ bool DNGImage::SetPlanarConfig(const unsigned short value) {
   const unsigned short data = value;
   bool ret = WriteTIFFTag(
       static_cast<unsigned short>(TIFFTAG_PLANAR_CONFIG), TIFF_SHORT, count,
-      reinterpret_cast<const unsigned char *>(&data), &ifd_tags_, &data_os_);
+      reinterpret_cast<const unsigned char *>(&data),
+      swap_endian_, &ifd_tags_, &data_os_);
 
   if (!ret) {
     return false;
@@ -1398,7 +1613,8 @@ bool DNGImage::SetCompression(const unsigned short value) {
   const unsigned short data = value;
   bool ret = WriteTIFFTag(
       static_cast<unsigned short>(TIFFTAG_COMPRESSION), TIFF_SHORT, count,
-      reinterpret_cast<const unsigned char *>(&data), &ifd_tags_, &data_os_);
+      reinterpret_cast<const unsigned char *>(&data),
+      swap_endian_, &ifd_tags_, &data_os_);
 
   if (!ret) {
     return false;
@@ -1437,11 +1653,6 @@ bool DNGImage::SetSampleFormat(const unsigned int num_samples,
     }
 
     vs[i] = values[i];
-
-    // TODO(syoyo): Swap values when writing IFD tag, not here.
-    if (swap_endian_) {
-      swap2(&vs[i]);
-    }
   }
 
   unsigned int count = num_samples;
@@ -1449,7 +1660,7 @@ bool DNGImage::SetSampleFormat(const unsigned int num_samples,
   bool ret = WriteTIFFTag(static_cast<unsigned short>(TIFFTAG_SAMPLEFORMAT),
                           TIFF_SHORT, count,
                           reinterpret_cast<const unsigned char *>(vs.data()),
-                          &ifd_tags_, &data_os_);
+                          swap_endian_, &ifd_tags_, &data_os_);
 
   if (!ret) {
     return false;
@@ -1474,7 +1685,8 @@ bool DNGImage::SetOrientation(const unsigned short value) {
   const unsigned int data = value;
   bool ret = WriteTIFFTag(
       static_cast<unsigned short>(TIFFTAG_ORIENTATION), TIFF_SHORT, count,
-      reinterpret_cast<const unsigned char *>(&data), &ifd_tags_, &data_os_);
+      reinterpret_cast<const unsigned char *>(&data),
+      swap_endian_, &ifd_tags_, &data_os_);
 
   if (!ret) {
     return false;
@@ -1488,7 +1700,8 @@ bool DNGImage::SetBlackLevel(const unsigned int num_components,
                              const unsigned short *values) {
   bool ret = WriteTIFFTag(
       static_cast<unsigned short>(TIFFTAG_BLACK_LEVEL), TIFF_SHORT, num_components,
-      reinterpret_cast<const unsigned char *>(values), &ifd_tags_, &data_os_);
+      reinterpret_cast<const unsigned char *>(values),
+      swap_endian_, &ifd_tags_, &data_os_);
 
   if (!ret) {
     return false;
@@ -1518,12 +1731,6 @@ bool DNGImage::SetBlackLevelRational(unsigned int num_samples,
 
     vs[2 * i + 0] = static_cast<unsigned int>(numerator);
     vs[2 * i + 1] = static_cast<unsigned int>(denominator);
-
-    // TODO(syoyo): Swap rational value(8 bytes) when writing IFD tag, not here.
-    if (swap_endian_) {
-      swap4(&vs[2 * i + 0]);
-      swap4(&vs[2 * i + 1]);
-    }
   }
 
   unsigned int count = num_samples;
@@ -1531,7 +1738,7 @@ bool DNGImage::SetBlackLevelRational(unsigned int num_samples,
   bool ret = WriteTIFFTag(static_cast<unsigned short>(TIFFTAG_BLACK_LEVEL),
                           TIFF_RATIONAL, count,
                           reinterpret_cast<const unsigned char *>(vs.data()),
-                          &ifd_tags_, &data_os_);
+                          swap_endian_, &ifd_tags_, &data_os_);
 
   if (!ret) {
     return false;
@@ -1561,12 +1768,6 @@ bool DNGImage::SetWhiteLevelRational(unsigned int num_samples,
 
     vs[2 * i + 0] = static_cast<unsigned int>(numerator);
     vs[2 * i + 1] = static_cast<unsigned int>(denominator);
-
-    // TODO(syoyo): Swap rational value(8 bytes) when writing IFD tag, not here.
-    if (swap_endian_) {
-      swap4(&vs[2 * i + 0]);
-      swap4(&vs[2 * i + 1]);
-    }
   }
 
   unsigned int count = num_samples;
@@ -1574,7 +1775,7 @@ bool DNGImage::SetWhiteLevelRational(unsigned int num_samples,
   bool ret = WriteTIFFTag(static_cast<unsigned short>(TIFFTAG_WHITE_LEVEL),
                           TIFF_RATIONAL, count,
                           reinterpret_cast<const unsigned char *>(vs.data()),
-                          &ifd_tags_, &data_os_);
+                          swap_endian_, &ifd_tags_, &data_os_);
 
   if (!ret) {
     return false;
@@ -1595,15 +1796,10 @@ bool DNGImage::SetXResolution(const double value) {
   data[0] = static_cast<unsigned int>(numerator);
   data[1] = static_cast<unsigned int>(denominator);
 
-  // TODO(syoyo): Swap rational value(8 bytes) when writing IFD tag, not here.
-  if (swap_endian_) {
-    swap4(&data[0]);
-    swap4(&data[1]);
-  }
-
   bool ret = WriteTIFFTag(
       static_cast<unsigned short>(TIFFTAG_XRESOLUTION), TIFF_RATIONAL, 1,
-      reinterpret_cast<const unsigned char *>(data), &ifd_tags_, &data_os_);
+      reinterpret_cast<const unsigned char *>(data),
+      swap_endian_, &ifd_tags_, &data_os_);
 
   if (!ret) {
     return false;
@@ -1624,15 +1820,10 @@ bool DNGImage::SetYResolution(const double value) {
   data[0] = static_cast<unsigned int>(numerator);
   data[1] = static_cast<unsigned int>(denominator);
 
-  // TODO(syoyo): Swap rational value(8 bytes) when writing IFD tag, not here.
-  if (swap_endian_) {
-    swap4(&data[0]);
-    swap4(&data[1]);
-  }
-
   bool ret = WriteTIFFTag(
       static_cast<unsigned short>(TIFFTAG_YRESOLUTION), TIFF_RATIONAL, 1,
-      reinterpret_cast<const unsigned char *>(data), &ifd_tags_, &data_os_);
+      reinterpret_cast<const unsigned char *>(data),
+      swap_endian_, &ifd_tags_, &data_os_);
 
   if (!ret) {
     return false;
@@ -1655,7 +1846,8 @@ bool DNGImage::SetResolutionUnit(const unsigned short value) {
   const unsigned short data = value;
   bool ret = WriteTIFFTag(
       static_cast<unsigned short>(TIFFTAG_RESOLUTION_UNIT), TIFF_SHORT, count,
-      reinterpret_cast<const unsigned char *>(&data), &ifd_tags_, &data_os_);
+      reinterpret_cast<const unsigned char *>(&data),
+      swap_endian_, &ifd_tags_, &data_os_);
 
   if (!ret) {
     return false;
@@ -1682,7 +1874,7 @@ bool DNGImage::SetImageDescription(const std::string &ascii) {
   bool ret = WriteTIFFTag(static_cast<unsigned short>(TIFFTAG_IMAGEDESCRIPTION),
                           TIFF_ASCII, count,
                           reinterpret_cast<const unsigned char *>(ascii.data()),
-                          &ifd_tags_, &data_os_);
+                          swap_endian_, &ifd_tags_, &data_os_);
 
   if (!ret) {
     return false;
@@ -1709,7 +1901,7 @@ bool DNGImage::SetUniqueCameraModel(const std::string &ascii) {
   bool ret = WriteTIFFTag(static_cast<unsigned short>(TIFFTAG_UNIQUE_CAMERA_MODEL),
                           TIFF_ASCII, count,
                           reinterpret_cast<const unsigned char *>(ascii.data()),
-                          &ifd_tags_, &data_os_);
+                          swap_endian_, &ifd_tags_, &data_os_);
 
   if (!ret) {
     return false;
@@ -1736,7 +1928,7 @@ bool DNGImage::SetSoftware(const std::string &ascii) {
   bool ret = WriteTIFFTag(static_cast<unsigned short>(TIFFTAG_SOFTWARE),
                           TIFF_ASCII, count,
                           reinterpret_cast<const unsigned char *>(ascii.data()),
-                          &ifd_tags_, &data_os_);
+                          swap_endian_, &ifd_tags_, &data_os_);
 
   if (!ret) {
     return false;
@@ -1753,7 +1945,8 @@ bool DNGImage::SetActiveArea(const unsigned int values[4]) {
   const unsigned int *data = values;
   bool ret = WriteTIFFTag(
       static_cast<unsigned short>(TIFFTAG_ACTIVE_AREA), TIFF_LONG, count,
-      reinterpret_cast<const unsigned char *>(data), &ifd_tags_, &data_os_);
+      reinterpret_cast<const unsigned char *>(data),
+      swap_endian_, &ifd_tags_, &data_os_);
 
   if (!ret) {
     return false;
@@ -1772,7 +1965,7 @@ bool DNGImage::SetDNGVersion(const unsigned char a,
   bool ret = WriteTIFFTag(
       static_cast<unsigned short>(TIFFTAG_DNG_VERSION), TIFF_BYTE, 4,
       reinterpret_cast<const unsigned char *>(data),
-      &ifd_tags_, &data_os_);
+      swap_endian_, &ifd_tags_, &data_os_);
 
   if (!ret) {
     return false;
@@ -1794,17 +1987,11 @@ bool DNGImage::SetColorMatrix1(const unsigned int plane_count,
 
     vs[2 * i + 0] = static_cast<unsigned int>(numerator);
     vs[2 * i + 1] = static_cast<unsigned int>(denominator);
-
-    // TODO(syoyo): Swap rational value(8 bytes) when writing IFD tag, not here.
-    if (swap_endian_) {
-      swap4(&vs[2 * i + 0]);
-      swap4(&vs[2 * i + 1]);
-    }
   }
   bool ret = WriteTIFFTag(static_cast<unsigned short>(TIFFTAG_COLOR_MATRIX1),
                           TIFF_SRATIONAL, uint32_t(vs.size() / 2),
                           reinterpret_cast<const unsigned char *>(vs.data()),
-                          &ifd_tags_, &data_os_);
+                          swap_endian_, &ifd_tags_, &data_os_);
 
   if (!ret) {
     return false;
@@ -1826,17 +2013,11 @@ bool DNGImage::SetColorMatrix2(const unsigned int plane_count,
 
     vs[2 * i + 0] = static_cast<unsigned int>(numerator);
     vs[2 * i + 1] = static_cast<unsigned int>(denominator);
-
-    // TODO(syoyo): Swap rational value(8 bytes) when writing IFD tag, not here.
-    if (swap_endian_) {
-      swap4(&vs[2 * i + 0]);
-      swap4(&vs[2 * i + 1]);
-    }
   }
   bool ret = WriteTIFFTag(static_cast<unsigned short>(TIFFTAG_COLOR_MATRIX2),
                           TIFF_SRATIONAL, uint32_t(vs.size() / 2),
                           reinterpret_cast<const unsigned char *>(vs.data()),
-                          &ifd_tags_, &data_os_);
+                          swap_endian_, &ifd_tags_, &data_os_);
 
   if (!ret) {
     return false;
@@ -1858,17 +2039,11 @@ bool DNGImage::SetForwardMatrix1(const unsigned int plane_count,
 
     vs[2 * i + 0] = static_cast<unsigned int>(numerator);
     vs[2 * i + 1] = static_cast<unsigned int>(denominator);
-
-    // TODO(syoyo): Swap rational value(8 bytes) when writing IFD tag, not here.
-    if (swap_endian_) {
-      swap4(&vs[2 * i + 0]);
-      swap4(&vs[2 * i + 1]);
-    }
   }
   bool ret = WriteTIFFTag(static_cast<unsigned short>(TIFFTAG_FORWARD_MATRIX1),
                           TIFF_SRATIONAL, uint32_t(vs.size() / 2),
                           reinterpret_cast<const unsigned char *>(vs.data()),
-                          &ifd_tags_, &data_os_);
+                          swap_endian_, &ifd_tags_, &data_os_);
 
   if (!ret) {
     return false;
@@ -1890,17 +2065,11 @@ bool DNGImage::SetForwardMatrix2(const unsigned int plane_count,
 
     vs[2 * i + 0] = static_cast<unsigned int>(numerator);
     vs[2 * i + 1] = static_cast<unsigned int>(denominator);
-
-    // TODO(syoyo): Swap rational value(8 bytes) when writing IFD tag, not here.
-    if (swap_endian_) {
-      swap4(&vs[2 * i + 0]);
-      swap4(&vs[2 * i + 1]);
-    }
   }
   bool ret = WriteTIFFTag(static_cast<unsigned short>(TIFFTAG_FORWARD_MATRIX2),
                           TIFF_SRATIONAL, uint32_t(vs.size() / 2),
                           reinterpret_cast<const unsigned char *>(vs.data()),
-                          &ifd_tags_, &data_os_);
+                          swap_endian_, &ifd_tags_, &data_os_);
 
   if (!ret) {
     return false;
@@ -1922,17 +2091,11 @@ bool DNGImage::SetCameraCalibration1(const unsigned int plane_count,
 
     vs[2 * i + 0] = static_cast<unsigned int>(numerator);
     vs[2 * i + 1] = static_cast<unsigned int>(denominator);
-
-    // TODO(syoyo): Swap rational value(8 bytes) when writing IFD tag, not here.
-    if (swap_endian_) {
-      swap4(&vs[2 * i + 0]);
-      swap4(&vs[2 * i + 1]);
-    }
   }
   bool ret = WriteTIFFTag(static_cast<unsigned short>(TIFFTAG_CAMERA_CALIBRATION1),
                           TIFF_SRATIONAL, uint32_t(vs.size() / 2),
                           reinterpret_cast<const unsigned char *>(vs.data()),
-                          &ifd_tags_, &data_os_);
+                          swap_endian_, &ifd_tags_, &data_os_);
 
   if (!ret) {
     return false;
@@ -1954,17 +2117,11 @@ bool DNGImage::SetCameraCalibration2(const unsigned int plane_count,
 
     vs[2 * i + 0] = static_cast<unsigned int>(numerator);
     vs[2 * i + 1] = static_cast<unsigned int>(denominator);
-
-    // TODO(syoyo): Swap rational value(8 bytes) when writing IFD tag, not here.
-    if (swap_endian_) {
-      swap4(&vs[2 * i + 0]);
-      swap4(&vs[2 * i + 1]);
-    }
   }
   bool ret = WriteTIFFTag(static_cast<unsigned short>(TIFFTAG_CAMERA_CALIBRATION2),
                           TIFF_SRATIONAL, uint32_t(vs.size() / 2),
                           reinterpret_cast<const unsigned char *>(vs.data()),
-                          &ifd_tags_, &data_os_);
+                          swap_endian_, &ifd_tags_, &data_os_);
 
   if (!ret) {
     return false;
@@ -1986,17 +2143,11 @@ bool DNGImage::SetAnalogBalance(const unsigned int plane_count,
 
     vs[2 * i + 0] = static_cast<unsigned int>(numerator);
     vs[2 * i + 1] = static_cast<unsigned int>(denominator);
-
-    // TODO(syoyo): Swap rational value(8 bytes) when writing IFD tag, not here.
-    if (swap_endian_) {
-      swap4(&vs[2 * i + 0]);
-      swap4(&vs[2 * i + 1]);
-    }
   }
   bool ret = WriteTIFFTag(static_cast<unsigned short>(TIFFTAG_ANALOG_BALANCE),
                           TIFF_RATIONAL, uint32_t(vs.size() / 2),
                           reinterpret_cast<const unsigned char *>(vs.data()),
-                          &ifd_tags_, &data_os_);
+                          swap_endian_, &ifd_tags_, &data_os_);
 
   if (!ret) {
     return false;
@@ -2013,7 +2164,7 @@ bool DNGImage::SetCFARepeatPatternDim(const unsigned short width,
   bool ret = WriteTIFFTag(
       static_cast<unsigned short>(TIFFTAG_CFA_REPEAT_PATTERN_DIM), TIFF_SHORT, 2,
       reinterpret_cast<const unsigned char *>(data),
-      &ifd_tags_, &data_os_);
+      swap_endian_, &ifd_tags_, &data_os_);
 
   if (!ret) {
     return false;
@@ -2030,7 +2181,7 @@ bool DNGImage::SetBlackLevelRepeatDim(const unsigned short width,
   bool ret = WriteTIFFTag(
       static_cast<unsigned short>(TIFFTAG_BLACK_LEVEL_REPEAT_DIM), TIFF_SHORT, 2,
       reinterpret_cast<const unsigned char *>(data),
-      &ifd_tags_, &data_os_);
+      swap_endian_, &ifd_tags_, &data_os_);
 
   if (!ret) {
     return false;
@@ -2044,7 +2195,7 @@ bool DNGImage::SetCalibrationIlluminant1(const unsigned short value) {
   bool ret = WriteTIFFTag(
       static_cast<unsigned short>(TIFFTAG_CALIBRATION_ILLUMINANT1), TIFF_SHORT, 1,
       reinterpret_cast<const unsigned char *>(&value),
-      &ifd_tags_, &data_os_);
+      swap_endian_, &ifd_tags_, &data_os_);
 
   if (!ret) {
     return false;
@@ -2058,7 +2209,7 @@ bool DNGImage::SetCalibrationIlluminant2(const unsigned short value) {
   bool ret = WriteTIFFTag(
       static_cast<unsigned short>(TIFFTAG_CALIBRATION_ILLUMINANT2), TIFF_SHORT, 1,
       reinterpret_cast<const unsigned char *>(&value),
-      &ifd_tags_, &data_os_);
+      swap_endian_, &ifd_tags_, &data_os_);
 
   if (!ret) {
     return false;
@@ -2077,7 +2228,7 @@ bool DNGImage::SetCFAPattern(const unsigned int num_components,
   bool ret = WriteTIFFTag(
       static_cast<unsigned short>(TIFFTAG_CFA_PATTERN), TIFF_BYTE, num_components,
       reinterpret_cast<const unsigned char *>(values),
-      &ifd_tags_, &data_os_);
+      swap_endian_, &ifd_tags_, &data_os_);
 
   if (!ret) {
     return false;
@@ -2099,17 +2250,11 @@ bool DNGImage::SetAsShotNeutral(const unsigned int plane_count,
 
     vs[2 * i + 0] = static_cast<unsigned int>(numerator);
     vs[2 * i + 1] = static_cast<unsigned int>(denominator);
-
-    // TODO(syoyo): Swap rational value(8 bytes) when writing IFD tag, not here.
-    if (swap_endian_) {
-      swap4(&vs[2 * i + 0]);
-      swap4(&vs[2 * i + 1]);
-    }
   }
   bool ret = WriteTIFFTag(static_cast<unsigned short>(TIFFTAG_AS_SHOT_NEUTRAL),
                           TIFF_RATIONAL, uint32_t(vs.size() / 2),
                           reinterpret_cast<const unsigned char *>(vs.data()),
-                          &ifd_tags_, &data_os_);
+                          swap_endian_, &ifd_tags_, &data_os_);
 
   if (!ret) {
     return false;
@@ -2131,17 +2276,11 @@ bool DNGImage::SetAsShotWhiteXY(const double x, const double y) {
 
     vs[2 * i + 0] = static_cast<unsigned int>(numerator);
     vs[2 * i + 1] = static_cast<unsigned int>(denominator);
-
-    // TODO(syoyo): Swap rational value(8 bytes) when writing IFD tag, not here.
-    if (swap_endian_) {
-      swap4(&vs[2 * i + 0]);
-      swap4(&vs[2 * i + 1]);
-    }
   }
   bool ret = WriteTIFFTag(static_cast<unsigned short>(TIFFTAG_AS_SHOT_WHITE_XY),
                           TIFF_RATIONAL, uint32_t(vs.size() / 2),
                           reinterpret_cast<const unsigned char *>(vs.data()),
-                          &ifd_tags_, &data_os_);
+                          swap_endian_, &ifd_tags_, &data_os_);
 
   if (!ret) {
     return false;
@@ -2218,8 +2357,8 @@ bool DNGImage::SetImageData(const unsigned char *data, const size_t data_len) {
 
     bool ret = WriteTIFFTag(
         static_cast<unsigned short>(TIFFTAG_STRIP_BYTE_COUNTS), TIFF_LONG,
-        count, reinterpret_cast<const unsigned char *>(&bytes), &ifd_tags_,
-        NULL);
+        count, reinterpret_cast<const unsigned char *>(&bytes), swap_endian_,
+        &ifd_tags_, NULL);
 
     if (!ret) {
       return false;
@@ -2273,6 +2412,240 @@ bool DNGImage::SetImageDataJpeg(const unsigned short *data, unsigned int width,
   return sid_res;
 }
 
+bool DNGImage::SetImageDataZIP(const unsigned char *data, unsigned int width,
+                               unsigned int height, unsigned int tile_width,
+                               unsigned int tile_length,
+                               unsigned short predictor, int level) {
+#ifdef TINY_DNG_WRITER_ENABLE_ZIP
+  if ((data == NULL) || (width == 0) || (height == 0)) {
+    err_ += "Invalid image data or image size for SetImageDataZIP().\n";
+    return false;
+  }
+
+  if ((tile_width == 0) || (tile_length == 0) || (tile_width % 16) ||
+      (tile_length % 16)) {
+    std::stringstream ss;
+    ss << "Tile size must be multiple of 16, but got " << tile_width << " x "
+       << tile_length << "\n";
+    err_ += ss.str();
+    return false;
+  }
+
+  if ((samples_per_pixels_ == 0) || bits_per_samples_.empty()) {
+    err_ +=
+        "SetSamplesPerPixel() and SetBitsPerSample() must be called before "
+        "SetImageDataZIP().\n";
+    return false;
+  }
+
+  if (!data_tile_offsets_.empty() || (data_strip_bytes_ > 0)) {
+    err_ += "Image data is already set.\n";
+    return false;
+  }
+
+  // FIXME(syoyo): Assume all channels use sample bps
+  const size_t bps = bits_per_samples_[0];
+  if ((bps != 8) && (bps != 16) && (bps != 32) && (bps != 64)) {
+    std::stringstream ss;
+    ss << "ZIP compression requires 8, 16, 32 or 64 bits per sample, but got "
+       << bps << "\n";
+    err_ += ss.str();
+    return false;
+  }
+
+  if ((predictor == PREDICTOR_HORIZONTAL) && (bps == 64)) {
+    err_ += "Horizontal differencing predictor does not support 64bit.\n";
+    return false;
+  } else if ((predictor == PREDICTOR_FLOATINGPOINT) && (bps == 8)) {
+    err_ += "Floating point predictor requires 16, 32 or 64bit samples.\n";
+    return false;
+  } else if ((predictor < PREDICTOR_NONE) ||
+             (predictor > PREDICTOR_FLOATINGPOINT)) {
+    std::stringstream ss;
+    ss << "Invalid predictor value " << predictor << "\n";
+    err_ += ss.str();
+    return false;
+  }
+
+  const size_t spp = samples_per_pixels_;
+  const size_t bytes_per_sample = bps / 8;
+  const size_t pixel_bytes = spp * bytes_per_sample;
+  const size_t tiles_across = (width + tile_width - 1) / tile_width;
+  const size_t tiles_down = (height + tile_length - 1) / tile_length;
+  const size_t num_tiles = tiles_across * tiles_down;
+  const size_t tile_bytes = size_t(tile_width) * tile_length * pixel_bytes;
+
+  std::vector<std::vector<unsigned char> > compressed(num_tiles);
+
+  // Gather a tile(replicating the last column and row for the tiles crossing
+  // the image boundary), apply predictor and compress it.
+  auto compress_tile = [&](size_t k, std::vector<unsigned char> *tile_buf,
+                           std::vector<unsigned char> *row_buf) -> bool {
+    const size_t tx = (k % tiles_across) * tile_width;
+    const size_t ty = (k / tiles_across) * tile_length;
+    const size_t x_len = (std::min)(size_t(tile_width), width - tx);
+    const size_t y_len = (std::min)(size_t(tile_length), height - ty);
+    const size_t tile_row_bytes = size_t(tile_width) * pixel_bytes;
+
+    tile_buf->resize(tile_bytes);
+    unsigned char *tile = tile_buf->data();
+    for (size_t y = 0; y < tile_length; y++) {
+      const size_t src_y = ty + (std::min)(y, y_len - 1);
+      unsigned char *dst_row = tile + y * tile_row_bytes;
+      memcpy(dst_row, data + (src_y * width + tx) * pixel_bytes,
+             x_len * pixel_bytes);
+      for (size_t x = x_len; x < tile_width; x++) {
+        memcpy(dst_row + x * pixel_bytes, dst_row + (x_len - 1) * pixel_bytes,
+               pixel_bytes);
+      }
+    }
+
+    if (!EncodePredictor(tile, tile_width, tile_length, spp, bytes_per_sample,
+                         predictor, swap_endian_, row_buf)) {
+      return false;
+    }
+
+#ifdef TINY_DNG_WRITER_USE_SYSTEM_ZLIB
+    uLongf compressed_size = compressBound(uLong(tile_bytes));
+    compressed[k].resize(compressed_size);
+    if (Z_OK != compress2(compressed[k].data(), &compressed_size, tile,
+                          uLong(tile_bytes), level)) {
+      return false;
+    }
+#else
+    mz_ulong compressed_size = mz_compressBound(mz_ulong(tile_bytes));
+    compressed[k].resize(compressed_size);
+    if (MZ_OK != mz_compress2(compressed[k].data(), &compressed_size, tile,
+                              mz_ulong(tile_bytes), level)) {
+      return false;
+    }
+#endif
+    compressed[k].resize(size_t(compressed_size));
+
+    return true;
+  };
+
+  bool failed = false;
+
+#ifdef TINY_DNG_WRITER_USE_THREAD
+  {
+    size_t num_threads =
+        (std::max)(1u, std::thread::hardware_concurrency());
+    num_threads = (std::min)(num_threads, num_tiles);
+
+    std::vector<std::thread> workers;
+    std::atomic<size_t> tile_count(0);
+    std::atomic<bool> thread_failed(false);
+
+    for (size_t t = 0; t < num_threads; t++) {
+      workers.emplace_back(std::thread([&]() {
+        std::vector<unsigned char> tile_buf;
+        std::vector<unsigned char> row_buf;
+        size_t k = 0;
+        while (!thread_failed && ((k = tile_count++) < num_tiles)) {
+          if (!compress_tile(k, &tile_buf, &row_buf)) {
+            thread_failed = true;
+          }
+        }
+      }));
+    }
+
+    for (auto &w : workers) {
+      w.join();
+    }
+
+    failed = thread_failed;
+  }
+#else
+  {
+    std::vector<unsigned char> tile_buf;
+    std::vector<unsigned char> row_buf;
+    for (size_t k = 0; k < num_tiles; k++) {
+      if (!compress_tile(k, &tile_buf, &row_buf)) {
+        failed = true;
+        break;
+      }
+    }
+  }
+#endif
+
+  if (failed) {
+    err_ += "Failed to compress tile with ZIP.\n";
+    return false;
+  }
+
+  // Write compressed tiles.
+  // NOTE: TILE_OFFSETS tag will be written at `WriteIFDToStream()`.
+  std::vector<unsigned int> byte_counts(num_tiles);
+  for (size_t k = 0; k < num_tiles; k++) {
+    data_tile_offsets_.push_back(size_t(data_os_.tellp()));
+    data_os_.write(reinterpret_cast<const char *>(compressed[k].data()),
+                   static_cast<std::streamsize>(compressed[k].size()));
+    byte_counts[k] = static_cast<unsigned int>(compressed[k].size());
+
+    // TIFF requires word alignment of data.
+    if (compressed[k].size() % 2) {
+      Write1(0, &data_os_);
+    }
+  }
+
+  // Reserve space for TileOffsets values, which are filled in
+  // `WriteDataToStream()`.
+  if (num_tiles > 1) {
+    data_tile_offsets_table_ = size_t(data_os_.tellp());
+    std::vector<unsigned int> placeholder(num_tiles, 0);
+    data_os_.write(reinterpret_cast<const char *>(placeholder.data()),
+                   static_cast<std::streamsize>(num_tiles * sizeof(unsigned int)));
+  }
+
+  {
+    const unsigned int values[2] = {tile_width, tile_length};
+    const unsigned short tags[2] = {TIFFTAG_TILE_WIDTH, TIFFTAG_TILE_LENGTH};
+    for (size_t i = 0; i < 2; i++) {
+      if (!WriteTIFFTag(tags[i], TIFF_LONG, 1,
+                        reinterpret_cast<const unsigned char *>(&values[i]),
+                        swap_endian_, &ifd_tags_, &data_os_)) {
+        return false;
+      }
+      num_fields_++;
+    }
+  }
+
+  {
+    if (!WriteTIFFTag(static_cast<unsigned short>(TIFFTAG_TILE_BYTE_COUNTS),
+                      TIFF_LONG, static_cast<unsigned int>(num_tiles),
+                      reinterpret_cast<const unsigned char *>(byte_counts.data()),
+                      swap_endian_, &ifd_tags_, &data_os_)) {
+      return false;
+    }
+    num_fields_++;
+  }
+
+  if (predictor != PREDICTOR_NONE) {
+    const unsigned short value = predictor;
+    if (!WriteTIFFTag(static_cast<unsigned short>(TIFFTAG_PREDICTOR),
+                      TIFF_SHORT, 1,
+                      reinterpret_cast<const unsigned char *>(&value),
+                      swap_endian_, &ifd_tags_, &data_os_)) {
+      return false;
+    }
+    num_fields_++;
+  }
+
+  return true;
+#else
+  (void)data;
+  (void)width;
+  (void)height;
+  (void)tile_width;
+  (void)tile_length;
+  (void)predictor;
+  (void)level;
+  err_ += "ZIP compression is disabled. Define TINY_DNG_WRITER_ENABLE_ZIP.\n";
+  return false;
+#endif
+}
+
 bool DNGImage::SetCustomFieldLong(const unsigned short tag, const int value) {
   unsigned int count = 1;
 
@@ -2281,7 +2654,7 @@ bool DNGImage::SetCustomFieldLong(const unsigned short tag, const int value) {
 
   bool ret = WriteTIFFTag(tag, TIFF_SLONG, count,
                           reinterpret_cast<const unsigned char *>(&value),
-                          &ifd_tags_, &data_os_);
+                          swap_endian_, &ifd_tags_, &data_os_);
 
   if (!ret) {
     return false;
@@ -2300,7 +2673,7 @@ bool DNGImage::SetCustomFieldULong(const unsigned short tag,
 
   bool ret = WriteTIFFTag(tag, TIFF_LONG, count,
                           reinterpret_cast<const unsigned char *>(&value),
-                          &ifd_tags_, &data_os_);
+                          swap_endian_, &ifd_tags_, &data_os_);
 
   if (!ret) {
     return false;
@@ -2348,33 +2721,31 @@ bool DNGImage::WriteDataToStream(std::ostream *ofs) const {
 
     // We may need to swap endian for pixel data.
     if (swap_endian_) {
-      if (bps == 16) {
-        size_t n = data_strip_bytes_ / sizeof(uint16_t);
-        uint16_t *ptr =
-            reinterpret_cast<uint16_t *>(data.data() + data_strip_offset_);
-
-        for (size_t i = 0; i < n; i++) {
-          swap2(&ptr[i]);
-        }
-
-      } else if (bps == 32) {
-        size_t n = data_strip_bytes_ / sizeof(uint32_t);
-        uint32_t *ptr =
-            reinterpret_cast<uint32_t *>(data.data() + data_strip_offset_);
-
-        for (size_t i = 0; i < n; i++) {
-          swap4(&ptr[i]);
-        }
+      if ((bps == 16) || (bps == 32) || (bps == 64)) {
+        const size_t bytes = bps / 8;
+        SwapSamples(data.data() + data_strip_offset_,
+                    data_strip_bytes_ / bytes, bytes);
+      }
+    }
+  }
 
-      } else if (bps == 64) {
-        size_t n = data_strip_bytes_ / sizeof(uint64_t);
-        uint64_t *ptr =
-            reinterpret_cast<uint64_t *>(data.data() + data_strip_offset_);
+  if (data_tile_offsets_.size() > 1) {
+    // Fill TileOffsets values. The stream is at the beginning of data of this
+    // image.
+    const std::streamoff base = ofs->tellp();
+    if (base < 0) {
+      err_ += "Failed to get the position of the stream.\n";
+      return false;
+    }
 
-        for (size_t i = 0; i < n; i++) {
-          swap8(&ptr[i]);
-        }
+    for (size_t k = 0; k < data_tile_offsets_.size(); k++) {
+      unsigned int offset =
+          static_cast<unsigned int>(size_t(base) + data_tile_offsets_[k]);
+      if (swap_endian_) {
+        swap4(&offset);
       }
+      memcpy(data.data() + data_tile_offsets_table_ + k * sizeof(unsigned int),
+             &offset, sizeof(unsigned int));
     }
   }
 
@@ -2394,7 +2765,26 @@ bool DNGImage::WriteIFDToStream(const unsigned int data_base_offset,
 
   // add STRIP_OFFSET tag and sort IFD tags.
   std::vector<IFDTag> tags = ifd_tags_;
-  {
+  if (!data_tile_offsets_.empty()) {
+    // Tiled image. TileOffsets values are filled in `WriteDataToStream()`
+    // when the image has multiple tiles.
+    IFDTag ifd;
+    ifd.tag = TIFFTAG_TILE_OFFSETS;
+    ifd.type = TIFF_LONG;
+    ifd.count = static_cast<unsigned int>(data_tile_offsets_.size());
+    if (ifd.count == 1) {
+      // Value itself, in the byte order of the file.
+      ifd.offset_or_value = static_cast<unsigned int>(
+          data_base_offset + data_tile_offsets_[0] + kHeaderSize);
+      if (swap_endian_) {
+        swap4(&ifd.offset_or_value);
+      }
+    } else {
+      ifd.offset_or_value =
+          static_cast<unsigned int>(data_tile_offsets_table_ + kHeaderSize);
+    }
+    tags.push_back(ifd);
+  } else {
     // For STRIP_OFFSET we need the actual offset value to data(image),
     // thus write STRIP_OFFSET here.
     unsigned int offset = strip_offset + kHeaderSize;
@@ -2403,6 +2793,9 @@ bool DNGImage::WriteIFDToStream(const unsigned int data_base_offset,
     ifd.type = TIFF_LONG;
     ifd.count = 1;
     ifd.offset_or_value = offset;
+    if (swap_endian_) {
+      swap4(&ifd.offset_or_value);
+    }
     tags.push_back(ifd);
   }
 
@@ -2431,29 +2824,9 @@ bool DNGImage::WriteIFDToStream(const unsigned int data_base_offset,
         unsigned int ifd_offt = ifd.offset_or_value + data_base_offset;
         Write4(ifd_offt, &ifd_os, swap_endian_);
       } else {
-        // less than 4 bytes = store data itself.
-
-        if (len == 1) {
-          const unsigned char value =
-              *(reinterpret_cast<const unsigned char *>(&ifd.offset_or_value));
-          Write1(value, &ifd_os);
-          unsigned char pad = 0;
-          Write1(pad, &ifd_os);
-          Write1(pad, &ifd_os);
-          Write1(pad, &ifd_os);
-        } else if (len == 2) {
-          const unsigned short value =
-              *(reinterpret_cast<const unsigned short *>(&ifd.offset_or_value));
-          Write2(value, &ifd_os, swap_endian_);
-          const unsigned short pad = 0;
-          Write2(pad, &ifd_os, swap_endian_);
-        } else if (len == 4) {
-          const unsigned int value =
-              *(reinterpret_cast<const unsigned int *>(&ifd.offset_or_value));
-          Write4(value, &ifd_os, swap_endian_);
-        } else {
-          assert(0);
-        }
+        // 4 bytes or less = data itself, already in the byte order of the
+        // file.
+        ifd_os.write(reinterpret_cast<const char *>(&ifd.offset_or_value), 4);
       }
     }
 